@@ -26,31 +26,79 @@
 #include "PBus-Broker.h"
 #include "PBus/PBus_Private.h"
 
-/*
- * Returns an ID by which this subscription rule will be known and can be
- * deleted by, and which is attached to all receiveNotification messages.
- */
-static S16NVRPCMessageSignature sigSubscribeTo = {
-    .name = "subscribeTo",
-    .raw = false,
-    .rtype = {.kind = S16R_KINT},
-    .nargs = 2,
-    .args = {
-        {.name = "busNamePattern", .type = {.kind = S16R_KSTRING}},
-        {.name = "notificationNamePattern", .type = {.kind = S16R_KSTRING}},
-        {.name = NULL}}};
-
 static intptr_t _subscribeTo (PBusObject * self, PBusInvocationContext * ctx,
                               const char * busNamePattern,
                               const char * notificationNamePattern)
 {
-    return 0;
+    return PBusBroker_subscribe (
+        gBroker.aCurrentClient, busNamePattern, notificationNamePattern);
+}
+
+static intptr_t _unsubscribe (PBusObject * self, PBusInvocationContext * ctx,
+                              intptr_t subscriptionID)
+{
+    return PBusBroker_unsubscribe (gBroker.aCurrentClient, subscriptionID);
+}
+
+static intptr_t _publish (PBusObject * self, PBusInvocationContext * ctx,
+                          const char * notificationName,
+                          const nvlist_t * params)
+{
+    return PBusBroker_publish (
+        gBroker.aCurrentClient, notificationName, params);
+}
+
+static fdptr_t _connectDirect (PBusObject * self, PBusInvocationContext * ctx,
+                               const char * busName)
+{
+    return PBusBroker_connectDirect (gBroker.aCurrentClient, ctx->err, busName);
 }
 
-static PBusMethod methSubscribeTo = {.messageSignature = &sigSubscribeTo,
-                                     .fnImplementation = (PBusFun)_subscribeTo};
+static intptr_t _registerBusName (PBusObject * self,
+                                  PBusInvocationContext * ctx,
+                                  const char * busName)
+{
+    return PBusBroker_setBusName (gBroker.aCurrentClient, busName);
+}
+
+static intptr_t _attachMonitor (PBusObject * self, PBusInvocationContext * ctx,
+                               const char * busNamePattern,
+                               const char * selectorPattern)
+{
+    return PBusMonitor_attach (
+        gBroker.aCurrentClient, busNamePattern, selectorPattern);
+}
+
+static PBusMethod methSubscribeTo = {
+    .messageSignature = &PBusBrokerSubscribeToSig,
+    .fnImplementation = (PBusFun)_subscribeTo};
+
+static PBusMethod methUnsubscribe = {
+    .messageSignature = &PBusBrokerUnsubscribeSig,
+    .fnImplementation = (PBusFun)_unsubscribe};
+
+static PBusMethod methPublish = {.messageSignature = &PBusBrokerPublishSig,
+                                 .fnImplementation = (PBusFun)_publish};
+
+static PBusMethod methConnectDirect = {
+    .messageSignature = &PBusBrokerConnectDirectSig,
+    .fnImplementation = (PBusFun)_connectDirect};
+
+static PBusMethod methRegisterBusName = {
+    .messageSignature = &PBusBrokerRegisterBusNameSig,
+    .fnImplementation = (PBusFun)_registerBusName};
+
+static PBusMethod methAttachMonitor = {
+    .messageSignature = &PBusBrokerAttachMonitorSig,
+    .fnImplementation = (PBusFun)_attachMonitor};
 
-static PBusMethod * methods[] = {&methSubscribeTo};
+static PBusMethod * methods[] = {&methSubscribeTo,
+                                 &methUnsubscribe,
+                                 &methPublish,
+                                 &methConnectDirect,
+                                 &methRegisterBusName,
+                                 &methAttachMonitor,
+                                 NULL};
 
 static PBusClass brokerClass = {.methods = &methods};
 
@@ -0,0 +1,255 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Traffic capture for monitors.
+ *
+ * Each message the broker receives is, while any monitor is attached, packed
+ * into a capture record and put in a ring buffer. At the end of each pass of
+ * the event loop the ring is drained: every monitor receives, as a single
+ * monitorFrames notification, the records passing its filters, already in the
+ * format of a capture file. When no monitor is attached nothing is recorded,
+ * so capture costs only a test of gBroker.aMonitors.
+ *
+ * The broker is single-threaded, so the ring needs no locking at all: records
+ * are produced and consumed on the same thread. If the ring fills within one
+ * pass, the oldest records are overwritten and counted as dropped.
+ */
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PBus-Broker.h"
+#include "dnv.h"
+#include "PBus/PBus_Private.h"
+
+#define kRingSize 1024
+
+typedef struct
+{
+    char * aFrom;
+    char * aTo;
+    char * aSelector;
+    void * aData; /* Header and packed frame, as written to a capture file */
+    size_t aLen;
+} PBusCaptureSlot;
+
+static PBusCaptureSlot gRing[kRingSize];
+static unsigned long gHead, gTail; /* Produce at head, consume at tail. */
+static unsigned long gDropped;
+
+static void slotClear (PBusCaptureSlot * slot)
+{
+    free (slot->aFrom);
+    free (slot->aTo);
+    free (slot->aSelector);
+    free (slot->aData);
+    memset (slot, 0, sizeof (*slot));
+}
+
+static uint64_t nowNanoseconds ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void PBusMonitor_capture (PBusClient * from, const nvlist_t * msg)
+{
+    PBusCaptureSlot * slot;
+    PBusCaptureRecordHeader hdr;
+    const char *to = "", *selector = "";
+    const nvlist_t * params = dnvlist_get_nvlist (msg, "params", NULL);
+    nvlist_t * frame;
+    void * packed;
+    size_t len;
+
+    if (S16NVRPCMessageIsReply (msg))
+    {
+        int id = nvlist_get_number (msg, "id");
+        PBusForward * fwd;
+
+        HASH_FIND_INT (gBroker.aForwards, &id, fwd);
+        if (fwd)
+            to = fwd->aOrigin->aBusName;
+    }
+    else if (params && nvlist_exists_string (params, "toBusname"))
+    {
+        to = nvlist_get_string (params, "toBusname");
+        selector = dnvlist_get_string (params, "selector", "");
+    }
+    else
+    {
+        to = kPBusBrokerBusName;
+        selector = dnvlist_get_string (msg, "method", "");
+    }
+
+    frame = nvlist_create (0);
+    nvlist_add_string (frame, "fromBusname", from->aBusName);
+    nvlist_add_string (frame, "toBusname", to);
+    nvlist_add_string (frame, "selector", selector);
+    nvlist_add_nvlist (frame, "message", msg);
+
+    /* Descriptors can't be packed; such messages are recorded bare. */
+    if (!(packed = nvlist_pack (frame, &len)))
+    {
+        nvlist_free_nvlist (frame, "message");
+        packed = nvlist_pack (frame, &len);
+    }
+    nvlist_destroy (frame);
+
+    if (!packed)
+        return;
+
+    if (gHead - gTail == kRingSize)
+    {
+        slotClear (&gRing[gTail++ % kRingSize]);
+        gDropped++;
+    }
+
+    slot = &gRing[gHead++ % kRingSize];
+    slot->aFrom = strdup (from->aBusName);
+    slot->aTo = strdup (to);
+    slot->aSelector = strdup (selector);
+
+    hdr.timestamp = nowNanoseconds ();
+    hdr.length = len;
+    hdr.reserved = 0;
+
+    slot->aLen = sizeof (hdr) + len;
+    slot->aData = malloc (slot->aLen);
+    memcpy (slot->aData, &hdr, sizeof (hdr));
+    memcpy ((char *)slot->aData + sizeof (hdr), packed, len);
+    free (packed);
+}
+
+static bool monitorWants (PBusMonitor * mon, PBusCaptureSlot * slot)
+{
+    return (!fnmatch (mon->aBusNamePattern, slot->aFrom, 0) ||
+            !fnmatch (mon->aBusNamePattern, slot->aTo, 0)) &&
+           !fnmatch (mon->aSelectorPattern, slot->aSelector, 0);
+}
+
+void PBusMonitor_drain ()
+{
+    PBusMonitor *mon, *tmp;
+
+    if (gHead == gTail)
+        return;
+
+    HASH_ITER (hh, gBroker.aMonitors, mon, tmp)
+    {
+        size_t len = 0;
+        char * batch;
+        nvlist_t *records, *params, *note;
+
+        for (unsigned long i = gTail; i != gHead; i++)
+            if (monitorWants (mon, &gRing[i % kRingSize]))
+                len += gRing[i % kRingSize].aLen;
+
+        if (!len && !gDropped)
+            continue;
+
+        records = nvlist_create (0);
+
+        /* An empty binary can't be added; a batch reporting only drops goes
+         * without records. */
+        if (len)
+        {
+            batch = malloc (len);
+            len = 0;
+            for (unsigned long i = gTail; i != gHead; i++)
+            {
+                PBusCaptureSlot * slot = &gRing[i % kRingSize];
+                if (monitorWants (mon, slot))
+                {
+                    memcpy (batch + len, slot->aData, slot->aLen);
+                    len += slot->aLen;
+                }
+            }
+            nvlist_move_binary (records, "records", batch, len);
+        }
+
+        nvlist_add_number (records, "dropped", gDropped);
+        params = nvlist_create (0);
+        nvlist_add_number (params, "monitorID", mon->aID);
+        nvlist_move_nvlist (params, "batch", records);
+        note = S16NVRPCNotificationNew (PBusMonitorFramesSig.name, params);
+        /* A batch reporting drops must itself get through, else the count
+         * of them would be lost with it. */
+        PBusClient_enqueue (mon->aClient, note, !gDropped);
+        nvlist_destroy (note);
+    }
+
+    while (gTail != gHead)
+        slotClear (&gRing[gTail++ % kRingSize]);
+    gDropped = 0;
+}
+
+int PBusMonitor_attach (PBusClient * pbc, const char * busNamePattern,
+                        const char * selectorPattern)
+{
+    PBusMonitor * mon = calloc (1, sizeof (*mon));
+
+    if (++gBroker.aNextMonitorID <= 0)
+        gBroker.aNextMonitorID = 1;
+
+    mon->aID = gBroker.aNextMonitorID;
+    mon->aClient = pbc;
+    mon->aBusNamePattern = strdup (busNamePattern);
+    mon->aSelectorPattern = strdup (selectorPattern);
+    HASH_ADD_INT (gBroker.aMonitors, aID, mon);
+
+    S16Log (kS16LogInfo,
+            "[FD %d] Monitor attached (bus names %s, selectors %s).\n",
+            pbc->aFD,
+            busNamePattern,
+            selectorPattern);
+
+    return mon->aID;
+}
+
+void PBusMonitor_detachClient (PBusClient * pbc)
+{
+    PBusMonitor *mon, *tmp;
+
+    HASH_ITER (hh, gBroker.aMonitors, mon, tmp)
+    {
+        if (mon->aClient != pbc)
+            continue;
+        HASH_DEL (gBroker.aMonitors, mon);
+        free (mon->aBusNamePattern);
+        free (mon->aSelectorPattern);
+        free (mon);
+    }
+
+    /* Nothing more to capture for. */
+    if (!gBroker.aMonitors)
+        while (gTail != gHead)
+            slotClear (&gRing[gTail++ % kRingSize]);
+}
@@ -26,14 +26,19 @@
 #include <sys/event.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <S16/NVRPC.h>
 #include <S16/Service.h>
+#include <dnv.h>
 #include <nv.h>
 #include <systemd/sd-daemon.h>
 
@@ -49,11 +54,201 @@ static bool PBusClient_isForFD (PBusClient * pbc, int fd)
     return pbc->aFD == fd;
 }
 
+static void PBusClient_armWrite (PBusClient * pbc, bool arm)
+{
+    struct kevent ev;
+
+    if (arm == pbc->aWriteArmed)
+        return;
+
+    EV_SET (&ev, pbc->aFD, EVFILT_WRITE, arm ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    if (kevent (gBroker.aKQ, &ev, 1, NULL, 0, NULL) == -1)
+        perror ("kevent");
+    pbc->aWriteArmed = arm;
+}
+
+static void PBusClient_clearQueue (PBusClient * pbc)
+{
+    PBusQueuedMessage * qm;
+
+    while ((qm = pbc->aQueueHead))
+    {
+        pbc->aQueueHead = qm->aNext;
+        if (qm->aNVL)
+            nvlist_destroy (qm->aNVL);
+        free (qm->aData);
+        free (qm);
+    }
+
+    pbc->aQueueTail = NULL;
+    pbc->aQueuedBytes = 0;
+}
+
+/*
+ * Writes as much of the client's queue as its socket will accept without
+ * blocking, and arranges to be called again when it is writable if any
+ * remains.
+ */
+static void PBusClient_flush (PBusClient * pbc)
+{
+    PBusQueuedMessage * qm;
+
+    while ((qm = pbc->aQueueHead))
+    {
+        if (qm->aNVL)
+        {
+            int flags = fcntl (pbc->aFD, F_GETFL), r;
+
+            /* A message carrying descriptors can't be packed, so it can't be
+             * written piecemeal either. Everything before it having been
+             * written, it is written whole, with the socket blocking (for at
+             * most kPBusClientSendTimeout) meanwhile. */
+            fcntl (pbc->aFD, F_SETFL, flags & ~O_NONBLOCK);
+            r = nvlist_send (pbc->aFD, qm->aNVL);
+            fcntl (pbc->aFD, F_SETFL, flags);
+
+            if (r == -1)
+            {
+                /* Part of it may have been written, so nothing more can be;
+                 * the client is cut off, and the EOF handled by the event
+                 * loop. */
+                S16Log (kS16LogError,
+                        "[FD %d] Failed to send descriptors: %m\n",
+                        pbc->aFD);
+                shutdown (pbc->aFD, SHUT_RDWR);
+                PBusClient_clearQueue (pbc);
+                break;
+            }
+        }
+        else
+        {
+            ssize_t n = send (pbc->aFD,
+                              (char *)qm->aData + qm->aOff,
+                              qm->aLen - qm->aOff,
+                              0);
+
+            if (n == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                /* The EOF is picked up and handled by the event loop. */
+                S16Log (kS16LogError, "[FD %d] Failed to send: %m\n", pbc->aFD);
+                PBusClient_clearQueue (pbc);
+                break;
+            }
+
+            qm->aOff += n;
+            if (qm->aOff < qm->aLen)
+                continue;
+        }
+
+        pbc->aQueueHead = qm->aNext;
+        if (!pbc->aQueueHead)
+            pbc->aQueueTail = NULL;
+        pbc->aQueuedBytes -= qm->aLen;
+        if (qm->aNVL)
+            nvlist_destroy (qm->aNVL);
+        free (qm->aData);
+        free (qm);
+    }
+
+    PBusClient_armWrite (pbc, pbc->aQueueHead != NULL);
+}
+
+void PBusClient_enqueue (PBusClient * pbc, const nvlist_t * msg,
+                         bool droppable)
+{
+    PBusQueuedMessage * qm;
+
+    if (droppable && pbc->aQueuedBytes > kPBusClientQueueLimit)
+    {
+        if (!pbc->aDropped++)
+            S16Log (kS16LogWarn,
+                    "[FD %d] Queue full; dropping notifications.\n",
+                    pbc->aFD);
+        return;
+    }
+
+    qm = calloc (1, sizeof (*qm));
+    if (!(qm->aData = nvlist_pack (msg, &qm->aLen)))
+    {
+        qm->aNVL = nvlist_clone (msg);
+        qm->aLen = 0;
+    }
+
+    if (pbc->aQueueTail)
+        pbc->aQueueTail->aNext = qm;
+    else
+        pbc->aQueueHead = qm;
+    pbc->aQueueTail = qm;
+    pbc->aQueuedBytes += qm->aLen;
+
+    PBusClient_flush (pbc);
+}
+
+static void PBusClient_send (PBusClient * pbc, const nvlist_t * msg)
+{
+    PBusClient_enqueue (pbc, msg, false);
+}
+
+static void PBusClient_sendError (PBusClient * pbc, int id,
+                                  S16NVRPCErrorCode code, const char * message)
+{
+    nvlist_t * reply;
+
+    if (!id) /* notification; no reply is expected */
+        return;
+
+    reply = S16NVRPCErrorReplyNew (id, code, message);
+    PBusClient_send (pbc, reply);
+    nvlist_destroy (reply);
+}
+
+static int PBusClient_getCredentials (int fd, PBusCredentials * creds)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return -1;
+    creds->aUID = cred.uid;
+    creds->aGID = cred.gid;
+    return 0;
+#else
+    return getpeereid (fd, &creds->aUID, &creds->aGID);
+#endif
+}
+
 PBusClient * PBusClient_new (int fd)
 {
     struct kevent ev;
+    struct timeval tmout = {kPBusClientSendTimeout, 0};
     PBusClient * pbc = calloc (1, sizeof (*pbc));
     pbc->aFD = fd;
+    pbc->aID = ++gBroker.aNextClientID;
+    pbc->aSubscriptions = PBusSubscription_list_new ();
+
+    if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == -1)
+        perror ("fcntl");
+    /* Bounds how long a client may stall the broker while a message with
+     * descriptors is written to it. */
+    if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tmout, sizeof (tmout)) == -1)
+        perror ("setsockopt");
+
+    if (PBusClient_getCredentials (fd, &pbc->aCredentials) == -1)
+    {
+        /* Deny anything requiring credentials. */
+        pbc->aCredentials.aUID = (uid_t)-1;
+        pbc->aCredentials.aGID = (gid_t)-1;
+    }
+
+    asprintf (&pbc->aBusName, "pbus:/client/%d", pbc->aID);
+    HASH_ADD_KEYPTR (hh,
+                     gBroker.aClientsByName,
+                     pbc->aBusName,
+                     strlen (pbc->aBusName),
+                     pbc);
 
     EV_SET (&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
     if (kevent (gBroker.aKQ, &ev, 1, NULL, 0, NULL) == -1)
@@ -68,21 +263,267 @@ PBusClient * PBusClient_new (int fd)
 void PBusClient_disconnect (PBusClient * pbc)
 {
     struct kevent ev;
+    PBusForward *fwd, *tmp;
+    PBusSubscription * sub;
 
     EV_SET (&ev, pbc->aFD, EVFILT_READ, EV_DELETE, 0, 0, NULL);
     if (kevent (gBroker.aKQ, &ev, 1, NULL, 0, NULL) == -1)
         perror ("kevent");
+    PBusClient_armWrite (pbc, false);
+    PBusClient_clearQueue (pbc);
+
+    while ((sub = PBusSubscription_list_lpop (&pbc->aSubscriptions)))
+        PBusBroker_unsubscribe (pbc, sub->aID);
+    PBusMonitor_detachClient (pbc);
+
+    /* Fail requests routed to this client, and forget those from it. */
+    HASH_ITER (hh, gBroker.aForwards, fwd, tmp)
+    {
+        if (fwd->aTarget == pbc)
+            PBusClient_sendError (fwd->aOrigin,
+                                  fwd->aOrigID,
+                                  kS16NVRPCErrorInternalError,
+                                  "Peer disconnected");
+        if (fwd->aTarget == pbc || fwd->aOrigin == pbc)
+        {
+            HASH_DEL (gBroker.aForwards, fwd);
+            free (fwd);
+        }
+    }
 
     close (pbc->aFD);
+    HASH_DEL (gBroker.aClientsByName, pbc);
     PBusClient_list_del (&gBroker.aClients, pbc);
     S16Log (kS16LogInfo, "[FD %d] Client disconnected.\n", pbc->aFD);
+    free (pbc->aBusName);
     free (pbc);
 }
 
+/*
+ * Whether @pbc may claim the well-known bus name @busName. Peers trust the
+ * names the broker vouches for (notably over direct links), so a name may be
+ * claimed only by the superuser or by the broker's own user, and never one of
+ * the names the broker assigns to clients itself.
+ */
+static bool PBusBroker_mayClaim (PBusClient * pbc, const char * busName)
+{
+    if (!strcmp (busName, kPBusBrokerBusName) ||
+        !strncmp (busName, "pbus:/client/", strlen ("pbus:/client/")))
+        return false;
+    if (pbc->aCredentials.aUID == (uid_t)-1)
+        return false;
+    return pbc->aCredentials.aUID == 0 || pbc->aCredentials.aUID == geteuid ();
+}
+
+int PBusBroker_setBusName (PBusClient * pbc, const char * busName)
+{
+    PBusClient * holder;
+
+    if (!PBusBroker_mayClaim (pbc, busName))
+    {
+        S16Log (kS16LogWarn,
+                "[FD %d] Refused bus name %s to UID %d.\n",
+                pbc->aFD,
+                busName,
+                (int)pbc->aCredentials.aUID);
+        return -1;
+    }
+
+    HASH_FIND_STR (gBroker.aClientsByName, busName, holder);
+    if (holder)
+        return holder == pbc ? 0 : -1;
+
+    HASH_DEL (gBroker.aClientsByName, pbc);
+    free (pbc->aBusName);
+    pbc->aBusName = strdup (busName);
+    HASH_ADD_KEYPTR (hh,
+                     gBroker.aClientsByName,
+                     pbc->aBusName,
+                     strlen (pbc->aBusName),
+                     pbc);
+
+    S16Log (kS16LogInfo, "[FD %d] Now known as %s.\n", pbc->aFD, busName);
+
+    return 0;
+}
+
+/*
+ * Routes a msgSend request to the client it is addressed to. The request's
+ * fromBusname is overwritten with the sender's bus name, so that it can be
+ * relied upon by the receiver.
+ */
+static void PBusBroker_forward (PBusClient * from, nvlist_t * msg)
+{
+    nvlist_t * params = nvlist_take_nvlist (msg, "params");
+    int origID = dnvlist_get_number (msg, "id", 0);
+    PBusClient * target;
+
+    HASH_FIND_STR (gBroker.aClientsByName,
+                   nvlist_get_string (params, "toBusname"),
+                   target);
+
+    if (!target)
+    {
+        PBusClient_sendError (
+            from, origID, kS16NVRPCErrorInvalidParams, "No such bus name");
+        nvlist_destroy (params);
+        return;
+    }
+
+    nvlist_free_string (params, "fromBusname");
+    nvlist_add_string (params, "fromBusname", from->aBusName);
+    nvlist_move_nvlist (msg, "params", params);
+
+    if (origID)
+    {
+        PBusForward * fwd = malloc (sizeof (*fwd));
+
+        if (++gBroker.aNextForwardID <= 0)
+            gBroker.aNextForwardID = 1;
+
+        fwd->aID = gBroker.aNextForwardID;
+        fwd->aOrigID = origID;
+        fwd->aOrigin = from;
+        fwd->aTarget = target;
+        HASH_ADD_INT (gBroker.aForwards, aID, fwd);
+
+        nvlist_free_number (msg, "id");
+        nvlist_add_number (msg, "id", fwd->aID);
+    }
+
+    PBusClient_send (target, msg);
+}
+
+/*
+ * Returns a reply to a routed request to the client which made the request.
+ */
+static void PBusBroker_relayReply (PBusClient * from, nvlist_t * reply)
+{
+    int id = nvlist_get_number (reply, "id");
+    PBusForward * fwd;
+
+    HASH_FIND_INT (gBroker.aForwards, &id, fwd);
+
+    if (!fwd || fwd->aTarget != from)
+    {
+        S16Log (kS16LogWarn,
+                "[FD %d] Discarding reply to unknown request %d.\n",
+                from->aFD,
+                id);
+        return;
+    }
+
+    HASH_DEL (gBroker.aForwards, fwd);
+    nvlist_free_number (reply, "id");
+    nvlist_add_number (reply, "id", fwd->aOrigID);
+    PBusClient_send (fwd->aOrigin, reply);
+    free (fwd);
+}
+
+/*
+ * Whether @from may have a direct link to @to. A direct link bypasses the
+ * broker entirely, so it is granted only between processes of the same user,
+ * or to the superuser.
+ */
+static bool PBusBroker_mayLink (PBusClient * from, PBusClient * to)
+{
+    if (from->aCredentials.aUID == (uid_t)-1)
+        return false;
+    return from->aCredentials.aUID == 0 ||
+           from->aCredentials.aUID == to->aCredentials.aUID;
+}
+
+int PBusBroker_connectDirect (PBusClient * pbc, S16NVRPCError * err,
+                              const char * busName)
+{
+    PBusClient * target;
+    nvlist_t *params, *note;
+    int sv[2];
+
+    HASH_FIND_STR (gBroker.aClientsByName, busName, target);
+
+    if (!target || target == pbc)
+    {
+        err->code = kS16NVRPCErrorInvalidParams;
+        err->message = "No such bus name";
+        return -1;
+    }
+    else if (!PBusBroker_mayLink (pbc, target))
+    {
+        err->code = kPBusErrorNotPermitted;
+        err->message = "Not permitted to link directly";
+        return -1;
+    }
+    else if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        S16Log (kS16LogError, "socketpair: %m\n");
+        err->code = kS16NVRPCErrorInternalError;
+        err->message = "Failed to create socket pair";
+        return -1;
+    }
+
+    params = nvlist_create (0);
+    nvlist_add_string (params, "fromBusname", pbc->aBusName);
+    nvlist_move_descriptor (params, "descriptor", sv[1]);
+    note = S16NVRPCNotificationNew (PBusDirectConnectionSig.name, params);
+    PBusClient_send (target, note);
+    nvlist_destroy (note);
+
+    S16Log (kS16LogInfo,
+            "[FD %d] Linked directly to %s.\n",
+            pbc->aFD,
+            target->aBusName);
+
+    return sv[0];
+}
+
+static bool PBusBroker_isRoutable (const nvlist_t * msg)
+{
+    const nvlist_t * params;
+
+    if (strcmp (dnvlist_get_string (msg, "method", ""), msgSendSig.name) ||
+        !(params = dnvlist_get_nvlist (msg, "params", NULL)) ||
+        !nvlist_exists_string (params, "toBusname"))
+        return false;
+
+    return strcmp (nvlist_get_string (params, "toBusname"), kPBusBrokerBusName);
+}
+
 void PBusClient_recv (PBusClient * pbc)
 {
-    S16Log (kS16LogInfo, "[FD %d] Receiving data from client %d.\n", pbc->aFD);
-    S16NVRPCServerReceiveFromFileDescriptor (gBroker.aRPCServer, pbc->aFD);
+    nvlist_t * msg = nvlist_recv (pbc->aFD, 0);
+    nvlist_t * response;
+
+    S16Log (kS16LogDebug, "[FD %d] Receiving data from client.\n", pbc->aFD);
+
+    if (!msg)
+    {
+        PBusClient_disconnect (pbc);
+        return;
+    }
+
+    /* Before routing, which renumbers the message and its forward. */
+    if (gBroker.aMonitors)
+        PBusMonitor_capture (pbc, msg);
+
+    if (S16NVRPCMessageIsReply (msg))
+        PBusBroker_relayReply (pbc, msg);
+    else if (PBusBroker_isRoutable (msg))
+        PBusBroker_forward (pbc, msg);
+    else
+    {
+        gBroker.aCurrentClient = pbc;
+        response = S16NVRPCServerHandleRequest (gBroker.aRPCServer, msg);
+        gBroker.aCurrentClient = NULL;
+
+        if (response)
+        {
+            PBusClient_send (pbc, response);
+            nvlist_destroy (response);
+        }
+    }
+
+    nvlist_destroy (msg);
 }
 
 PBusClient * PBusBroker_findClient (int fd)
@@ -91,22 +532,27 @@ PBusClient * PBusBroker_findClient (int fd)
         ->val;
 }
 
+/*
+ * Serves msgSend requests addressed to the broker itself.
+ */
 void * msgRecv (S16NVRPCCallContext * ctx, const char * fromBusname,
                 const char * toBusname, const char * objectPath,
                 const char * selector, nvlist_t * params)
 {
-    /*printf ("Receive from busname %s to busname %s, object path %s, selector "
-            "%s, parameters:\n%s\n",
-            fromBusname,
-            toBusname,
-            objectPath,
-            selector,
-            ucl_object_emit (S16NVRPCNVListToUCL (params), UCL_EMIT_JSON));*/
-
-    ctx->err.code = kS16NVRPCErrorInvalidParams;
-    ctx->err.message = "Parameters are invalid.\n";
+    nvlist_t * result = PBusDispatchCacheSend (gBroker.aDispatchCache,
+                                               &ctx->err,
+                                               objectPath,
+                                               gBroker.aCurrentClient->aBusName,
+                                               selector,
+                                               params);
+
+    if (!result && !ctx->err.code)
+    {
+        ctx->err.code = kS16NVRPCErrorNoSuchMethod;
+        ctx->err.message = "No such object or selector";
+    }
 
-    return NULL; // nvlist_create (0);
+    return result;
 }
 
 int main ()
@@ -127,6 +573,8 @@ int main ()
     }
 
     S16HandleSignalWithKQueue (gBroker.aKQ, SIGINT);
+    /* Clients disconnecting are noticed by the event loop. */
+    signal (SIGPIPE, SIG_IGN);
 
     if ((gBroker.aListenSocket = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
     {
@@ -155,6 +603,8 @@ int main ()
         exit (EXIT_FAILURE);
     }
 
+    gBroker.brokerObject = &gBrokerObject;
+    gBroker.aDispatchCache = PBusDispatchCacheNew (gBroker.brokerObject);
     gBroker.aRPCServer = S16NVRPCServerNew (NULL);
     S16NVRPCServerRegisterMethod (
         gBroker.aRPCServer, &msgSendSig, (S16NVRPCImplementationFn)msgRecv);
@@ -192,6 +642,9 @@ int main ()
 
             break;
         }
+        case EVFILT_WRITE:
+            PBusClient_flush (PBusBroker_findClient (ev.ident));
+            break;
         case EVFILT_SIGNAL:
             fprintf (
                 stderr,
@@ -202,6 +655,9 @@ int main ()
                 run = false;
             break;
         }
+
+        if (gBroker.aMonitors)
+            PBusMonitor_drain ();
     }
 
     return 1;
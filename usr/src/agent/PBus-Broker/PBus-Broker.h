@@ -30,6 +30,7 @@
 
 #include "PBus/PBus.h"
 #include "S16/List.h"
+#include "uthash.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -42,29 +43,187 @@ extern "C"
         gid_t aGID;
     } PBusCredentials;
 
-    typedef struct
+/* Beyond this many bytes queued to a client, notifications are dropped. */
+#define kPBusClientQueueLimit (4 * 1024 * 1024)
+/* Seconds a client may take to accept a message carrying descriptors. */
+#define kPBusClientSendTimeout 5
+
+    typedef struct PBusClient PBusClient;
+    typedef struct PBusMatchNode PBusMatchNode;
+
+    /*
+     * A subscription to notifications from bus names matching one glob
+     * pattern and with notification names matching another.
+     */
+    typedef struct PBusSubscription
+    {
+        int aID;
+        PBusClient * aClient;
+        char * aBusNamePattern;
+        char * aNotificationNamePattern;
+        PBusMatchNode * aNode; /* Node of the matcher trie where it ends */
+
+        UT_hash_handle hh; /* Hashed by aID */
+    } PBusSubscription;
+
+    S16ListType (PBusSubscription, PBusSubscription *);
+
+    /*
+     * A message waiting to be written to a client.
+     */
+    typedef struct PBusQueuedMessage
+    {
+        struct PBusQueuedMessage * aNext;
+        void * aData; /* Packed message, if aNVL is NULL */
+        size_t aLen, aOff;
+        nvlist_t * aNVL; /* Message with descriptors, which can't be packed */
+    } PBusQueuedMessage;
+
+    struct PBusClient
     {
 
         int aFD; /* FD on which this client is connected */
         int aID; /* Unique (per system session) ID of client */
         PBusCredentials aCredentials; /* Credentials of client */
-    } PBusClient;
+        char * aBusName;              /* Bus name by which client is known */
+
+        PBusSubscription_list_t aSubscriptions;
+
+        /*
+         * Messages to the client are queued and written as the socket becomes
+         * writable, so that a slow client never stalls the broker.
+         */
+        PBusQueuedMessage *aQueueHead, *aQueueTail;
+        size_t aQueuedBytes;
+        bool aWriteArmed;       /* Whether EVFILT_WRITE is registered */
+        unsigned long aDropped; /* Notifications dropped as queue was full */
+
+        UT_hash_handle hh; /* Hashed by bus name */
+    };
 
     S16ListType (PBusClient, PBusClient *);
 
+    /*
+     * A client receiving captured traffic. Frames whose either end has a bus
+     * name matching aBusNamePattern, and whose selector matches
+     * aSelectorPattern, are delivered to it.
+     */
+    typedef struct PBusMonitor
+    {
+        int aID;
+        PBusClient * aClient;
+        char * aBusNamePattern;
+        char * aSelectorPattern;
+
+        UT_hash_handle hh; /* Hashed by aID */
+    } PBusMonitor;
+
+    /*
+     * A request routed from one client to another, awaiting its reply. The
+     * request's ID is replaced with one unique to the broker while it is in
+     * flight, so that the IDs chosen by different clients cannot clash.
+     */
+    typedef struct
+    {
+        int aID;     /* Broker's ID for the request */
+        int aOrigID; /* Originator's ID for the request */
+        PBusClient * aOrigin;
+        PBusClient * aTarget;
+
+        UT_hash_handle hh; /* Hashed by aID */
+    } PBusForward;
+
     typedef struct
     {
         int aListenSocket;
         int aKQ;
         S16NVRPCServer * aRPCServer;
         PBusObject * brokerObject;
+        PBusDispatchCache * aDispatchCache;
 
         PBusClient_list_t aClients;
+        PBusClient * aClientsByName;
+        /* The client whose request to the broker object is being served. */
+        PBusClient * aCurrentClient;
+        int aNextClientID;
+
+        PBusForward * aForwards;
+        int aNextForwardID;
+
+        PBusSubscription * aSubscriptions;
+        int aNextSubscriptionID;
+
+        PBusMonitor * aMonitors; /* If NULL, no traffic is captured */
+        int aNextMonitorID;
     } PBusBroker;
 
     extern PBusBroker gBroker;
     extern PBusObject gBrokerObject;
 
+    /*
+     * Queues a message to a client. If @droppable, the message is dropped
+     * instead when the client's queue is full.
+     */
+    void PBusClient_enqueue (PBusClient * pbc, const nvlist_t * msg,
+                             bool droppable);
+
+    /*
+     * Sets the bus name by which a client is known. Returns 0 if successful,
+     * -1 if the name is taken or the client may not claim it.
+     */
+    int PBusBroker_setBusName (PBusClient * pbc, const char * busName);
+
+    /*
+     * Creates a direct link between a client and the client known by @busName,
+     * sending one end to the latter and returning the other. Returns -1 and
+     * sets @err if refused.
+     */
+    int PBusBroker_connectDirect (PBusClient * pbc, S16NVRPCError * err,
+                                  const char * busName);
+
+    /*
+     * Subscribes a client to notifications. Returns the subscription ID.
+     */
+    int PBusBroker_subscribe (PBusClient * pbc, const char * busNamePattern,
+                              const char * notificationNamePattern);
+
+    /*
+     * Cancels a client's subscription. Returns 0 if successful, -1 if there
+     * was no such subscription.
+     */
+    int PBusBroker_unsubscribe (PBusClient * pbc, int subscriptionID);
+
+    /*
+     * Delivers a notification from a client to every matching subscription.
+     * Returns the number of subscriptions to which it was delivered.
+     */
+    int PBusBroker_publish (PBusClient * pbc, const char * notificationName,
+                            const nvlist_t * params);
+
+    /*
+     * The combined matcher of all subscriptions' patterns.
+     */
+    typedef void (*PBusMatchFn) (PBusSubscription * sub, void * user);
+
+    void PBusMatcher_add (PBusSubscription * sub);
+    void PBusMatcher_remove (PBusSubscription * sub);
+    /* Calls @fn for every subscription matching. */
+    void PBusMatcher_match (const char * busName, const char * notificationName,
+                            PBusMatchFn fn, void * user);
+
+    /*
+     * Records a message received from a client for monitors. To be called
+     * only while gBroker.aMonitors is non-NULL.
+     */
+    void PBusMonitor_capture (PBusClient * from, const nvlist_t * msg);
+    /* Delivers the records captured so far to the monitors. */
+    void PBusMonitor_drain ();
+    /* Attaches a client as a monitor. Returns the monitor ID. */
+    int PBusMonitor_attach (PBusClient * pbc, const char * busNamePattern,
+                            const char * selectorPattern);
+    /* Detaches every monitor belonging to a client. */
+    void PBusMonitor_detachClient (PBusClient * pbc);
+
 #ifdef __cplusplus
 }
 #endif
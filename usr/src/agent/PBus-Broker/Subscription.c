@@ -0,0 +1,331 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Subscription matching.
+ *
+ * Every active subscription's pair of patterns is joined, with
+ * kPatternSeparator between them, into a single pattern; all these are
+ * compiled into one trie, in which the edges are literal characters, '?', or
+ * '*'. A notification's bus name and notification name are joined the same way
+ * and the trie is run as an NFA over the result. Subscriptions sharing pattern
+ * prefixes share trie nodes, so the cost of matching is governed by the length
+ * of the subject and the number of distinct wildcard positions among the
+ * patterns, rather than by the number of subscriptions.
+ *
+ * Wildcards never match the separator, so neither half of a pattern can match
+ * into the other half of the subject.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PBus-Broker.h"
+#include "PBus/PBus_Private.h"
+
+#define kPatternSeparator '\x1f'
+
+typedef enum
+{
+    kEdgeLiteral,
+    kEdgeAny,  /* '?' */
+    kEdgeStar, /* '*' */
+} PBusMatchEdgeKind;
+
+struct PBusMatchNode
+{
+    PBusMatchEdgeKind aKind;
+    char aChar; /* For kEdgeLiteral */
+    PBusMatchNode * aParent;
+
+    PBusMatchNode * aLiterals; /* Hashed by aChar */
+    PBusMatchNode * aAny;
+    PBusMatchNode * aStar;
+
+    /* Subscriptions whose patterns end at this node. */
+    PBusSubscription_list_t aSubscriptions;
+    unsigned long aMark; /* Last matching step in which node was active. */
+
+    UT_hash_handle hh;
+};
+
+typedef struct
+{
+    PBusMatchNode ** aNodes;
+    size_t aCount, aCap;
+} PBusMatchSet;
+
+static PBusMatchNode gRoot;
+static unsigned long gMark;
+/* Sets of active nodes, reused between matches. */
+static PBusMatchSet gSets[2];
+
+static PBusMatchNode * nodeChild (PBusMatchNode * node, char c)
+{
+    PBusMatchNode ** slot = NULL;
+    PBusMatchNode * child = NULL;
+    PBusMatchEdgeKind kind = kEdgeLiteral;
+
+    if (c == '*')
+    {
+        slot = &node->aStar;
+        kind = kEdgeStar;
+    }
+    else if (c == '?')
+    {
+        slot = &node->aAny;
+        kind = kEdgeAny;
+    }
+    else
+        HASH_FIND (hh, node->aLiterals, &c, 1, child);
+
+    if (slot)
+        child = *slot;
+
+    if (child)
+        return child;
+
+    child = calloc (1, sizeof (*child));
+    child->aKind = kind;
+    child->aChar = c;
+    child->aParent = node;
+    child->aSubscriptions = PBusSubscription_list_new ();
+
+    if (slot)
+        *slot = child;
+    else
+        HASH_ADD (hh, node->aLiterals, aChar, 1, child);
+
+    return child;
+}
+
+static PBusMatchNode * insertPattern (PBusMatchNode * node, const char * str)
+{
+    for (; *str; str++)
+    {
+        /* Consecutive stars are equivalent to one. */
+        if (*str == '*' && node->aKind == kEdgeStar)
+            continue;
+        node = nodeChild (node, *str);
+    }
+    return node;
+}
+
+static void pruneNode (PBusMatchNode * node)
+{
+    while (node != &gRoot && LL_empty (&node->aSubscriptions) &&
+           !node->aLiterals && !node->aAny && !node->aStar)
+    {
+        PBusMatchNode * parent = node->aParent;
+
+        if (node->aKind == kEdgeStar)
+            parent->aStar = NULL;
+        else if (node->aKind == kEdgeAny)
+            parent->aAny = NULL;
+        else
+            HASH_DEL (parent->aLiterals, node);
+
+        free (node);
+        node = parent;
+    }
+}
+
+void PBusMatcher_add (PBusSubscription * sub)
+{
+    PBusMatchNode * node;
+
+    node = insertPattern (&gRoot, sub->aBusNamePattern);
+    node = nodeChild (node, kPatternSeparator);
+    node = insertPattern (node, sub->aNotificationNamePattern);
+
+    PBusSubscription_list_add (&node->aSubscriptions, sub);
+    sub->aNode = node;
+}
+
+void PBusMatcher_remove (PBusSubscription * sub)
+{
+    PBusSubscription_list_del (&sub->aNode->aSubscriptions, sub);
+    pruneNode (sub->aNode);
+    sub->aNode = NULL;
+}
+
+/*
+ * Adds @node to @set, together with any star node following it (as a star may
+ * match the empty string.) Nodes already added during this step are skipped.
+ */
+static void setAdd (PBusMatchSet * set, PBusMatchNode * node)
+{
+    while (node && node->aMark != gMark)
+    {
+        node->aMark = gMark;
+
+        if (set->aCount == set->aCap)
+        {
+            set->aCap = set->aCap ? set->aCap * 2 : 16;
+            set->aNodes = realloc (set->aNodes, set->aCap * sizeof (node));
+        }
+
+        set->aNodes[set->aCount++] = node;
+        node = node->aStar;
+    }
+}
+
+/*
+ * Advances the active set @cur over character @c into @next.
+ */
+static void step (PBusMatchSet * cur, PBusMatchSet * next, char c)
+{
+    gMark++;
+    next->aCount = 0;
+
+    for (size_t i = 0; i < cur->aCount; i++)
+    {
+        PBusMatchNode *node = cur->aNodes[i], *child;
+
+        if (c != kPatternSeparator)
+        {
+            if (node->aKind == kEdgeStar)
+                setAdd (next, node);
+            setAdd (next, node->aAny);
+        }
+
+        HASH_FIND (hh, node->aLiterals, &c, 1, child);
+        setAdd (next, child);
+    }
+}
+
+static bool stepString (PBusMatchSet ** cur, PBusMatchSet ** next,
+                        const char * str)
+{
+    for (; *str; str++)
+    {
+        PBusMatchSet * tmp;
+
+        step (*cur, *next, *str);
+        tmp = *cur;
+        *cur = *next;
+        *next = tmp;
+
+        if (!(*cur)->aCount)
+            return false;
+    }
+    return true;
+}
+
+void PBusMatcher_match (const char * busName, const char * notificationName,
+                        PBusMatchFn fn, void * user)
+{
+    PBusMatchSet *cur = &gSets[0], *next = &gSets[1];
+    const char sep[2] = {kPatternSeparator, '\0'};
+
+    gMark++;
+    cur->aCount = 0;
+    setAdd (cur, &gRoot);
+
+    if (!stepString (&cur, &next, busName) || !stepString (&cur, &next, sep) ||
+        !stepString (&cur, &next, notificationName))
+        return;
+
+    for (size_t i = 0; i < cur->aCount; i++)
+        LL_each (&cur->aNodes[i]->aSubscriptions, it)
+            fn (list_it_val (it), user);
+}
+
+int PBusBroker_subscribe (PBusClient * pbc, const char * busNamePattern,
+                          const char * notificationNamePattern)
+{
+    PBusSubscription * sub = calloc (1, sizeof (*sub));
+
+    if (++gBroker.aNextSubscriptionID <= 0)
+        gBroker.aNextSubscriptionID = 1;
+
+    sub->aID = gBroker.aNextSubscriptionID;
+    sub->aClient = pbc;
+    sub->aBusNamePattern = strdup (busNamePattern);
+    sub->aNotificationNamePattern = strdup (notificationNamePattern);
+
+    PBusMatcher_add (sub);
+    HASH_ADD_INT (gBroker.aSubscriptions, aID, sub);
+    PBusSubscription_list_add (&pbc->aSubscriptions, sub);
+
+    return sub->aID;
+}
+
+int PBusBroker_unsubscribe (PBusClient * pbc, int subscriptionID)
+{
+    PBusSubscription * sub;
+
+    HASH_FIND_INT (gBroker.aSubscriptions, &subscriptionID, sub);
+    if (!sub || sub->aClient != pbc)
+        return -1;
+
+    PBusMatcher_remove (sub);
+    HASH_DEL (gBroker.aSubscriptions, sub);
+    PBusSubscription_list_del (&pbc->aSubscriptions, sub);
+
+    free (sub->aBusNamePattern);
+    free (sub->aNotificationNamePattern);
+    free (sub);
+
+    return 0;
+}
+
+typedef struct
+{
+    const char * aFromBusname;
+    const char * aNotificationName;
+    const nvlist_t * aParams;
+    int aDelivered;
+} PBusPublication;
+
+static void deliver (PBusSubscription * sub, void * user)
+{
+    PBusPublication * pub = user;
+    nvlist_t *params = nvlist_create (0), *note;
+
+    nvlist_add_number (params, "subscriptionID", sub->aID);
+    nvlist_add_string (params, "fromBusname", pub->aFromBusname);
+    nvlist_add_string (params, "notificationName", pub->aNotificationName);
+    nvlist_add_nvlist (params, "params", pub->aParams);
+
+    note = S16NVRPCNotificationNew (PBusReceiveNotificationSig.name, params);
+    PBusClient_enqueue (sub->aClient, note, true);
+    nvlist_destroy (note);
+
+    pub->aDelivered++;
+}
+
+int PBusBroker_publish (PBusClient * pbc, const char * notificationName,
+                        const nvlist_t * params)
+{
+    PBusPublication pub = {.aFromBusname = pbc->aBusName,
+                           .aNotificationName = notificationName,
+                           .aParams = params,
+                           .aDelivered = 0};
+
+    PBusMatcher_match (pbc->aBusName, notificationName, deliver, &pub);
+
+    return pub.aDelivered;
+}
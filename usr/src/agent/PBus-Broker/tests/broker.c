@@ -0,0 +1,212 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <atf-c.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PBus-Broker.h"
+
+PBusBroker gBroker;
+
+/* Messages queued to clients, in place of the broker's event loop. */
+static int nEnqueued;
+static nvlist_t * lastEnqueued;
+static bool lastDroppable;
+
+void PBusClient_enqueue (PBusClient * pbc, const nvlist_t * msg,
+                         bool droppable)
+{
+    nEnqueued++;
+    if (lastEnqueued)
+        nvlist_destroy (lastEnqueued);
+    lastEnqueued = nvlist_clone (msg);
+    lastDroppable = droppable;
+}
+
+static PBusSubscription * sub_new (const char * busNamePattern,
+                                   const char * notificationNamePattern)
+{
+    PBusSubscription * sub = calloc (1, sizeof (*sub));
+
+    sub->aBusNamePattern = strdup (busNamePattern);
+    sub->aNotificationNamePattern = strdup (notificationNamePattern);
+    PBusMatcher_add (sub);
+
+    return sub;
+}
+
+static void sub_destroy (PBusSubscription * sub)
+{
+    PBusMatcher_remove (sub);
+    free (sub->aBusNamePattern);
+    free (sub->aNotificationNamePattern);
+    free (sub);
+}
+
+/* Sets bit aID of the word at @user for each matching subscription. */
+static void mark (PBusSubscription * sub, void * user)
+{
+    *(unsigned *)user |= 1u << sub->aID;
+}
+
+static unsigned match (const char * busName, const char * notificationName)
+{
+    unsigned matched = 0;
+    PBusMatcher_match (busName, notificationName, mark, &matched);
+    return matched;
+}
+
+ATF_TC (match_patterns);
+ATF_TC_HEAD (match_patterns, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests matching of literal, '?' and '*' patterns");
+}
+ATF_TC_BODY (match_patterns, tc)
+{
+    PBusSubscription * subs[] = {
+        sub_new ("pbus:/system/a", "Changed"),
+        sub_new ("pbus:/system/?", "Changed"),
+        sub_new ("pbus:/system/*", "*"),
+        sub_new ("*", "Chang*"),
+        sub_new ("pbus:/system/a", "Changed"),
+        sub_new ("**", "?"),
+    };
+
+    for (int i = 0; i < 6; i++)
+        subs[i]->aID = i;
+
+    ATF_CHECK_EQ (0x1f, match ("pbus:/system/a", "Changed"));
+    ATF_CHECK_EQ (0x0c, match ("pbus:/system/ab", "Changed"));
+    ATF_CHECK_EQ (0x08, match ("pbus:/user/a", "Change"));
+    ATF_CHECK_EQ (0x04, match ("pbus:/system/a", "Removed"));
+    ATF_CHECK_EQ (0x24, match ("pbus:/system/", "X"));
+    ATF_CHECK_EQ (0x20, match ("", "X"));
+    ATF_CHECK_EQ (0x00, match ("pbus:/user/a", "Removed"));
+
+    /* Both halves must match. */
+    ATF_CHECK_EQ (0x00, match ("pbus:/user/a", ""));
+
+    /* A removed subscription no longer matches, while one sharing its
+     * pattern does. */
+    sub_destroy (subs[0]);
+    ATF_CHECK_EQ (0x1e, match ("pbus:/system/a", "Changed"));
+    sub_destroy (subs[4]);
+    ATF_CHECK_EQ (0x0e, match ("pbus:/system/a", "Changed"));
+
+    for (int i = 1; i < 6; i++)
+        if (i != 4)
+            sub_destroy (subs[i]);
+    ATF_CHECK_EQ (0x00, match ("pbus:/system/a", "Changed"));
+}
+
+ATF_TC (publish);
+ATF_TC_HEAD (publish, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests delivery of notifications to subscribers");
+}
+ATF_TC_BODY (publish, tc)
+{
+    PBusClient from = {.aBusName = "pbus:/system/a"}, to = {0};
+    nvlist_t * params = nvlist_create (0);
+    int id;
+
+    to.aSubscriptions = PBusSubscription_list_new ();
+    id = PBusBroker_subscribe (&to, "pbus:/system/*", "Changed");
+    PBusBroker_subscribe (&to, "pbus:/user/*", "*");
+
+    ATF_CHECK_EQ (1, PBusBroker_publish (&from, "Changed", params));
+    ATF_CHECK_EQ (0, PBusBroker_publish (&from, "Removed", params));
+    ATF_CHECK_EQ (1, nEnqueued);
+
+    ATF_CHECK_EQ (-1, PBusBroker_unsubscribe (&from, id));
+    ATF_CHECK_EQ (0, PBusBroker_unsubscribe (&to, id));
+    ATF_CHECK_EQ (-1, PBusBroker_unsubscribe (&to, id));
+    ATF_CHECK_EQ (0, PBusBroker_publish (&from, "Changed", params));
+
+    nvlist_destroy (params);
+}
+
+static void capture (PBusClient * from, const char * method)
+{
+    nvlist_t * msg = nvlist_create (0);
+
+    nvlist_add_string (msg, "method", method);
+    PBusMonitor_capture (from, msg);
+    nvlist_destroy (msg);
+}
+
+ATF_TC (monitor_drops);
+ATF_TC_HEAD (monitor_drops, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests reporting to monitors of dropped records");
+}
+ATF_TC_BODY (monitor_drops, tc)
+{
+    PBusClient from = {.aBusName = "pbus:/system/a"}, mon = {0};
+    const nvlist_t * batch;
+
+    PBusMonitor_attach (&mon, "*", "Wanted");
+    nEnqueued = 0;
+
+    /* Overflow the ring with records the monitor doesn't want. */
+    for (int i = 0; i < 1025; i++)
+        capture (&from, "Other");
+    PBusMonitor_drain ();
+
+    ATF_REQUIRE_EQ (1, nEnqueued);
+    ATF_CHECK (!lastDroppable);
+    batch = nvlist_get_nvlist (nvlist_get_nvlist (lastEnqueued, "params"),
+                               "batch");
+    ATF_CHECK_EQ (1, nvlist_get_number (batch, "dropped"));
+    ATF_CHECK (!nvlist_exists (batch, "records"));
+
+    /* The count is reported once only. */
+    capture (&from, "Other");
+    PBusMonitor_drain ();
+    ATF_CHECK_EQ (1, nEnqueued);
+
+    capture (&from, "Wanted");
+    PBusMonitor_drain ();
+    ATF_REQUIRE_EQ (2, nEnqueued);
+    ATF_CHECK (lastDroppable);
+    batch = nvlist_get_nvlist (nvlist_get_nvlist (lastEnqueued, "params"),
+                               "batch");
+    ATF_CHECK_EQ (0, nvlist_get_number (batch, "dropped"));
+    ATF_CHECK (nvlist_exists_binary (batch, "records"));
+
+    PBusMonitor_detachClient (&mon);
+}
+
+ATF_TP_ADD_TCS (tp)
+{
+    ATF_TP_ADD_TC (tp, match_patterns);
+    ATF_TP_ADD_TC (tp, publish);
+    ATF_TP_ADD_TC (tp, monitor_drops);
+    return atf_no_error ();
+}
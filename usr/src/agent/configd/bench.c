@@ -0,0 +1,150 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Benchmark of the repository's import path. Generates manifests, then
+ * imports them into the manifest layer as manifest-import does at boot, and
+ * reports the time taken. Generation and parsing are not timed. Finally
+ * reports what the string table saved.
+ *
+ * Usage: configd-bench [count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "S16/Repository_Private.h"
+#include "ucl.h"
+
+#include "configd.h"
+
+subscriber_list_t subs;
+s16note_list_t notes;
+
+static S16Service * generate_svc (int i)
+{
+    char * txt;
+    struct ucl_parser * parser = ucl_parser_new (0);
+    ucl_object_t * usvc;
+    S16Service * svc;
+
+    /* Each depends on its predecessor, as real services form chains. Each
+     * instance is templated alike, as in test/example.ucl. */
+    asprintf (&txt,
+              "path = \"svc:/bench/svc%d\";\n"
+              "methods = [{ name = \"start\"; properties = [\n"
+              "    { name = \"exec\"; value = \"/bin/true %d\"; }]; }];\n"
+              "dependencies = [{ grouping = \"require-all\";\n"
+              "    restart-on = \"none\"; paths = [\"svc:/bench/svc%d\"]; }];\n"
+              "instances = [{ path = \"svc:/bench/svc%d:default\";\n"
+              "    properties = [{ name = \"device\";\n"
+              "        value = \"${instance-name}\"; }];\n"
+              "    methods = [{ name = \"start\"; properties = [\n"
+              "      { name = \"exec\"; value = \"getty ${device}\"; }]; }];\n"
+              "}];\n",
+              i,
+              i,
+              i ? i - 1 : 0,
+              i);
+
+    ucl_parser_add_string (parser, txt, 0);
+    usvc = ucl_parser_get_object (parser);
+    svc = s16db_ucl_to_svc (usvc);
+
+    ucl_object_unref (usvc);
+    ucl_parser_free (parser);
+    free (txt);
+
+    return svc;
+}
+
+static double elapsed (struct timespec * start, struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main (int argc, char * argv[])
+{
+    int count = argc > 1 ? atoi (argv[1]) : 5000;
+    S16Service ** svcs = malloc (sizeof (*svcs) * count);
+    struct timespec start, end;
+    double secs;
+    s16str_stats_t str;
+
+    db_setup ();
+    notes = s16note_list_new ();
+
+    for (int i = 0; i < count; i++)
+        svcs[i] = generate_svc (i);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++)
+        db_import (L_MANIFEST, svcs[i]);
+    db_publish ();
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    secs = elapsed (&start, &end);
+    printf ("Imported %d manifests in %.3f s (%.1f us each)\n",
+            count,
+            secs,
+            secs * 1e6 / count);
+
+    printf ("Queued %d notes\n", s16note_list_size (&notes));
+    s16note_list_deepdestroy (&notes, s16note_destroy);
+
+    /* And the same again, as on re-import of unchanged manifests. */
+    for (int i = 0; i < count; i++)
+        svcs[i] = generate_svc (i);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++)
+        db_import (L_MANIFEST, svcs[i]);
+    db_publish ();
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    secs = elapsed (&start, &end);
+    printf ("Reimported %d manifests in %.3f s (%.1f us each)\n",
+            count,
+            secs,
+            secs * 1e6 / count);
+    /* Nothing changed, so nothing to tell. */
+    printf ("Queued %d notes\n", s16note_list_size (&notes));
+    s16note_list_deepdestroy (&notes, s16note_destroy);
+
+    s16str_stats (&str);
+    printf ("Strings: %zu held for %zu references, in %zu bytes; "
+            "%zu bytes saved\n",
+            str.strings,
+            str.refs,
+            str.bytes,
+            str.bytes_saved);
+
+    free (svcs);
+    db_destroy ();
+
+    return 0;
+}
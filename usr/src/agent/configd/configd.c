@@ -25,12 +25,14 @@
 
 #include <assert.h>
 #include <err.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/event.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "systemd/sd-daemon.h"
@@ -49,10 +51,118 @@ s16db_scope_t user;
 subscriber_list_t subs;
 s16note_list_t notes;
 
+/* Whether the socket was bound by us, rather than passed to us. */
+static bool own_socket = false;
+/* Our arguments, with which a successor is started. */
+static char ** our_argv;
+
+/* How long the repository must be left unchanged before a changed image is
+ * saved, in nanoseconds. */
+#define kImageSaveDelay 250000000
+/* Events handled, and so calls committed, in one batch at most. */
+#define kMaxEvents 64
+/* Notifications which may wait to be sent to any one subscriber, unless
+ * otherwise configured. */
+#define kDefaultQueueLimit 1024
+/* Threads serving reads, unless otherwise configured. */
+#define kDefaultWorkers 4
+
+struct option options[] = {{"queue-limit", required_argument, NULL, 'q'},
+                           {"overflow", required_argument, NULL, 'o'},
+                           {"workers", required_argument, NULL, 'w'},
+                           {"takeover", no_argument, NULL, 't'},
+                           {NULL, 0, NULL, 0}};
+
 void clean_exit ()
 {
+    workers_stop ();
+    if (db_image_dirty ())
+        db_save_image ();
     db_destroy ();
-    unlink (S16DB_CONFIGD_SOCKET_PATH);
+    handoff_cleanup ();
+    /* A socket passed to us belongs to restartd, which will pass it again to
+     * our successor; connections made meanwhile wait in it. */
+    if (own_socket)
+        unlink (S16DB_CONFIGD_SOCKET_PATH);
+}
+
+/* Starts a successor to take over from us, with our own arguments. */
+static void spawn_successor ()
+{
+    int argc;
+    char ** argv;
+    static const char kExecFailed[] = "Failed to start successor\n";
+    sigset_t none;
+    pid_t pid;
+
+    /* The child may only do what is async-signal-safe; so everything it
+     * needs is made ready beforehand. */
+    for (argc = 0; our_argv[argc]; argc++)
+        ;
+    argv = calloc (argc + 2, sizeof (char *));
+    memcpy (argv, our_argv, argc * sizeof (char *));
+    argv[argc] = "--takeover";
+    sigemptyset (&none);
+
+    if ((pid = fork ()) != 0)
+    {
+        if (pid == -1)
+            S16Log (kS16LogError, "Failed to fork successor: %m\n");
+        free (argv);
+        return;
+    }
+
+    /* Nothing of ours may leak into the successor; in particular, stray
+     * copies of our connections would keep them open after it closes them.
+     * Everything it needs, it is handed. */
+    for (int fd = STDERR_FILENO + 1; fd < 256; fd++)
+        close (fd);
+    sigprocmask (SIG_SETMASK, &none, NULL);
+
+    execvp (argv[0], argv);
+    write (STDERR_FILENO, kExecFailed, sizeof (kExecFailed) - 1);
+    _exit (EXIT_FAILURE);
+}
+
+/* Adopts the subscription, if any, of a connection handed over. */
+static void adopt_conn (int old_fd, int fd, void * subs_nvl)
+{
+    subscriber_import (subs_nvl, old_fd, fd);
+}
+
+static void handle_event (s16rpc_srv_t * srv, struct kevent * ev, bool * run)
+{
+    if (workers_investigate_kevent (ev) || handoff_investigate_kevent (ev))
+        return;
+
+    s16rpc_investigate_kevent (srv, ev);
+
+    if (ev->flags & EV_EOF)
+    {
+        int fd = ev->ident;
+        subscriber_t * sub = NULL;
+
+        list_foreach (subscriber, &subs, it)
+        {
+            if (it->val->fd == fd)
+                sub = it->val;
+        }
+
+        /* one of our subscribers closed their socket, remove from
+         * subscriber list */
+        if (sub)
+            subscriber_remove (sub);
+    }
+
+    switch (ev->filter)
+    {
+    case EVFILT_SIGNAL:
+        if (ev->ident == SIGINT)
+            *run = false;
+        else if (ev->ident == SIGUSR2)
+            spawn_successor ();
+        break;
+    }
 }
 
 int main (int argc, char * argv[])
@@ -60,33 +170,112 @@ int main (int argc, char * argv[])
     int listener_s;
     int kq;
     struct sockaddr_un sun;
-    struct kevent ev;
+    struct kevent ev, evs[kMaxEvents];
     s16rpc_srv_t * srv;
     bool run = true;
+    int c;
+    size_t queue_limit = kDefaultQueueLimit;
+    s16rpc_overflow_policy_t overflow = S16RPC_OVERFLOW_COALESCE;
+    size_t nworkers = kDefaultWorkers;
+    bool takeover = false;
+    nvlist_t * handover = NULL;
+    int handoff_conn = -1, view_fd = -1;
 
-    /* make sure repo socket deleted after exit */
-    atexit (clean_exit);
-    S16LogInit ("Service Repository");
+    our_argv = argv;
 
-    if ((listener_s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+    while ((c = getopt_long (argc, argv, "q:o:w:t", options, NULL)) >= 0)
     {
-        perror ("Failed to create socket");
-        exit (-1);
+        switch (c)
+        {
+        case 'q':
+            queue_limit = strtoul (optarg, NULL, 10);
+            break;
+
+        case 'o':
+            if (!strcmp (optarg, "coalesce"))
+                overflow = S16RPC_OVERFLOW_COALESCE;
+            else if (!strcmp (optarg, "drop-oldest"))
+                overflow = S16RPC_OVERFLOW_DROP_OLDEST;
+            else if (!strcmp (optarg, "disconnect"))
+                overflow = S16RPC_OVERFLOW_DISCONNECT;
+            else
+            {
+                fprintf (stderr,
+                         "Overflow policy must be one of coalesce, "
+                         "drop-oldest, disconnect\n");
+                exit (EXIT_FAILURE);
+            }
+            break;
+
+        case 'w':
+            nworkers = strtoul (optarg, NULL, 10);
+            break;
+
+        case 't':
+            takeover = true;
+            break;
+
+        default:
+            fprintf (stderr,
+                     "Usage: %s [-q queue-limit] [-o overflow-policy] "
+                     "[-w workers] [-t]\n",
+                     argv[0]);
+            exit (EXIT_FAILURE);
+        }
     }
 
-    memset (&sun, 0, sizeof (struct sockaddr_un));
-    sun.sun_family = AF_UNIX;
-    strncpy (sun.sun_path, S16DB_CONFIGD_SOCKET_PATH, sizeof (sun.sun_path));
+    /* make sure repo socket deleted after exit */
+    if (!takeover)
+        atexit (clean_exit);
+    S16LogInit ("Service Repository");
 
-    if (bind (listener_s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == -1)
+    /* Taking over from a running configd, we are handed its socket with
+     * everything else. Until it lets go, we must disturb nothing shared with
+     * it, so no cleanup is made at exit until then. */
+    if (takeover)
     {
-        perror ("Failed to bind socket");
-        exit (-1);
+        if (!(handover = handoff_receive (&handoff_conn)))
+            exit (EXIT_FAILURE);
+        listener_s = dup (nvlist_get_descriptor (handover, "listener"));
+        S16CloseOnExec (listener_s);
     }
+    /* Clients may already have connected to a socket passed to us, while we
+     * were starting; they are served once we are ready. */
+    else if (S16ListenFds () >= 1)
+        listener_s = S16_LISTEN_FDS_START;
+    else
+    {
+        if ((listener_s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+        {
+            perror ("Failed to create socket");
+            exit (-1);
+        }
 
-    listen (listener_s, 5);
+        memset (&sun, 0, sizeof (struct sockaddr_un));
+        sun.sun_family = AF_UNIX;
+        strncpy (
+            sun.sun_path, S16DB_CONFIGD_SOCKET_PATH, sizeof (sun.sun_path));
 
+        if (bind (listener_s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == -1)
+        {
+            perror ("Failed to bind socket");
+            exit (-1);
+        }
+
+        listen (listener_s, 5);
+        own_socket = true;
+    }
+
+    stats_setup ();
     db_setup ();
+    /* If there is no image, the manifests will be imported as usual. */
+    if (db_open (S16DB_CONFIGD_IMAGE_PATH, S16DB_CONFIGD_LOG_PATH) == -1)
+    {
+        S16Log (kS16LogError, "Failed to open repository; exiting\n");
+        exit (EXIT_FAILURE);
+    }
+    if (handover)
+        db_handoff_import (nvlist_get_nvlist (handover, "db"));
 
     subs = subscriber_list_new ();
     notes = s16note_list_new ();
@@ -94,63 +283,100 @@ int main (int argc, char * argv[])
     kq = kqueue ();
 
     signal (SIGINT, SIG_IGN);
+    /* SIGUSR2 starts a successor to take over from us. */
+    signal (SIGUSR2, SIG_IGN);
+    signal (SIGCHLD, SIG_IGN);
 
-    EV_SET (&ev, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
-
-    if (kevent (kq, &ev, 1, 0, 0, 0) == -1)
+    for (int i = 0; i < 2; i++)
     {
-        perror ("KQueue: Failed to set signal event\n");
-        exit (EXIT_FAILURE);
+        EV_SET (&ev, i ? SIGUSR2 : SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+
+        if (kevent (kq, &ev, 1, 0, 0, 0) == -1)
+        {
+            perror ("KQueue: Failed to set signal event\n");
+            exit (EXIT_FAILURE);
+        }
     }
 
     srv = s16rpc_srv_new (kq, listener_s, NULL, false);
+    s16rpc_srv_set_queue_limit (srv, queue_limit, overflow);
     rpc_setup (srv);
 
-    sd_notify (0, "READY=1\nSTATUS=Service repository up and running");
-
-    while (run)
+    if (handover)
     {
-        s16note_t * note = NULL;
+        /* Our predecessor may still be writing to the connections until it
+         * lets go; output handed over waits until then. */
+        s16rpc_srv_hold_replies (srv);
+        s16rpc_srv_import (srv,
+                           nvlist_get_nvlist (handover, "conns"),
+                           adopt_conn,
+                           (void *)nvlist_get_nvlist (handover, "subs"));
 
-        memset (&ev, 0x00, sizeof (struct kevent));
-        kevent (kq, NULL, 0, &ev, 1, NULL);
+        if (handoff_complete (handoff_conn) == -1)
+        {
+            S16Log (kS16LogError, "Predecessor did not let go; exiting\n");
+            exit (EXIT_FAILURE);
+        }
 
-        s16rpc_investigate_kevent (srv, &ev);
+        if (nvlist_exists_descriptor (handover, "view"))
+            view_fd = dup (nvlist_get_descriptor (handover, "view"));
+        own_socket = nvlist_get_bool (handover, "own-socket");
+        nvlist_destroy (handover);
+        atexit (clean_exit);
+        S16Log (kS16LogInfo, "Took over from predecessor\n");
+    }
 
-        if (ev.flags & EV_EOF)
-        {
-            int fd = ev.ident;
-            subscriber_t * sub = NULL;
+    /* The view, too, is our predecessor's until it lets go; were we to fail
+     * to take over, it would otherwise be left naming us as its publisher.
+     * It is set up before any reply is sent, so that a client told of a
+     * change finds it in the view. */
+    db_view_setup (view_fd);
+    s16rpc_srv_release_replies (srv);
 
-            list_foreach (subscriber, &subs, it)
-            {
-                if (it->val->clnt.fd == fd)
-                    sub = it->val;
-            }
+    workers_setup (srv, kq, nworkers);
+    handoff_setup (kq);
 
-            /* one of our subscribers closed their socket, remove from
-             * subscriber list */
-            if (sub)
-                subscriber_list_del (&subs, sub);
-        }
+    /* Having taken over, we are now the main process of the service. */
+    sd_notifyf (0,
+                "MAINPID=%d\nREADY=1\nSTATUS=Service repository up and "
+                "running",
+                (int)getpid ());
 
-        switch (ev.filter)
-        {
-        case EVFILT_SIGNAL:
-            if (ev.ident == SIGINT)
-                run = false;
-            break;
-        }
+    while (run)
+    {
+        struct timespec idle = {0, kImageSaveDelay}, began;
+        int nev;
 
-        while ((note = s16note_list_lpop (&notes)))
+        memset (evs, 0x00, sizeof (evs));
+        nev = kevent (
+            kq, NULL, 0, evs, kMaxEvents, db_image_dirty () ? &idle : NULL);
+
+        /* The repository has settled since it last changed; save it. */
+        if (nev == 0)
         {
-            ucl_object_t * unote = s16db_note_to_ucl (note);
-            list_foreach (subscriber, &subs, it)
-            {
-                if (it->val->kinds & note->note_type)
-                    s16rpc_clnt_call_unsafe (&it->val->clnt, "notify", unote);
-            }
+            db_save_image ();
+            continue;
         }
+
+        clock_gettime (CLOCK_MONOTONIC, &began);
+
+        /* The replies to a batch of calls are sent only once the changes
+         * they made are durable, and visible to readers. */
+        s16rpc_srv_hold_replies (srv);
+        for (int i = 0; i < nev; i++)
+            handle_event (srv, &evs[i], &run);
+        if (db_commit () == -1)
+            s16rpc_srv_fail_replies (
+                srv, S16ENOTDURABLE, "Changes could not be made durable");
+        db_publish ();
+        s16rpc_srv_release_replies (srv);
+
+        rpc_push_subscribers (srv);
+        stats_loop_iteration (&began);
+
+        /* Handed over, we exit here; else we carry on. */
+        if (handoff_pending ())
+            handoff_serve (srv, listener_s, own_socket);
     }
 
     return 0;
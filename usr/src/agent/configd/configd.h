@@ -27,25 +27,236 @@
 #define REPOSITORYD_H_
 
 #include "S16/Repository.h"
+#include "nv.h"
 
 typedef struct
 {
-    s16rpc_clnt_t clnt;
+    /* The subscriber's connection; notifications to it are queued there. */
+    int fd;
     int kinds;
+    /* Restrictions on the notes wanted (see s16db_note_filter_t), with
+     * instances as "svc:inst" strings. */
+    char ** prefixes;
+    size_t nprefixes;
+    char ** insts;
+    size_t ninsts;
+    unsigned types;
+    /* Used by the matcher. */
+    unsigned long stamp;
+    /* Whether changes to the repository are pushed, and if so, the epoch and
+     * generation which the subscriber has been brought up to, and the fields
+     * it wants. */
+    bool changes;
+    unsigned long epoch, gen;
+    int proj;
 } subscriber_t;
 
 S16ListType (subscriber, subscriber_t *);
 
+typedef void (*db_change_walk_fun) (S16Path * path, void * user);
+
+/* An immutable version of the merged repository, as published after a batch
+ * of changes. It may be read from any thread, between rcu_read_lock() and
+ * rcu_read_unlock(). */
+typedef struct db_snapshot_s
+{
+    /* The generation of the repository it captures. */
+    unsigned long generation;
+    /* Sorted by name. */
+    S16Service ** svcs;
+    size_t nsvcs;
+    /* Services which it alone still refers to, freed with it. */
+    S16Service ** dead;
+    size_t ndead;
+} db_snapshot_t;
+
+typedef void (*rcu_free_fun) (void * obj);
+
+/* Reads from a snapshot what a call wants. @path may be NULL. */
+typedef ucl_object_t * (*worker_read_fun) (const db_snapshot_t * snap,
+                                           S16Path * path, int proj);
+
+typedef enum
+{
+    W_ENABLE,    /* Payload: path of instance */
+    W_DISABLE,   /* Payload: path of instance */
+    W_ADMIN_SVC, /* Payload: service as JSON */
+} wal_rec_type_t;
+
+typedef void (*wal_replay_fun) (wal_rec_type_t type, const char * data,
+                                size_t len, void * user);
+
 /* rpc.c */
 void rpc_setup (s16rpc_srv_t * srv);
+/* Queues for subscribers the pending notes and changes to the repository.
+ * Subscribers disconnected by the overflow policy are forgotten. */
+void rpc_push_subscribers (s16rpc_srv_t * srv);
+/* Removes a subscriber and destroys it. */
+void subscriber_remove (subscriber_t * sub);
+/* Describes the subscribers, by the descriptors of their connections, for a
+ * successor. */
+nvlist_t * subscribers_export ();
+/* Restores the subscriber described for connection @old_fd, if there was one,
+ * as that of connection @fd. */
+void subscriber_import (const nvlist_t * nvl, int old_fd, int fd);
+
+/* import.c */
+/* Imports the manifests at @paths to @layer, returning the reply to
+ * import-manifests. */
+ucl_object_t * import_manifests (const char ** paths, size_t n,
+                                 s16db_layer_t layer);
+
+/* txn.c */
+/* Checks, then applies together, the operations of a transaction, returning
+ * the reply to transaction. */
+ucl_object_t * txn_apply (const ucl_object_t * uops);
+
+/* filter.c */
+/* Must be called whenever a subscription changes or a subscriber goes. */
+void filter_invalidate ();
+/* Adds to @out each subscriber which wants @note. */
+void filter_match (s16note_t * note, subscriber_list_t * out);
+/* Describes the changes to the repository since generation @gen of @epoch;
+ * or, if @epoch is not the current epoch, the whole repository. Only the
+ * fields in @proj are included. */
+ucl_object_t * rpc_changes_since (unsigned long epoch, unsigned long gen,
+                                  int proj);
 
 /* db.c */
 void db_setup ();
 void db_destroy ();
 void db_import (s16db_layer_t layer, S16Service * svc);
+/* Looks up a path in the merged scope as it is now, changes not yet
+ * published included. Only for the main thread. */
 s16db_lookup_result_t db_lookup_path_merged (S16Path * path);
-svc_list_t * db_get_all_svcs_merged ();
+/* The services of the merged scope as it is now. Only for the main thread. */
+const svc_list_t * db_merged_svcs ();
+/* Publishes, with each snapshot from now on, a view of the merged scope in
+ * shared memory for local clients to read; into the view open as @fd, handed
+ * over by a predecessor, unless it is -1. */
+void db_view_setup (int fd);
+/* The descriptor of the view, or -1 if there is none. */
+int db_view_fd ();
+/* Publishes a snapshot of the merged scope, if it has changed since the last,
+ * and frees what old snapshots no reader still holds. */
+void db_publish ();
+/* The snapshot last published. Must be called between rcu_read_lock() and
+ * rcu_read_unlock(), which delimit the snapshot's use. */
+db_snapshot_t * db_snapshot ();
+s16db_lookup_result_t db_snapshot_lookup (const db_snapshot_t * snap,
+                                          S16Path * path);
 int db_set_enabled (S16Path * path, bool enabled);
+/* Sets runtime state. It is kept in the merged scope, not in any layer. */
+int db_set_state (S16Path * path, S16ServiceState state);
+/* Whether a manifest differs from that last recorded at its path. */
+bool db_manifest_changed (const s16db_manifest_sig_t * sig);
+void db_record_manifest (const s16db_manifest_sig_t * sig);
+/* Loads the layers and manifest signatures from the image at @image, if it
+ * exists, then replays over them the log at @log. Returns 0 if successful, or
+ * -1 if the log can't be opened and read in full. */
+int db_open (const char * image, const char * log);
+/* Makes durable the changes made since the last commit. Returns 0 if
+ * successful, or -1 if they could not be; they remain in effect regardless. */
+int db_commit ();
+/* Whether anything held in the image has changed since it was saved. */
+bool db_image_dirty ();
+/* Saves the layers and manifest signatures as an image, emptying the log. */
+int db_save_image ();
+unsigned long db_epoch ();
+/* The generation of the snapshot last published. */
+unsigned long db_generation ();
+/* Calls @fn with the path of each service or instance changed since
+ * generation @gen, up to generation @upto, most recently changed first. */
+void db_walk_changes_since (unsigned long gen, unsigned long upto,
+                            db_change_walk_fun fn, void * user);
+/* Saves the image, then describes for a successor what it doesn't hold.
+ * Returns NULL on failure. */
+nvlist_t * db_handoff_export ();
+/* Restores, once the image is loaded, what a predecessor described. */
+void db_handoff_import (const nvlist_t * nvl);
+
+/* handoff.c */
+/* Awaits successors on the handoff socket. */
+void handoff_setup (int kq);
+/* Removes the handoff socket, unless it was never made. */
+void handoff_cleanup ();
+/* Must be called with each event; returns true if it was a successor's. */
+bool handoff_investigate_kevent (struct kevent * ev);
+/* Whether a successor is waiting to be handed over to. */
+bool handoff_pending ();
+/* Hands over to the waiting successor everything of @srv, including its
+ * @listener. Exits if it succeeds; else returns, and configd carries on. */
+void handoff_serve (s16rpc_srv_t * srv, int listener, bool own_socket);
+/* Connects to the running configd and receives its handover, setting @s to
+ * the connection. Returns NULL on failure. */
+nvlist_t * handoff_receive (int * s);
+/* Acknowledges, over @s, a handover adopted, and waits for the predecessor to
+ * let go. Returns 0 if we are to carry on, else -1. Closes @s. */
+int handoff_complete (int s);
+
+/* index.c */
+/* Must be called as each merged service is put into the merged scope, and
+ * again as it is taken out. */
+void index_add_svc (S16Service * svc);
+void index_remove_svc (S16Service * svc);
+/* Must be called when a merged instance's state changes from @old. */
+void index_set_state (S16ServiceInstance * inst, S16ServiceState old);
+void index_destroy ();
+/* Finds the merged instances satisfying the predicate @upred, returning an
+ * array of them with only the fields in @proj; or NULL if @upred is
+ * malformed. Only for the main thread. */
+ucl_object_t * index_query (const ucl_object_t * upred, int proj);
+
+/* stats.c */
+void stats_setup ();
+/* Counts an iteration of the event loop, begun at @began. */
+void stats_loop_iteration (const struct timespec * began);
+void stats_note_published (const s16note_t * note);
+/* Counts @n notes elided, returning the total. */
+size_t stats_notes_elided (size_t n);
+/* Reports the statistics of configd and of its RPC server @srv. */
+ucl_object_t * stats_report (s16rpc_srv_t * srv);
+
+/* workers.c */
+/* Starts @n threads to serve reads for @srv, which wake the main thread
+ * through @kq. With none, reads are served on the main thread. */
+void workers_setup (s16rpc_srv_t * srv, int kq, size_t n);
+/* Finishes the reads pending, then stops the threads. */
+void workers_stop ();
+/* Serves the read @fn for the call @dat, consuming @path. With workers, the
+ * reply is deferred and NULL returned; else the result is returned. */
+ucl_object_t * workers_read (s16rpc_data_t * dat, worker_read_fun fn,
+                             S16Path * path, int proj);
+/* Sends the replies to reads the workers have done. */
+void workers_complete ();
+/* Must be called with each event; returns true if it was the workers'. */
+bool workers_investigate_kevent (struct kevent * ev);
+
+/* rcu.c */
+/* Makes room for @n threads to read snapshots. */
+void rcu_setup (size_t n);
+/* Registers the calling thread as the @i'th reader. */
+void rcu_register (size_t i);
+void rcu_read_lock ();
+void rcu_read_unlock ();
+/* Arranges for @fn to be called on @obj once no reader can still refer to
+ * it. @obj must already be unreachable to new readers. Main thread only. */
+void rcu_retire (void * obj, rcu_free_fun fn);
+/* Frees what retired objects no reader can still refer to. Main thread
+ * only. */
+void rcu_reclaim ();
+
+/* wal.c */
+/* Opens the log at @path, calling @fn for each record in it.
+ * Returns the number of records, or -1 if the log can't be opened. */
+int wal_open (const char * path, wal_replay_fun fn, void * user);
+void wal_append (wal_rec_type_t type, const void * data, size_t len);
+/* Writes and syncs the records appended since the last commit.
+ * Returns 0 if successful. */
+int wal_commit ();
+/* Empties the log, its records being made durable by other means. */
+void wal_reset ();
+size_t wal_size ();
 
 extern s16db_scope_t global;
 extern subscriber_list_t subs;
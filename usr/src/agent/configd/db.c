@@ -45,20 +45,209 @@
 
 #include <assert.h>
 #include <err.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "S16/Repository_Private.h"
+#include "nv.h"
+#include "uthash.h"
 
 #include "configd.h"
 
-s16db_scope_t merged;
+/*
+ * A layer holds its services in a list, and indexes them by name. The merged
+ * scope is kept the same way; it is updated one service at a time, whenever
+ * that service changes in any layer.
+ *
+ * Readers other than the main thread never see the merged scope itself, but
+ * an immutable snapshot of it. After each batch of changes, a new snapshot is
+ * published, sharing with its predecessor the services which didn't change.
+ * So a merged service, once published, is never altered: a change replaces it
+ * with a new one, and the old one is freed with the last snapshot that could
+ * refer to it, once no reader can still hold that (see rcu.c).
+ */
+typedef struct db_svc_entry_s
+{
+    svc_list_it node; /* Its node in the layer's list; keyed by service name */
+    bool shared;      /* Whether a published snapshot may refer to it */
+
+    UT_hash_handle hh;
+} db_svc_entry_t;
+
+typedef struct
+{
+    s16db_scope_t scope;
+    db_svc_entry_t * index;
+} db_layer_t;
+
+static db_layer_t merged;
+
+/* The snapshot last published; readers load it atomically. */
+static _Atomic (db_snapshot_t *) published = NULL;
+/* Merged services replaced or removed since then. Snapshots up to the one
+ * published may still refer to them, so they are freed with it. */
+static S16Service ** superseded = NULL;
+static size_t nsuperseded = 0, superseded_cap = 0;
+/* Whether the merged scope has changed since then. */
+static bool merged_dirty = true;
 
 /* Manifest scope. */
-s16db_scope_t manifest;
+static db_layer_t manifest;
 /* User scope. */
-s16db_scope_t admin;
+static db_layer_t admin;
+
+/*
+ * The repository generation is advanced by every change to a service or
+ * instance. The change log holds, for each path ever changed, the generation
+ * of its latest change, ordered oldest first; so a consumer holding the
+ * repository as of some generation can be told just what changed since, at a
+ * cost proportional to the change. The epoch distinguishes generations
+ * counted by different runs of configd; it must differ even between runs
+ * begun within the same second, as when configd is restarted after a crash.
+ */
+typedef struct db_change_s
+{
+    char * key; /* String form of path */
+    S16Path * path;
+    unsigned long gen;
+
+    UT_hash_handle hh;
+} db_change_t;
+
+static unsigned long epoch;
+static unsigned long generation = 1;
+static db_change_t * changes = NULL;
+
+/* Whether the repository is being loaded, during which the services merged
+ * are not news to anyone, and no N_CONFIG notes are queued. */
+static bool loading = false;
+
+/* The view of the merged scope published in shared memory, if any. */
+static s16db_view_pub_t * view = NULL;
+
+/*
+ * The layers are persisted as a repository image, which is loaded at startup
+ * in place of importing every manifest. With them are kept the signatures of
+ * the manifests imported, so that an unchanged manifest can be skipped.
+ */
+typedef struct db_manifest_s
+{
+    s16db_manifest_sig_t sig; /* Keyed by path */
 
+    UT_hash_handle hh;
+} db_manifest_t;
+
+static db_manifest_t * manifests = NULL;
+/* Whether the layers or signatures have changed since the image was saved. */
+static bool image_dirty = false;
+static const char * image_path = NULL;
+
+/* Once the log grows this large, a new image is saved, emptying it. This
+ * bounds the time taken to replay it at startup. */
+#define kLogCompactSize (1024 * 1024)
+
+/* Disposes of a service taken out of a layer. */
+static void discard (db_layer_t * layer, S16Service * svc)
+{
+    if (layer != &merged)
+    {
+        S16ServiceDestroy (svc);
+        return;
+    }
+
+    if (nsuperseded == superseded_cap)
+    {
+        superseded_cap = superseded_cap ? superseded_cap * 2 : 64;
+        superseded =
+            realloc (superseded, superseded_cap * sizeof (*superseded));
+    }
+    superseded[nsuperseded++] = svc;
+    merged_dirty = true;
+    index_remove_svc (svc);
+}
+
+static S16Service * layer_find (db_layer_t * layer, const char * name)
+{
+    db_svc_entry_t * entry;
+
+    HASH_FIND_STR (layer->index, name, entry);
+    return entry ? entry->node->val : NULL;
+}
+
+/* Puts a service into a layer, replacing and destroying any same-named. */
+static void layer_put (db_layer_t * layer, S16Service * svc)
+{
+    db_svc_entry_t * entry;
+
+    HASH_FIND_STR (layer->index, svc->path->svc, entry);
+
+    if (entry)
+    {
+        /* Rekeyed, as the key belongs to the service being replaced. */
+        HASH_DEL (layer->index, entry);
+        discard (layer, entry->node->val);
+        entry->node->val = svc;
+    }
+    else
+    {
+        entry = malloc (sizeof (*entry));
+        svc_list_lpush (&layer->scope.svcs, svc);
+        entry->node = list_begin (&layer->scope.svcs);
+    }
+
+    entry->shared = false;
+    HASH_ADD_KEYPTR (
+        hh, layer->index, svc->path->svc, strlen (svc->path->svc), entry);
+    if (layer == &merged)
+    {
+        merged_dirty = true;
+        index_add_svc (svc);
+    }
+}
+
+static void layer_remove (db_layer_t * layer, const char * name)
+{
+    db_svc_entry_t * entry;
+    S16Service * svc;
+
+    HASH_FIND_STR (layer->index, name, entry);
+
+    if (!entry)
+        return;
+
+    svc = entry->node->val;
+    HASH_DEL (layer->index, entry);
+    svc_list_del (&layer->scope.svcs, svc);
+    discard (layer, svc);
+    free (entry);
+}
+
+static void layer_init (db_layer_t * layer)
+{
+    layer->scope.svcs = svc_list_new ();
+    layer->index = NULL;
+}
+
+static void layer_destroy (db_layer_t * layer)
+{
+    db_svc_entry_t *entry, *tmp;
+
+    HASH_ITER (hh, layer->index, entry, tmp)
+    {
+        HASH_DEL (layer->index, entry);
+        free (entry);
+    }
+    svc_list_deepdestroy (&layer->scope.svcs, S16ServiceDestroy);
+}
+
+/*
+ * The merge functions fold an entry of a higher layer into a copy of the
+ * merged entry so far. Whatever is taken from the higher layer is copied, so
+ * that the merged scope never shares with the layers.
+ */
 int merge_depgroup_into_list (S16DependencyGroup * depgroup,
                               depgroup_list_t * list)
 {
@@ -71,7 +260,7 @@ int merge_depgroup_into_list (S16DependencyGroup * depgroup,
         cand->val = S16DependencyGroupCopy (depgroup);
     }
     else
-        depgroup_list_add (list, depgroup);
+        depgroup_list_add (list, S16DependencyGroupCopy (depgroup));
 
     return 0;
 }
@@ -86,7 +275,7 @@ int merge_prop_into_list (S16Property * prop, prop_list_t * list)
         cand->val = S16PropertyCopy (prop);
     }
     else
-        prop_list_add (list, prop);
+        prop_list_add (list, S16PropertyCopy (prop));
 
     return 0;
 }
@@ -101,7 +290,7 @@ int merge_meth_into_list (S16ServiceMethod * meth, meth_list_t * list)
         cand->val = S16MethodCopy (meth);
     }
     else
-        meth_list_add (list, meth);
+        meth_list_add (list, S16MethodCopy (meth));
 
     return 0;
 }
@@ -117,6 +306,7 @@ void merge_inst_into_inst (S16ServiceInstance * to, S16ServiceInstance * from)
     depgroup_list_walk (&from->depgroups,
                         (depgroup_list_walk_fun)merge_depgroup_into_list,
                         (void *)&to->depgroups);
+    to->enabled = from->enabled;
 }
 
 int merge_inst_into_list (S16ServiceInstance * inst, inst_list_t * list)
@@ -124,11 +314,9 @@ int merge_inst_into_list (S16ServiceInstance * inst, inst_list_t * list)
     inst_list_it cand = inst_list_find_cmp (list, S16InstanceNamesEqual, inst);
 
     if (cand)
-    {
-        merge_inst_into_inst (inst, cand->val);
-    }
+        merge_inst_into_inst (cand->val, inst);
     else
-        inst_list_add (list, inst);
+        inst_list_add (list, S16InstanceCopy (inst));
 
     return 0;
 }
@@ -147,42 +335,325 @@ void merge_svc_into_svc (S16Service * to, S16Service * from)
     meth_list_walk (&from->meths,
                     (meth_list_walk_fun)merge_meth_into_list,
                     (void *)&to->meths);
+    inst_list_walk (&from->insts,
+                    (inst_list_walk_fun)merge_inst_into_list,
+                    (void *)&to->insts);
     depgroup_list_walk (&from->depgroups,
                         (depgroup_list_walk_fun)merge_depgroup_into_list,
                         (void *)&to->depgroups);
 }
 
-int merge_svc_into_list (S16Service * svc, svc_list_t * svcs)
+/* Runtime state belongs to the merged scope alone; carry it over. */
+static void carry_state (S16Service * to, S16Service * from)
+{
+    to->state = from->state;
+
+    list_foreach (inst, &to->insts, it)
+    {
+        S16ServiceInstance * old = list_it_val (
+            inst_list_find_cmp (&from->insts, S16InstanceNamesEqual, it->val));
+
+        if (old)
+            it->val->state = old->state;
+    }
+}
+
+static void note_config (s16note_config_type_t type, S16Path * path,
+                         s16note_config_diff_t * diff)
+{
+    s16note_list_add (&notes, s16note_config_new (type, path, diff));
+}
+
+/*
+ * Queues N_CONFIG notes describing how the merged form of a service changed
+ * from @old to @now, either of which may be NULL: one for the service, if it
+ * came, went, or its own configuration changed, and one for each instance
+ * which did likewise. The instances of a service added or removed come and
+ * go with it, and have no notes of their own.
+ */
+static void diff_merged (S16Service * old, S16Service * now)
+{
+    s16note_config_diff_t * diff;
+
+    if (loading)
+        return;
+    else if (!old || !now)
+    {
+        note_config (old ? CF_REMOVED : CF_ADDED, (old ? old : now)->path,
+                     NULL);
+        return;
+    }
+
+    if ((diff = s16note_diff_svc (old, now)))
+        note_config (CF_CHANGED, now->path, diff);
+
+    list_foreach (inst, &now->insts, it)
+    {
+        inst_list_it was =
+            inst_list_find_cmp (&old->insts, S16InstanceNamesEqual, it->val);
+
+        if (!was)
+            note_config (CF_ADDED, it->val->path, NULL);
+        else if ((diff = s16note_diff_inst (was->val, it->val)))
+            note_config (CF_CHANGED, it->val->path, diff);
+    }
+
+    list_foreach (inst, &old->insts, it)
+    {
+        if (!inst_list_find_cmp (&now->insts, S16InstanceNamesEqual, it->val))
+            note_config (CF_REMOVED, it->val->path, NULL);
+    }
+}
+
+/* Rebuilds the merged form of the named service from the layers. */
+static void remerge (const char * name)
+{
+    S16Service * man = layer_find (&manifest, name);
+    S16Service * adm = layer_find (&admin, name);
+    S16Service * old = layer_find (&merged, name);
+    S16Service * svc;
+
+    if (!man && !adm)
+    {
+        if (old)
+            diff_merged (old, NULL);
+        layer_remove (&merged, name);
+        return;
+    }
+
+    svc = S16ServiceCopy (man ? man : adm);
+    if (man && adm)
+        merge_svc_into_svc (svc, adm);
+    if (old)
+        carry_state (svc, old);
+
+    /* Before the old form is discarded. */
+    diff_merged (old, svc);
+    layer_put (&merged, svc);
+}
+
+/* Records a change to the service or instance at @path. */
+static void note_change (S16Path * path)
 {
-    S16Service * cand =
-        list_it_val (svc_list_find_cmp (svcs, S16ServiceNamesEqual, svc));
+    char * key = S16PathToString (path);
+    db_change_t * change;
 
-    if (!cand)
-        svc_list_add (svcs, S16ServiceCopy (svc));
+    HASH_FIND_STR (changes, key, change);
+
+    /* Re-added, so that the log stays ordered by generation. */
+    if (change)
+    {
+        HASH_DEL (changes, change);
+        free (key);
+    }
     else
-        merge_svc_into_svc (cand, svc);
+    {
+        change = malloc (sizeof (*change));
+        change->key = key;
+        change->path = S16PathCopy (path);
+    }
 
-    return 0;
+    change->gen = ++generation;
+    HASH_ADD_KEYPTR (hh, changes, change->key, strlen (change->key), change);
 }
 
-/* TODO: Optimise this. */
-static void update_merged ()
+static int svc_cmp (const void * a, const void * b)
 {
-    svc_list_deepdestroy (&merged.svcs, S16ServiceDestroy);
+    return strcmp ((*(S16Service * const *)a)->path->svc,
+                   (*(S16Service * const *)b)->path->svc);
+}
+
+static int svc_name_cmp (const void * name, const void * b)
+{
+    return strcmp (name, (*(S16Service * const *)b)->path->svc);
+}
 
-    merged.svcs = svc_list_map (&manifest.svcs, S16ServiceCopy);
+static void snapshot_free (void * obj)
+{
+    db_snapshot_t * snap = obj;
 
-    svc_list_walk (&admin.svcs,
-                   (svc_list_walk_fun)merge_svc_into_list,
-                   (void *)&merged.svcs);
+    for (size_t i = 0; i < snap->ndead; i++)
+        S16ServiceDestroy (snap->dead[i]);
+    free (snap->dead);
+    free (snap->svcs);
+    free (snap);
+}
+
+void db_publish ()
+{
+    db_snapshot_t *snap, *old = atomic_load (&published);
+    db_svc_entry_t * entry;
+    size_t i = 0;
+
+    if (old && !merged_dirty && old->generation == generation)
+        return;
+
+    snap = malloc (sizeof (*snap));
+    snap->generation = generation;
+    snap->nsvcs = HASH_COUNT (merged.index);
+    snap->svcs =
+        malloc ((snap->nsvcs ? snap->nsvcs : 1) * sizeof (*snap->svcs));
+    snap->dead = NULL;
+    snap->ndead = 0;
+
+    for (entry = merged.index; entry; entry = entry->hh.next)
+    {
+        entry->shared = true;
+        snap->svcs[i++] = entry->node->val;
+    }
+    qsort (snap->svcs, snap->nsvcs, sizeof (*snap->svcs), svc_cmp);
+
+    atomic_store (&published, snap);
+    if (view)
+        s16db_view_pub_put (view, snap->svcs, snap->nsvcs, snap->generation);
+
+    /* What was superseded since the old snapshot was published can be
+     * referred to by no later one. */
+    if (old)
+    {
+        old->dead = superseded;
+        old->ndead = nsuperseded;
+        rcu_retire (old, snapshot_free);
+        superseded = NULL;
+        nsuperseded = superseded_cap = 0;
+    }
+    merged_dirty = false;
+
+    rcu_reclaim ();
+}
+
+db_snapshot_t * db_snapshot () { return atomic_load (&published); }
+
+/* An epoch unique to this run: the time to the nanosecond, with our pid
+ * mixed in. It is kept within 63 bits, as it goes over the wire as a signed
+ * integer; and 0, which no epoch is, is left to mean none. */
+static unsigned long new_epoch ()
+{
+    struct timespec now;
+    uint64_t e;
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    e = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    e ^= (uint64_t)getpid () << 40;
+    e &= INT64_MAX;
+
+    return e ? e : 1;
 }
 
 void db_setup ()
 {
-    merged.svcs = svc_list_new ();
-    manifest.svcs = svc_list_new ();
+    layer_init (&merged);
+    layer_init (&manifest);
+    layer_init (&admin);
+    epoch = new_epoch ();
+    db_publish ();
+}
+
+void db_view_setup (int fd)
+{
+    db_snapshot_t * snap = atomic_load (&published);
+
+    if (fd != -1)
+        view = s16db_view_pub_adopt (fd);
+    if (!view)
+        view = s16db_view_pub_new ();
+    if (view)
+        s16db_view_pub_put (view, snap->svcs, snap->nsvcs, snap->generation);
+}
+
+int db_view_fd () { return view ? s16db_view_pub_fd (view) : -1; }
+
+void db_destroy ()
+{
+    db_manifest_t *man, *tmp;
+    db_snapshot_t * snap = atomic_exchange (&published, NULL);
+
+    /* By now, there are no readers. */
+    if (snap)
+    {
+        snap->dead = superseded;
+        snap->ndead = nsuperseded;
+        rcu_retire (snap, snapshot_free);
+        superseded = NULL;
+        nsuperseded = superseded_cap = 0;
+    }
+    rcu_reclaim ();
+
+    if (view)
+        s16db_view_pub_destroy (view);
+    view = NULL;
+
+    index_destroy ();
+    layer_destroy (&merged);
+    layer_destroy (&manifest);
+    layer_destroy (&admin);
+
+    HASH_ITER (hh, manifests, man, tmp)
+    {
+        HASH_DEL (manifests, man);
+        free (man->sig.path);
+        free (man);
+    }
+}
+
+/*
+ * Retrieves the admin layer's entry for an instance, creating it and its
+ * service, with nothing but their paths, if absent.
+ */
+static S16ServiceInstance * admin_inst (S16Path * path)
+{
+    S16Service * svc = layer_find (&admin, path->svc);
+    S16ServiceInstance * inst;
+
+    if (!svc)
+    {
+        svc = S16ServiceAlloc ();
+        svc->path = S16PathNew (path->svc, NULL);
+        layer_put (&admin, svc);
+    }
+
+    list_foreach (inst, &svc->insts, it)
+    {
+        if (!strcmp (it->val->path->inst, path->inst))
+            return it->val;
+    }
+
+    inst = calloc (1, sizeof (*inst));
+    inst->path = S16PathCopy (path);
+    inst->props = prop_list_new ();
+    inst->meths = meth_list_new ();
+    inst->depgroups = depgroup_list_new ();
+    inst->enabled = true;
+    inst_list_add (&svc->insts, inst);
+
+    return inst;
+}
+
+static void log_svc (S16Service * svc)
+{
+    ucl_object_t * usvc = s16db_S16Serviceo_ucl (svc);
+    char * json = (char *)ucl_object_emit (usvc, UCL_EMIT_JSON_COMPACT);
+
+    wal_append (W_ADMIN_SVC, json, strlen (json) + 1);
+    free (json);
+    ucl_object_unref (usvc);
+}
+
+static void set_inst_enabled (S16ServiceInstance * inst, bool enabled)
+{
+    char * path = S16PathToString (inst->path);
+
+    wal_append (enabled ? W_ENABLE : W_DISABLE, path, strlen (path) + 1);
+    free (path);
+
+    admin_inst (inst->path)->enabled = enabled;
+    image_dirty = true;
+    note_change (inst->path);
+    s16note_list_add (
+        &notes,
+        s16note_new (
+            N_ADMIN_REQ, enabled ? A_ENABLE : A_DISABLE, inst->path, 0));
 }
-void db_destroy () { svc_list_deepdestroy (&manifest.svcs, S16ServiceDestroy); }
 
 int db_set_enabled (S16Path * path, bool enabled)
 {
@@ -193,36 +664,399 @@ int db_set_enabled (S16Path * path, bool enabled)
     else if (lu.type == SVC)
     {
         list_foreach (inst, &lu.s->insts, it)
-        {
-            it->val->enabled = false;
-            s16note_list_add (&notes,
-                              s16note_new (N_ADMIN_REQ,
-                                           enabled ? A_ENABLE : A_DISABLE,
-                                           it->val->path,
-                                           0));
-        }
+            set_inst_enabled (it->val, enabled);
     }
+    else if (!lu.i)
+        return S16ENOSUCHINST;
     else
+        set_inst_enabled (lu.i, enabled);
+
+    /* The layers are altered; the merged service follows. */
+    remerge (path->svc);
+
+    return 0;
+}
+
+int db_set_state (S16Path * path, S16ServiceState state)
+{
+    s16db_lookup_result_t lu = db_lookup_path_merged (path);
+    db_svc_entry_t * entry;
+
+    if (lu.type == NOTFOUND || !lu.s)
+        return S16ENOSUCHSVC;
+    else if (lu.type == INSTANCE && !lu.i)
+        return S16ENOSUCHINST;
+
+    /* A published service is never altered; a copy replaces it. */
+    HASH_FIND_STR (merged.index, lu.s->path->svc, entry);
+    if (entry && entry->shared)
     {
-        lu.i->enabled = enabled;
-        s16note_list_add (
-            &notes,
-            s16note_new (N_ADMIN_REQ, enabled ? A_ENABLE : A_DISABLE, path, 0));
+        layer_put (&merged, S16ServiceCopy (lu.s));
+        lu = db_lookup_path_merged (path);
     }
+
+    if (lu.type == SVC)
+        lu.s->state = state;
+    else
+    {
+        S16ServiceState old = lu.i->state;
+
+        lu.i->state = state;
+        index_set_state (lu.i, old);
+    }
+
+    note_change (path);
+
     return 0;
 }
 
 void db_import (s16db_layer_t layer, S16Service * svc)
 {
-    svc_list_add (&manifest.svcs, svc);
-    update_merged ();
+    /* Manifests can be imported again; only the admin layer is logged. */
+    if (layer == L_ADMIN)
+        log_svc (svc);
+
+    layer_put (layer == L_ADMIN ? &admin : &manifest, svc);
+    remerge (svc->path->svc);
+    note_change (svc->path);
+    image_dirty = true;
 }
 
-s16db_lookup_result_t db_lookup_path_merged (S16Path * path)
+bool db_manifest_changed (const s16db_manifest_sig_t * sig)
+{
+    db_manifest_t * man;
+
+    HASH_FIND_STR (manifests, sig->path, man);
+
+    return !man || man->sig.size != sig->size || man->sig.hash != sig->hash;
+}
+
+static void put_manifest (const s16db_manifest_sig_t * sig, void * unused)
 {
-    s16db_lookup_result_t r = s16db_lookup_path_in_scope (manifest, path);
+    db_manifest_t * man;
+
+    HASH_FIND_STR (manifests, sig->path, man);
+
+    if (!man)
+    {
+        man = malloc (sizeof (*man));
+        man->sig.path = strdup (sig->path);
+        HASH_ADD_KEYPTR (
+            hh, manifests, man->sig.path, strlen (man->sig.path), man);
+    }
+
+    man->sig.size = sig->size;
+    man->sig.hash = sig->hash;
+}
+
+void db_record_manifest (const s16db_manifest_sig_t * sig)
+{
+    put_manifest (sig, NULL);
+    image_dirty = true;
+}
+
+static void put_image_svc (s16db_layer_t layer, S16Service * svc,
+                           void * unused)
+{
+    layer_put (layer == L_ADMIN ? &admin : &manifest, svc);
+    remerge (svc->path->svc);
+}
+
+static void replay_record (wal_rec_type_t type, const char * data,
+                           size_t len, void * unused)
+{
+    if (!len || data[len - 1])
+        return;
+
+    if (type == W_ENABLE || type == W_DISABLE)
+    {
+        S16Path * path = s16db_string_to_path (data);
+
+        if (path && path->svc && path->inst)
+        {
+            admin_inst (path)->enabled = type == W_ENABLE;
+            remerge (path->svc);
+        }
+        if (path)
+            S16PathDestroy (path);
+    }
+    else if (type == W_ADMIN_SVC)
+    {
+        struct ucl_parser * parser = ucl_parser_new (0);
+        ucl_object_t * usvc;
+        S16Service * svc;
+
+        ucl_parser_add_string (parser, data, len - 1);
+        if ((usvc = ucl_parser_get_object (parser)))
+        {
+            if ((svc = s16db_ucl_to_svc (usvc)))
+            {
+                layer_put (&admin, svc);
+                remerge (svc->path->svc);
+            }
+            ucl_object_unref (usvc);
+        }
+        ucl_parser_free (parser);
+    }
+}
+
+int db_open (const char * image, const char * log)
+{
+    int nrecs;
+
+    image_path = image;
+    loading = true;
+
+    if (!s16db_image_load (image, put_image_svc, put_manifest, NULL))
+        S16Log (kS16LogInfo,
+                "Loaded %d services from repository image.\n",
+                (int)HASH_COUNT (merged.index));
+
+    if ((nrecs = wal_open (log, replay_record, NULL)) == -1)
+        return -1;
+    else if (nrecs > 0)
+    {
+        S16Log (kS16LogInfo, "Replayed %d log records.\n", nrecs);
+        /* To be folded into a new image. */
+        image_dirty = true;
+    }
+
+    loading = false;
+    db_publish ();
+
+    return 0;
+}
+
+int db_commit ()
+{
+    /* The log failing, the batch is made durable by an image instead. */
+    if (wal_commit () == -1)
+        return db_save_image ();
+
+    if (wal_size () > kLogCompactSize)
+        db_save_image ();
+
+    return 0;
+}
+
+bool db_image_dirty () { return image_dirty; }
+
+int db_save_image ()
+{
+    size_t nsigs = HASH_COUNT (manifests), i = 0;
+    s16db_manifest_sig_t * sigs;
+    db_manifest_t * man;
+    int r;
+
+    if (!image_path)
+        return -1;
+
+    sigs = malloc ((nsigs ? nsigs : 1) * sizeof (*sigs));
+    for (man = manifests; man; man = man->hh.next)
+        sigs[i++] = man->sig;
+
+    r = s16db_image_write (
+        image_path, &manifest.scope.svcs, &admin.scope.svcs, sigs, nsigs);
+    free (sigs);
+
+    /* Everything logged is now in the image. */
+    if (!r)
+    {
+        image_dirty = false;
+        wal_reset ();
+    }
+
     return r;
 }
 
-/* Retrieves a list of all services, fully merged. */
-svc_list_t * db_get_all_svcs_merged () { return &merged.svcs; }
+/* Looks up the service or instance at @path, given its service @svc. */
+static s16db_lookup_result_t lookup_in_svc (S16Service * svc, S16Path * path)
+{
+    s16db_lookup_result_t res;
+
+    if (!(res.s = svc))
+    {
+        res.type = NOTFOUND;
+        return res;
+    }
+
+    res.type = SVC;
+
+    if (path->inst)
+    {
+        S16Service * svc = res.s;
+
+        res.type = INSTANCE;
+        res.i = NULL;
+
+        list_foreach (inst, &svc->insts, it)
+        {
+            if (!strcmp (path->inst, it->val->path->inst))
+                res.i = it->val;
+        }
+    }
+
+    return res;
+}
+
+const svc_list_t * db_merged_svcs () { return &merged.scope.svcs; }
+
+s16db_lookup_result_t db_lookup_path_merged (S16Path * path)
+{
+    if (!path->svc)
+        return s16db_lookup_path_in_scope (merged.scope, path);
+
+    return lookup_in_svc (layer_find (&merged, path->svc), path);
+}
+
+s16db_lookup_result_t db_snapshot_lookup (const db_snapshot_t * snap,
+                                          S16Path * path)
+{
+    S16Service ** found;
+
+    if (!path->svc)
+        return (s16db_lookup_result_t){.type = SVC, .s = NULL};
+
+    found = bsearch (path->svc,
+                     snap->svcs,
+                     snap->nsvcs,
+                     sizeof (*snap->svcs),
+                     svc_name_cmp);
+
+    return lookup_in_svc (found ? *found : NULL, path);
+}
+
+unsigned long db_epoch () { return epoch; }
+
+unsigned long db_generation () { return atomic_load (&published)->generation; }
+
+void db_walk_changes_since (unsigned long gen, unsigned long upto,
+                            db_change_walk_fun fn, void * user)
+{
+    db_change_t * change;
+
+    if (!changes)
+        return;
+
+    /* Newest first, stopping at the first change the consumer already has. */
+    for (change = ELMT_FROM_HH (changes->hh.tbl, changes->hh.tbl->tail);
+         change && change->gen > gen;
+         change = change->hh.prev)
+    {
+        if (change->gen <= upto)
+            fn (change->path, user);
+    }
+}
+
+/*
+ * Handover to a successor. The layers and manifest signatures go by way of
+ * the image; the rest, which the image doesn't hold, is described alongside:
+ * the epoch, the generation and the change log, so that the successor can
+ * tell consumers just what changed since they last looked, as we would have;
+ * and the runtime states of the merged scope.
+ */
+
+nvlist_t * db_handoff_export ()
+{
+    nvlist_t *nvl, *nvchanges, *nvstates;
+    db_change_t * change;
+    char * spath;
+
+    if (db_save_image ())
+        return NULL;
+
+    nvl = nvlist_create (0);
+    nvchanges = nvlist_create (0);
+    nvstates = nvlist_create (0);
+
+    nvlist_add_number (nvl, "epoch", epoch);
+    nvlist_add_number (nvl, "generation", generation);
+
+    /* Oldest first, as the successor must keep them. */
+    for (change = changes; change; change = change->hh.next)
+        nvlist_add_number (nvchanges, change->key, change->gen);
+
+    list_foreach (svc, &merged.scope.svcs, it)
+    {
+        if (it->val->state != kS16StateNone)
+        {
+            spath = S16PathToString (it->val->path);
+            nvlist_add_number (nvstates, spath, it->val->state);
+            free (spath);
+        }
+
+        list_foreach (inst, &it->val->insts, iit)
+        {
+            if (iit->val->state == kS16StateNone)
+                continue;
+            spath = S16PathToString (iit->val->path);
+            nvlist_add_number (nvstates, spath, iit->val->state);
+            free (spath);
+        }
+    }
+
+    nvlist_move_nvlist (nvl, "changes", nvchanges);
+    nvlist_move_nvlist (nvl, "states", nvstates);
+
+    return nvl;
+}
+
+static void changes_clear ()
+{
+    db_change_t *change, *tmp;
+
+    HASH_ITER (hh, changes, change, tmp)
+    {
+        HASH_DEL (changes, change);
+        free (change->key);
+        S16PathDestroy (change->path);
+        free (change);
+    }
+}
+
+void db_handoff_import (const nvlist_t * nvl)
+{
+    const nvlist_t * nvchanges = nvlist_get_nvlist (nvl, "changes");
+    const nvlist_t * nvstates = nvlist_get_nvlist (nvl, "states");
+    const char * name;
+    void * cookie = NULL;
+    int type;
+
+    /* Entries which make no sense are skipped, as in replaying the log. */
+    while ((name = nvlist_next (nvstates, &type, &cookie)))
+    {
+        S16Path * path;
+
+        if (type != NV_TYPE_NUMBER || !(path = s16db_string_to_path (name)))
+            continue;
+
+        if (path->svc)
+            db_set_state (path, nvlist_get_number (nvstates, name));
+        S16PathDestroy (path);
+    }
+
+    /* What loading the image and setting the states recorded is replaced
+     * with the predecessor's record. */
+    changes_clear ();
+    cookie = NULL;
+    while ((name = nvlist_next (nvchanges, &type, &cookie)))
+    {
+        db_change_t * change;
+        S16Path * path;
+
+        if (type != NV_TYPE_NUMBER || !(path = s16db_string_to_path (name)))
+            continue;
+
+        change = malloc (sizeof (*change));
+        change->key = strdup (name);
+        change->path = path;
+        change->gen = nvlist_get_number (nvchanges, name);
+        HASH_ADD_KEYPTR (
+            hh, changes, change->key, strlen (change->key), change);
+    }
+
+    epoch = nvlist_get_number (nvl, "epoch");
+    generation = nvlist_get_number (nvl, "generation");
+    merged_dirty = true;
+    db_publish ();
+}
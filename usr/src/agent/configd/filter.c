@@ -0,0 +1,237 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Subscription matching. A subscriber may restrict the notes it
+ * receives to those whose paths begin with one of a set of service prefixes,
+ * or name one of a set of instances, and to a set of sub-types.
+ *
+ * The path restrictions of all subscribers are compiled into an index: a trie
+ * of service name prefixes and a table of instances, with unrestricted
+ * subscribers kept aside. Finding the subscribers interested in a note then
+ * costs time in proportion to the length of its path and the number of
+ * interested subscribers, not to the number of subscribers. The index is
+ * recompiled lazily, after subscriptions change.
+ */
+
+#include <stdlib.h>
+
+#include "uthash.h"
+
+#include "configd.h"
+
+typedef struct trie_node_s
+{
+    char ch;
+    struct trie_node_s *child, *sibling;
+    /* Subscribers with a prefix ending here */
+    subscriber_list_t subs;
+} trie_node_t;
+
+typedef struct inst_entry_s
+{
+    /* "svc:inst" for an instance, or "svc" for any instance of a service */
+    char * key;
+    subscriber_list_t subs;
+
+    UT_hash_handle hh;
+} inst_entry_t;
+
+static bool stale = true;
+static trie_node_t * trie = NULL;
+static inst_entry_t * insts = NULL;
+static subscriber_list_t unfiltered;
+/* Marks subscribers already matched to the current note. */
+static unsigned long stamp = 0;
+
+static void trie_destroy (trie_node_t * node)
+{
+    while (node)
+    {
+        trie_node_t * sibling = node->sibling;
+
+        trie_destroy (node->child);
+        subscriber_list_destroy (&node->subs);
+        free (node);
+        node = sibling;
+    }
+}
+
+static trie_node_t * trie_node_new (char ch, trie_node_t * sibling)
+{
+    trie_node_t * node = calloc (1, sizeof (*node));
+
+    node->ch = ch;
+    node->sibling = sibling;
+    node->subs = subscriber_list_new ();
+    return node;
+}
+
+static void trie_add (const char * prefix, subscriber_t * sub)
+{
+    trie_node_t ** level = &trie;
+    trie_node_t * node = NULL;
+
+    /* The root stands for the empty prefix. */
+    if (!trie)
+        trie = trie_node_new ('\0', NULL);
+    node = trie;
+
+    for (const char * c = prefix; *c; c++)
+    {
+        level = &node->child;
+
+        for (node = *level; node && node->ch != *c; node = node->sibling)
+            ;
+
+        if (!node)
+            node = *level = trie_node_new (*c, *level);
+    }
+
+    subscriber_list_add (&node->subs, sub);
+}
+
+static void insts_add (const char * key, subscriber_t * sub)
+{
+    inst_entry_t * entry;
+
+    HASH_FIND_STR (insts, key, entry);
+
+    if (!entry)
+    {
+        entry = malloc (sizeof (*entry));
+        entry->key = strdup (key);
+        entry->subs = subscriber_list_new ();
+        HASH_ADD_KEYPTR (hh, insts, entry->key, strlen (entry->key), entry);
+    }
+
+    subscriber_list_add (&entry->subs, sub);
+}
+
+static void index_clear ()
+{
+    inst_entry_t *entry, *tmp;
+
+    trie_destroy (trie);
+    trie = NULL;
+
+    HASH_ITER (hh, insts, entry, tmp)
+    {
+        HASH_DEL (insts, entry);
+        subscriber_list_destroy (&entry->subs);
+        free (entry->key);
+        free (entry);
+    }
+
+    subscriber_list_destroy (&unfiltered);
+}
+
+static void index_compile ()
+{
+    index_clear ();
+
+    list_foreach (subscriber, &subs, it)
+    {
+        subscriber_t * sub = it->val;
+
+        if (!sub->nprefixes && !sub->ninsts)
+            subscriber_list_add (&unfiltered, sub);
+
+        for (size_t i = 0; i < sub->nprefixes; i++)
+            trie_add (sub->prefixes[i], sub);
+
+        for (size_t i = 0; i < sub->ninsts; i++)
+        {
+            char * svc = strdup (sub->insts[i]);
+            char * colon = strchr (svc, ':');
+
+            /* Notes about the service as a whole concern its instances. */
+            if (colon)
+                *colon = '\0';
+            insts_add (sub->insts[i], sub);
+            insts_add (svc, sub);
+            free (svc);
+        }
+    }
+
+    stale = false;
+}
+
+static void consider (subscriber_list_t * cands, s16note_t * note,
+                      subscriber_list_t * out)
+{
+    list_foreach (subscriber, cands, it)
+    {
+        subscriber_t * sub = it->val;
+
+        if (sub->stamp == stamp || !(sub->kinds & note->note_type) ||
+            (sub->types && !(sub->types & (1u << note->type))))
+            continue;
+
+        sub->stamp = stamp;
+        subscriber_list_add (out, sub);
+    }
+}
+
+void filter_invalidate () { stale = true; }
+
+void filter_match (s16note_t * note, subscriber_list_t * out)
+{
+    const char * svc = note->path->svc ? note->path->svc : "";
+    trie_node_t * node;
+    inst_entry_t * entry;
+    char * key;
+
+    if (stale)
+        index_compile ();
+
+    stamp++;
+
+    consider (&unfiltered, note, out);
+
+    /* Every node on the way down the trie is a matching prefix. */
+    node = trie;
+    for (const char * c = svc; node; c++)
+    {
+        consider (&node->subs, note, out);
+
+        if (!*c)
+            break;
+
+        for (node = node->child; node && node->ch != *c; node = node->sibling)
+            ;
+    }
+
+    if (note->path->inst)
+        asprintf (&key, "%s:%s", note->path->svc, note->path->inst);
+    else
+        key = strdup (note->path->svc ? note->path->svc : "");
+
+    HASH_FIND_STR (insts, key, entry);
+    if (entry)
+        consider (&entry->subs, note, out);
+
+    free (key);
+}
@@ -0,0 +1,225 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+/*
+ * Desc: Handover to a successor. A configd may be replaced, whether to
+ * upgrade it or to restart it, without its clients noticing: a successor
+ * started with --takeover connects to the handoff socket, and is sent in one
+ * message the listening socket, every connection (with any call partly
+ * received from it, and whatever output it has not yet been sent), the
+ * subscriptions, the shared view, and whatever of the repository the image
+ * does not hold; the image is saved first.
+ *
+ * The successor adopts all this, then acknowledges it; this configd then lets
+ * the successor know that it is to carry on, and exits at once, disturbing
+ * nothing. Should the successor fail or fall silent before acknowledging, this
+ * configd carries on instead, and the successor exits.
+ */
+
+#include <stdlib.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "S16/JSONRPCServer.h"
+#include "S16/Repository_Private.h"
+
+#include "configd.h"
+
+/* How long to wait for the other side of a handover, in seconds. */
+#define kHandoffTimeout 10
+
+static int handoff_s = -1;
+/* Whether a successor has connected, and is to be handed over to. */
+static bool pending = false;
+
+static void set_timeout (int s)
+{
+    struct timeval tmout = {kHandoffTimeout, 0};
+
+    setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tmout, sizeof (tmout));
+    setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tmout, sizeof (tmout));
+}
+
+static void handoff_addr (struct sockaddr_un * sun)
+{
+    memset (sun, 0, sizeof (struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    strncpy (sun->sun_path, S16DB_CONFIGD_HANDOFF_PATH, sizeof (sun->sun_path));
+}
+
+void handoff_setup (int kq)
+{
+    struct sockaddr_un sun;
+    struct kevent ev;
+
+    if ((handoff_s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror ("Failed to create handoff socket");
+        return;
+    }
+
+    S16CloseOnExec (handoff_s);
+    handoff_addr (&sun);
+    unlink (S16DB_CONFIGD_HANDOFF_PATH);
+
+    /* Whoever connects is handed everything; only our own user may. */
+    if (bind (handoff_s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == -1 ||
+        chmod (S16DB_CONFIGD_HANDOFF_PATH, S_IRUSR | S_IWUSR) == -1 ||
+        listen (handoff_s, 1) == -1)
+    {
+        perror ("Failed to bind handoff socket");
+        goto fail;
+    }
+
+    EV_SET (&ev, handoff_s, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent (kq, &ev, 1, 0, 0, 0) == -1)
+    {
+        perror ("KQueue: Failed to set read event for handoff socket");
+        goto fail;
+    }
+
+    return;
+
+fail:
+    close (handoff_s);
+    handoff_s = -1;
+}
+
+void handoff_cleanup ()
+{
+    if (handoff_s != -1)
+        unlink (S16DB_CONFIGD_HANDOFF_PATH);
+}
+
+bool handoff_investigate_kevent (struct kevent * ev)
+{
+    if (handoff_s == -1 || ev->filter != EVFILT_READ ||
+        (int)ev->ident != handoff_s)
+        return false;
+
+    pending = true;
+    return true;
+}
+
+bool handoff_pending ()
+{
+    return pending;
+}
+
+void handoff_serve (s16rpc_srv_t * srv, int listener, bool own_socket)
+{
+    nvlist_t *nvl, *db;
+    char ack;
+    int s;
+
+    pending = false;
+    if ((s = accept (handoff_s, NULL, NULL)) == -1)
+        return;
+
+    S16Log (kS16LogInfo, "Handing over to a successor\n");
+    set_timeout (s);
+
+    /* Reads still pending are finished first. Should the handover fail, reads
+     * are served on the main thread from then on. */
+    workers_stop ();
+
+    if (!(db = db_handoff_export ()))
+    {
+        S16Log (kS16LogError, "Failed to save image; not handing over\n");
+        close (s);
+        return;
+    }
+
+    nvl = nvlist_create (0);
+    nvlist_add_descriptor (nvl, "listener", listener);
+    nvlist_add_bool (nvl, "own-socket", own_socket);
+    if (db_view_fd () != -1)
+        nvlist_add_descriptor (nvl, "view", db_view_fd ());
+    nvlist_move_nvlist (nvl, "db", db);
+    nvlist_move_nvlist (nvl, "conns", s16rpc_srv_export (srv));
+    nvlist_move_nvlist (nvl, "subs", subscribers_export ());
+
+    ack = 1;
+    if (nvlist_send (s, nvl) == -1 || read (s, &ack, 1) != 1 ||
+        write (s, &ack, 1) != 1)
+    {
+        S16Log (kS16LogError, "Handover failed; carrying on\n");
+        nvlist_destroy (nvl);
+        close (s);
+        return;
+    }
+
+    /* Everything now belongs to the successor, and is left as it is: the
+     * sockets, the image, and the view stay, so no cleanup is done. */
+    S16Log (kS16LogInfo, "Handed over to successor\n");
+    _exit (EXIT_SUCCESS);
+}
+
+nvlist_t * handoff_receive (int * s)
+{
+    struct sockaddr_un sun;
+    nvlist_t * nvl;
+
+    if ((*s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror ("Failed to create socket for takeover");
+        return NULL;
+    }
+
+    S16CloseOnExec (*s);
+    handoff_addr (&sun);
+
+    if (connect (*s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == -1)
+    {
+        perror ("Failed to connect to running configd");
+        close (*s);
+        return NULL;
+    }
+
+    set_timeout (*s);
+    if (!(nvl = nvlist_recv (*s, 0)))
+    {
+        perror ("Failed to receive handover");
+        close (*s);
+    }
+
+    return nvl;
+}
+
+int handoff_complete (int s)
+{
+    char ack = 1;
+    int r = 0;
+
+    /* The predecessor answers only once it is committed to exiting. */
+    if (write (s, &ack, 1) != 1 || read (s, &ack, 1) != 1)
+        r = -1;
+
+    close (s);
+    return r;
+}
@@ -0,0 +1,171 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Bulk import of manifests. The manifests are read, fingerprinted and
+ * parsed on as many threads as there are processors, and the services then
+ * applied on the main thread, in the order given, in one batch. The batch is
+ * published as one snapshot, and pushed to subscribers as one set of changes.
+ *
+ * While the threads run, the main thread waits for them, and so nothing in
+ * the repository changes; they may therefore consult the recorded manifest
+ * signatures without locking. They touch nothing else of configd's.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "S16/Repository_Private.h"
+
+#include "configd.h"
+
+typedef struct
+{
+    const char * path;
+    bool have_sig;
+    s16db_manifest_sig_t sig;
+    bool changed;
+    S16Service * svc;
+    char * err;
+} import_item_t;
+
+typedef struct
+{
+    import_item_t * items;
+    size_t nitems;
+    atomic_size_t next;
+} import_job_t;
+
+static void load (import_item_t * item)
+{
+    /* A manifest which can't be fingerprinted is left to fail at parsing. */
+    item->have_sig = !s16db_manifest_sig (item->path, &item->sig);
+    item->changed = !item->have_sig || db_manifest_changed (&item->sig);
+
+    if (item->changed)
+        item->svc = s16db_parse_manifest (item->path, &item->err);
+}
+
+static int import_thread (void * arg)
+{
+    import_job_t * job = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add (&job->next, 1)) < job->nitems)
+        load (&job->items[i]);
+
+    return 0;
+}
+
+static size_t nthreads_for (size_t nitems)
+{
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (ncpus < 1)
+        ncpus = 1;
+
+    return nitems < (size_t)ncpus ? nitems : (size_t)ncpus;
+}
+
+ucl_object_t * import_manifests (const char ** paths, size_t n,
+                                 s16db_layer_t layer)
+{
+    import_job_t job;
+    size_t nthreads = nthreads_for (n), started = 0;
+    thrd_t * threads = calloc (nthreads + 1, sizeof (*threads));
+    size_t imported = 0, unchanged = 0;
+    ucl_object_t * reply = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * ufailed = ucl_object_typed_new (UCL_ARRAY);
+
+    job.items = calloc (n + 1, sizeof (*job.items));
+    job.nitems = n;
+    atomic_init (&job.next, 0);
+
+    for (size_t i = 0; i < n; i++)
+        job.items[i].path = paths[i];
+
+    /* The main thread does its share, and all of it if no thread starts. */
+    for (; started + 1 < nthreads; started++)
+    {
+        if (thrd_create (&threads[started],
+                         (thrd_start_t)import_thread,
+                         &job) != thrd_success)
+            break;
+    }
+    import_thread (&job);
+    for (size_t i = 0; i < started; i++)
+        thrd_join (threads[i], NULL);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        import_item_t * item = &job.items[i];
+
+        if (!item->changed)
+            unchanged++;
+        else if (item->svc)
+        {
+            db_import (layer, item->svc);
+            if (item->have_sig)
+                db_record_manifest (&item->sig);
+            imported++;
+        }
+        else
+        {
+            ucl_object_t * ufail = ucl_object_typed_new (UCL_OBJECT);
+
+            ucl_object_insert_key (
+                ufail, ucl_object_fromstring (item->path), "path", 0, 0);
+            ucl_object_insert_key (
+                ufail, ucl_object_fromstring (item->err), "error", 0, 0);
+            ucl_array_append (ufailed, ufail);
+            free (item->err);
+        }
+
+        if (item->have_sig)
+            free (item->sig.path);
+    }
+
+    S16Log (kS16LogInfo,
+            "Imported %zu manifests (%zu unchanged, %zu failed) on %zu "
+            "threads.\n",
+            imported,
+            unchanged,
+            n - imported - unchanged,
+            started + 1);
+
+    ucl_object_insert_key (
+        reply, ucl_object_fromint (imported), "imported", 0, 0);
+    ucl_object_insert_key (
+        reply, ucl_object_fromint (unchanged), "unchanged", 0, 0);
+    ucl_object_insert_key (reply, ufailed, "failed", 0, 0);
+
+    free (job.items);
+    free (threads);
+
+    return reply;
+}
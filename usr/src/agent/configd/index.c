@@ -0,0 +1,560 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Secondary indices over the merged scope, and the query engine built
+ * on them. Three indices are kept, each mapping a key to the services and
+ * instances it applies to:
+ *
+ * - state: the instances in each state;
+ * - property: for each property name, the services and instances which set
+ *   it;
+ * - dependents: for each path depended upon, the services and instances
+ *   whose dependency groups name it.
+ *
+ * They are updated as each merged service is put or discarded, so they always
+ * describe the merged scope as the main thread sees it. A query draws its
+ * candidates from the smallest index set its predicate allows, and tests each
+ * candidate against the rest of the predicate; so it costs time in proportion
+ * to that set rather than to the repository. Only a predicate with no indexed
+ * term needs to walk every instance.
+ */
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "S16/Repository_Private.h"
+#include "uthash.h"
+
+#include "configd.h"
+
+typedef struct idx_member_s
+{
+    char * key; /* "svc:inst" for an instance, "svc" for a service */
+    char * svc;
+    char * inst; /* NULL for a service */
+
+    UT_hash_handle hh;
+} idx_member_t;
+
+typedef struct idx_set_s
+{
+    char * key; /* Property name or path depended upon */
+    idx_member_t * members;
+
+    UT_hash_handle hh;
+} idx_set_t;
+
+static idx_member_t * by_state[kS16StateEnumMaximum];
+static idx_set_t * by_prop = NULL;
+static idx_set_t * dependents = NULL;
+
+static char * member_key (const char * svc, const char * inst)
+{
+    char * key;
+
+    if (inst)
+        asprintf (&key, "%s:%s", svc, inst);
+    else
+        key = strdup (svc);
+
+    return key;
+}
+
+static void member_add (idx_member_t ** members, const char * svc,
+                        const char * inst)
+{
+    char * key = member_key (svc, inst);
+    idx_member_t * member;
+
+    HASH_FIND_STR (*members, key, member);
+
+    if (member)
+    {
+        free (key);
+        return;
+    }
+
+    member = malloc (sizeof (*member));
+    member->key = key;
+    member->svc = strdup (svc);
+    member->inst = inst ? strdup (inst) : NULL;
+    HASH_ADD_KEYPTR (hh, *members, member->key, strlen (member->key), member);
+}
+
+static void member_remove (idx_member_t ** members, const char * svc,
+                           const char * inst)
+{
+    char * key = member_key (svc, inst);
+    idx_member_t * member;
+
+    HASH_FIND_STR (*members, key, member);
+    free (key);
+
+    if (!member)
+        return;
+
+    HASH_DEL (*members, member);
+    free (member->key);
+    free (member->svc);
+    free (member->inst);
+    free (member);
+}
+
+static void set_add (idx_set_t ** sets, const char * setkey, const char * svc,
+                     const char * inst)
+{
+    idx_set_t * set;
+
+    HASH_FIND_STR (*sets, setkey, set);
+
+    if (!set)
+    {
+        set = malloc (sizeof (*set));
+        set->key = strdup (setkey);
+        set->members = NULL;
+        HASH_ADD_KEYPTR (hh, *sets, set->key, strlen (set->key), set);
+    }
+
+    member_add (&set->members, svc, inst);
+}
+
+static void set_remove (idx_set_t ** sets, const char * setkey,
+                        const char * svc, const char * inst)
+{
+    idx_set_t * set;
+
+    HASH_FIND_STR (*sets, setkey, set);
+
+    if (!set)
+        return;
+
+    member_remove (&set->members, svc, inst);
+
+    if (!set->members)
+    {
+        HASH_DEL (*sets, set);
+        free (set->key);
+        free (set);
+    }
+}
+
+/* The key by which a path depended upon is indexed and queried. */
+static char * dep_key (const S16Path * path)
+{
+    return path->svc ? member_key (path->svc, path->inst) : NULL;
+}
+
+typedef void (*set_op_fun) (idx_set_t ** sets, const char * setkey,
+                            const char * svc, const char * inst);
+
+static void index_entity (set_op_fun op, const char * svc, const char * inst,
+                          prop_list_t * props, depgroup_list_t * depgroups)
+{
+    list_foreach (prop, props, it)
+        op (&by_prop, it->val->name, svc, inst);
+
+    list_foreach (depgroup, depgroups, dit)
+    {
+        list_foreach (path, &dit->val->paths, pit)
+        {
+            char * key = dep_key (pit->val);
+
+            if (key)
+                op (&dependents, key, svc, inst);
+            free (key);
+        }
+    }
+}
+
+static bool valid_state (S16ServiceState state)
+{
+    return state >= 0 && state < kS16StateEnumMaximum;
+}
+
+void index_add_svc (S16Service * svc)
+{
+    const char * name = svc->path->svc;
+
+    index_entity (set_add, name, NULL, &svc->props, &svc->depgroups);
+
+    list_foreach (inst, &svc->insts, it)
+    {
+        S16ServiceInstance * inst = it->val;
+
+        if (valid_state (inst->state))
+            member_add (&by_state[inst->state], name, inst->path->inst);
+        index_entity (
+            set_add, name, inst->path->inst, &inst->props, &inst->depgroups);
+    }
+}
+
+void index_remove_svc (S16Service * svc)
+{
+    const char * name = svc->path->svc;
+
+    index_entity (set_remove, name, NULL, &svc->props, &svc->depgroups);
+
+    list_foreach (inst, &svc->insts, it)
+    {
+        S16ServiceInstance * inst = it->val;
+
+        if (valid_state (inst->state))
+            member_remove (&by_state[inst->state], name, inst->path->inst);
+        index_entity (
+            set_remove, name, inst->path->inst, &inst->props, &inst->depgroups);
+    }
+}
+
+void index_set_state (S16ServiceInstance * inst, S16ServiceState old)
+{
+    const S16Path * path = inst->path;
+
+    if (valid_state (old))
+        member_remove (&by_state[old], path->svc, path->inst);
+    if (valid_state (inst->state))
+        member_add (&by_state[inst->state], path->svc, path->inst);
+}
+
+static void members_destroy (idx_member_t ** members)
+{
+    idx_member_t *member, *tmp;
+
+    HASH_ITER (hh, *members, member, tmp)
+    {
+        HASH_DEL (*members, member);
+        free (member->key);
+        free (member->svc);
+        free (member->inst);
+        free (member);
+    }
+}
+
+static void sets_destroy (idx_set_t ** sets)
+{
+    idx_set_t *set, *tmp;
+
+    HASH_ITER (hh, *sets, set, tmp)
+    {
+        HASH_DEL (*sets, set);
+        members_destroy (&set->members);
+        free (set->key);
+        free (set);
+    }
+}
+
+void index_destroy ()
+{
+    for (int i = 0; i < kS16StateEnumMaximum; i++)
+        members_destroy (&by_state[i]);
+    sets_destroy (&by_prop);
+    sets_destroy (&dependents);
+}
+
+/**********************************************************
+ * Queries
+ **********************************************************/
+
+/* A conjunction of terms; those absent are unconstrained. */
+typedef struct
+{
+    bool has_state;
+    S16ServiceState state;
+    bool has_enabled;
+    bool enabled;
+    const char * prop;
+    const char *prop_equals, *prop_prefix;
+    char * depends_on;
+    const char * glob;
+} query_t;
+
+typedef struct query_result_s
+{
+    char * key;
+
+    UT_hash_handle hh;
+} query_result_t;
+
+typedef struct
+{
+    query_t * q;
+    int proj;
+    ucl_object_t * reply;
+    /* Instances already tested, as a service and one of its instances may
+     * both be candidates. */
+    query_result_t * seen;
+} query_ctx_t;
+
+static int query_parse (const ucl_object_t * upred, query_t * q)
+{
+    const ucl_object_t *ustate, *uenabled, *uprop, *udep, *upath;
+
+    memset (q, 0, sizeof (*q));
+
+    if (ucl_object_type (upred) != UCL_OBJECT)
+        return -1;
+
+    if ((ustate = ucl_object_lookup (upred, "state")))
+    {
+        q->has_state = true;
+        q->state = ucl_object_toint (ustate);
+    }
+
+    if ((uenabled = ucl_object_lookup (upred, "enabled")))
+    {
+        q->has_enabled = true;
+        q->enabled = ucl_object_toboolean (uenabled);
+    }
+
+    if ((uprop = ucl_object_lookup (upred, "property")))
+    {
+        q->prop = ucl_object_tostring (ucl_object_lookup (uprop, "name"));
+        q->prop_equals =
+            ucl_object_tostring (ucl_object_lookup (uprop, "equals"));
+        q->prop_prefix =
+            ucl_object_tostring (ucl_object_lookup (uprop, "prefix"));
+        if (!q->prop)
+            return -1;
+    }
+
+    if ((udep = ucl_object_lookup (upred, "depends-on")))
+    {
+        S16Path * path = ucl_object_type (udep) == UCL_STRING
+                             ? s16db_ucl_to_path (udep)
+                             : NULL;
+
+        if (!path || !(q->depends_on = dep_key (path)))
+        {
+            if (path)
+                S16PathDestroy (path);
+            return -1;
+        }
+        S16PathDestroy (path);
+    }
+
+    if ((upath = ucl_object_lookup (upred, "path")))
+        q->glob = ucl_object_tostring (upath);
+
+    return 0;
+}
+
+static S16Property * find_prop (prop_list_t * props, const char * name)
+{
+    list_foreach (prop, props, it)
+    {
+        if (!strcmp (it->val->name, name))
+            return it->val;
+    }
+
+    return NULL;
+}
+
+static bool prop_matches (const query_t * q, S16Property * prop)
+{
+    char buf[32];
+    const char * value;
+
+    if (!prop)
+        return false;
+
+    if (prop->type == kS16PropertyTypeString)
+        value = prop->value.s ? prop->value.s : "";
+    else if (prop->type == kS16PropertyTypeBoolean)
+        value = prop->value.i ? "true" : "false";
+    else
+    {
+        snprintf (buf, sizeof (buf), "%ld", prop->value.i);
+        value = buf;
+    }
+
+    if (q->prop_equals && strcmp (value, q->prop_equals))
+        return false;
+    if (q->prop_prefix &&
+        strncmp (value, q->prop_prefix, strlen (q->prop_prefix)))
+        return false;
+
+    return true;
+}
+
+static bool depends_on (depgroup_list_t * depgroups, const char * key)
+{
+    list_foreach (depgroup, depgroups, dit)
+    {
+        list_foreach (path, &dit->val->paths, pit)
+        {
+            char * dkey = dep_key (pit->val);
+            bool match = dkey && !strcmp (dkey, key);
+
+            free (dkey);
+            if (match)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+static bool matches (const query_t * q, S16Service * svc,
+                     S16ServiceInstance * inst)
+{
+    if (q->has_state && inst->state != q->state)
+        return false;
+
+    if (q->has_enabled && inst->enabled != q->enabled)
+        return false;
+
+    /* An instance inherits what its service sets and it doesn't. */
+    if (q->prop)
+    {
+        S16Property * prop = find_prop (&inst->props, q->prop);
+
+        if (!prop_matches (q, prop ? prop : find_prop (&svc->props, q->prop)))
+            return false;
+    }
+
+    if (q->depends_on && !depends_on (&inst->depgroups, q->depends_on) &&
+        !depends_on (&svc->depgroups, q->depends_on))
+        return false;
+
+    if (q->glob)
+    {
+        char * path;
+        bool match;
+
+        asprintf (&path, "svc:/%s:%s", svc->path->svc, inst->path->inst);
+        match = !fnmatch (q->glob, path, 0);
+
+        free (path);
+        if (!match)
+            return false;
+    }
+
+    return true;
+}
+
+static void consider (query_ctx_t * ctx, S16Service * svc,
+                      S16ServiceInstance * inst)
+{
+    char * key = member_key (svc->path->svc, inst->path->inst);
+    query_result_t * seen;
+
+    HASH_FIND_STR (ctx->seen, key, seen);
+
+    if (seen)
+    {
+        free (key);
+        return;
+    }
+
+    seen = malloc (sizeof (*seen));
+    seen->key = key;
+    HASH_ADD_KEYPTR (hh, ctx->seen, seen->key, strlen (seen->key), seen);
+
+    if (matches (ctx->q, svc, inst))
+        ucl_array_append (ctx->reply,
+                          s16db_inst_to_ucl_projected (inst, ctx->proj));
+}
+
+/* Considers the instances of a member: itself, or all those of a service. */
+static void consider_member (query_ctx_t * ctx, idx_member_t * member)
+{
+    S16Path path = {.full_qual = true, .svc = member->svc, .inst = NULL};
+    s16db_lookup_result_t lu = db_lookup_path_merged (&path);
+
+    if (lu.type != SVC || !lu.s)
+        return;
+
+    list_foreach (inst, &lu.s->insts, it)
+    {
+        if (!member->inst || !strcmp (member->inst, it->val->path->inst))
+            consider (ctx, lu.s, it->val);
+    }
+}
+
+static idx_member_t * set_members (idx_set_t * sets, const char * key)
+{
+    idx_set_t * set;
+
+    HASH_FIND_STR (sets, key, set);
+    return set ? set->members : NULL;
+}
+
+ucl_object_t * index_query (const ucl_object_t * upred, int proj)
+{
+    query_t q;
+    query_ctx_t ctx = {.q = &q, .proj = proj, .seen = NULL};
+    idx_member_t *cands = NULL, *member, *tmp;
+    query_result_t *seen, *stmp;
+    bool indexed = false;
+
+    if (query_parse (upred, &q))
+        return NULL;
+
+    ctx.reply = ucl_object_typed_new (UCL_ARRAY);
+
+    /* Candidates come from the smallest index set the predicate names. */
+#define Candidates(set)                                                        \
+    do                                                                         \
+    {                                                                          \
+        idx_member_t * s = (set);                                              \
+        if (!indexed || HASH_COUNT (s) < HASH_COUNT (cands))                   \
+            cands = s;                                                         \
+        indexed = true;                                                        \
+    } while (0)
+    if (q.has_state && valid_state (q.state))
+        Candidates (by_state[q.state]);
+    else if (q.has_state)
+        Candidates (NULL);
+    if (q.prop)
+        Candidates (set_members (by_prop, q.prop));
+    if (q.depends_on)
+        Candidates (set_members (dependents, q.depends_on));
+#undef Candidates
+
+    if (indexed)
+    {
+        HASH_ITER (hh, cands, member, tmp)
+            consider_member (&ctx, member);
+    }
+    else
+    {
+        list_foreach (svc, db_merged_svcs (), sit)
+        {
+            list_foreach (inst, &sit->val->insts, it)
+                consider (&ctx, sit->val, it->val);
+        }
+    }
+
+    HASH_ITER (hh, ctx.seen, seen, stmp)
+    {
+        HASH_DEL (ctx.seen, seen);
+        free (seen->key);
+        free (seen);
+    }
+    free (q.depends_on);
+
+    return ctx.reply;
+}
@@ -0,0 +1,124 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Epoch-based reclamation of repository snapshots. Readers of a
+ * snapshot take no lock; instead, each registered reader announces, in a
+ * slot of its own, the epoch in which it began reading. The writer retires a
+ * snapshot once it has published its successor, tagging it with the epoch
+ * then current and advancing the epoch. A reader that began in a later epoch
+ * can only have found the successor, so a retired snapshot is freed once no
+ * reader remains which began in its epoch or earlier.
+ *
+ * Only the writer, configd's main thread, retires and reclaims, so the list
+ * of retired objects needs no lock.
+ */
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "configd.h"
+
+typedef struct
+{
+    /* The epoch in which the reader began reading, or 0 if it is not. */
+    atomic_ulong epoch;
+} rcu_reader_t;
+
+typedef struct rcu_retired_s
+{
+    void * obj;
+    rcu_free_fun fn;
+    unsigned long epoch;
+    struct rcu_retired_s * next;
+} rcu_retired_t;
+
+static rcu_reader_t * readers = NULL;
+static size_t nreaders = 0;
+static atomic_ulong global_epoch = 1;
+/* Oldest first. */
+static rcu_retired_t * retired = NULL, ** retired_tail = &retired;
+
+static _Thread_local rcu_reader_t * self = NULL;
+
+void rcu_setup (size_t n)
+{
+    readers = calloc (n, sizeof (*readers));
+    nreaders = n;
+}
+
+void rcu_register (size_t i)
+{
+    self = &readers[i];
+}
+
+void rcu_read_lock ()
+{
+    atomic_store (&self->epoch, atomic_load (&global_epoch));
+}
+
+void rcu_read_unlock ()
+{
+    atomic_store (&self->epoch, 0);
+}
+
+void rcu_retire (void * obj, rcu_free_fun fn)
+{
+    rcu_retired_t * ret = malloc (sizeof (*ret));
+
+    ret->obj = obj;
+    ret->fn = fn;
+    ret->epoch = atomic_fetch_add (&global_epoch, 1);
+    ret->next = NULL;
+
+    *retired_tail = ret;
+    retired_tail = &ret->next;
+}
+
+void rcu_reclaim ()
+{
+    unsigned long oldest = ULONG_MAX;
+
+    for (size_t i = 0; i < nreaders; i++)
+    {
+        unsigned long epoch = atomic_load (&readers[i].epoch);
+
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    while (retired && retired->epoch < oldest)
+    {
+        rcu_retired_t * ret = retired;
+
+        retired = ret->next;
+        ret->fn (ret->obj);
+        free (ret);
+    }
+
+    if (!retired)
+        retired_tail = &retired;
+}
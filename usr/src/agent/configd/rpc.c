@@ -35,6 +35,8 @@
 
 #include "configd.h"
 
+static s16rpc_srv_t * server;
+
 /* Fun: disable/enable
  * Desc: (Dis/en)ables a service by setting its enabled flag to (false/true) and
  * dispatching an administrative event. Sig: int (S16Path * path) */
@@ -57,6 +59,25 @@ ret:
     return ucl_object_fromint (e);
 }
 
+/* Fun: set-state
+ * Desc: Sets the runtime state of a service or instance.
+ * Sig: int (S16Path * path, S16ServiceState state) */
+ucl_object_t * handle_set_state (s16rpc_data_t * dat,
+                                 const ucl_object_t * upath,
+                                 const ucl_object_t * ustate)
+{
+    int e;
+    S16Path * path = s16db_ucl_to_path (upath);
+
+    if (!path)
+        return ucl_object_fromint (S16EBADPATH);
+
+    e = db_set_state (path, ucl_object_toint (ustate));
+    S16PathDestroy (path);
+
+    return ucl_object_fromint (e);
+}
+
 /* Fun: import-service
  * Desc: Import a full manifest to the given layer.
  * Sig: int (S16Service * svc, enum layer) */
@@ -79,44 +100,103 @@ ucl_object_t * handle_import_service (s16rpc_data_t * dat,
     return ucl_object_fromint (e);
 }
 
-/* Fun: get-all-services-merged
- * Desc: Get a merged list of all services.
- * Sig: int (S16Service * svc, enum layer) */
-ucl_object_t * handle_get_all_services_merged (s16rpc_data_t * dat)
+/* Fun: transaction
+ * Desc: Applies a batch of operations atomically: all of them, or, if any is
+ * bad, none. Each is one of {op: "enable" | "disable", path},
+ * {op: "set-state", path, state}, or {op: "import-service", service, layer}.
+ * Sig: {error, failed?} (op ops[]) */
+ucl_object_t * handle_transaction (s16rpc_data_t * dat,
+                                   const ucl_object_t * uops)
 {
-    ucl_object_t * ureply = ucl_object_typed_new (UCL_ARRAY);
+    if (ucl_object_type (uops) != UCL_ARRAY)
+        return ucl_object_fromint (S16EBADTXN);
 
-    S16Log (kS16LogWarn, "Received request on FD %d\n", dat->sock);
+    return txn_apply (uops);
+}
 
-    for (svc_list_it it = list_begin (db_get_all_svcs_merged ()); it != NULL;
-         it = list_next (it))
-        ucl_array_append (ureply, s16db_S16Serviceo_ucl (it->val));
+/* Fun: import-manifests
+ * Desc: Imports the manifest files at the given absolute paths to the given
+ * layer, skipping those unchanged since last imported, and records their
+ * signatures. The manifests are parsed in parallel and applied together.
+ * Sig: {imported, unchanged, failed: {path, error}[]} (char * paths[],
+ * enum layer) */
+ucl_object_t * handle_import_manifests (s16rpc_data_t * dat,
+                                        const ucl_object_t * upaths,
+                                        const ucl_object_t * ulayer)
+{
+    const char ** paths = calloc (ucl_array_size (upaths) + 1, sizeof (*paths));
+    const ucl_object_t * upath;
+    ucl_object_iter_t it = NULL;
+    ucl_object_t * reply;
+    size_t n = 0;
+
+    while ((upath = ucl_iterate_object (upaths, &it, true)))
+    {
+        if (ucl_object_type (upath) == UCL_STRING)
+            paths[n++] = ucl_object_tostring (upath);
+    }
+
+    reply = import_manifests (paths, n, ucl_object_toint (ulayer));
+    free (paths);
+
+    return reply;
+}
+
+/*
+ * The get-* calls are served by the reader pool (see workers.c), from the
+ * snapshot last published. What they read must come from that snapshot alone.
+ */
+static ucl_object_t * all_services (const db_snapshot_t * snap,
+                                    S16Path * unused, int proj)
+{
+    ucl_object_t * ureply = ucl_object_typed_new (UCL_ARRAY);
+
+    for (size_t i = 0; i < snap->nsvcs; i++)
+        ucl_array_append (
+            ureply, s16db_S16Serviceo_ucl_projected (snap->svcs[i], proj));
 
     return ureply;
 }
 
-/* Fun: get-path-merged
- * Desc: Get the merged service or instance for the given path.
- * Sig: {type, value?} (S16Path * path) */
-ucl_object_t * handle_get_path_merged (s16rpc_data_t * dat,
-                                       const ucl_object_t * upath)
+/* Fun: get-all-services-merged
+ * Desc: Get a merged list of all services.
+ * Sig: S16Service *[] () */
+ucl_object_t * handle_get_all_services_merged (s16rpc_data_t * dat)
+{
+    return workers_read (dat, all_services, NULL, S16DB_PROJ_ALL);
+}
+
+/* Fun: get-all-services-projected
+ * Desc: Get a merged list of all services, with only the fields in the given
+ * projection.
+ * Sig: S16Service *[] (s16db_projection_t) */
+ucl_object_t * handle_get_all_services_projected (s16rpc_data_t * dat,
+                                                  const ucl_object_t * uproj)
+{
+    return workers_read (dat, all_services, NULL, ucl_object_toint (uproj));
+}
+
+static ucl_object_t * path_merged (const db_snapshot_t * snap, S16Path * path,
+                                   int proj)
 {
     ucl_object_t * reply = ucl_object_typed_new (UCL_OBJECT);
-    S16Path * path = s16db_ucl_to_path (upath);
-    s16db_lookup_result_t res = db_lookup_path_merged (path);
+    s16db_lookup_result_t res = {.type = NOTFOUND};
+
+    if (path)
+        res = db_snapshot_lookup (snap, path);
 
     if (res.type == SVC && res.s)
     {
-        ucl_object_t * usvc = s16db_S16Serviceo_ucl (res.s);
+        ucl_object_t * usvc = s16db_S16Serviceo_ucl_projected (res.s, proj);
         ucl_object_insert_key (
             reply, ucl_object_fromstring ("svc"), "type", 0, 1);
         ucl_object_insert_key (reply, usvc, "value", 0, 1);
     }
     else if (res.type == INSTANCE && res.i)
     {
-        ucl_object_t * uinst = s16db_inst_to_ucl (res.i);
+        ucl_object_t * uinst = s16db_inst_to_ucl_projected (res.i, proj);
         ucl_object_insert_key (
-            reply, ucl_object_fromstring ("svc"), "type", 0, 1);
+            reply, ucl_object_fromstring ("inst"), "type", 0, 1);
         ucl_object_insert_key (reply, uinst, "value", 0, 1);
     }
     else
@@ -125,40 +205,526 @@ ucl_object_t * handle_get_path_merged (s16rpc_data_t * dat,
             reply, ucl_object_fromstring ("error"), "type", 0, 1);
     }
 
-    S16PathDestroy (path);
+    return reply;
+}
+
+/* Fun: get-path-merged
+ * Desc: Get the merged service or instance for the given path.
+ * Sig: {type, value?} (S16Path * path) */
+ucl_object_t * handle_get_path_merged (s16rpc_data_t * dat,
+                                       const ucl_object_t * upath)
+{
+    return workers_read (
+        dat, path_merged, s16db_ucl_to_path (upath), S16DB_PROJ_ALL);
+}
+
+/* Fun: get-path-projected
+ * Desc: Get the merged service or instance for the given path, with only the
+ * fields in the given projection.
+ * Sig: {type, value?} (S16Path * path, s16db_projection_t) */
+ucl_object_t * handle_get_path_projected (s16rpc_data_t * dat,
+                                          const ucl_object_t * upath,
+                                          const ucl_object_t * uproj)
+{
+    return workers_read (dat,
+                         path_merged,
+                         s16db_ucl_to_path (upath),
+                         ucl_object_toint (uproj));
+}
+
+/* Fun: query
+ * Desc: Find the merged instances satisfying a predicate, with only the
+ * fields in the given projection. The predicate is an object whose keys are
+ * the terms, all of which must hold: state (int), enabled (bool),
+ * property ({name, equals?, prefix?}), depends-on (S16Path), and path (glob).
+ * Sig: inst[] | int (predicate, s16db_projection_t) */
+ucl_object_t * handle_query (s16rpc_data_t * dat, const ucl_object_t * upred,
+                             const ucl_object_t * uproj)
+{
+    ucl_object_t * res = index_query (upred, ucl_object_toint (uproj));
+
+    return res ? res : ucl_object_fromint (S16EBADQUERY);
+}
+
+typedef struct
+{
+    const db_snapshot_t * snap;
+    ucl_object_t * reply;
+    int proj;
+} changes_ctx_t;
+
+static void add_change (S16Path * path, void * ctx)
+{
+    changes_ctx_t * cc = ctx;
+    s16db_lookup_result_t res = db_snapshot_lookup (cc->snap, path);
+    const char * key;
+    ucl_object_t * obj;
+
+    if (res.type == SVC && res.s)
+        key = "services",
+        obj = s16db_S16Serviceo_ucl_projected (res.s, cc->proj);
+    else if (res.type == INSTANCE && res.i)
+        key = "instances", obj = s16db_inst_to_ucl_projected (res.i, cc->proj);
+    else
+        key = "removed", obj = s16db_S16Patho_ucl (path);
+
+    ucl_array_append ((ucl_object_t *)ucl_object_lookup (cc->reply, key), obj);
+}
+
+ucl_object_t * rpc_changes_since (unsigned long epoch, unsigned long gen,
+                                  int proj)
+{
+    ucl_object_t * reply = ucl_object_typed_new (UCL_OBJECT);
+    bool full = epoch != db_epoch ();
+    const db_snapshot_t * snap;
+
+    /* Only changes the snapshot reflects are described; later ones will be
+     * once it is superseded. */
+    rcu_read_lock ();
+    snap = db_snapshot ();
+
+    ucl_object_insert_key (
+        reply, ucl_object_fromint (db_epoch ()), "epoch", 0, 0);
+    ucl_object_insert_key (
+        reply, ucl_object_fromint (snap->generation), "generation", 0, 0);
+    ucl_object_insert_key (reply, ucl_object_frombool (full), "full", 0, 0);
+    ucl_object_insert_key (
+        reply, ucl_object_typed_new (UCL_ARRAY), "services", 0, 0);
+    ucl_object_insert_key (
+        reply, ucl_object_typed_new (UCL_ARRAY), "instances", 0, 0);
+    ucl_object_insert_key (
+        reply, ucl_object_typed_new (UCL_ARRAY), "removed", 0, 0);
+
+    if (full)
+    {
+        ucl_object_t * usvcs =
+            (ucl_object_t *)ucl_object_lookup (reply, "services");
+
+        for (size_t i = 0; i < snap->nsvcs; i++)
+            ucl_array_append (
+                usvcs, s16db_S16Serviceo_ucl_projected (snap->svcs[i], proj));
+    }
+    else
+    {
+        changes_ctx_t cc = {.snap = snap, .reply = reply, .proj = proj};
+        db_walk_changes_since (gen, snap->generation, add_change, &cc);
+    }
+
+    rcu_read_unlock ();
 
     return reply;
 }
 
+/* Fun: get-changes-since
+ * Desc: Get the services and instances added, changed, or removed since the
+ * given generation of the given epoch, with only the fields in the given
+ * projection. If the epoch is not current, all services are sent, and full is
+ * set.
+ * Sig: {epoch, generation, full, services, instances, removed} (int epoch,
+ * int generation, s16db_projection_t) */
+ucl_object_t * handle_get_changes_since (s16rpc_data_t * dat,
+                                         const ucl_object_t * uepoch,
+                                         const ucl_object_t * ugen,
+                                         const ucl_object_t * uproj)
+{
+    return rpc_changes_since (ucl_object_toint (uepoch),
+                              ucl_object_toint (ugen),
+                              ucl_object_toint (uproj));
+}
+
+static void clear_filter (subscriber_t * sub)
+{
+    for (size_t i = 0; i < sub->nprefixes; i++)
+        free (sub->prefixes[i]);
+    for (size_t i = 0; i < sub->ninsts; i++)
+        free (sub->insts[i]);
+    free (sub->prefixes);
+    free (sub->insts);
+    sub->prefixes = sub->insts = NULL;
+    sub->nprefixes = sub->ninsts = sub->types = 0;
+}
+
+void subscriber_remove (subscriber_t * sub)
+{
+    subscriber_list_del (&subs, sub);
+    clear_filter (sub);
+    free (sub);
+    filter_invalidate ();
+}
+
+static subscriber_t * subscriber_for_sock (int sock)
+{
+    subscriber_t * sub;
+
+    list_foreach (subscriber, &subs, it)
+    {
+        if (it->val->fd == sock)
+            return it->val;
+    }
+
+    sub = calloc (1, sizeof (*sub));
+    sub->fd = sock;
+    sub->kinds = 0;
+    sub->changes = false;
+    subscriber_list_add (&subs, sub);
+
+    return sub;
+}
+
 /* Fun: subscribe
  * Desc: Subscribe to the given set of notifications.
  * Sig: int (s16note_type_t) */
 ucl_object_t * handle_subscribe (s16rpc_data_t * dat,
                                  const ucl_object_t * utypes)
 {
-    int types = ucl_object_toint (utypes);
-    subscriber_t * sub = malloc (sizeof (*sub));
+    subscriber_t * sub = subscriber_for_sock (dat->sock);
 
-    sub->clnt = s16rpc_clnt_new (dat->sock);
-    sub->kinds = types;
+    clear_filter (sub);
+    sub->kinds = ucl_object_toint (utypes);
+    filter_invalidate ();
 
-    subscriber_list_add (&subs, sub);
+    return ucl_object_fromint (0);
+}
+
+static char ** strings_from_ucl (const ucl_object_t * uarr, size_t * n,
+                                 bool paths)
+{
+    char ** strs = calloc (ucl_array_size (uarr) + 1, sizeof (*strs));
+    const ucl_object_t * ustr;
+    ucl_object_iter_t it = NULL;
+
+    *n = 0;
+
+    while ((ustr = ucl_iterate_object (uarr, &it, true)))
+    {
+        S16Path * path;
+
+        if (ucl_object_type (ustr) != UCL_STRING)
+            continue;
+        else if (!paths)
+            strs[(*n)++] = strdup (ucl_object_tostring (ustr));
+        /* Instances are kept in the form the matcher looks them up by. */
+        else if ((path = s16db_ucl_to_path (ustr)))
+        {
+            if (path->svc && path->inst)
+                asprintf (&strs[(*n)++], "%s:%s", path->svc, path->inst);
+            S16PathDestroy (path);
+        }
+    }
+
+    return strs;
+}
+
+/* Fun: subscribe-filtered
+ * Desc: Subscribe to the given set of notifications, restricted by a filter
+ * of the form {prefixes: string[], instances: S16Path[], types: int}; see
+ * s16db_note_filter_t.
+ * Sig: int (s16note_type_t, filter) */
+ucl_object_t * handle_subscribe_filtered (s16rpc_data_t * dat,
+                                          const ucl_object_t * utypes,
+                                          const ucl_object_t * ufilter)
+{
+    subscriber_t * sub = subscriber_for_sock (dat->sock);
+    const ucl_object_t * uprefixes = ucl_object_lookup (ufilter, "prefixes");
+    const ucl_object_t * uinsts = ucl_object_lookup (ufilter, "instances");
+    const ucl_object_t * usubtypes = ucl_object_lookup (ufilter, "types");
+
+    clear_filter (sub);
+    sub->kinds = ucl_object_toint (utypes);
+    sub->prefixes = strings_from_ucl (uprefixes, &sub->nprefixes, false);
+    sub->insts = strings_from_ucl (uinsts, &sub->ninsts, true);
+    sub->types = usubtypes ? ucl_object_toint (usubtypes) : 0;
+    filter_invalidate ();
 
     return ucl_object_fromint (0);
 }
 
+/* Fun: subscribe-changes
+ * Desc: Subscribe to have changes to the repository pushed as notifications
+ * of the subscriber's changes method, which takes an argument of the same
+ * form as get-changes-since returns. The changes since the given generation
+ * are returned at once.
+ * Sig: {epoch, generation, full, services, instances, removed} (int epoch,
+ * int generation, s16db_projection_t) */
+ucl_object_t * handle_subscribe_changes (s16rpc_data_t * dat,
+                                         const ucl_object_t * uepoch,
+                                         const ucl_object_t * ugen,
+                                         const ucl_object_t * uproj)
+{
+    subscriber_t * sub = subscriber_for_sock (dat->sock);
+
+    sub->changes = true;
+    sub->epoch = db_epoch ();
+    sub->gen = db_generation ();
+    sub->proj = ucl_object_toint (uproj);
+
+    return rpc_changes_since (ucl_object_toint (uepoch),
+                              ucl_object_toint (ugen),
+                              sub->proj);
+}
+
+/* Fun: get-queue-stats
+ * Desc: Describes the output queue of each subscriber.
+ * Sig: {fd, kinds, changes, depth, max-depth, sent, dropped, coalesced,
+ * lag-ms}[] () */
+ucl_object_t * handle_get_queue_stats (s16rpc_data_t * dat)
+{
+    ucl_object_t * ureply = ucl_object_typed_new (UCL_ARRAY);
+
+    list_foreach (subscriber, &subs, it)
+    {
+        ucl_object_t * ustats = ucl_object_typed_new (UCL_OBJECT);
+        s16rpc_queue_stats_t stats;
+
+        if (s16rpc_srv_queue_stats (server, it->val->fd, &stats))
+            continue;
+
+#define Stat(name, val)                                                        \
+    ucl_object_insert_key (ustats, ucl_object_fromint (val), name, 0, 1)
+        Stat ("fd", it->val->fd);
+        Stat ("kinds", it->val->kinds);
+        Stat ("changes", it->val->changes);
+        Stat ("depth", stats.depth);
+        Stat ("max-depth", stats.max_depth);
+        Stat ("sent", stats.sent);
+        Stat ("dropped", stats.dropped);
+        Stat ("coalesced", stats.coalesced);
+        Stat ("lag-ms", stats.lag_ms);
+#undef Stat
+
+        ucl_array_append (ureply, ustats);
+    }
+
+    return ureply;
+}
+
+/* Fun: get-stats
+ * Desc: Describes the load on configd: calls and their latencies by method,
+ * traffic and queues by connection, notes published, the size of the merged
+ * scope, memory, and time spent in each iteration of the event loop.
+ * Sig: {uptime-s, methods, connections, notes, scope, memory, loop} () */
+ucl_object_t * handle_get_stats (s16rpc_data_t * dat)
+{
+    return stats_report (server);
+}
+
+/* Queues a notification for a subscriber. Returns false if the overflow
+ * policy disconnected it. */
+static bool push (subscriber_t * sub, s16rpc_frame_t * frame)
+{
+    return !s16rpc_srv_send (server, sub->fd, frame);
+}
+
+void rpc_push_subscribers (s16rpc_srv_t * srv)
+{
+    s16note_t * note;
+    subscriber_list_t gone = subscriber_list_new ();
+    size_t elided = s16note_list_coalesce (&notes);
+
+    if (elided)
+        S16Log (kS16LogDebug,
+                "Coalesced away %zu notes (%zu in all).\n",
+                elided,
+                stats_notes_elided (elided));
+
+    /* Each note is serialised once, if anyone wants it, and the frame
+     * shared between the queues of those who do. Later notes of the same
+     * kind about the same path may supersede it. */
+    while ((note = s16note_list_lpop (&notes)))
+    {
+        subscriber_list_t wanting = subscriber_list_new ();
+        ucl_object_t * params;
+        char * path;
+        char * key;
+        s16rpc_frame_t * frame;
+
+        stats_note_published (note);
+        filter_match (note, &wanting);
+
+        if (!list_begin (&wanting))
+        {
+            s16note_destroy (note);
+            continue;
+        }
+
+        params = ucl_object_typed_new (UCL_ARRAY);
+        path = S16PathToString (note->path);
+        asprintf (&key, "notify:%d:%d:%s", note->note_type, note->type, path);
+        ucl_array_append (params, s16db_note_to_ucl (note));
+        /* A config note's diff is not repeated by any later note, so it
+         * mustn't be dropped. */
+        frame = s16rpc_frame_new_notification (
+            "notify", params, key, note->note_type != N_CONFIG);
+
+        list_foreach (subscriber, &wanting, it)
+        {
+            if (!push (it->val, frame))
+                subscriber_list_add (&gone, it->val);
+        }
+
+        s16rpc_frame_release (frame);
+        ucl_object_unref (params);
+        free (key);
+        free (path);
+        s16note_destroy (note);
+        subscriber_list_destroy (&wanting);
+
+        list_foreach (subscriber, &gone, it)
+            subscriber_remove (it->val);
+        subscriber_list_destroy (&gone);
+    }
+
+    /* Changes can't be dropped, as each builds on those before. Instead,
+     * while one is still queued for a subscriber, no more are sent to it;
+     * once it is gone, the next covers everything since. */
+    list_foreach (subscriber, &subs, it)
+    {
+        subscriber_t * sub = it->val;
+        ucl_object_t * params;
+        s16rpc_frame_t * frame;
+
+        if (!sub->changes || sub->gen == db_generation () ||
+            s16rpc_srv_is_queued (srv, sub->fd, "changes"))
+            continue;
+
+        params = ucl_object_typed_new (UCL_ARRAY);
+        ucl_array_append (params,
+                          rpc_changes_since (sub->epoch, sub->gen, sub->proj));
+        frame = s16rpc_frame_new_notification ("changes", params, "changes",
+                                               false);
+        s16rpc_srv_send (srv, sub->fd, frame);
+        s16rpc_frame_release (frame);
+        ucl_object_unref (params);
+        sub->gen = db_generation ();
+    }
+}
+
+static nvlist_t * strings_to_nv (char ** strs, size_t n)
+{
+    nvlist_t * nvl = nvlist_create (0);
+    char name[16];
+
+    for (size_t i = 0; i < n; i++)
+    {
+        snprintf (name, sizeof (name), "%zu", i);
+        nvlist_add_string (nvl, name, strs[i]);
+    }
+
+    return nvl;
+}
+
+static char ** strings_from_nv (const nvlist_t * nvl, size_t * n)
+{
+    const char * name;
+    void * cookie = NULL;
+    int type;
+    char ** strs;
+
+    for (*n = 0; nvlist_next (nvl, &type, &cookie); (*n)++)
+        ;
+    strs = calloc (*n + 1, sizeof (*strs));
+
+    *n = 0;
+    cookie = NULL;
+    while ((name = nvlist_next (nvl, &type, &cookie)))
+        if (type == NV_TYPE_STRING)
+            strs[(*n)++] = strdup (nvlist_get_string (nvl, name));
+
+    return strs;
+}
+
+nvlist_t * subscribers_export ()
+{
+    nvlist_t * nvl = nvlist_create (0);
+
+    list_foreach (subscriber, &subs, it)
+    {
+        subscriber_t * sub = it->val;
+        nvlist_t * nvsub = nvlist_create (0);
+        char name[16];
+
+        nvlist_add_number (nvsub, "kinds", sub->kinds);
+        nvlist_add_number (nvsub, "types", sub->types);
+        nvlist_move_nvlist (
+            nvsub, "prefixes", strings_to_nv (sub->prefixes, sub->nprefixes));
+        nvlist_move_nvlist (
+            nvsub, "instances", strings_to_nv (sub->insts, sub->ninsts));
+        nvlist_add_bool (nvsub, "changes", sub->changes);
+        nvlist_add_number (nvsub, "epoch", sub->epoch);
+        nvlist_add_number (nvsub, "generation", sub->gen);
+        nvlist_add_number (nvsub, "projection", sub->proj);
+
+        snprintf (name, sizeof (name), "%d", sub->fd);
+        nvlist_move_nvlist (nvl, name, nvsub);
+    }
+
+    return nvl;
+}
+
+void subscriber_import (const nvlist_t * nvl, int old_fd, int fd)
+{
+    const nvlist_t * nvsub;
+    subscriber_t * sub;
+    char name[16];
+
+    snprintf (name, sizeof (name), "%d", old_fd);
+    if (!nvlist_exists_nvlist (nvl, name))
+        return;
+
+    nvsub = nvlist_get_nvlist (nvl, name);
+    sub = subscriber_for_sock (fd);
+    clear_filter (sub);
+    sub->kinds = nvlist_get_number (nvsub, "kinds");
+    sub->types = nvlist_get_number (nvsub, "types");
+    sub->prefixes = strings_from_nv (nvlist_get_nvlist (nvsub, "prefixes"),
+                                     &sub->nprefixes);
+    sub->insts =
+        strings_from_nv (nvlist_get_nvlist (nvsub, "instances"), &sub->ninsts);
+    sub->changes = nvlist_get_bool (nvsub, "changes");
+    sub->epoch = nvlist_get_number (nvsub, "epoch");
+    sub->gen = nvlist_get_number (nvsub, "generation");
+    sub->proj = nvlist_get_number (nvsub, "projection");
+    filter_invalidate ();
+}
+
 void rpc_setup (s16rpc_srv_t * srv)
 {
+    server = srv;
+
     s16rpc_srv_register_method (
         srv, "disable", 1, (s16rpc_fun_t)handle_disable);
     s16rpc_srv_register_method (srv, "enable", 1, (s16rpc_fun_t)handle_disable);
+    s16rpc_srv_register_method (
+        srv, "set-state", 2, (s16rpc_fun_t)handle_set_state);
     s16rpc_srv_register_method (
         srv, "import-service", 2, (s16rpc_fun_t)handle_import_service);
+    s16rpc_srv_register_method (
+        srv, "transaction", 1, (s16rpc_fun_t)handle_transaction);
+    s16rpc_srv_register_method (
+        srv, "import-manifests", 2, (s16rpc_fun_t)handle_import_manifests);
     s16rpc_srv_register_method (
         srv, "get-all-services-merged", 0, handle_get_all_services_merged);
+    s16rpc_srv_register_method (
+        srv,
+        "get-all-services-projected",
+        1,
+        (s16rpc_fun_t)handle_get_all_services_projected);
     s16rpc_srv_register_method (
         srv, "get-path-merged", 1, (s16rpc_fun_t)handle_get_path_merged);
+    s16rpc_srv_register_method (
+        srv, "get-path-projected", 2, (s16rpc_fun_t)handle_get_path_projected);
+    s16rpc_srv_register_method (srv, "query", 2, (s16rpc_fun_t)handle_query);
+
+    s16rpc_srv_register_method (
+        srv, "get-changes-since", 3, (s16rpc_fun_t)handle_get_changes_since);
 
     s16rpc_srv_register_method (
         srv, "subscribe", 1, (s16rpc_fun_t)handle_subscribe);
+    s16rpc_srv_register_method (
+        srv, "subscribe-filtered", 2, (s16rpc_fun_t)handle_subscribe_filtered);
+    s16rpc_srv_register_method (
+        srv, "subscribe-changes", 3, (s16rpc_fun_t)handle_subscribe_changes);
+    s16rpc_srv_register_method (
+        srv, "get-queue-stats", 0, handle_get_queue_stats);
+    s16rpc_srv_register_method (srv, "get-stats", 0, handle_get_stats);
 }
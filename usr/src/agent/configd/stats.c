@@ -0,0 +1,203 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Load statistics. The RPC server keeps those of its methods and
+ * connections; here are kept those of the notes published and the event loop,
+ * and all are gathered into one report on request.
+ */
+
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "S16/Repository_Private.h"
+
+#include "configd.h"
+
+/* Indexed by the bit of each s16note_type_t. */
+#define kNoteKinds 4
+
+static unsigned long notes_published[kNoteKinds];
+static unsigned long notes_elided;
+
+static unsigned long loop_iterations, loop_total_us, loop_max_us;
+static unsigned long loop_latency[S16RPC_LATENCY_BUCKETS];
+
+static struct timespec started;
+
+void stats_setup () { clock_gettime (CLOCK_MONOTONIC, &started); }
+
+static unsigned long us_since (const struct timespec * then)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000000 +
+           (now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+void stats_loop_iteration (const struct timespec * began)
+{
+    unsigned long us = us_since (began);
+
+    loop_iterations++;
+    loop_total_us += us;
+    if (us > loop_max_us)
+        loop_max_us = us;
+    loop_latency[s16rpc_latency_bucket (us)]++;
+}
+
+void stats_note_published (const s16note_t * note)
+{
+    for (int i = 0; i < kNoteKinds; i++)
+        if (note->note_type == (1 << i))
+            notes_published[i]++;
+}
+
+size_t stats_notes_elided (size_t n) { return notes_elided += n; }
+
+static void ins_int (ucl_object_t * obj, const char * key, long val)
+{
+    ucl_object_insert_key (obj, ucl_object_fromint (val), key, 0, 1);
+}
+
+/* Trailing empty buckets are left out, to keep the report small. */
+static ucl_object_t * histogram (const unsigned long * buckets)
+{
+    ucl_object_t * uhist = ucl_object_typed_new (UCL_ARRAY);
+    int n = S16RPC_LATENCY_BUCKETS;
+
+    while (n && !buckets[n - 1])
+        n--;
+    for (int i = 0; i < n; i++)
+        ucl_array_append (uhist, ucl_object_fromint (buckets[i]));
+
+    return uhist;
+}
+
+static void add_method (const s16rpc_method_stats_t * stats, void * user)
+{
+    ucl_object_t * umeth = ucl_object_typed_new (UCL_OBJECT);
+
+    ucl_object_insert_key (
+        umeth, ucl_object_fromstring (stats->name), "name", 0, 1);
+    ins_int (umeth, "calls", stats->calls);
+    ins_int (umeth, "errors", stats->errors);
+    ucl_object_insert_key (
+        umeth, histogram (stats->latency), "latency-us", 0, 1);
+    ucl_array_append (user, umeth);
+}
+
+static void add_conn (int fd, const s16rpc_queue_stats_t * stats, void * user)
+{
+    ucl_object_t * uconn = ucl_object_typed_new (UCL_OBJECT);
+    subscriber_t * sub = NULL;
+
+    list_foreach (subscriber, &subs, it)
+    {
+        if (it->val->fd == fd)
+            sub = it->val;
+    }
+
+    ins_int (uconn, "fd", fd);
+    ins_int (uconn, "pid", stats->pid);
+    ins_int (uconn, "uid", stats->uid);
+    ins_int (uconn, "calls", stats->calls);
+    ins_int (uconn, "bytes-in", stats->bytes_in);
+    ins_int (uconn, "bytes-out", stats->bytes_out);
+    ins_int (uconn, "kinds", sub ? sub->kinds : 0);
+    ins_int (uconn, "depth", stats->depth);
+    ins_int (uconn, "max-depth", stats->max_depth);
+    ins_int (uconn, "dropped", stats->dropped);
+    ins_int (uconn, "coalesced", stats->coalesced);
+    ins_int (uconn, "lag-ms", stats->lag_ms);
+    ucl_array_append (user, uconn);
+}
+
+ucl_object_t * stats_report (s16rpc_srv_t * srv)
+{
+    static const char * kinds[kNoteKinds] = {
+        "admin-req", "restarter-req", "state-change", "config"};
+    ucl_object_t * ureport = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * umeths = ucl_object_typed_new (UCL_ARRAY);
+    ucl_object_t * uconns = ucl_object_typed_new (UCL_ARRAY);
+    ucl_object_t * unotes = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * uscope = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * umem = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * uloop = ucl_object_typed_new (UCL_OBJECT);
+    unsigned long nsvcs = 0, ninsts = 0;
+    s16mem_stats_t mem;
+    s16str_stats_t str;
+    struct rusage ru;
+
+    ins_int (ureport, "uptime-s", us_since (&started) / 1000000);
+
+    s16rpc_srv_walk_methods (srv, add_method, umeths);
+    ucl_object_insert_key (ureport, umeths, "methods", 0, 1);
+
+    s16rpc_srv_walk_conns (srv, add_conn, uconns);
+    ucl_object_insert_key (ureport, uconns, "connections", 0, 1);
+
+    for (int i = 0; i < kNoteKinds; i++)
+        ins_int (unotes, kinds[i], notes_published[i]);
+    ins_int (unotes, "elided", notes_elided);
+    ucl_object_insert_key (ureport, unotes, "notes", 0, 1);
+
+    list_foreach (svc, db_merged_svcs (), it)
+    {
+        nsvcs++;
+        list_foreach (inst, &it->val->insts, iit)
+            ninsts++;
+    }
+    ins_int (uscope, "services", nsvcs);
+    ins_int (uscope, "instances", ninsts);
+    ins_int (uscope, "generation", db_generation ());
+    ucl_object_insert_key (ureport, uscope, "scope", 0, 1);
+
+    s16mem_stats (&mem);
+    ins_int (umem, "allocs", mem.allocs);
+    ins_int (umem, "frees", mem.frees);
+    ins_int (umem, "pool-allocs", mem.pool_allocs);
+    ins_int (umem, "pool-used", mem.pool_used);
+    ins_int (umem, "pool-size", mem.pool_size);
+    s16str_stats (&str);
+    ins_int (umem, "strings", str.strings);
+    ins_int (umem, "string-refs", str.refs);
+    ins_int (umem, "string-bytes", str.bytes);
+    ins_int (umem, "string-bytes-saved", str.bytes_saved);
+    /* Kilobytes on most systems, bytes on some. */
+    if (!getrusage (RUSAGE_SELF, &ru))
+        ins_int (umem, "max-rss", ru.ru_maxrss);
+    ucl_object_insert_key (ureport, umem, "memory", 0, 1);
+
+    ins_int (uloop, "iterations", loop_iterations);
+    ins_int (uloop, "total-us", loop_total_us);
+    ins_int (uloop, "max-us", loop_max_us);
+    ucl_object_insert_key (uloop, histogram (loop_latency), "latency-us", 0, 1);
+    ucl_object_insert_key (ureport, uloop, "loop", 0, 1);
+
+    return ureport;
+}
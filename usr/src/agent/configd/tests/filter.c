@@ -0,0 +1,129 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <atf-c.h>
+
+#include "configd.h"
+
+#define kAllKinds (N_ADMIN_REQ | N_RESTARTER_REQ | N_STATE_CHANGE | N_CONFIG)
+
+subscriber_list_t subs;
+
+/* Subscribes, as subscriber @id, to the given notes. @prefixes and @insts
+ * are NULL-terminated. */
+static subscriber_t * subscribe (int id, int kinds, char ** prefixes,
+                                 char ** insts, unsigned types)
+{
+    subscriber_t * sub = calloc (1, sizeof (*sub));
+
+    sub->fd = id;
+    sub->kinds = kinds;
+    sub->prefixes = prefixes;
+    while (prefixes && prefixes[sub->nprefixes])
+        sub->nprefixes++;
+    sub->insts = insts;
+    while (insts && insts[sub->ninsts])
+        sub->ninsts++;
+    sub->types = types;
+
+    subscriber_list_add (&subs, sub);
+    filter_invalidate ();
+
+    return sub;
+}
+
+/* Returns the set of subscribers wanting a note, each as bit 1 << id. */
+static unsigned match (s16note_type_t note_type, int type, const char * svc,
+                       const char * inst)
+{
+    S16Path * path = S16PathNew (svc, inst);
+    s16note_t * note = s16note_new (note_type, type, path, 0);
+    subscriber_list_t out = subscriber_list_new ();
+    unsigned matched = 0;
+
+    filter_match (note, &out);
+
+    list_foreach (subscriber, &out, it)
+    {
+        /* Each is found once only, however many ways it matches. */
+        ATF_CHECK (!(matched & 1u << it->val->fd));
+        matched |= 1u << it->val->fd;
+    }
+
+    subscriber_list_destroy (&out);
+    s16note_destroy (note);
+    S16PathDestroy (path);
+
+    return matched;
+}
+
+ATF_TC (match_filters);
+ATF_TC_HEAD (match_filters, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests matching notes to subscribers by service prefix, "
+                       "instance, note kind and sub-type");
+}
+ATF_TC_BODY (match_filters, tc)
+{
+    char *net[] = {"net/", NULL}, *ssh[] = {"net/ssh", NULL},
+         *sshdef[] = {"net/ssh:default", NULL}, *log[] = {"sys/log:main", NULL};
+    subscriber_t * d;
+
+    subs = subscriber_list_new ();
+    subscribe (0, N_CONFIG | N_STATE_CHANGE, NULL, NULL, 0);
+    subscribe (1, kAllKinds, net, NULL, 0);
+    subscribe (2, kAllKinds, ssh, NULL, 0);
+    d = subscribe (3, kAllKinds, NULL, sshdef, 0);
+    subscribe (4, N_CONFIG, NULL, log, 1u << CF_REMOVED);
+    subscribe (5, kAllKinds, net, sshdef, 0);
+
+    ATF_CHECK_EQ (0x2f, match (N_CONFIG, CF_CHANGED, "net/ssh", "default"));
+    ATF_CHECK_EQ (0x27, match (N_CONFIG, CF_CHANGED, "net/ssh", "other"));
+    /* A note about a service concerns its instances. */
+    ATF_CHECK_EQ (0x2f, match (N_CONFIG, CF_CHANGED, "net/ssh", NULL));
+    /* Prefixes are of the service name, not of its components. */
+    ATF_CHECK_EQ (0x26, match (N_ADMIN_REQ, A_ENABLE, "net/sshd", "default"));
+    ATF_CHECK_EQ (0x01, match (N_CONFIG, CF_ADDED, "net", NULL));
+
+    ATF_CHECK_EQ (0x01, match (N_STATE_CHANGE, SC_ONLINE, "sys/log", "main"));
+    ATF_CHECK_EQ (0x01, match (N_CONFIG, CF_CHANGED, "sys/log", "main"));
+    ATF_CHECK_EQ (0x11, match (N_CONFIG, CF_REMOVED, "sys/log", "main"));
+    ATF_CHECK_EQ (0x11, match (N_CONFIG, CF_REMOVED, "sys/log", NULL));
+    ATF_CHECK_EQ (0x00, match (N_RESTARTER_REQ, RR_START, "sys/log", "main"));
+
+    /* The index is recompiled once a subscriber goes. */
+    subscriber_list_del (&subs, d);
+    filter_invalidate ();
+    ATF_CHECK_EQ (0x27, match (N_CONFIG, CF_CHANGED, "net/ssh", "default"));
+    free (d);
+}
+
+ATF_TP_ADD_TCS (tp)
+{
+    ATF_TP_ADD_TC (tp, match_filters);
+    return atf_no_error ();
+}
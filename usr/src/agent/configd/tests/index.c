@@ -0,0 +1,271 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <atf-c.h>
+
+#include "configd.h"
+
+/* The merged scope, as index.c sees it. */
+static svc_list_t merged;
+
+/* The instances queried, each reported as bit 1 << its position here. */
+static const char * paths[] = {
+    "svc:/web:a",
+    "svc:/web:b",
+    "svc:/db:main",
+    "svc:/db:replica",
+    "svc:/cache:x",
+};
+#define kNPaths (sizeof (paths) / sizeof (*paths))
+
+s16db_lookup_result_t db_lookup_path_merged (S16Path * path)
+{
+    s16db_lookup_result_t res = {.type = NOTFOUND};
+
+    list_foreach (svc, &merged, it)
+    {
+        if (!strcmp (it->val->path->svc, path->svc))
+        {
+            res.type = SVC;
+            res.s = it->val;
+        }
+    }
+
+    return res;
+}
+
+const svc_list_t * db_merged_svcs ()
+{
+    return &merged;
+}
+
+static S16Property * prop (const char * name, const char * value)
+{
+    S16Property * prop = calloc (1, sizeof (*prop));
+
+    prop->name = s16str_intern (name);
+    prop->type = kS16PropertyTypeString;
+    prop->value.s = s16str_intern (value);
+
+    return prop;
+}
+
+/* A dependency group requiring the one path given. */
+static S16DependencyGroup * depgroup (const char * svc, const char * inst)
+{
+    S16DependencyGroup * dg = calloc (1, sizeof (*dg));
+
+    dg->name = strdup ("dg");
+    dg->type = kS16RequireAll;
+    dg->paths = path_list_new ();
+    path_list_add (&dg->paths, S16PathNew (svc, inst));
+
+    return dg;
+}
+
+static S16ServiceInstance * add_inst (S16Service * svc, const char * name,
+                                      S16ServiceState state, bool enabled)
+{
+    S16ServiceInstance * inst = calloc (1, sizeof (*inst));
+
+    inst->path = S16PathNew (svc->path->svc, name);
+    inst->props = prop_list_new ();
+    inst->meths = meth_list_new ();
+    inst->depgroups = depgroup_list_new ();
+    inst->state = state;
+    inst->enabled = enabled;
+    inst_list_add (&svc->insts, inst);
+
+    return inst;
+}
+
+static S16Service * add_svc (const char * name)
+{
+    S16Service * svc = S16ServiceAlloc ();
+
+    svc->path = S16PathNew (name, NULL);
+    svc_list_add (&merged, svc);
+
+    return svc;
+}
+
+/* Runs the query @pred, returning the set of instances found, or -1 if it was
+ * rejected. Each instance must be found at most once. */
+static int query (const char * pred, int proj)
+{
+    struct ucl_parser * parser = ucl_parser_new (0);
+    ucl_object_t *upred, *reply;
+    const ucl_object_t * uinst;
+    ucl_object_iter_t it = NULL;
+    int found = 0;
+
+    ucl_parser_add_string (parser, pred, 0);
+    ATF_REQUIRE ((upred = ucl_parser_get_object (parser)));
+    ucl_parser_free (parser);
+
+    reply = index_query (upred, proj);
+    ucl_object_unref (upred);
+
+    if (!reply)
+        return -1;
+
+    while ((uinst = ucl_iterate_object (reply, &it, true)))
+    {
+        const char * path =
+            ucl_object_tostring (ucl_object_lookup (uinst, "path"));
+        size_t i;
+
+        for (i = 0; i < kNPaths && strcmp (paths[i], path); i++)
+            ;
+        ATF_REQUIRE (i < kNPaths);
+        ATF_CHECK (!(found & 1 << i));
+        found |= 1 << i;
+
+        /* Only the fields projected are given. */
+        ATF_CHECK_EQ (!!(proj & S16DB_PROJ_STATE),
+                      !!ucl_object_lookup (uinst, "state"));
+        ATF_CHECK_EQ (!!(proj & S16DB_PROJ_ENABLED),
+                      !!ucl_object_lookup (uinst, "enabled"));
+    }
+
+    ucl_object_unref (reply);
+
+    return found;
+}
+
+ATF_TC (query_indices);
+ATF_TC_HEAD (query_indices, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests queries by state, property and dependency "
+                       "drawn from the secondary indices, and that the "
+                       "indices follow changes to the merged scope");
+}
+ATF_TC_BODY (query_indices, tc)
+{
+    S16Service *web, *db, *cache;
+    S16ServiceInstance *a, *b, *replica;
+    char * pred;
+
+    merged = svc_list_new ();
+
+    web = add_svc ("web");
+    prop_list_add (&web->props, prop ("port", "80"));
+    a = add_inst (web, "a", kS16StateOnline, true);
+    depgroup_list_add (&a->depgroups, depgroup ("db", "main"));
+    b = add_inst (web, "b", kS16StateOffline, true);
+    prop_list_add (&b->props, prop ("port", "8080"));
+
+    db = add_svc ("db");
+    add_inst (db, "main", kS16StateOnline, true);
+    replica = add_inst (db, "replica", kS16StateMaintenance, false);
+
+    cache = add_svc ("cache");
+    depgroup_list_add (&cache->depgroups, depgroup ("db", NULL));
+    add_inst (cache, "x", kS16StateOnline, true);
+
+    list_foreach (svc, &merged, it)
+        index_add_svc (it->val);
+
+    asprintf (&pred, "{\"state\": %d}", kS16StateOnline);
+    ATF_CHECK_EQ (0x15, query (pred, S16DB_PROJ_ALL));
+    ATF_CHECK_EQ (0x15, query (pred, S16DB_PROJ_STATE));
+    ATF_CHECK_EQ (0x15, query (pred, 0));
+    free (pred);
+
+    asprintf (&pred,
+              "{\"state\": %d, \"enabled\": false}",
+              kS16StateMaintenance);
+    ATF_CHECK_EQ (0x08, query (pred, S16DB_PROJ_ALL));
+    free (pred);
+    ATF_CHECK_EQ (0x00, query ("{\"state\": 99}", S16DB_PROJ_ALL));
+
+    /* An instance inherits its service's property unless it sets its own. */
+    ATF_CHECK_EQ (0x03, query ("{\"property\": {\"name\": \"port\"}}", 0));
+    ATF_CHECK_EQ (
+        0x01,
+        query ("{\"property\": {\"name\": \"port\", \"equals\": \"80\"}}", 0));
+    ATF_CHECK_EQ (
+        0x03,
+        query ("{\"property\": {\"name\": \"port\", \"prefix\": \"80\"}}", 0));
+    ATF_CHECK_EQ (0x00, query ("{\"property\": {\"name\": \"none\"}}", 0));
+
+    /* Likewise its service's dependencies. */
+    ATF_CHECK_EQ (0x01, query ("{\"depends-on\": \"svc:/db:main\"}", 0));
+    ATF_CHECK_EQ (0x10, query ("{\"depends-on\": \"svc:/db\"}", 0));
+
+    /* Terms are conjoined, whichever index supplies the candidates. */
+    asprintf (&pred,
+              "{\"state\": %d, \"property\": {\"name\": \"port\"}}",
+              kS16StateOffline);
+    ATF_CHECK_EQ (0x02, query (pred, 0));
+    free (pred);
+    ATF_CHECK_EQ (0x00,
+                  query ("{\"depends-on\": \"svc:/db:main\", \"property\": "
+                         "{\"name\": \"port\", \"equals\": \"8080\"}}",
+                         0));
+
+    /* With no indexed term, every instance is tested. */
+    ATF_CHECK_EQ (0x0c, query ("{\"path\": \"svc:/db:*\"}", 0));
+    ATF_CHECK_EQ (0x1f, query ("{}", 0));
+
+    ATF_CHECK_EQ (-1, query ("{\"property\": {\"equals\": \"80\"}}", 0));
+    ATF_CHECK_EQ (-1, query ("{\"depends-on\": 3}", 0));
+    ATF_CHECK_EQ (-1, query ("[]", 0));
+
+    /* The state index follows state changes. */
+    replica->state = kS16StateOnline;
+    index_set_state (replica, kS16StateMaintenance);
+    asprintf (&pred, "{\"state\": %d}", kS16StateOnline);
+    ATF_CHECK_EQ (0x1d, query (pred, 0));
+    free (pred);
+    asprintf (&pred, "{\"state\": %d}", kS16StateMaintenance);
+    ATF_CHECK_EQ (0x00, query (pred, 0));
+    free (pred);
+
+    /* And every index forgets a service taken out of the merged scope. */
+    index_remove_svc (web);
+    svc_list_del (&merged, web);
+    S16ServiceDestroy (web);
+
+    ATF_CHECK_EQ (0x00, query ("{\"property\": {\"name\": \"port\"}}", 0));
+    ATF_CHECK_EQ (0x00, query ("{\"depends-on\": \"svc:/db:main\"}", 0));
+    ATF_CHECK_EQ (0x10, query ("{\"depends-on\": \"svc:/db\"}", 0));
+    asprintf (&pred, "{\"state\": %d}", kS16StateOnline);
+    ATF_CHECK_EQ (0x1c, query (pred, 0));
+    free (pred);
+
+    index_destroy ();
+    list_foreach (svc, &merged, it)
+        S16ServiceDestroy (it->val);
+    svc_list_destroy (&merged);
+}
+
+ATF_TP_ADD_TCS (tp)
+{
+    ATF_TP_ADD_TC (tp, query_indices);
+    return atf_no_error ();
+}
@@ -0,0 +1,209 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <sys/stat.h>
+
+#include <atf-c.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "configd.h"
+
+#define kLog "log"
+
+typedef struct
+{
+    int count;
+    wal_rec_type_t types[8];
+    char data[8][32];
+} replayed_t;
+
+static void replay (wal_rec_type_t type, const char * data, size_t len,
+                    void * user)
+{
+    replayed_t * rep = user;
+
+    if (rep->count < 8)
+    {
+        rep->types[rep->count] = type;
+        snprintf (rep->data[rep->count], 32, "%.*s", (int)len, data);
+    }
+    rep->count++;
+}
+
+static void append (wal_rec_type_t type, const char * str)
+{
+    wal_append (type, str, strlen (str) + 1);
+}
+
+static off_t log_size ()
+{
+    struct stat sb;
+
+    ATF_REQUIRE (stat (kLog, &sb) == 0);
+    return sb.st_size;
+}
+
+static void log_write_at (off_t off, const void * data, size_t len)
+{
+    int fd = open (kLog, O_WRONLY);
+
+    ATF_REQUIRE (fd != -1);
+    ATF_REQUIRE (pwrite (fd, data, len, off) == (ssize_t)len);
+    close (fd);
+}
+
+ATF_TC (replay);
+ATF_TC_HEAD (replay, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests that committed records are replayed in order");
+}
+ATF_TC_BODY (replay, tc)
+{
+    replayed_t rep = {0};
+
+    ATF_REQUIRE_EQ (0, wal_open (kLog, replay, &rep));
+    append (W_ENABLE, "svc:/a:i");
+    append (W_DISABLE, "svc:/b:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    append (W_ADMIN_SVC, "{}");
+    /* Not yet committed, so not yet in the log. */
+    ATF_CHECK (log_size () < (off_t)wal_size ());
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    ATF_CHECK_EQ (log_size (), (off_t)wal_size ());
+
+    ATF_REQUIRE_EQ (3, wal_open (kLog, replay, &rep));
+    ATF_CHECK_EQ (3, rep.count);
+    ATF_CHECK_EQ (W_ENABLE, rep.types[0]);
+    ATF_CHECK_STREQ ("svc:/a:i", rep.data[0]);
+    ATF_CHECK_EQ (W_DISABLE, rep.types[1]);
+    ATF_CHECK_STREQ ("svc:/b:i", rep.data[1]);
+    ATF_CHECK_EQ (W_ADMIN_SVC, rep.types[2]);
+    ATF_CHECK_STREQ ("{}", rep.data[2]);
+}
+
+ATF_TC (torn_tail);
+ATF_TC_HEAD (torn_tail, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that a torn or corrupt record ends the log, and "
+                       "is cut off before anything more is appended");
+}
+ATF_TC_BODY (torn_tail, tc)
+{
+    replayed_t rep = {0};
+    off_t good, second;
+    const char torn[] = {0x40, 0, 0, 0, 1};
+
+    ATF_REQUIRE_EQ (0, wal_open (kLog, replay, &rep));
+    append (W_ENABLE, "svc:/a:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    second = log_size ();
+    append (W_DISABLE, "svc:/a:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    good = log_size ();
+
+    /* A record whose header was only partly written. */
+    log_write_at (good, torn, sizeof (torn));
+    ATF_REQUIRE_EQ (2, wal_open (kLog, replay, &rep));
+    ATF_CHECK_EQ (good, log_size ());
+
+    /* What follows is appended after the last good record. */
+    append (W_ENABLE, "svc:/b:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    rep.count = 0;
+    ATF_REQUIRE_EQ (3, wal_open (kLog, replay, &rep));
+    ATF_CHECK_STREQ ("svc:/b:i", rep.data[2]);
+
+    /* A record failing its checksum ends the log there. */
+    log_write_at (log_size () - 2, "X", 1);
+    rep.count = 0;
+    ATF_REQUIRE_EQ (2, wal_open (kLog, replay, &rep));
+    ATF_CHECK_EQ (good, log_size ());
+
+    log_write_at (second + 4, "\xff", 1);
+    rep.count = 0;
+    ATF_REQUIRE_EQ (1, wal_open (kLog, replay, &rep));
+    ATF_CHECK_EQ (second, log_size ());
+}
+
+ATF_TC (truncate);
+ATF_TC_HEAD (truncate, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests that resetting the log empties it");
+}
+ATF_TC_BODY (truncate, tc)
+{
+    replayed_t rep = {0};
+
+    ATF_REQUIRE_EQ (0, wal_open (kLog, replay, &rep));
+    append (W_ENABLE, "svc:/a:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    append (W_DISABLE, "svc:/a:i");
+
+    /* Records pending are discarded with those committed. */
+    wal_reset ();
+    ATF_CHECK_EQ (0, wal_size ());
+    ATF_CHECK_EQ (0, log_size ());
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    ATF_CHECK_EQ (0, log_size ());
+
+    append (W_DISABLE, "svc:/b:i");
+    ATF_REQUIRE_EQ (0, wal_commit ());
+    ATF_REQUIRE_EQ (1, wal_open (kLog, replay, &rep));
+    ATF_CHECK_STREQ ("svc:/b:i", rep.data[0]);
+}
+
+ATF_TC (unreadable);
+ATF_TC_HEAD (unreadable, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests that a log which can't be read isn't used");
+}
+ATF_TC_BODY (unreadable, tc)
+{
+    replayed_t rep = {0};
+
+    ATF_REQUIRE (mkdir (kLog, 0700) == 0);
+    ATF_CHECK_EQ (-1, wal_open (kLog, replay, &rep));
+    ATF_CHECK_EQ (0, rep.count);
+
+    /* Nor is anything appended to it. */
+    append (W_ENABLE, "svc:/a:i");
+    ATF_CHECK_EQ (0, wal_size ());
+}
+
+ATF_TP_ADD_TCS (tp)
+{
+    ATF_TP_ADD_TC (tp, replay);
+    ATF_TP_ADD_TC (tp, torn_tail);
+    ATF_TP_ADD_TC (tp, truncate);
+    ATF_TP_ADD_TC (tp, unreadable);
+    return atf_no_error ();
+}
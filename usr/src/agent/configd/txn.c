@@ -0,0 +1,208 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Transactions. A client may gather enables, disables, state changes
+ * and service imports into one transaction, sent in one call. Every
+ * operation is checked before any is applied, and if one is bad, none is.
+ * Those applied are applied together, on the main thread, between one
+ * snapshot and the next: so readers see all of them or none, the log records
+ * them in one commit, and their notes are coalesced and pushed to subscribers
+ * as one batch.
+ *
+ * An operation may refer to a service or instance imported by an operation
+ * before it in the same transaction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "S16/Repository_Private.h"
+
+#include "configd.h"
+
+typedef enum
+{
+    T_ENABLE,
+    T_DISABLE,
+    T_SET_STATE,
+    T_IMPORT,
+} txn_op_type_t;
+
+typedef struct
+{
+    txn_op_type_t type;
+    S16Path * path;
+    S16ServiceState state;
+    S16Service * svc;
+    s16db_layer_t layer;
+} txn_op_t;
+
+static int parse_op (const ucl_object_t * uop, txn_op_t * op)
+{
+    const ucl_object_t * utype = ucl_object_lookup (uop, "op");
+    const ucl_object_t * upath = ucl_object_lookup (uop, "path");
+    const char * type;
+
+    if (!utype || ucl_object_type (utype) != UCL_STRING)
+        return S16EBADTXN;
+
+    type = ucl_object_tostring (utype);
+
+    if (!strcmp (type, "import-service"))
+    {
+        const ucl_object_t * usvc = ucl_object_lookup (uop, "service");
+        const ucl_object_t * ulayer = ucl_object_lookup (uop, "layer");
+
+        op->type = T_IMPORT;
+        if (!usvc || ucl_object_type (usvc) != UCL_OBJECT || !ulayer ||
+            !(op->svc = s16db_ucl_to_svc (usvc)))
+            return S16EBADTXN;
+        op->layer = ucl_object_toint (ulayer);
+        return 0;
+    }
+    else if (!strcmp (type, "enable"))
+        op->type = T_ENABLE;
+    else if (!strcmp (type, "disable"))
+        op->type = T_DISABLE;
+    else if (!strcmp (type, "set-state"))
+    {
+        const ucl_object_t * ustate = ucl_object_lookup (uop, "state");
+
+        if (!ustate || ucl_object_type (ustate) != UCL_INT)
+            return S16EBADTXN;
+        op->type = T_SET_STATE;
+        op->state = ucl_object_toint (ustate);
+    }
+    else
+        return S16EBADTXN;
+
+    if (!upath || ucl_object_type (upath) != UCL_STRING ||
+        !(op->path = s16db_ucl_to_path (upath)) || !op->path->svc)
+        return S16EBADPATH;
+
+    return 0;
+}
+
+static bool svc_has_inst (const S16Service * svc, const char * name)
+{
+    list_foreach (inst, &svc->insts, it)
+    {
+        if (!strcmp (it->val->path->inst, name))
+            return true;
+    }
+
+    return false;
+}
+
+/* Checks that the path of the @i'th operation leads somewhere, either in the
+ * repository or among the services imported by the operations before it. */
+static int check_path (const txn_op_t * ops, size_t i)
+{
+    S16Path * path = ops[i].path;
+    s16db_lookup_result_t lu = db_lookup_path_merged (path);
+    bool have_svc = lu.type != NOTFOUND;
+
+    /* The instance and service share the union. */
+    if (have_svc && lu.s)
+        return 0;
+
+    while (i-- > 0)
+    {
+        const S16Service * svc = ops[i].svc;
+
+        if (ops[i].type != T_IMPORT || strcmp (svc->path->svc, path->svc))
+            continue;
+        else if (!path->inst || svc_has_inst (svc, path->inst))
+            return 0;
+        have_svc = true;
+    }
+
+    return have_svc ? S16ENOSUCHINST : S16ENOSUCHSVC;
+}
+
+static void apply_op (txn_op_t * op)
+{
+    switch (op->type)
+    {
+    case T_ENABLE:
+    case T_DISABLE:
+        db_set_enabled (op->path, op->type == T_ENABLE);
+        break;
+
+    case T_SET_STATE:
+        db_set_state (op->path, op->state);
+        break;
+
+    case T_IMPORT:
+        S16LogService (
+            kS16LogInfo, op->svc, "Service loaded into repository.\n");
+        db_import (op->layer, op->svc);
+        /* The repository has it now. */
+        op->svc = NULL;
+        break;
+    }
+}
+
+ucl_object_t * txn_apply (const ucl_object_t * uops)
+{
+    size_t n = ucl_array_size (uops), i = 0;
+    txn_op_t * ops = calloc (n ? n : 1, sizeof (*ops));
+    ucl_object_t * ureply = ucl_object_typed_new (UCL_OBJECT);
+    const ucl_object_t * uop;
+    ucl_object_iter_t it = NULL;
+    int e = 0;
+
+    while (!e && (uop = ucl_iterate_object (uops, &it, true)))
+    {
+        if (!(e = parse_op (uop, &ops[i])) && ops[i].path)
+            e = check_path (ops, i);
+        if (!e)
+            i++;
+    }
+
+    if (e)
+        ucl_object_insert_key (
+            ureply, ucl_object_fromint (i), "failed", 0, 1);
+    else
+    {
+        for (i = 0; i < n; i++)
+            apply_op (&ops[i]);
+        S16Log (kS16LogInfo, "Applied a transaction of %zu operations.\n", n);
+    }
+
+    ucl_object_insert_key (ureply, ucl_object_fromint (e), "error", 0, 1);
+
+    for (i = 0; i < n; i++)
+    {
+        if (ops[i].path)
+            S16PathDestroy (ops[i].path);
+        if (ops[i].svc)
+            S16ServiceDestroy (ops[i].svc);
+    }
+    free (ops);
+
+    return ureply;
+}
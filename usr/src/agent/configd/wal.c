@@ -0,0 +1,221 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: The admin layer's write-ahead log. Administrative changes are made
+ * durable by appending a record of each to the log. Records are collected
+ * over a batch of RPCs and written and synced together, with the replies to
+ * the batch held back until then; so a thousand changes made together cost
+ * one sync, not a thousand.
+ *
+ * At startup, the log is replayed over the repository image. Saving a new
+ * image empties it, so the log never holds more than the changes made since
+ * the last image.
+ *
+ * Each record is a header followed by a payload. A record which is torn or
+ * fails its checksum marks the end of the log; it and anything after it are
+ * discarded.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "S16/Repository_Private.h"
+
+#include "configd.h"
+
+typedef struct
+{
+    uint32_t len; /* Of the payload */
+    uint32_t type;
+    uint64_t checksum;
+} wal_header_t;
+
+static int wal_fd = -1;
+/* Length of the log as synced. */
+static size_t wal_len = 0;
+/* Records appended but not yet written. */
+static char * pending = NULL;
+static size_t pending_len = 0, pending_cap = 0;
+
+static uint64_t record_checksum (uint32_t type, const void * data,
+                                 uint32_t len)
+{
+    return s16db_hash (data, len) ^ ((uint64_t)type << 32 | len);
+}
+
+int wal_open (const char * path, wal_replay_fun fn, void * user)
+{
+    struct stat sb;
+    char * buf = NULL;
+    size_t off = 0;
+    int nrecs = 0;
+
+    s16db_mkdir_parents (path);
+
+    if ((wal_fd = open (path, O_RDWR | O_CREAT, 0600)) == -1 ||
+        fstat (wal_fd, &sb) == -1)
+    {
+        S16Log (kS16LogError, "Failed to open log %s: %m\n", path);
+        if (wal_fd != -1)
+            close (wal_fd);
+        wal_fd = -1;
+        return -1;
+    }
+
+    /* Unless the log is read in full, it mustn't be appended to: the new
+     * records would overwrite those not replayed. */
+    if (sb.st_size && !(buf = malloc (sb.st_size)))
+        goto fail;
+
+    while (off < (size_t)sb.st_size)
+    {
+        ssize_t n = pread (wal_fd, buf + off, sb.st_size - off, off);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            goto fail;
+
+        off += n;
+    }
+
+    off = 0;
+
+    while (off + sizeof (wal_header_t) <= (size_t)sb.st_size)
+    {
+        wal_header_t hdr;
+        const char * data = buf + off + sizeof (hdr);
+
+        memcpy (&hdr, buf + off, sizeof (hdr));
+
+        if (hdr.len > sb.st_size - off - sizeof (hdr) ||
+            record_checksum (hdr.type, data, hdr.len) != hdr.checksum)
+            break;
+
+        fn (hdr.type, data, hdr.len, user);
+        off += sizeof (hdr) + hdr.len;
+        nrecs++;
+    }
+
+    if (off != (size_t)sb.st_size)
+    {
+        S16Log (kS16LogWarn,
+                "Discarding %ld bytes of incomplete log records.\n",
+                (long)(sb.st_size - off));
+        ftruncate (wal_fd, off);
+        fsync (wal_fd);
+    }
+
+    free (buf);
+    wal_len = off;
+    lseek (wal_fd, off, SEEK_SET);
+
+    return nrecs;
+
+fail:
+    S16Log (kS16LogError, "Failed to read log %s: %m\n", path);
+    free (buf);
+    close (wal_fd);
+    wal_fd = -1;
+    return -1;
+}
+
+void wal_append (wal_rec_type_t type, const void * data, size_t len)
+{
+    wal_header_t hdr = {.len = len,
+                        .type = type,
+                        .checksum = record_checksum (type, data, len)};
+
+    if (wal_fd == -1)
+        return;
+
+    if (pending_len + sizeof (hdr) + len > pending_cap)
+    {
+        pending_cap = pending_cap ? pending_cap : 4096;
+        while (pending_len + sizeof (hdr) + len > pending_cap)
+            pending_cap *= 2;
+        pending = realloc (pending, pending_cap);
+    }
+
+    memcpy (pending + pending_len, &hdr, sizeof (hdr));
+    memcpy (pending + pending_len + sizeof (hdr), data, len);
+    pending_len += sizeof (hdr) + len;
+}
+
+int wal_commit ()
+{
+    size_t off = 0;
+
+    if (!pending_len)
+        return 0;
+
+    while (off < pending_len)
+    {
+        ssize_t n = write (wal_fd, pending + off, pending_len - off);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1)
+            goto fail;
+
+        off += n;
+    }
+
+    if (fsync (wal_fd))
+        goto fail;
+
+    wal_len += pending_len;
+    pending_len = 0;
+    return 0;
+
+fail:
+    /* Cut back to the last good record, so later ones aren't lost behind a
+     * partial one. */
+    S16Log (kS16LogError, "Failed to write log: %m\n");
+    ftruncate (wal_fd, wal_len);
+    lseek (wal_fd, wal_len, SEEK_SET);
+    pending_len = 0;
+    return -1;
+}
+
+void wal_reset ()
+{
+    pending_len = 0;
+
+    if (wal_fd == -1)
+        return;
+
+    ftruncate (wal_fd, 0);
+    lseek (wal_fd, 0, SEEK_SET);
+    fsync (wal_fd);
+    wal_len = 0;
+}
+
+size_t wal_size () { return wal_len + pending_len; }
@@ -0,0 +1,261 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: The reader pool. Calls which only read the merged repository are
+ * served by a pool of worker threads, so that a large read doesn't hold up
+ * the main thread, nor a large import the readers. A worker reads the
+ * snapshot published last, without taking any lock on it; the main thread
+ * meanwhile goes on making and publishing changes.
+ *
+ * The method handling such a call defers its reply and queues a job. When a
+ * worker has done it, it queues the job again for the main thread, and wakes
+ * it by triggering a user event on its KQueue; the main thread then sends
+ * the reply. Nothing in s16rpc is touched off the main thread.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/event.h>
+#include <threads.h>
+
+#include "configd.h"
+
+/* Identifies the user event which wakes the main thread. */
+#define kWorkersIdent 0x5316
+
+typedef struct job_s
+{
+    s16rpc_deferred_t * call;
+    worker_read_fun fn;
+    S16Path * path;
+    int proj;
+    ucl_object_t * result;
+
+    struct job_s * next;
+} job_t;
+
+typedef struct
+{
+    job_t * head;
+    job_t ** tail;
+} job_queue_t;
+
+static s16rpc_srv_t * server;
+static int kq;
+static thrd_t * threads = NULL;
+static size_t nthreads = 0;
+
+/* Protects all below. */
+static mtx_t lock;
+static cnd_t wake;
+static bool stopping = false;
+static job_queue_t pending = {NULL, &pending.head};
+static job_queue_t done = {NULL, &done.head};
+
+static void queue_put (job_queue_t * queue, job_t * job)
+{
+    job->next = NULL;
+    *queue->tail = job;
+    queue->tail = &job->next;
+}
+
+static job_t * queue_take (job_queue_t * queue)
+{
+    job_t * job = queue->head;
+
+    if (job && !(queue->head = job->next))
+        queue->tail = &queue->head;
+
+    return job;
+}
+
+static ucl_object_t * run (worker_read_fun fn, S16Path * path, int proj)
+{
+    ucl_object_t * result;
+
+    rcu_read_lock ();
+    result = fn (db_snapshot (), path, proj);
+    rcu_read_unlock ();
+
+    return result;
+}
+
+static int worker_main (void * arg)
+{
+    rcu_register ((intptr_t)arg);
+
+    while (1)
+    {
+        job_t * job;
+        bool first;
+
+        mtx_lock (&lock);
+        while (!pending.head && !stopping)
+            cnd_wait (&wake, &lock);
+        job = queue_take (&pending);
+        mtx_unlock (&lock);
+
+        if (!job)
+            return 0;
+
+        job->result = run (job->fn, job->path, job->proj);
+
+        mtx_lock (&lock);
+        first = !done.head;
+        queue_put (&done, job);
+        mtx_unlock (&lock);
+
+        /* The main thread takes all that are done when woken. */
+        if (first)
+        {
+            struct kevent ev;
+
+            EV_SET (&ev, kWorkersIdent, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+            kevent (kq, &ev, 1, NULL, 0, NULL);
+        }
+    }
+}
+
+void workers_setup (s16rpc_srv_t * srv, int kqfd, size_t n)
+{
+    struct kevent ev;
+
+    server = srv;
+    kq = kqfd;
+
+    /* The main thread is reader 0. */
+    rcu_setup (n + 1);
+    rcu_register (0);
+
+    if (!n)
+        return;
+
+    mtx_init (&lock, mtx_plain);
+    cnd_init (&wake);
+
+    EV_SET (&ev, kWorkersIdent, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent (kq, &ev, 1, NULL, 0, NULL) == -1)
+    {
+        perror ("KQueue: Failed to set worker event");
+        exit (EXIT_FAILURE);
+    }
+
+    threads = calloc (n, sizeof (*threads));
+    for (nthreads = 0; nthreads < n; nthreads++)
+    {
+        if (thrd_create (&threads[nthreads],
+                         (thrd_start_t)worker_main,
+                         (void *)(intptr_t) (nthreads + 1)) != thrd_success)
+        {
+            S16Log (kS16LogError, "Failed to start reader thread.\n");
+            break;
+        }
+    }
+}
+
+void workers_stop ()
+{
+    if (!nthreads)
+        return;
+
+    /* Workers finish what is pending before they exit. */
+    mtx_lock (&lock);
+    stopping = true;
+    cnd_broadcast (&wake);
+    mtx_unlock (&lock);
+
+    for (size_t i = 0; i < nthreads; i++)
+        thrd_join (threads[i], NULL);
+    nthreads = 0;
+
+    workers_complete ();
+}
+
+ucl_object_t * workers_read (s16rpc_data_t * dat, worker_read_fun fn,
+                             S16Path * path, int proj)
+{
+    job_t * job;
+    ucl_object_t * result;
+
+    if (!nthreads)
+    {
+        result = run (fn, path, proj);
+        if (path)
+            S16PathDestroy (path);
+        return result;
+    }
+
+    job = malloc (sizeof (*job));
+    job->call = s16rpc_defer (dat);
+    job->fn = fn;
+    job->path = path;
+    job->proj = proj;
+    job->result = NULL;
+
+    mtx_lock (&lock);
+    queue_put (&pending, job);
+    cnd_signal (&wake);
+    mtx_unlock (&lock);
+
+    return NULL;
+}
+
+bool workers_investigate_kevent (struct kevent * ev)
+{
+    if (ev->filter != EVFILT_USER || ev->ident != kWorkersIdent)
+        return false;
+
+    workers_complete ();
+    return true;
+}
+
+void workers_complete ()
+{
+    job_queue_t finished;
+    job_t * job;
+
+    if (!threads)
+        return;
+
+    mtx_lock (&lock);
+    finished = done;
+    if (!finished.head)
+        finished.tail = &finished.head;
+    done.head = NULL;
+    done.tail = &done.head;
+    mtx_unlock (&lock);
+
+    while ((job = queue_take (&finished)))
+    {
+        s16rpc_srv_complete (server, job->call, job->result);
+        if (job->path)
+            S16PathDestroy (job->path);
+        free (job);
+    }
+
+    /* The workers may have let go of old snapshots. */
+    rcu_reclaim ();
+}
@@ -36,6 +36,11 @@
  * - Instance -> Service's Depgroups (inherited)
  * - Instance -> Instance's Depgroups
  * - Depgroups -> Depgroup's Dependents (Services and Instances)
+ *
+ * Vertices are identified by dense integer IDs, and the graph is kept as a
+ * structure of arrays indexed by them (see graph_t). Each edge is held once
+ * in the dependencies of its source and once in the dependents of its target,
+ * both in compressed-sparse-row form, patched in place as edges come and go.
  */
 
 #include <assert.h>
@@ -44,121 +49,260 @@
 #include <string.h>
 
 #include "graphd.h"
+#include "uthash.h"
 #include "utstring.h"
 
-vertex_list_t graph;
+struct vtx_index_s
+{
+    char * key;
+    vtx_t id;
+
+    UT_hash_handle hh;
+};
+
+graph_t graph;
+
+/* The room a row is first given, in edges. */
+#define kRowInitialCap 2
 
-#define PS(x) S16PathToString (x->path)
+#define PS(x) S16PathToString (graph.path[x])
 
 void print_all ();
 
-edge_t * edge_new (vertex_t * from, vertex_t * to)
+/* Adjacency */
+
+static void csr_grow (csr_t * csr, size_t cap)
+{
+    csr->off = realloc (csr->off, cap * sizeof (uint32_t));
+    csr->len = realloc (csr->len, cap * sizeof (uint32_t));
+    csr->cap = realloc (csr->cap, cap * sizeof (uint32_t));
+}
+
+/* Lays the rows out afresh, in order of vertex, each with its room. */
+static void csr_compact (csr_t * csr)
+{
+    size_t total = 0, pos = 0;
+    vtx_t * adj;
+
+    for (vtx_t v = 0; v < graph.n; v++)
+        total += csr->cap[v];
+    adj = malloc ((total ? total : 1) * sizeof (vtx_t));
+
+    for (vtx_t v = 0; v < graph.n; v++)
+    {
+        memcpy (adj + pos,
+                csr->adj + csr->off[v],
+                csr->len[v] * sizeof (vtx_t));
+        csr->off[v] = pos;
+        pos += csr->cap[v];
+    }
+
+    free (csr->adj);
+    csr->adj = adj;
+    csr->nadj = csr->adjcap = total;
+    csr->waste = 0;
+}
+
+static void csr_add (csr_t * csr, vtx_t v, vtx_t to)
+{
+    if (csr->len[v] == csr->cap[v])
+    {
+        uint32_t cap = csr->cap[v] ? csr->cap[v] * 2 : kRowInitialCap;
+
+        if (csr->nadj + cap > csr->adjcap)
+        {
+            csr->adjcap = csr->adjcap * 2 > csr->nadj + cap ? csr->adjcap * 2
+                                                            : csr->nadj + cap;
+            csr->adj = realloc (csr->adj, csr->adjcap * sizeof (vtx_t));
+        }
+
+        memcpy (csr->adj + csr->nadj,
+                csr->adj + csr->off[v],
+                csr->len[v] * sizeof (vtx_t));
+        csr->waste += csr->cap[v];
+        csr->off[v] = csr->nadj;
+        csr->cap[v] = cap;
+        csr->nadj += cap;
+
+        if (csr->waste > csr->nadj / 2)
+            csr_compact (csr);
+    }
+
+    csr->adj[csr->off[v] + csr->len[v]++] = to;
+}
+
+/* Removes the edge from @v to @to, keeping the order of the rest. */
+static void csr_del (csr_t * csr, vtx_t v, vtx_t to)
+{
+    vtx_t * row = csr->adj + csr->off[v];
+
+    for (uint32_t i = 0; i < csr->len[v]; i++)
+    {
+        if (row[i] == to)
+        {
+            memmove (row + i,
+                     row + i + 1,
+                     (csr->len[v] - i - 1) * sizeof (vtx_t));
+            csr->len[v]--;
+            return;
+        }
+    }
+}
+
+#define csr_row(csr, v) ((csr)->adj + (csr)->off[v])
+
+/* The @i'th dependency, and dependent, of @v. Rows may move as edges are
+ * added, so loops which may add edges must use these rather than csr_row. */
+#define vtx_dep(v, i) csr_row (&graph.deps, v)[i]
+#define vtx_rdep(v, i) csr_row (&graph.rdeps, v)[i]
+
+/* Vertices */
+
+static inline bool vtx_has (vtx_t v, uint8_t flag)
+{
+    return graph.flags[v] & flag;
+}
+
+static inline void vtx_set (vtx_t v, uint8_t flag, bool on)
 {
-    edge_t * e = malloc (sizeof (edge_t));
-    e->from = from;
-    e->to = to;
-    return e;
+    if (on)
+        graph.flags[v] |= flag;
+    else
+        graph.flags[v] &= ~flag;
+}
+
+/* Makes the key by which @path is indexed. */
+static char * path_key (const S16Path * path)
+{
+    size_t len = snprintf (
+        NULL, 0, "%s:%s", path->svc, path->inst ? path->inst : "");
+    char * key = malloc (len + 1);
+
+    sprintf (key, "%s:%s", path->svc, path->inst ? path->inst : "");
+    return key;
 }
 
-void vtx_edge_add (vertex_t * v, vertex_t * to)
+void vtx_edge_add (vtx_t v, vtx_t to)
 {
-    edge_list_add (&v->dependencies, edge_new (v, to));
-    edge_list_add (&to->dependents, edge_new (to, v));
+    csr_add (&graph.deps, v, to);
+    csr_add (&graph.rdeps, to, v);
 }
 
-void vtx_online (vertex_t * v, void * reason)
+void vtx_online (vtx_t v, void * reason)
 {
     s16note_list_add (
         &notes,
         s16note_new (
-            N_STATE_CHANGE, SC_ONLINE, v->path, (int)(intptr_t)reason));
+            N_STATE_CHANGE, SC_ONLINE, graph.path[v], (int)(intptr_t)reason));
 }
 
-void vtx_offline (vertex_t * v, void * reason)
+void vtx_offline (vtx_t v, void * reason)
 {
     s16note_list_add (
         &notes,
         s16note_new (
-            N_STATE_CHANGE, SC_OFFLINE, v->path, (int)(intptr_t)reason));
+            N_STATE_CHANGE, SC_OFFLINE, graph.path[v], (int)(intptr_t)reason));
 }
 
-void vtx_enable (vertex_t * v)
+void vtx_enable (vtx_t v)
 {
     s16note_list_add (&notes,
                       s16note_new (N_STATE_CHANGE,
                                    SC_OFFLINE,
-                                   v->path,
+                                   graph.path[v],
                                    (int)(intptr_t)kS16RestartOnRestart));
 }
 
 /* n.b. we don't really need a reason for this; cut it all out and generate an
  * kS16RestartOnRestart event? */
-void vtx_disable (vertex_t * v, void * reason)
+void vtx_disable (vtx_t v, void * reason)
 {
     s16note_list_add (
         &notes,
         s16note_new (
-            N_STATE_CHANGE, SC_DISABLED, v->path, (int)(intptr_t)reason));
+            N_STATE_CHANGE, SC_DISABLED, graph.path[v], (int)(intptr_t)reason));
 }
 
-static void vtx_dependencies_do (vertex_t * v, void (*fun) (vertex_t *, void *),
+static void vtx_dependencies_do (vtx_t v, void (*fun) (vtx_t, void *),
                                  void * extra)
 {
-    LL_each (&v->dependencies, it) fun (it->val->to, extra);
+    for (uint32_t i = 0; i < graph.deps.len[v]; i++)
+        fun (vtx_dep (v, i), extra);
 }
 
-static void vtx_dependents_do (vertex_t * v, void (*fun) (vertex_t *, void *),
+static void vtx_dependents_do (vtx_t v, void (*fun) (vtx_t, void *),
                                void * extra)
 {
-    LL_each (&v->dependents, it) fun (it->val->to, extra);
+    for (uint32_t i = 0; i < graph.rdeps.len[v]; i++)
+        fun (vtx_rdep (v, i), extra);
 }
 
-bool vtx_is_running (vertex_t * v)
+bool vtx_is_running (vtx_t v)
 {
-    return v->state == kS16StateOnline || v->state == kS16StateDegraded;
+    return graph.state[v] == kS16StateOnline ||
+           graph.state[v] == kS16StateDegraded;
+}
+
+/* A path through the graph, as found by vtx_is_reachable. */
+typedef struct
+{
+    vtx_t * v;
+    size_t n, cap;
+} vtx_path_t;
+
+static void vtx_path_push (vtx_path_t * path, vtx_t v)
+{
+    if (path->n == path->cap)
+    {
+        path->cap = path->cap ? path->cap * 2 : 8;
+        path->v = realloc (path->v, path->cap * sizeof (vtx_t));
+    }
+    path->v[path->n++] = v;
 }
 
 static bool /* continue? */
-vtx_is_reachable_internal (vertex_t * v, vertex_t * to, vertex_list_t * seen,
-                           vertex_list_t * pathTo)
+vtx_is_reachable_internal (vtx_t v, vtx_t to, uint8_t * seen,
+                           vtx_path_t * pathTo)
 {
+    const vtx_t * row = csr_row (&graph.deps, v);
     bool cont = true;
 
-    if (vertex_list_find_eq (seen, v))
+    if (seen[v])
         return false;
-    vertex_list_add (seen, v);
+    seen[v] = 1;
 
-    if (v->dg_type == kS16ExcludeAll)
+    if (graph.dg_type[v] == kS16ExcludeAll)
         return false;
 
     if (v == to)
     {
-        vertex_list_lpush (pathTo, v);
+        vtx_path_push (pathTo, v);
         return false;
     }
 
-    list_foreach (edge, &v->dependencies, it)
+    for (uint32_t i = 0; i < graph.deps.len[v]; i++)
     {
-        cont = vtx_is_reachable_internal (it->val->to, to, seen, pathTo);
+        cont = vtx_is_reachable_internal (row[i], to, seen, pathTo);
         if (!cont)
             break;
     }
 
-    if (vertex_list_size (pathTo))
-        vertex_list_lpush (pathTo, v);
+    /* Pushed in reverse, from @to back to the start. */
+    if (pathTo->n)
+        vtx_path_push (pathTo, v);
 
     return cont;
 }
 
 /* Returns true if a vertex is reachable from another. */
-bool vtx_is_reachable (vertex_t * from, vertex_t * to, vertex_list_t * pathTo)
+bool vtx_is_reachable (vtx_t from, vtx_t to, vtx_path_t * pathTo)
 {
-    vertex_list_t seen = vertex_list_new ();
+    uint8_t * seen = calloc (graph.n, 1);
 
-    vtx_is_reachable_internal (from, to, &seen, pathTo);
-    vertex_list_destroy (&seen);
+    vtx_is_reachable_internal (from, to, seen, pathTo);
+    free (seen);
 
-    if (!vertex_list_empty (pathTo))
+    if (pathTo->n)
         return true;
     else
         return false;
@@ -169,11 +313,11 @@ bool vtx_is_reachable (vertex_t * from, vertex_t * to, vertex_list_t * pathTo)
  * If cyclic, returns 1 and does not add the edges.
  * Otherwise returns 0 and adds the edges.
  */
-int vtx_dependency_add (vertex_t * v, vertex_t * to, vertex_list_t * pathTo)
+int vtx_dependency_add (vtx_t v, vtx_t to, vtx_path_t * pathTo)
 {
     if (vtx_is_reachable (to, v, pathTo))
     {
-        S16LogPath (kS16LogError, v->path, "Cyclical dependency\n");
+        S16LogPath (kS16LogError, graph.path[v], "Cyclical dependency\n");
         return 1;
     }
     else
@@ -183,53 +327,124 @@ int vtx_dependency_add (vertex_t * v, vertex_t * to, vertex_list_t * pathTo)
     }
 }
 
-void graph_init () { graph = vertex_list_new (); }
+void graph_init () { memset (&graph, 0, sizeof (graph)); }
+
+vtx_t vtx_find_by_path (const S16Path * name)
+{
+    char * key = path_key (name);
+    vtx_index_t * ent;
+
+    HASH_FIND_STR (graph.index, key, ent);
+    free (key);
+
+    return ent ? ent->id : kVtxNone;
+}
 
-bool match_vertex_by_path (vertex_t * cand, void * path)
+/* Makes room for a vertex, returning its ID. */
+static vtx_t vtx_alloc ()
 {
-    return S16PathEqual (cand->path, (S16Path *)path);
+    vtx_t v;
+
+    if (graph.nfree)
+        return graph.free[--graph.nfree];
+
+    if (graph.n == graph.cap)
+    {
+        graph.cap = graph.cap ? graph.cap * 2 : 64;
+        graph.type = realloc (graph.type, graph.cap);
+        graph.flags = realloc (graph.flags, graph.cap);
+        graph.state = realloc (graph.state, graph.cap);
+        graph.dg_type = realloc (graph.dg_type, graph.cap);
+        graph.restart_on = realloc (graph.restart_on, graph.cap);
+        graph.path = realloc (graph.path, graph.cap * sizeof (S16Path *));
+        csr_grow (&graph.deps, graph.cap);
+        csr_grow (&graph.rdeps, graph.cap);
+    }
+
+    v = graph.n++;
+    graph.deps.off[v] = graph.deps.len[v] = graph.deps.cap[v] = 0;
+    graph.rdeps.off[v] = graph.rdeps.len[v] = graph.rdeps.cap[v] = 0;
+
+    return v;
 }
 
-vertex_t * vtx_find_by_path (const S16Path * name)
+/* Removes a vertex, which must have no edges left, and frees its ID. */
+static void vtx_free (vtx_t v)
 {
-    return list_it_val (
-        vertex_list_find (&graph, match_vertex_by_path, (void *)name));
+    vtx_index_t * ent;
+    char * key = path_key (graph.path[v]);
+
+    HASH_FIND_STR (graph.index, key, ent);
+    free (key);
+    HASH_DEL (graph.index, ent);
+    free (ent->key);
+    free (ent);
+
+    S16PathDestroy (graph.path[v]);
+    graph.path[v] = NULL;
+    graph.flags[v] = VF_FREE;
+
+    /* The rows keep their room, for whichever vertex gets the ID next. */
+    graph.free = realloc (graph.free, (graph.nfree + 1) * sizeof (vtx_t));
+    graph.free[graph.nfree++] = v;
 }
 
-vertex_t * vtx_find_or_add (S16Path * path, vertex_type_t type,
-                            S16DependencyGroupType dg_type,
-                            S16DependencyGroupRestartOnCondition restart_on)
+vtx_t vtx_find_or_add (S16Path * path, vertex_type_t type,
+                       S16DependencyGroupType dg_type,
+                       S16DependencyGroupRestartOnCondition restart_on)
 {
-    vertex_t * nv = vtx_find_by_path (path);
+    vtx_t nv = vtx_find_by_path (path);
+    vtx_index_t * ent;
 
-    if (nv)
+    if (nv != kVtxNone)
         return nv;
 
-    nv = calloc (1, sizeof (vertex_t));
-
-    nv->path = S16PathCopy (path);
+    nv = vtx_alloc ();
 
-    nv->dependencies = edge_list_new ();
-    nv->dependents = edge_list_new ();
+    graph.path[nv] = S16PathCopy (path);
 
-    nv->type = type;
-    nv->dg_type = dg_type;
-    nv->restart_on = restart_on;
+    graph.type[nv] = type;
+    graph.dg_type[nv] = dg_type;
+    graph.restart_on[nv] = restart_on;
 
-    nv->state = kS16StateUninitialised;
+    graph.state[nv] = kS16StateUninitialised;
+    graph.flags[nv] = 0;
 
-    vertex_list_add (&graph, nv);
+    ent = malloc (sizeof (*ent));
+    ent->key = path_key (path);
+    ent->id = nv;
+    HASH_ADD_KEYPTR (hh, graph.index, ent->key, strlen (ent->key), ent);
 
     return nv;
 }
 
-void vtx_setup (vertex_t * v);
+void vtx_setup (vtx_t v);
 
-int setup_dep (S16Path * path, vertex_t * vg, vertex_list_t * pathTo)
+/* Installs from the repository the service of @path, for a dependency on a
+ * service added since the graph was built. Returns the vertex for @path, or
+ * kVtxNone if there is no such service or instance. */
+static vtx_t vtx_install_path (const S16Path * path)
 {
-    vertex_t * vdep;
+    S16Path * svcp = S16PathNew (path->svc, NULL);
+    S16Service * svc = s16db_lookup_path (&hdl, svcp).s;
 
-    assert ((vdep = vtx_find_by_path (path)));
+    S16PathDestroy (svcp);
+    if (svc)
+        graph_install_service (svc);
+
+    return vtx_find_by_path (path);
+}
+
+int setup_dep (S16Path * path, vtx_t vg, vtx_path_t * pathTo)
+{
+    vtx_t vdep = vtx_find_by_path (path);
+
+    if (vdep == kVtxNone && (vdep = vtx_install_path (path)) == kVtxNone)
+    {
+        S16LogPath (
+            kS16LogError, graph.path[vg], "Dependency on unknown path\n");
+        return 0;
+    }
 
     if (vtx_dependency_add (vg, vdep, pathTo))
         return 1;
@@ -252,16 +467,16 @@ S16Path * make_depgroup_path (const S16Path * path, int cnt)
     return dgp;
 }
 
-int setup_depgroup (vertex_t * v, S16DependencyGroup * dg, S16Path * dgp,
-                    vertex_list_t * pathTo)
+int setup_depgroup (vtx_t v, S16DependencyGroup * dg, S16Path * dgp,
+                    vtx_path_t * pathTo)
 {
-    vertex_t * dgv;
+    vtx_t dgv;
 
     dgv = vtx_find_or_add (dgp, V_DEPGROUP, dg->type, dg->restart_on);
     S16PathDestroy (dgp);
     vtx_dependency_add (v, dgv, pathTo);
 
-    v->is_setup = 1;
+    vtx_set (v, VF_SETUP, true);
 
     list_foreach (path, &dg->paths, it)
     {
@@ -275,21 +490,21 @@ int setup_depgroup (vertex_t * v, S16DependencyGroup * dg, S16Path * dgp,
 
 /* Updates a vertex with fresh data from the handle. To be called after updating
  * the handle. */
-void vtx_update (vertex_t * v)
+void vtx_update (vtx_t v)
 {
     int cnt = 0;
-    // bool old_enabled = v->is_enabled;
-    vertex_list_t pathTo = vertex_list_new ();
+    // bool old_enabled = vtx_has (v, VF_ENABLED);
+    vtx_path_t pathTo = {NULL, 0, 0};
     depgroup_list_t * depgroups = NULL;
 
-    if (v->type == V_INST)
+    if (graph.type[v] == V_INST)
     {
-        S16ServiceInstance * inst = s16db_lookup_path (&hdl, v->path).i;
+        S16ServiceInstance * inst = s16db_lookup_path (&hdl, graph.path[v]).i;
         depgroups = &inst->depgroups;
     }
-    else if (v->type == V_SVC)
+    else if (graph.type[v] == V_SVC)
     {
-        S16Service * svc = s16db_lookup_path (&hdl, v->path).s;
+        S16Service * svc = s16db_lookup_path (&hdl, graph.path[v]).s;
         depgroups = &svc->depgroups;
     }
     else
@@ -300,7 +515,7 @@ void vtx_update (vertex_t * v)
     list_foreach (depgroup, depgroups, it)
     {
         int err;
-        S16Path * dgn = make_depgroup_path (v->path, cnt);
+        S16Path * dgn = make_depgroup_path (graph.path[v], cnt);
 
         cnt++;
 
@@ -309,15 +524,45 @@ void vtx_update (vertex_t * v)
             printf ("kS16LogErrorOR: Cyclical dependencies\n");
         }
     }
+
+    free (pathTo.v);
+}
+
+/* Removes a vertex's depgroups, with their edges, from the graph, so that
+ * vtx_update can set them up afresh. */
+static void vtx_clear_depgroups (vtx_t v)
+{
+    vtx_t * row = csr_row (&graph.deps, v);
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < graph.deps.len[v]; i++)
+    {
+        vtx_t dgv = row[i];
+        const vtx_t * dgrow = csr_row (&graph.deps, dgv);
+
+        if (graph.type[dgv] != V_DEPGROUP)
+        {
+            row[kept++] = dgv;
+            continue;
+        }
+
+        for (uint32_t j = 0; j < graph.deps.len[dgv]; j++)
+            csr_del (&graph.rdeps, dgrow[j], dgv);
+        graph.deps.len[dgv] = 0;
+        graph.rdeps.len[dgv] = 0;
+
+        vtx_free (dgv);
+    }
+
+    graph.deps.len[v] = kept;
 }
 
-void vtx_setup (vertex_t * v)
+void vtx_setup (vtx_t v)
 {
-    if (v->is_setup)
+    if (vtx_has (v, VF_SETUP))
         return;
 
-    v->is_setup = 1;
-    v->is_enabled = 1;
+    vtx_set (v, VF_SETUP | VF_ENABLED, true);
 
     vtx_update (v);
 }
@@ -331,25 +576,26 @@ typedef enum
     UNSATISFIABLE,
 } satisfied_t;
 
-satisfied_t vtx_satisfies (vertex_t * v, bool recurse);
-satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse);
+satisfied_t vtx_satisfies (vtx_t v, bool recurse);
+satisfied_t depgroup_is_satisfied (vtx_t v, bool recurse);
 
-bool vtx_inst_can_come_up (vertex_t * v)
+bool vtx_inst_can_come_up (vtx_t v)
 {
-    return (v->is_enabled && !v->to_offline && !v->to_disable) &&
+    return (vtx_has (v, VF_ENABLED) &&
+            !vtx_has (v, VF_TO_OFFLINE | VF_TO_DISABLE)) &&
            (depgroup_is_satisfied (v, true) == SATISFIED);
 }
 
-satisfied_t vtx_inst_satisfies (vertex_t * v, bool recurse)
+satisfied_t vtx_inst_satisfies (vtx_t v, bool recurse)
 {
-    assert (v->type == V_INST);
+    assert (graph.type[v] == V_INST);
 
     /* if not setup by now, it is not a valid instance, and needs administrative
      * intervention to correct */
-    if (!v->is_setup || !v->is_enabled)
+    if (!vtx_has (v, VF_SETUP) || !vtx_has (v, VF_ENABLED))
         return UNSATISFIABLE;
 
-    switch (v->state)
+    switch ((S16ServiceState)graph.state[v])
     {
     case kS16StateUninitialised:
         return UNSATISFIED;
@@ -368,20 +614,20 @@ satisfied_t vtx_inst_satisfies (vertex_t * v, bool recurse)
     case kS16StateDegraded:
         return SATISFIED;
     }
-    S16LogPath (kS16LogError, v->path, "Should NOT be here!\n");
+    S16LogPath (kS16LogError, graph.path[v], "Should NOT be here!\n");
     abort ();
 }
 
-satisfied_t vtx_inst_satisfies_optional (vertex_t * v, bool recurse)
+satisfied_t vtx_inst_satisfies_optional (vtx_t v, bool recurse)
 {
-    assert (v->type == V_INST);
+    assert (graph.type[v] == V_INST);
 
     /* if not setup by now, it is not a valid instance, and needs administrative
      * intervention to correct */
-    if (!v->is_setup)
+    if (!vtx_has (v, VF_SETUP))
         return SATISFIED;
 
-    switch (v->state)
+    switch ((S16ServiceState)graph.state[v])
     {
     case kS16StateUninitialised:
         return UNSATISFIED;
@@ -398,19 +644,19 @@ satisfied_t vtx_inst_satisfies_optional (vertex_t * v, bool recurse)
     case kS16StateDegraded:
         return SATISFIED;
     }
-    S16LogPath (kS16LogError, v->path, "Should NOT be here!\n");
+    S16LogPath (kS16LogError, graph.path[v], "Should NOT be here!\n");
     abort ();
 }
 
-satisfied_t vtx_inst_satisfies_exclusion (vertex_t * v)
+satisfied_t vtx_inst_satisfies_exclusion (vtx_t v)
 {
-    assert (v->type == V_INST);
+    assert (graph.type[v] == V_INST);
 
     /* If not yet setup, it's an invalid instance - satisfies exclusion. */
-    if (!v->is_setup)
+    if (!vtx_has (v, VF_SETUP))
         return SATISFIED;
 
-    switch (v->state)
+    switch ((S16ServiceState)graph.state[v])
     {
     case kS16StateUninitialised:
     case kS16StateOffline:
@@ -422,31 +668,36 @@ satisfied_t vtx_inst_satisfies_exclusion (vertex_t * v)
     case kS16StateOnline:
     case kS16StateDegraded:
         /* If we are awaiting disabling, then we may not be unsatisfiable. */
-        return v->is_enabled ? UNSATISFIABLE : UNSATISFIED;
+        return vtx_has (v, VF_ENABLED) ? UNSATISFIABLE : UNSATISFIED;
     }
-    S16LogPath (kS16LogError, v->path, "Should NOT be here!\n");
+    S16LogPath (kS16LogError, graph.path[v], "Should NOT be here!\n");
     abort ();
 }
 
-satisfied_t vtx_satisfies (vertex_t * v, bool recurse)
+satisfied_t vtx_satisfies (vtx_t v, bool recurse)
 {
-    if (v->type == V_INST)
+    if (graph.type[v] == V_INST)
         return vtx_inst_satisfies (v, recurse);
     else
         return depgroup_is_satisfied (v, recurse);
 }
 
-satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
+satisfied_t depgroup_is_satisfied (vtx_t v, bool recurse)
 {
-    switch (v->dg_type)
+    /* Working out satisfiability never changes the graph, so the row stays
+     * where it is. */
+    const vtx_t * row = csr_row (&graph.deps, v);
+    uint32_t n = graph.deps.len[v];
+
+    switch ((S16DependencyGroupType)graph.dg_type[v])
     {
     case kS16RequireAll:
     {
         satisfied_t sat = SATISFIED;
 
-        list_foreach (edge, &v->dependencies, it)
+        for (uint32_t i = 0; i < n; i++)
         {
-            satisfied_t esat = vtx_satisfies (it->val->to, recurse);
+            satisfied_t esat = vtx_satisfies (row[i], recurse);
             if (esat != SATISFIED)
                 sat = (sat == UNSATISFIABLE) ? UNSATISFIABLE : esat;
         }
@@ -458,12 +709,12 @@ satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
     {
         bool sat = UNSATISFIABLE;
 
-        if (edge_list_empty (&v->dependencies))
+        if (!n)
             return SATISFIED;
 
-        list_foreach (edge, &v->dependencies, it)
+        for (uint32_t i = 0; i < n; i++)
         {
-            satisfied_t esat = vtx_satisfies (it->val->to, recurse);
+            satisfied_t esat = vtx_satisfies (row[i], recurse);
             if (esat == SATISFIED)
                 return SATISFIED;
             if (esat == UNSATISFIED)
@@ -477,25 +728,26 @@ satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
     {
         satisfied_t sat = SATISFIED;
 
-        list_foreach (edge, &v->dependencies, it)
+        for (uint32_t i = 0; i < n; i++)
         {
             satisfied_t esat;
-            vertex_t * dv = it->val->to;
+            vtx_t dv = row[i];
 
-            assert (dv->type != V_DEPGROUP);
+            assert (graph.type[dv] != V_DEPGROUP);
 
-            if (dv->type == V_INST)
+            if (graph.type[dv] == V_INST)
             {
                 esat = vtx_inst_satisfies_optional (dv, recurse);
                 if (esat != SATISFIED)
                     sat = (sat == UNSATISFIABLE) ? UNSATISFIABLE : esat;
             }
-            if (dv->type == V_SVC)
+            if (graph.type[dv] == V_SVC)
             {
-                list_foreach (edge, &dv->dependencies, iit)
+                const vtx_t * irow = csr_row (&graph.deps, dv);
+
+                for (uint32_t j = 0; j < graph.deps.len[dv]; j++)
                 {
-                    vertex_t * ddv = iit->val->to;
-                    esat = vtx_inst_satisfies_optional (ddv, recurse);
+                    esat = vtx_inst_satisfies_optional (irow[j], recurse);
                     if (esat != SATISFIED)
                         sat = (sat == UNSATISFIABLE) ? UNSATISFIABLE : esat;
                 }
@@ -503,7 +755,7 @@ satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
         }
 
         S16LogPath (kS16LogInfo,
-                    v->path,
+                    graph.path[v],
                     "Optional_all: %s\n",
                     sat == SATISFIED ? "Satisfied" : "Not satisfied");
 
@@ -514,22 +766,22 @@ satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
     {
         satisfied_t sat = SATISFIED;
 
-        list_foreach (edge, &v->dependencies, it)
+        for (uint32_t i = 0; i < n; i++)
         {
             satisfied_t esat;
-            vertex_t * dv = it->val->to;
+            vtx_t dv = row[i];
 
-            assert (dv->type != V_DEPGROUP);
+            assert (graph.type[dv] != V_DEPGROUP);
 
-            if (dv->type == V_INST)
+            if (graph.type[dv] == V_INST)
             {
                 esat = vtx_inst_satisfies_exclusion (dv);
                 if (esat != SATISFIED)
                     sat = (sat == UNSATISFIABLE) ? UNSATISFIABLE : esat;
             }
-            if (dv->type == V_SVC)
+            if (graph.type[dv] == V_SVC)
             {
-                list_foreach (edge, &dv->dependencies, iit)
+                for (uint32_t j = 0; j < graph.deps.len[dv]; j++)
                 {
                     esat = vtx_inst_satisfies_exclusion (dv);
                     if (esat != SATISFIED)
@@ -541,59 +793,60 @@ satisfied_t depgroup_is_satisfied (vertex_t * v, bool recurse)
         return sat;
     }
     }
-    S16LogPath (kS16LogInfo, v->path, "Should NOT be here!\n");
+    S16LogPath (kS16LogInfo, graph.path[v], "Should NOT be here!\n");
     abort ();
 }
 
-vertex_t * install_inst (vertex_t * vsv, S16ServiceInstance * inst)
+vtx_t install_inst (vtx_t vsv, S16ServiceInstance * inst)
 {
-    vertex_t * in =
+    vtx_t in =
         vtx_find_or_add (inst->path, V_INST, kS16RequireAll, kS16RestartOnAny);
 
     return in;
 }
 
-vertex_t * graph_install_service (S16Service * svc)
+vtx_t graph_install_service (S16Service * svc)
 {
-    vertex_t * sv =
+    vtx_t sv =
         vtx_find_or_add (svc->path, V_SVC, kS16RequireAll, kS16RestartOnAny);
 
-    if (sv->is_setup)
+    if (vtx_has (sv, VF_SETUP))
         return sv;
     else
     {
         for (inst_list_it it = list_begin (&svc->insts); it != NULL;
              it = inst_list_it_next (it))
         {
-            vertex_t * iv = install_inst (sv, it->val);
+            vtx_t iv = install_inst (sv, it->val);
             vtx_edge_add (sv, iv);
         }
     }
 
-    sv->is_setup = 1;
+    vtx_set (sv, VF_SETUP, true);
 
     return sv;
 }
 
 void graph_setup_all ()
 {
-    s16note_t * note;
-
     /* This stuff needs to be moved to a test */
 
-#define processNotes()                                                         \
-    while ((note = s16note_list_lpop (&notes)))                                \
-    graph_process_note (note)
+#define processNotes() graph_process_notes ()
 
-    list_foreach (vertex, &graph, it) vtx_setup (it->val);
+    /* Setting up vertices adds more, which are set up in turn. */
+    for (vtx_t v = 0; v < graph.n; v++)
+        if (!vtx_has (v, VF_FREE))
+            vtx_setup (v);
     // print_all ();
-    list_foreach (vertex, &graph, it) if (it->val->type == V_INST &&
-                                          vtx_inst_can_come_up (it->val))
-    {
-        /* send 'go online' */
-        s16note_list_add (
-            &notes, s16note_new (N_STATE_CHANGE, SC_OFFLINE, it->val->path, 0));
-    }
+    for (vtx_t v = 0; v < graph.n; v++)
+        if (graph.type[v] == V_INST && !vtx_has (v, VF_FREE) &&
+            vtx_inst_can_come_up (v))
+        {
+            /* send 'go online' */
+            s16note_list_add (
+                &notes,
+                s16note_new (N_STATE_CHANGE, SC_OFFLINE, graph.path[v], 0));
+        }
     processNotes ();
 
     // print_all ();
@@ -625,10 +878,10 @@ void graph_setup_all ()
     print_all ();
 }
 
-void vtx_notify_start (vertex_t * v, void * vreason)
+void vtx_notify_start (vtx_t v, void * vreason)
 {
     int reason = (int)(intptr_t)vreason;
-    switch (v->type)
+    switch (graph.type[v])
     {
     case V_INST:
         if (vtx_inst_can_come_up (v))
@@ -636,22 +889,24 @@ void vtx_notify_start (vertex_t * v, void * vreason)
             if (vtx_is_running (v))
             {
                 /* if restarton > on_error, then restart... */
-                S16LogPath (
-                    kS16LogDebug, v->path, "Not bringing up as already up.\n");
+                S16LogPath (kS16LogDebug,
+                            graph.path[v],
+                            "Not bringing up as already up.\n");
                 if (reason > kS16RestartOnError)
                 {
-                    S16LogPath (
-                        kS16LogDebug, v->path, "Sending reset command?\n");
+                    S16LogPath (kS16LogDebug,
+                                graph.path[v],
+                                "Sending reset command?\n");
                 }
             }
             else
             {
                 S16LogPath (kS16LogInfo,
-                            v->path,
+                            graph.path[v],
                             "Bringing up because dependency went up\n");
                 s16note_list_add (
                     &notes,
-                    s16note_new (N_STATE_CHANGE, SC_ONLINE, v->path, 0));
+                    s16note_new (N_STATE_CHANGE, SC_ONLINE, graph.path[v], 0));
             }
         }
         break;
@@ -659,14 +914,14 @@ void vtx_notify_start (vertex_t * v, void * vreason)
     case V_DEPGROUP:
     case V_SVC:
         vtx_dependents_do (
-            v, vtx_notify_start, (void *)(intptr_t)v->restart_on);
+            v, vtx_notify_start, (void *)(intptr_t)graph.restart_on[v]);
     }
 }
 
-void vtx_notify_stop (vertex_t * v, void * vreason)
+void vtx_notify_stop (vtx_t v, void * vreason)
 {
     S16DependencyGroupRestartOnCondition reason = (intptr_t)vreason;
-    switch (v->type)
+    switch (graph.type[v])
     {
     case V_INST:
         /* Note: We won't have had this propagated to us unless one of our
@@ -674,35 +929,37 @@ void vtx_notify_stop (vertex_t * v, void * vreason)
         if (!vtx_is_running (v))
         {
             /* if restarton > on_error, then restart... */
-            S16LogPath (
-                kS16LogDebug, v->path, "Not bringing down as already down.\n");
+            S16LogPath (kS16LogDebug,
+                        graph.path[v],
+                        "Not bringing down as already down.\n");
         }
         else
         {
             S16LogPath (kS16LogDebug,
-                        v->path,
+                        graph.path[v],
                         "Bringing down in response to dependency down.\n");
 
             s16note_list_add (
                 &notes,
-                s16note_new (N_STATE_CHANGE, SC_OFFLINE, v->path, reason));
+                s16note_new (
+                    N_STATE_CHANGE, SC_OFFLINE, graph.path[v], reason));
         }
         break;
 
     case V_DEPGROUP:
         /* don't propagate stops to exclude-all groups */
-        if (v->dg_type == kS16ExcludeAll)
+        if (graph.dg_type[v] == kS16ExcludeAll)
             break;
 
         /* if we only restart on, for example, kS16RestartOnError (1), and
          * reason is only kS16RestartOnRestart (2), then we don't need to
          * propagate it. */
         S16LogPath (kS16LogInfo,
-                    v->path,
+                    graph.path[v],
                     "v->Restart_on: %d < Restart: %d?\n",
-                    v->restart_on,
+                    graph.restart_on[v],
                     reason);
-        if (v->restart_on < reason)
+        if (graph.restart_on[v] < reason)
             break;
 
         /* otherwise FALLTHROUGH */
@@ -711,9 +968,9 @@ void vtx_notify_stop (vertex_t * v, void * vreason)
     }
 }
 
-void vtx_notify_misc (vertex_t * v, void * reason)
+void vtx_notify_misc (vtx_t v, void * reason)
 {
-    if (v->type == V_INST)
+    if (graph.type[v] == V_INST)
     {
         if (vtx_inst_can_come_up (v) && !vtx_is_running (v))
             vtx_online (v, reason);
@@ -721,55 +978,57 @@ void vtx_notify_misc (vertex_t * v, void * reason)
     vtx_dependents_do (v, vtx_notify_misc, reason);
 }
 
-void vtx_notify_admin_disable (vertex_t * v, void * reason)
+void vtx_notify_admin_disable (vtx_t v, void * reason)
 {
-    switch (v->type)
+    switch (graph.type[v])
     {
     case V_INST:
-        if (v->state != kS16StateOnline && v->state != kS16StateDegraded)
-            S16LogPath (
-                kS16LogDebug, v->path, "Not bringing down as already down.\n");
-        v->to_offline = true;
+        if (!vtx_is_running (v))
+            S16LogPath (kS16LogDebug,
+                        graph.path[v],
+                        "Not bringing down as already down.\n");
+        vtx_set (v, VF_TO_OFFLINE, true);
         vtx_dependents_do (v, vtx_notify_admin_disable, reason);
         break;
 
     case V_DEPGROUP:
         /* If a vertex is an kS16ExcludeAll one, we don't mark it. Neither if
          * the restart_on mode is kS16RestartOnNone or kS16RestartOnError. */
-        if (v->dg_type == kS16ExcludeAll ||
-            (v->restart_on == kS16RestartOnNone ||
-             v->restart_on == kS16RestartOnError))
+        if (graph.dg_type[v] == kS16ExcludeAll ||
+            (graph.restart_on[v] == kS16RestartOnNone ||
+             graph.restart_on[v] == kS16RestartOnError))
             return;
     case V_SVC:
         vtx_dependents_do (v, vtx_notify_admin_disable, reason);
     }
 }
 
-bool vtx_can_go_down (vertex_t * v, bool root)
+bool vtx_can_go_down (vtx_t v, bool root)
 {
-    list_foreach (edge, &v->dependents, it)
+    const vtx_t * row = csr_row (&graph.rdeps, v);
+
+    for (uint32_t i = 0; i < graph.rdeps.len[v]; i++)
     {
         /* check for to_offline; if we didn't apply it, we don't want to go
          * down.*/
-        if (it->val->to->type == V_INST && !it->val->to->to_offline)
+        if (graph.type[row[i]] == V_INST && !vtx_has (row[i], VF_TO_OFFLINE))
             continue;
-        else if (!vtx_can_go_down (it->val->to, false))
+        else if (!vtx_can_go_down (row[i], false))
             return false;
     }
     /* If not root (i.e. we have been invoked by others) we object. */
-    if (v->type == V_INST &&
-        (v->state == kS16StateOnline || v->state == kS16StateDegraded) && !root)
+    if (graph.type[v] == V_INST && vtx_is_running (v) && !root)
         return false;
 
     return true;
 }
 
-void vtx_offline_if_possible (vertex_t * v, void * reason)
+void vtx_offline_if_possible (vtx_t v, void * reason)
 {
-    if (!v->to_offline)
+    if (!vtx_has (v, VF_TO_OFFLINE))
         return;
 
-    if (v->type == V_INST)
+    if (graph.type[v] == V_INST)
     {
         if (vtx_can_go_down (v, true))
             vtx_offline (v, reason);
@@ -778,12 +1037,12 @@ void vtx_offline_if_possible (vertex_t * v, void * reason)
 
 /* called after an inst goes offline; offline its dependencies if they are due
  * to go offline. */
-void vtx_offline_dependency (vertex_t * v, void * reason)
+void vtx_offline_dependency (vtx_t v, void * reason)
 {
-    if (v->type == V_INST && !v->to_offline)
+    if (graph.type[v] == V_INST && !vtx_has (v, VF_TO_OFFLINE))
         return;
 
-    if (v->type == V_INST)
+    if (graph.type[v] == V_INST)
     {
         if (vtx_can_go_down (v, true))
             vtx_offline (v, reason);
@@ -794,17 +1053,17 @@ void vtx_offline_dependency (vertex_t * v, void * reason)
     }
 }
 
-void vtx_process_admin_req (vertex_t * v, s16note_admin_type_t type, int reason)
+void vtx_process_admin_req (vtx_t v, s16note_admin_type_t type, int reason)
 {
     switch (type)
     {
     case A_DISABLE:
-        v->to_disable = true;
-        v->to_offline = true;
-        v->is_enabled = false;
+        vtx_set (v, VF_TO_DISABLE, true);
+        vtx_set (v, VF_TO_OFFLINE, true);
+        vtx_set (v, VF_ENABLED, false);
 
         S16LogPath (kS16LogInfo,
-                    v->path,
+                    graph.path[v],
                     "Received administrative request to disable. Shutting "
                     "down any dependencies first.\n");
 
@@ -812,22 +1071,23 @@ void vtx_process_admin_req (vertex_t * v, s16note_admin_type_t type, int reason)
             v, vtx_notify_admin_disable, (void *)(intptr_t)reason);
         if (vtx_can_go_down (v, true))
             S16LogPath (kS16LogInfo,
-                        v->path,
+                        graph.path[v],
                         "No subnodes to deal with; can disable directly.\n");
-        list_foreach (vertex, &graph, it)
+        for (vtx_t it = 0; it < graph.n; it++)
         {
-            vtx_offline_if_possible (it->val,
-                                     (void *)(intptr_t)kS16RestartOnRestart);
+            if (!vtx_has (it, VF_FREE))
+                vtx_offline_if_possible (
+                    it, (void *)(intptr_t)kS16RestartOnRestart);
         }
         break;
 
     case A_ENABLE:
-        v->to_disable = false;
-        v->to_offline = false;
-        v->is_enabled = true;
+        vtx_set (v, VF_TO_DISABLE, false);
+        vtx_set (v, VF_TO_OFFLINE, false);
+        vtx_set (v, VF_ENABLED, true);
 
         S16LogPath (kS16LogInfo,
-                    v->path,
+                    graph.path[v],
                     "Received administrative request to enable.\n");
 
         vtx_enable (v);
@@ -837,27 +1097,27 @@ void vtx_process_admin_req (vertex_t * v, s16note_admin_type_t type, int reason)
     }
 }
 
-void vtx_process_state_change (vertex_t * v, s16note_sc_type_t type, int reason)
+void vtx_process_state_change (vtx_t v, s16note_sc_type_t type, int reason)
 {
-    bool to_offline = v->to_offline;
+    bool to_offline = vtx_has (v, VF_TO_OFFLINE);
 
     switch (type)
     {
     case SC_ONLINE:
-        S16LogPath (kS16LogInfo, v->path, "-> Online.\n");
-        v->state = kS16StateOnline;
+        S16LogPath (kS16LogInfo, graph.path[v], "-> Online.\n");
+        graph.state[v] = kS16StateOnline;
         vtx_dependents_do (v, vtx_notify_start, (void *)(intptr_t)reason);
         break;
 
     case SC_OFFLINE:
-        S16LogPath (kS16LogInfo, v->path, "-> Offline.\n");
-        v->state = kS16StateOffline;
-        v->to_offline = false;
+        S16LogPath (kS16LogInfo, graph.path[v], "-> Offline.\n");
+        graph.state[v] = kS16StateOffline;
+        vtx_set (v, VF_TO_OFFLINE, false);
         if (to_offline)
         {
             vtx_dependencies_do (
                 v, vtx_offline_dependency, (void *)(intptr_t)reason);
-            if (v->to_disable)
+            if (vtx_has (v, VF_TO_DISABLE))
                 vtx_disable (v, (void *)(intptr_t)reason);
         }
         else if (vtx_inst_can_come_up (v))
@@ -868,10 +1128,10 @@ void vtx_process_state_change (vertex_t * v, s16note_sc_type_t type, int reason)
         break;
 
     case SC_DISABLED:
-        S16LogPath (kS16LogInfo, v->path, "-> Disabled.\n");
-        v->to_offline = false;
-        v->to_disable = false;
-        v->state = kS16StateDisabled;
+        S16LogPath (kS16LogInfo, graph.path[v], "-> Disabled.\n");
+        vtx_set (v, VF_TO_OFFLINE, false);
+        vtx_set (v, VF_TO_DISABLE, false);
+        graph.state[v] = kS16StateDisabled;
 
         vtx_dependents_do (v, vtx_notify_misc, (void *)(intptr_t)reason);
 
@@ -882,46 +1142,167 @@ void vtx_process_state_change (vertex_t * v, s16note_sc_type_t type, int reason)
     }
 }
 
+/* Installs the vertex for a service or instance added to the repository, or
+ * sets afresh that of one removed and added again. */
+static void vtx_process_added (S16Path * path)
+{
+    S16Path * svcp = S16PathNew (path->svc, NULL);
+    vtx_t sv = vtx_find_by_path (svcp);
+    s16db_lookup_result_t lu = s16db_lookup_path (&hdl, path);
+    vtx_t v;
+
+    S16PathDestroy (svcp);
+
+    /* For either type, as the service and instance share the union. */
+    if (!lu.s)
+        return;
+    else if (lu.type == SVC)
+    {
+        v = graph_install_service (lu.s);
+        for (uint32_t i = 0; i < graph.deps.len[v]; i++)
+            vtx_setup (vtx_dep (v, i));
+    }
+    else if (sv == kVtxNone)
+    {
+        /* Its service is new too; installing that installs the instance. */
+        if ((v = vtx_install_path (path)) == kVtxNone)
+            return;
+    }
+    else if ((v = vtx_find_by_path (path)) == kVtxNone)
+    {
+        v = install_inst (sv, lu.i);
+        vtx_edge_add (sv, v);
+    }
+
+    vtx_clear_depgroups (v);
+    vtx_set (v, VF_SETUP, true);
+    vtx_set (v, VF_ENABLED, lu.type == SVC || lu.i->enabled);
+    vtx_update (v);
+}
+
+/*
+ * Reconfigures the graph for an N_CONFIG note. Only a change to the
+ * depgroups of a vertex alters the graph, and then only that vertex's
+ * depgroups are rebuilt. Properties and methods are the restarters' concern,
+ * and enabling is dealt with on the administrative request that goes with it.
+ */
+void vtx_process_config (S16Path * path, s16note_config_type_t type,
+                         const s16note_config_diff_t * diff)
+{
+    vtx_t v = vtx_find_by_path (path);
+
+    /* The changes to the repository follow the notes about them, so the
+     * handle may not have them yet. */
+    s16db_refresh (&hdl);
+
+    switch (type)
+    {
+    case CF_ADDED:
+        S16LogPath (kS16LogInfo, path, "Added to the repository.\n");
+        vtx_process_added (path);
+        break;
+
+    case CF_CHANGED:
+        if (v == kVtxNone)
+            vtx_process_added (path);
+        else if (!diff || diff->depgroups.n)
+        {
+            S16LogPath (kS16LogInfo, path, "Dependencies changed.\n");
+            vtx_clear_depgroups (v);
+            vtx_update (v);
+        }
+        break;
+
+    case CF_REMOVED:
+        if (v == kVtxNone)
+            break;
+        /* Dependents may refer to it still, so the vertex stays, disabled
+         * and depending on nothing. */
+        S16LogPath (kS16LogInfo, path, "Removed from the repository.\n");
+        vtx_clear_depgroups (v);
+        vtx_set (v, VF_ENABLED, false);
+        break;
+
+    default:
+        S16Log (kS16LogError, "Config change type not handled.\n");
+    }
+}
+
 void graph_process_note (s16note_t * note)
 {
-    vertex_t * v = vtx_find_by_path (note->path);
-    if (note->note_type == N_ADMIN_REQ)
+    vtx_t v = vtx_find_by_path (note->path);
+
+    if ((note->note_type == N_ADMIN_REQ ||
+         note->note_type == N_STATE_CHANGE) &&
+        v == kVtxNone)
+        S16LogPath (kS16LogError, note->path, "Note for unknown vertex.\n");
+    else if (note->note_type == N_ADMIN_REQ)
         vtx_process_admin_req (v, note->type, note->reason);
     else if (note->note_type == N_STATE_CHANGE)
-        vtx_process_state_change (
-            vtx_find_by_path (note->path), note->type, note->reason);
+        vtx_process_state_change (v, note->type, note->reason);
+    else if (note->note_type == N_CONFIG)
+        vtx_process_config (note->path, note->type, note->diff);
     else
         S16Log (kS16LogError, "Note type not handled.\n");
+
+    s16note_destroy (note);
+}
+
+size_t graph_process_notes ()
+{
+    size_t elided = 0;
+
+    /* Processing a note may queue more. Each generation of the cascade is
+     * coalesced and drained in turn; as the queue is FIFO, this is the order
+     * in which they would have been processed anyway. */
+    while (list_begin (&notes))
+    {
+        s16note_list_t batch = notes;
+        s16note_t * note;
+
+        notes = s16note_list_new ();
+        elided += s16note_list_coalesce (&batch);
+
+        while ((note = s16note_list_lpop (&batch)))
+            graph_process_note (note);
+    }
+
+    return elided;
 }
 
 #define TypeStr(x)                                                             \
-    x->type == V_SVC ? "Svc" : x->type == V_INST ? "Inst" : "DGroup"
+    graph.type[x] == V_SVC ? "Svc" : graph.type[x] == V_INST ? "Inst" : "DGroup"
 
 /* Sorry that this is so bad. I'll do it properly sometime soon. */
 void print_all ()
 {
     char * buf = calloc (16800, 1);
-    list_foreach (vertex, &graph, it)
+    for (vtx_t v = 0; v < graph.n; v++)
     {
         char lbuf[256];
-        if (it->val->type == V_SVC)
+        const vtx_t * row = csr_row (&graph.rdeps, v);
+
+        if (vtx_has (v, VF_FREE))
+            continue;
+
+        if (graph.type[v] == V_SVC)
             sprintf (lbuf,
                      "\"%s\" [shape=cylinder] %s\n",
-                     S16PathToString (it->val->path),
-                     depgroup_is_satisfied (it->val, false)
+                     PS (v),
+                     depgroup_is_satisfied (v, false)
                          ? "[style=filled, fillcolor=green]"
                          : "");
-        else if (it->val->type == V_INST)
+        else if (graph.type[v] == V_INST)
             sprintf (lbuf,
                      "\"%s\" [shape=component] %s\n",
-                     S16PathToString (it->val->path),
-                     it->val->state == kS16StateOnline
+                     PS (v),
+                     graph.state[v] == kS16StateOnline
                          ? "[style=filled, fillcolor=green]"
                          : "");
-        else if (it->val->type == V_DEPGROUP)
+        else if (graph.type[v] == V_DEPGROUP)
         {
             const char * dgts;
-            switch (it->val->dg_type)
+            switch ((S16DependencyGroupType)graph.dg_type[v])
             {
             case kS16RequireAll:
                 dgts = "require-all";
@@ -938,24 +1319,22 @@ void print_all ()
             }
             sprintf (lbuf,
                      "\"%s\" [shape=note, label=\"%s\\n%s\"]\n",
-                     S16PathToString (it->val->path),
-                     S16PathToString (it->val->path),
+                     PS (v),
+                     PS (v),
                      dgts);
         }
 
         strcat (buf, lbuf);
 
-        for (edge_list_it ite = list_begin (&((it->val)->dependents));
-             ite != NULL;
-             ite = list_next (ite))
+        for (uint32_t i = 0; i < graph.rdeps.len[v]; i++)
         {
             char lbuf[256];
             sprintf (lbuf,
                      "\"%s\" -> \"%s\" [label=\"depends on\"];\n",
-                     S16PathToString (ite->val->to->path),
-                     S16PathToString (ite->val->from->path));
+                     PS (row[i]),
+                     PS (v));
             strcat (buf, lbuf);
         }
     }
     printf ("digraph {\n%s}\n", buf);
-}
\ No newline at end of file
+}
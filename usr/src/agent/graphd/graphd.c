@@ -44,6 +44,7 @@ int main (int argc, char * argv[])
 {
     kq = kqueue ();
     struct timespec tmout = {3, 0};
+    size_t notes_elided = 0;
 
     S16LogInit ("S16 Graphing Service");
 
@@ -51,7 +52,11 @@ int main (int argc, char * argv[])
         perror ("KQueue: Failed to open\n");
 
     notes = s16note_list_new ();
-    if (s16db_hdl_new (&hdl))
+    /* The graph is built from dependencies; methods and properties are
+     * never needed. */
+    if (s16db_hdl_new_with_projection (&hdl,
+                                       S16DB_PROJ_STATE | S16DB_PROJ_ENABLED |
+                                           S16DB_PROJ_DEPGROUPS))
         perror ("Failed to connect to repository");
 
     graph_init ();
@@ -65,11 +70,14 @@ int main (int argc, char * argv[])
 
     s16db_subscribe (
         &hdl, kq, N_ADMIN_REQ | N_RESTARTER_REQ | N_STATE_CHANGE | N_CONFIG);
+    /* Keep the cached repository current, so lookups never see stale data. */
+    s16db_subscribe_changes (&hdl, kq);
 
     while (1)
     {
         s16note_t * note = NULL;
         struct kevent ev;
+        size_t elided;
 
         memset (&ev, 0x00, sizeof (struct kevent));
 
@@ -81,12 +89,21 @@ int main (int argc, char * argv[])
 
         s16db_investigate_kevent (&hdl, &ev);
 
+        elided = s16db_coalesce_notes (&hdl);
         while ((note = s16db_get_note (&hdl)))
             graph_process_note (note);
 
         /* for testing purposes, internal note queue */
-        while ((note = s16note_list_lpop (&notes)))
-            graph_process_note (note);
+        elided += graph_process_notes ();
+
+        if (elided)
+        {
+            notes_elided += elided;
+            S16Log (kS16LogDebug,
+                    "Coalesced away %zu notes (%zu in all).\n",
+                    elided,
+                    notes_elided);
+        }
     }
 
     close (kq);
@@ -26,6 +26,8 @@
 #ifndef GRAPHD_H_
 #define GRAPHD_H_
 
+#include <stdint.h>
+
 #include "S16/Repository.h"
 
 /* Vertex type */
@@ -36,59 +38,91 @@ typedef enum
     V_DEPGROUP
 } vertex_type_t;
 
-typedef struct vertex_s vertex_t;
-typedef struct edge_s edge_t;
+/* A vertex is identified by a dense integer ID, which indexes each of the
+ * arrays of the graph. IDs of vertices removed are reused. */
+typedef uint32_t vtx_t;
+
+#define kVtxNone UINT32_MAX
 
-S16ListType (vertex, vertex_t *);
-S16ListType (edge, edge_t *);
+/* Vertex flags */
+/* Has this vertex been set up with its dependencies? */
+#define VF_SETUP 0x01
+/* Is this vertex enabled? */
+#define VF_ENABLED 0x02
+/* Is this vertex to go offline? */
+#define VF_TO_OFFLINE 0x04
+/* Is this vertex to be disabled? */
+#define VF_TO_DISABLE 0x08
+/* Is this ID free, its vertex having been removed? */
+#define VF_FREE 0x10
 
-/* Vertex */
-struct vertex_s
+/*
+ * Adjacency in compressed-sparse-row form: the edges of vertex v are the IDs
+ * adj[off[v]] to adj[off[v] + len[v] - 1]. Each row has room for cap[v]
+ * edges, so that an edge may mostly be added in place; a row outgrowing its
+ * room is moved to the end of adj, and adj is compacted once the room so
+ * abandoned (waste) exceeds half of it.
+ */
+typedef struct
 {
-    S16Path * path;
+    uint32_t *off, *len, *cap;
+    vtx_t * adj;
+    size_t nadj, adjcap, waste;
+} csr_t;
+
+typedef struct vtx_index_s vtx_index_t;
 
-    /* Type of vertex */
-    vertex_type_t type;
+/*
+ * The graph, as a structure of arrays indexed by vertex ID. The fields
+ * consulted as notes propagate and as satisfiability is worked out lie each
+ * in an array of its own, so that these loops scan contiguous memory; the
+ * paths, wanted only to find a vertex or to name one, lie apart.
+ */
+typedef struct
+{
+    /* IDs in use (or free) are 0 to n - 1; the arrays have room for cap. */
+    size_t n, cap;
 
-    /* Dependency grouping type.
+    /* vertex_type_t */
+    uint8_t * type;
+    /* VF_* */
+    uint8_t * flags;
+    /* S16ServiceState */
+    uint8_t * state;
+    /* S16DependencyGroupType.
      * kS16RequireAll for instances (they need all their depgroups up.)
      * kS16RequireAny for services (they need at least one instance up - for
      * now.)
      */
-    S16DependencyGroupType dg_type;
-    /* Restart-on type. */
-    S16DependencyGroupRestartOnCondition restart_on;
-
-    edge_list_t dependencies;
-    edge_list_t dependents;
-
-    /* State of vertex */
-    S16ServiceState state;
-
-    /* Has this vertex been set up with its dependencies? */
-    bool is_setup : 1;
-    /* Is this vertex enabled? */
-    bool is_enabled : 1;
-    /* Is this vertex to go offline? */
-    bool to_offline : 1;
-    /* Is this vertex to be disabled? */
-    bool to_disable : 1;
-};
-
-struct edge_s
-{
-    vertex_t *from, *to;
-};
+    uint8_t * dg_type;
+    /* S16DependencyGroupRestartOnCondition */
+    uint8_t * restart_on;
+
+    S16Path ** path;
+    /* Finds a vertex by path. */
+    vtx_index_t * index;
+
+    /* What each vertex depends on, and what depends on it. */
+    csr_t deps, rdeps;
+
+    /* IDs free for reuse. */
+    vtx_t * free;
+    size_t nfree;
+} graph_t;
 
 /* Initialises the graph engine. */
 void graph_init ();
 /* Adds a new service to the graph. */
-vertex_t * graph_install_service (S16Service * svc);
+vtx_t graph_install_service (S16Service * svc);
 /* Sets up all vertices */
 void graph_setup_all ();
 /* Processes incoming notes. */
 void graph_process_note (s16note_t * note);
+/* Processes the internal note queue until it is empty. Returns the number of
+ * notes elided by coalescing. */
+size_t graph_process_notes ();
 
+extern graph_t graph;
 extern s16db_hdl_t hdl;
 /* Notifications received */
 extern s16note_list_t notes;
@@ -63,8 +63,9 @@ void sd_notify_srv_cleanup ();
 /* Check a KEvent received. */
 void sd_notify_srv_investigate_kevent (struct kevent * ev);
 
-/* Clean up everything after having forked. */
-void manager_fork_cleanup ();
+/* Clean up everything after having forked, but for the first @keep
+ * descriptors passed by the LISTEN_FDS protocol. */
+void manager_fork_cleanup (int keep);
 
 /* To be called when the service repository comes up. */
 void manager_configd_came_up ();
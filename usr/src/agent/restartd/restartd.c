@@ -78,7 +78,7 @@ struct option options[] = {{"system", no_argument, NULL, 'r'},
 
 void clean_exit () { sd_notify_srv_cleanup (); }
 
-void manager_fork_cleanup ()
+void manager_fork_cleanup (int keep)
 {
     /* In principle, we don't need to do this. Everything of ours is CLOEXEC and
      * we *should* be able to close the Kernel Queue and accordingly have all
@@ -87,10 +87,99 @@ void manager_fork_cleanup ()
      * as CLOEXEC, and what's worse, explicitly using EV_DELETE on our
      * EVFILT_SIGNAL handlers stops us, the parent, from receiving EVFILT_SIGNAL
      * events, but leaves the signalfds open! Something is rotten. */
-    for (int fd = 3; fd < 256; fd++)
+    for (int fd = S16_LISTEN_FDS_START + keep; fd < 256; fd++)
         close (fd);
 }
 
+/* Creates the repository's listening socket, to be passed to configd. Clients
+ * can then connect as soon as it is started, rather than once it is ready;
+ * their calls wait in the socket until configd is ready to serve them. The
+ * socket outlives configd, should it be restarted. Returns -1 on failure. */
+static int configd_listen ()
+{
+    struct sockaddr_un sun;
+    int s;
+
+    if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror ("Failed to create repository socket");
+        return -1;
+    }
+
+    S16CloseOnExec (s);
+
+    memset (&sun, 0, sizeof (struct sockaddr_un));
+    sun.sun_family = AF_UNIX;
+    strncpy (sun.sun_path, S16DB_CONFIGD_SOCKET_PATH, sizeof (sun.sun_path));
+
+    /* Whatever is there, nothing is listening on it. */
+    unlink (S16DB_CONFIGD_SOCKET_PATH);
+
+    if (bind (s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == -1 ||
+        listen (s, SOMAXCONN) == -1)
+    {
+        perror ("Failed to bind repository socket");
+        close (s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Subscribes to changes to the configuration of services, so that units can
+ * be reconfigured as they change. Only the diffs are wanted: units are added
+ * on request, not as services are. */
+static void subscribe_config ()
+{
+    s16db_note_filter_t filter = {.types = 1 << CF_CHANGED};
+
+    s16db_subscribe_filtered (&manager.h, manager.kq, N_CONFIG, &filter);
+}
+
+static bool unit_concerned (Unit * unit, const S16Path * path)
+{
+    return !strcmp (unit->path->svc, path->svc) &&
+           (!path->inst ||
+            (unit->path->inst && !strcmp (unit->path->inst, path->inst)));
+}
+
+/* Reconfigures the units whose methods or properties changed. An instance
+ * inherits from its service, so a change to a service concerns each of its
+ * instances' units. */
+static void process_config_notes ()
+{
+    s16note_t * note;
+    bool refreshed = false;
+
+    s16db_coalesce_notes (&manager.h);
+
+    while ((note = s16db_get_note (&manager.h)))
+    {
+        const s16note_config_diff_t * diff = note->diff;
+
+        if (note->note_type != N_CONFIG || note->type != CF_CHANGED ||
+            (diff && !diff->props.n && !diff->meths.n))
+        {
+            s16note_destroy (note);
+            continue;
+        }
+
+        /* The note is news before the repository's changes reach us. */
+        if (!refreshed)
+            refreshed = !s16db_refresh (&manager.h);
+
+        LL_each (&manager.units, it)
+        {
+            if (!unit_concerned (it->val, note->path))
+                continue;
+            S16LogPath (kS16LogInfo, it->val->path, "Reconfiguring.\n");
+            unit_setup (it->val);
+        }
+
+        s16note_destroy (note);
+    }
+}
+
 /* TODO: Evaluate if this is still useful now we have the notify functionality.
  * Connections to the repository shouldn't fail if it has notified as being up,
  * except with EINTR, which we should handle in libs16. */
@@ -112,6 +201,7 @@ void repo_retry_cb (long timer, void * unused)
     {
         S16Log (kS16LogDebug, "Connected to the repository.\n");
         manager.repo_up = true;
+        subscribe_config ();
     }
 }
 
@@ -127,6 +217,7 @@ void manager_configd_came_up ()
     else
     {
         manager.repo_up = true;
+        subscribe_config ();
     }
 }
 
@@ -179,6 +270,8 @@ int main (int argc, char * argv[])
         perror ("Failed to connect to repository");
         manager.repo_up = false;
     }
+    else
+        subscribe_config ();
 
     S16HandleSignalWithKQueue (manager.kq, SIGHUP);
     S16HandleSignalWithKQueue (manager.kq, SIGCHLD);
@@ -192,6 +285,7 @@ int main (int argc, char * argv[])
 
         configd->type = U_NOTIFY;
         configd->methods[UM_START] = "/opt/s16/libexec/s16.configd";
+        configd->listen_fd = configd_listen ();
         configd->state = UkS16StateOffline;
 
         unit_msg (configd, note);
@@ -232,6 +326,8 @@ int main (int argc, char * argv[])
 
         timerset_investigate_kevent (&manager.ts, &ev);
         sd_notify_srv_investigate_kevent (&ev);
+        s16db_investigate_kevent (&manager.h, &ev);
+        process_config_notes ();
 
         switch (ev.filter)
         {
@@ -141,6 +141,8 @@ static void dispatch_sd_notify (pid_t pid, char * buf)
             unit_notify_ready (unit);
         else if (len > 7 && !strncmp (seg, "STATUS=", 7))
             unit_notify_status (unit, strndup (seg + 7, len - 7));
+        else if (len > 8 && !strncmp (seg, "MAINPID=", 8))
+            unit_notify_mainpid (unit, atoi (seg + 8));
         else
             S16Log (kS16LogWarn,
                     "Unhandled component of notify message: \"%s\"\n",
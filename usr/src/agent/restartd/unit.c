@@ -67,8 +67,15 @@ void unit_timer_event (long id, void * data);
 
 void fork_cleanup_cb (void * data)
 {
+    Unit * unit = data;
+    int keep = 0;
+
     setenv ("NOTIFY_SOCKET", NOTIFY_SOCKET_PATH, 1);
-    manager_fork_cleanup ();
+    /* The start method's process is the daemon, which wants the socket. */
+    if (unit->state == US_START && unit->listen_fd != -1 &&
+        !S16PassListenFds (&unit->listen_fd, 1))
+        keep = 1;
+    manager_fork_cleanup (keep);
 }
 
 UnitMethodType state_to_S16ServiceMethodype (UnitState state)
@@ -100,7 +107,7 @@ void unit_deregister_pid (Unit * unit, pid_t pid)
 pid_t unit_fork_and_register (Unit * unit, const char * cmd)
 {
     S16PendingProcess * pwait =
-        S16ProcessForkAndWait (cmd, fork_cleanup_cb, NULL);
+        S16ProcessForkAndWait (cmd, fork_cleanup_cb, unit);
     pid_t ret = 0;
 
     if (pwait == NULL || pwait->pid == 0)
@@ -598,6 +605,22 @@ void unit_notify_status (Unit * unit, char * status)
                 status);
 }
 
+void unit_notify_mainpid (Unit * unit, pid_t pid)
+{
+    /* Only a process already of the unit may be made its main PID; a service
+     * handing itself over to a successor it forked names the successor. */
+    if (!unit_has_pid (unit, pid))
+    {
+        S16LogPath (kS16LogWarn,
+                    unit->path,
+                    "Ignoring MAINPID=%d: not a process of the unit\n",
+                    pid);
+        return;
+    }
+
+    unit->main_pid = pid;
+}
+
 bool unit_has_pid (Unit * unit, pid_t pid)
 {
     LL_each (&unit->pids, it)
@@ -615,12 +638,74 @@ Unit * unit_add (S16Path * path)
     unit->path = path;
     unit->pids = pid_list_new ();
     unit->state = UkS16StateUninitialisedIALISED;
+    unit->listen_fd = -1;
 
     Unit_list_add (&manager.units, unit);
 
     return unit;
 }
 
+/* The names of methods in the repository. */
+static const char * method_names[UM_MAX] = {
+    [UM_PRESTART] = "prestart",
+    [UM_START] = "start",
+    [UM_POSTSTART] = "poststart",
+    [UM_STOP] = "stop",
+    [UM_POSTSTOP] = "poststop",
+};
+
+static const char * method_exec (meth_list_t * meths, const char * name)
+{
+    list_foreach (meth, meths, it)
+    {
+        if (strcmp (it->val->name, name))
+            continue;
+
+        list_foreach (prop, &it->val->props, pit)
+        {
+            if (pit->val->type == kS16PropertyTypeString &&
+                !strcmp (pit->val->name, "exec"))
+                return pit->val->value.s;
+        }
+    }
+
+    return NULL;
+}
+
+/* The methods are expanded here, rather than at each fork; expansion is
+ * repeated only for those whose exec, or any property it refers to, has
+ * changed. */
+void unit_setup (Unit * unit)
+{
+    S16Path * spath = S16ServicePathFromInstancePath (unit->path);
+    s16db_lookup_result_t svc = s16db_lookup_path (&manager.h, spath);
+    s16db_lookup_result_t inst =
+        s16db_lookup_path_details (&manager.h, unit->path);
+
+    S16PathDestroy (spath);
+
+    /* Units not in the repository, such as configd's own before it is up,
+     * keep the methods they were given. */
+    if (inst.type != INSTANCE || !inst.i)
+        return;
+
+    for (int m = 0; m < UM_MAX; m++)
+    {
+        const char * exec = method_exec (&inst.i->meths, method_names[m]);
+
+        if (!exec && svc.type == SVC && svc.s)
+            exec = method_exec (&svc.s->meths, method_names[m]);
+
+        unit->templates[m] = S16TemplateUpdate (unit->templates[m], exec);
+        unit->methods[m] =
+            unit->templates[m]
+                ? S16TemplateExpand (unit->templates[m],
+                                     svc.type == SVC ? svc.s : NULL,
+                                     inst.i)
+                : NULL;
+    }
+}
+
 /* Sends a note to the given unit. */
 void unit_msg (Unit * unit, s16note_t * note)
 {
@@ -630,6 +715,8 @@ void unit_msg (Unit * unit, s16note_t * note)
     case RR_START:
     {
         S16LogPath (kS16LogInfo, unit->path, "Received request to bring up.\n");
+        if (manager.repo_up)
+            unit_setup (unit);
         unit_enter_prestart (unit);
     }
     }
@@ -92,7 +92,14 @@ typedef struct
     UnitRestart to_restart;
     bool is_enabled;
 
+    /* A listening socket made by us and passed to the start method by the
+     * LISTEN_FDS protocol, or -1. */
+    int listen_fd;
+
     const char * methods[UM_MAX];
+    /* The exec properties of the methods, compiled; methods[] holds their
+     * expansions, unless set otherwise. */
+    S16Template * templates[UM_MAX];
 
     /* Transient state */
     /* Current state of unit */
@@ -136,6 +143,8 @@ void unit_notify_ready (Unit * unit);
  * Notifies given unit of a new status message from the daemon.
  * Arg @status is owned by receiver. */
 void unit_notify_status (Unit * unit, char * status);
+/* Notifies given unit that the daemon names @pid as its main PID. */
+void unit_notify_mainpid (Unit * unit, pid_t pid);
 
 /* Returns true if the given unit is in charge of the given PID. */
 bool unit_has_pid (Unit * unit, pid_t pid);
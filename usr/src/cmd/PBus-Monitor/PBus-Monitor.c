@@ -23,27 +23,230 @@
  * Use is subject to license terms.
  */
 
+/*
+ * PBus-Monitor: displays or captures the traffic passing through the P-Bus
+ * broker.
+ *
+ * Run without arguments, every message is decoded and printed as it passes.
+ * The -b and -s options restrict this to messages to or from bus names, or
+ * with selectors, matching a glob pattern. With -w, messages are instead
+ * written unaltered to a capture file, which -r later decodes offline.
+ */
+
+#include <errno.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "PBus/PBus.h"
+#include "PBus/PBus_Private.h"
+#include "dnv.h"
+
+struct option options[] = {{"bus-name", required_argument, NULL, 'b'},
+                           {"selector", required_argument, NULL, 's'},
+                           {"write", required_argument, NULL, 'w'},
+                           {"read", required_argument, NULL, 'r'},
+                           {"help", no_argument, NULL, 'h'},
+                           {NULL, 0, NULL, 0}};
+
+static FILE * gCapture = NULL; /* If set, records are written here. */
+
+static void usage (const char * progName)
+{
+    fprintf (stderr,
+             "Usage: %s [-b bus-name-pattern] [-s selector-pattern] "
+             "[-w file]\n"
+             "       %s -r file\n",
+             progName,
+             progName);
+}
+
+static void printRecord (const PBusCaptureRecordHeader * hdr,
+                         const void * data)
+{
+    nvlist_t * frame = nvlist_unpack (data, hdr->length, 0);
+    time_t secs = hdr->timestamp / 1000000000;
+    char stamp[32];
+
+    strftime (stamp, sizeof (stamp), "%H:%M:%S", localtime (&secs));
+
+    if (!frame)
+    {
+        printf ("%s.%09lu <malformed record>\n",
+                stamp,
+                (unsigned long)(hdr->timestamp % 1000000000));
+        return;
+    }
+
+    printf ("%s.%09lu %s -> %s %s\n",
+            stamp,
+            (unsigned long)(hdr->timestamp % 1000000000),
+            dnvlist_get_string (frame, "fromBusname", "?"),
+            dnvlist_get_string (frame, "toBusname", "?"),
+            dnvlist_get_string (frame, "selector", ""));
+
+    if (nvlist_exists_nvlist (frame, "message"))
+    {
+        ucl_object_t * obj =
+            S16NVRPCNVListToUCL (nvlist_get_nvlist (frame, "message"));
+        unsigned char * json = ucl_object_emit (obj, UCL_EMIT_JSON_COMPACT);
+
+        printf ("    %s\n", json);
+        free (json);
+        ucl_object_unref (obj);
+    }
+    else
+        printf ("    <message carried descriptors>\n");
+
+    nvlist_destroy (frame);
+}
+
+/*
+ * Decodes a buffer of capture records. Returns the number of bytes consumed;
+ * a trailing partial record is left.
+ */
+static size_t printRecords (const char * data, size_t len)
+{
+    size_t off = 0;
+
+    while (len - off >= sizeof (PBusCaptureRecordHeader))
+    {
+        PBusCaptureRecordHeader hdr;
+
+        memcpy (&hdr, data + off, sizeof (hdr));
+        if (len - off - sizeof (hdr) < hdr.length)
+            break;
+        printRecord (&hdr, data + off + sizeof (hdr));
+        off += sizeof (hdr) + hdr.length;
+    }
+
+    return off;
+}
+
+static void * monitorFrames (S16NVRPCCallContext * ctx, intptr_t monitorID,
+                             nvlist_t * batch)
+{
+    size_t len;
+    const void * records = dnvlist_get_binary (batch, "records", &len, "", 0);
+    unsigned long dropped = dnvlist_get_number (batch, "dropped", 0);
+
+    if (dropped)
+        fprintf (stderr, "PBus-Monitor: %lu frames dropped\n", dropped);
+
+    if (gCapture)
+    {
+        if (fwrite (records, 1, len, gCapture) != len)
+        {
+            perror ("Failed to write capture");
+            exit (EXIT_FAILURE);
+        }
+        fflush (gCapture);
+    }
+    else
+        printRecords (records, len);
+
+    return NULL;
+}
+
+static int readCapture (const char * path)
+{
+    FILE * file = fopen (path, "rb");
+    char magic[kPBusCaptureMagicLen];
+    char * data = NULL;
+    size_t len = 0, cap = 0, n;
+
+    if (!file)
+    {
+        perror ("Failed to open capture");
+        return EXIT_FAILURE;
+    }
+
+    if (fread (magic, 1, sizeof (magic), file) != sizeof (magic) ||
+        memcmp (magic, kPBusCaptureMagic, sizeof (magic)))
+    {
+        fprintf (stderr, "%s: Not a P-Bus capture file\n", path);
+        fclose (file);
+        return EXIT_FAILURE;
+    }
+
+    /* Records are decoded as each chunk arrives, so memory stays bounded. */
+    do
+    {
+        size_t used;
 
-ssize_t write (int fildes, const void * buf, size_t nbyte);
+        if (cap - len < 65536)
+            data = realloc (data, cap = cap ? cap * 2 : 131072);
+        n = fread (data + len, 1, cap - len, file);
+        len += n;
+        used = printRecords (data, len);
+        memmove (data, data + used, len - used);
+        len -= used;
+    } while (n);
 
-extern S16NVRPCMessageSignature msgSendSig;
+    if (len)
+        fprintf (stderr, "%s: Truncated final record\n", path);
 
-S16NVRPCMessageSignature testMethSig = {
-    .name = "TestMeth",
-    .rtype = {.kind = S16R_KSTRING},
-    .nargs = 2,
-    .args = {{.name = "argA", .type = {.kind = S16R_KSTRING}},
-             {.name = "argB", .type = {.kind = S16R_KSTRING}},
-             {.name = NULL}}};
+    free (data);
+    fclose (file);
+    return EXIT_SUCCESS;
+}
 
-int main ()
+int main (int argc, char * argv[])
 {
-    PBusConnection * conn = PBusConnectionNew (NULL);
+    PBusConnection * conn;
     PBusInvocation * invoc;
     S16NVRPCError * err;
+    const char *busNamePattern = "*", *selectorPattern = "*";
+    const char *capturePath = NULL, *readPath = NULL;
+    int c;
+
+    while ((c = getopt_long (argc, argv, "b:s:w:r:h", options, NULL)) >= 0)
+    {
+        switch (c)
+        {
+        case 'b':
+            busNamePattern = optarg;
+            break;
+
+        case 's':
+            selectorPattern = optarg;
+            break;
+
+        case 'w':
+            capturePath = optarg;
+            break;
+
+        case 'r':
+            readPath = optarg;
+            break;
+
+        case 'h':
+        default:
+            usage (argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (readPath)
+        return readCapture (readPath);
+
+    if (capturePath)
+    {
+        if (!(gCapture = fopen (capturePath, "wb")))
+        {
+            perror ("Failed to open capture");
+            return EXIT_FAILURE;
+        }
+        fwrite (kPBusCaptureMagic, 1, kPBusCaptureMagicLen, gCapture);
+    }
+
+    conn = PBusConnectionNew (NULL);
+    S16NVRPCServerRegisterMethod (conn->rpcServer,
+                                  &PBusMonitorFramesSig,
+                                  (S16NVRPCImplementationFn)monitorFrames);
 
     if (PBusConnectionConnectToSystemBroker (conn) == -1)
     {
@@ -51,15 +254,23 @@ int main ()
         exit (-1);
     }
 
-    invoc = PBusInvocationNewWithSignature (&testMethSig);
-    PBusInvocationSetArguments (invoc, "hello", "world");
+    invoc = PBusInvocationNewWithSignature (&PBusBrokerAttachMonitorSig);
+    PBusInvocationSetArguments (invoc, busNamePattern, selectorPattern);
     err = PBusInvocationSendTo (invoc, PBusConnectionGetBrokerObject (conn));
 
     if (err)
     {
         printf ("Error: Code %d: %s\n", err->code, err->message);
         S16NVRPCErrorDestroy (err);
+        return EXIT_FAILURE;
     }
+    PBusInvocationDestroy (invoc);
+
+    while (PBusConnectionReceiveFromFileDescriptor (conn) != -1)
+        ;
+
+    if (gCapture)
+        fclose (gCapture);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -53,6 +53,11 @@ void disable (const char * spath)
     S16Path * path = s16db_string_to_path (spath);
     if (!path)
         fail ("Path is invalid.");
+    else if (svcadm.in_txn)
+    {
+        s16db_txn_disable (&svcadm.txn, path);
+        S16PathDestroy (path);
+    }
     else
     {
         int res = s16db_disable (&svcadm.h, path);
@@ -70,6 +75,11 @@ void enable (const char * spath)
     S16Path * path = s16db_string_to_path (spath);
     if (!path)
         fail ("Path is invalid.");
+    else if (svcadm.in_txn)
+    {
+        s16db_txn_enable (&svcadm.txn, path);
+        S16PathDestroy (path);
+    }
     else
     {
         int res = s16db_enable (&svcadm.h, path);
@@ -82,6 +92,62 @@ void enable (const char * spath)
     }
 }
 
+/* Between "begin" and "commit", enables and disables are only gathered; on
+ * commit, they are applied together, or not at all. */
+void txn_begin ()
+{
+    if (svcadm.in_txn)
+    {
+        fail ("A transaction is already begun.");
+        return;
+    }
+
+    s16db_txn_begin (&svcadm.txn);
+    svcadm.in_txn = true;
+}
+
+void txn_commit ()
+{
+    size_t n, failed = 0;
+    int res;
+
+    if (!svcadm.in_txn)
+    {
+        fail ("No transaction is begun.");
+        return;
+    }
+
+    n = s16db_txn_size (&svcadm.txn);
+    res = s16db_txn_commit (&svcadm.h, &svcadm.txn, &failed);
+    svcadm.in_txn = false;
+
+    if (!res)
+    {
+        printf ("Applied %zu operations.\n", n);
+        success ();
+    }
+    else
+    {
+        printf ("Operation %zu of %zu failed: code %d; none applied.\n",
+                failed + 1,
+                n,
+                res);
+        fail ("Bad result from repository server.");
+    }
+}
+
+void txn_abort ()
+{
+    if (!svcadm.in_txn)
+    {
+        fail ("No transaction is begun.");
+        return;
+    }
+
+    s16db_txn_abort (&svcadm.txn);
+    svcadm.in_txn = false;
+}
+
 void parse (const char * text)
 {
     /* current token */
@@ -138,12 +204,17 @@ int main (int argc, char * argv[])
         interact ();
     else
     {
-        char * txt = calloc (1, 256);
+        size_t len = 1;
+        char * txt;
+
+        for (int i = 1; i < argc; i++)
+            len += strlen (argv[i]) + 1;
+        txt = calloc (1, len);
 
         for (int i = 1; i < argc; i++)
         {
-            strncat (txt, argv[i], 255);
-            strncat (txt, " ", 255);
+            strcat (txt, argv[i]);
+            strcat (txt, " ");
         }
 
         parse (txt);
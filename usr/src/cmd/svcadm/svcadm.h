@@ -33,11 +33,18 @@ struct svcadm_s
     /* repository handle */
     s16db_hdl_t h;
     bool want_quit;
+    /* Operations gathered since "begin", if any, to be applied together on
+     * "commit". */
+    bool in_txn;
+    s16db_txn_t txn;
 };
 
 extern struct svcadm_s svcadm;
 
 void disable (const char * path);
 void enable (const char * path);
+void txn_begin ();
+void txn_commit ();
+void txn_abort ();
 
 #endif
\ No newline at end of file
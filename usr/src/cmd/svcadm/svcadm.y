@@ -41,5 +41,8 @@ cmds ::= cmds cmd.
 cmd ::= NL.
 cmd ::= DISABLE TEXT(t) NL. { disable(t); free(t); }
 cmd ::= ENABLE TEXT(t) NL. { enable(t); free(t); }
+cmd ::= BEGIN NL. { txn_begin(); }
+cmd ::= COMMIT NL. { txn_commit(); }
+cmd ::= ABORT NL. { txn_abort(); }
 cmd ::= QUIT NL. { svcadm.want_quit = 1; }
 cmd ::= TEXT.
\ No newline at end of file
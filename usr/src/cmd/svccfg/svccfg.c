@@ -31,9 +31,6 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 
-#include "ucl.h"
-#include "utstring.h"
-
 #include "svccfg.h"
 #include "svccfg.tab.h"
 #include "svccfg.y.h"
@@ -45,93 +42,151 @@ void * Parse (void *, int, void *, void *);
 
 struct svccfg_s svccfg;
 
+static void fail (const char * s) { printf ("Task failed: %s\n", s); }
+
 static void success () { printf ("Task completed successfully.\n"); }
 
-static void canonicalise_svc (ucl_object_t * svc)
+/* Within a transaction, the manifests are parsed here, rather than by configd,
+ * and their services gathered to be imported on commit. One which fails to
+ * parse fails the transaction. */
+static void import_to_txn (str_list_t * paths)
 {
-    ucl_object_t * uname = ucl_object_pop_key (svc, "name");
-    const ucl_object_t * uinsts = ucl_object_lookup (svc, "instances");
-    const char * name = ucl_object_tostring (uname);
-
-    ucl_object_insert_key (svc, uname, "path", 0, 1);
-
-    if (uinsts)
+    LL_each (paths, it)
     {
-        ucl_object_t * uinst;
-        ucl_object_iter_t it = NULL;
+        char * err;
+        S16Service * svc = s16db_parse_manifest (it->val, &err);
 
-        while ((uinst = (ucl_object_t *)ucl_object_iterate (uinsts, &it, true)))
+        if (!svc)
         {
-            ucl_object_t * uname = ucl_object_pop_key (uinst, "name");
-            char * path;
-
-            asprintf (&path, "%s:%s", name, ucl_object_tostring (uname));
-            ucl_object_insert_key (
-                uinst, ucl_object_fromstring (path), "path", 0, 1);
-
-            ucl_object_unref (uname);
-            free (path);
+            printf ("%s: %s\n", it->val, err);
+            free (err);
+            if (!svccfg.txn_failed)
+                svccfg.txn_failed = strdup (it->val);
+            continue;
         }
+
+        s16db_txn_import_ucl_svc (
+            &svccfg.txn, s16db_S16Serviceo_ucl (svc), L_MANIFEST);
+        S16ServiceDestroy (svc);
     }
 }
 
 void import (str_list_t * paths)
 {
-    int num_manifests = str_list_size (paths);
-    int loaded = 0;
-    int failed = 0;
-    UT_string * errs;
+    size_t num_manifests = str_list_size (paths);
+    const char ** abspaths = calloc (num_manifests + 1, sizeof (*abspaths));
+    s16db_import_report_t report;
+    size_t i = 0;
+    int e;
 
-    utstring_new (errs);
-    printf ("Loading S16 service manifests: ");
+    if (svccfg.in_txn)
+    {
+        import_to_txn (paths);
+        free (abspaths);
+        return;
+    }
 
+    /* configd reads the manifests itself, from its own working directory. */
     LL_each (paths, it)
     {
-        int bs = 0;
-        int e;
-        struct ucl_parser * parser = ucl_parser_new (0);
-        ucl_object_t * obj = NULL;
-        const char * path = it->val;
-
-        bs = printf ("%d/%d", ++loaded, num_manifests);
-        fflush (stdout);
-        while (bs--)
-            putchar ('\b');
-        ucl_parser_add_file (parser, path);
-
-        if (ucl_parser_get_error (parser))
-        {
-            failed++;
-            utstring_printf (errs,
-                             "\t%s: Manifest parser error: %s\n",
-                             path,
-                             ucl_parser_get_error (parser));
-            goto cleanup;
-        }
+        char * abspath = realpath (it->val, NULL);
+        abspaths[i++] = abspath ? abspath : strdup (it->val);
+    }
 
-        obj = ucl_parser_get_object (parser);
+    printf ("Loading %zu S16 service manifests.\n", num_manifests);
 
-        canonicalise_svc (obj);
+    if ((e = s16db_import_manifests (
+             &svccfg.h, abspaths, num_manifests, L_MANIFEST, &report)))
+        printf ("Failed to import S16 service manifests: code %d\n", e);
+    else
+    {
+        if (report.unchanged)
+            printf ("%zu S16 service manifests unchanged.\n",
+                    report.unchanged);
 
-        if ((e = s16db_import_ucl_svc (&svccfg.h, obj, L_MANIFEST)))
+        if (report.nfailed)
         {
-            failed++;
-            utstring_printf (errs, "\t%s: code %d", path, e);
+            printf ("%zu S16 service descriptions failed to load:\n",
+                    report.nfailed);
+            for (i = 0; i < report.nfailed; i++)
+                printf ("\t%s: %s\n",
+                        report.failed_paths[i],
+                        report.failed_errors[i]);
         }
 
-    cleanup:
-        if (obj)
-            ucl_obj_unref (obj);
-        ucl_parser_free (parser);
+        s16db_import_report_destroy (&report);
     }
-    putchar ('\n');
 
-    if (failed)
+    for (i = 0; i < num_manifests; i++)
+        free ((char *)abspaths[i]);
+    free (abspaths);
+}
+
+/* Between "begin" and "commit", imports are only gathered; on commit, they
+ * are applied together, or not at all. */
+void txn_begin ()
+{
+    if (svccfg.in_txn)
     {
-        printf ("%d S16 service descriptions failed to load:\n%s",
-                failed,
-                utstring_body (errs));
+        fail ("A transaction is already begun.");
+        return;
     }
+
+    s16db_txn_begin (&svccfg.txn);
+    svccfg.in_txn = true;
+}
+
+void txn_commit ()
+{
+    size_t n, failed = 0;
+    int res;
+
+    if (!svccfg.in_txn)
+    {
+        fail ("No transaction is begun.");
+        return;
+    }
+
+    if (svccfg.txn_failed)
+    {
+        printf ("Manifest %s failed to parse; none imported.\n",
+                svccfg.txn_failed);
+        txn_abort ();
+        fail ("Transaction aborted.");
+        return;
+    }
+
+    n = s16db_txn_size (&svccfg.txn);
+    res = s16db_txn_commit (&svccfg.h, &svccfg.txn, &failed);
+    svccfg.in_txn = false;
+
+    if (!res)
+    {
+        printf ("Imported %zu services.\n", n);
+        success ();
+    }
+    else
+    {
+        printf ("Service %zu of %zu failed: code %d; none imported.\n",
+                failed + 1,
+                n,
+                res);
+        fail ("Bad result from repository server.");
+    }
+}
+
+void txn_abort ()
+{
+    if (!svccfg.in_txn)
+    {
+        fail ("No transaction is begun.");
+        return;
+    }
+
+    s16db_txn_abort (&svccfg.txn);
+    svccfg.in_txn = false;
+    free (svccfg.txn_failed);
+    svccfg.txn_failed = NULL;
 }
 
 void parse (const char * text)
@@ -190,12 +245,17 @@ int main (int argc, char * argv[])
         interact ();
     else
     {
-        char * txt = calloc (1, 256);
+        size_t len = 1;
+        char * txt;
+
+        for (int i = 1; i < argc; i++)
+            len += strlen (argv[i]) + 1;
+        txt = calloc (1, len);
 
         for (int i = 1; i < argc; i++)
         {
-            strncat (txt, argv[i], 255);
-            strncat (txt, " ", 255);
+            strcat (txt, argv[i]);
+            strcat (txt, " ");
         }
 
         parse (txt);
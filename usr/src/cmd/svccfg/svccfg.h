@@ -35,10 +35,20 @@ struct svccfg_s
     /* repository handle */
     s16db_hdl_t h;
     bool want_quit;
+    /* Services gathered since "begin", if any, to be imported together on
+     * "commit". */
+    bool in_txn;
+    s16db_txn_t txn;
+    /* The first manifest which failed to parse within the transaction, if
+     * any; it is then aborted on "commit". */
+    char * txn_failed;
 };
 
 extern struct svccfg_s svccfg;
 
 void import (str_list_t * path);
+void txn_begin ();
+void txn_commit ();
+void txn_abort ();
 
 #endif
\ No newline at end of file
@@ -45,5 +45,8 @@ text_list(L) ::= text_list(l) TEXT(t). { str_list_add((L = l), t); }
 
 cmd ::= NL.
 cmd ::= IMPORT text_list(t) NL. { import(t); free (t); }
+cmd ::= BEGIN NL. { txn_begin(); }
+cmd ::= COMMIT NL. { txn_commit(); }
+cmd ::= ABORT NL. { txn_abort(); }
 cmd ::= QUIT NL. { svccfg.want_quit = 1; }
 cmd ::= TEXT.
\ No newline at end of file
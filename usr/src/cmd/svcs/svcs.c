@@ -23,7 +23,15 @@
  * Use is subject to license terms.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "S16/Repository.h"
+#include "ucl.h"
+
+/* Reads of the shared view to try before falling back to asking configd. */
+#define kViewTries 8
 
 struct svcs_s
 {
@@ -33,32 +41,222 @@ struct svcs_s
 
 struct svcs_s svcs;
 
-static void print_svc (S16ServiceState state, S16Path * path)
+static void print_svc (FILE * f, S16ServiceState state, const char * spath)
 {
     const char * sstate = S16StateToString (state);
     size_t need_t = strlen (sstate) < 8;
-    char * spath = S16PathToString (path);
 
-    printf ("%s%s\tDate\t\t%s\n", sstate, need_t ? "\t" : "", spath);
+    fprintf (f, "%s%s\tDate\t\t%s\n", sstate, need_t ? "\t" : "", spath);
+}
+
+static void print_path (S16ServiceState state, S16Path * path)
+{
+    char * spath = S16PathToString (path);
 
+    print_svc (stdout, state, spath);
     free (spath);
 }
 
+/* Prints the services from configd's shared view, which needs no connection.
+ * Returns false if there is no view, or no consistent read of it could be
+ * made. */
+static bool print_view ()
+{
+    s16db_view_t * view = s16db_view_open ();
+    char * out;
+    size_t len;
+    bool consistent = false;
+    FILE * f;
+
+    if (!view)
+        return false;
+
+    /* Printed aside, as a read may have to be retried. */
+    for (int tries = 0; !consistent && tries < kViewTries; tries++)
+    {
+        f = open_memstream (&out, &len);
+        s16db_view_begin (view);
+
+        for (size_t i = 0; i < s16db_view_nsvcs (view); i++)
+        {
+            s16db_view_ent_t svc = s16db_view_svc (view, i);
+
+            print_svc (f, s16db_view_state (view, svc),
+                       s16db_view_path (view, svc));
+
+            for (size_t j = 0; j < s16db_view_ninsts (view, svc); j++)
+            {
+                s16db_view_ent_t inst = s16db_view_inst (view, svc, j);
+
+                print_svc (f, s16db_view_state (view, inst),
+                           s16db_view_path (view, inst));
+            }
+        }
+
+        fclose (f);
+        if ((consistent = s16db_view_end (view)))
+            fputs (out, stdout);
+        free (out);
+    }
+
+    s16db_view_close (view);
+
+    return consistent;
+}
+
+static long field (const ucl_object_t * obj, const char * key)
+{
+    return ucl_object_toint (ucl_object_lookup (obj, key));
+}
+
+/* Estimates a percentile from a latency histogram, as the upper bound of the
+ * bucket it falls in. */
+static unsigned long percentile (const ucl_object_t * uhist, unsigned pct)
+{
+    const ucl_object_t * ubucket;
+    ucl_object_iter_t it = NULL;
+    unsigned long total = 0, seen = 0;
+    unsigned bucket = 0;
+
+    while ((ubucket = ucl_iterate_object (uhist, &it, true)))
+        total += ucl_object_toint (ubucket);
+
+    it = NULL;
+    while ((ubucket = ucl_iterate_object (uhist, &it, true)))
+    {
+        seen += ucl_object_toint (ubucket);
+        if (total && seen * 100 >= total * pct)
+            break;
+        bucket++;
+    }
+
+    return 1ul << bucket;
+}
+
+static int print_stats ()
+{
+    ucl_object_t * ustats = s16db_get_stats (&svcs.h);
+    const ucl_object_t *uscope, *umem, *uloop, *unotes, *uobj;
+    ucl_object_iter_t it = NULL;
+
+    if (!ustats)
+        return 1;
+
+    uscope = ucl_object_lookup (ustats, "scope");
+    umem = ucl_object_lookup (ustats, "memory");
+    uloop = ucl_object_lookup (ustats, "loop");
+    unotes = ucl_object_lookup (ustats, "notes");
+
+    printf ("Up %lds; %ld services, %ld instances, generation %ld\n",
+            field (ustats, "uptime-s"),
+            field (uscope, "services"),
+            field (uscope, "instances"),
+            field (uscope, "generation"));
+    printf ("Memory: %ld allocs, %ld frees, %ld from emergency pool "
+            "(%ld of %ld bytes); max RSS %ld\n",
+            field (umem, "allocs"),
+            field (umem, "frees"),
+            field (umem, "pool-allocs"),
+            field (umem, "pool-used"),
+            field (umem, "pool-size"),
+            field (umem, "max-rss"));
+    printf ("Strings: %ld held, %ld references, %ld bytes; %ld bytes saved\n",
+            field (umem, "strings"),
+            field (umem, "string-refs"),
+            field (umem, "string-bytes"),
+            field (umem, "string-bytes-saved"));
+    printf ("Event loop: %ld iterations, mean %ldus, p99 <%luus, max %ldus\n",
+            field (uloop, "iterations"),
+            field (uloop, "iterations")
+                ? field (uloop, "total-us") / field (uloop, "iterations")
+                : 0,
+            percentile (ucl_object_lookup (uloop, "latency-us"), 99),
+            field (uloop, "max-us"));
+    printf ("Notes published: %ld admin, %ld restarter, %ld state, %ld config; "
+            "%ld elided\n\n",
+            field (unotes, "admin-req"),
+            field (unotes, "restarter-req"),
+            field (unotes, "state-change"),
+            field (unotes, "config"),
+            field (unotes, "elided"));
+
+    printf ("METHOD\t\t\t\tCALLS\tERRORS\tP50(us)\tP99(us)\n");
+    while ((uobj = ucl_iterate_object (
+                ucl_object_lookup (ustats, "methods"), &it, true)))
+    {
+        const ucl_object_t * uhist = ucl_object_lookup (uobj, "latency-us");
+
+        if (!field (uobj, "calls"))
+            continue;
+        printf ("%-32s%ld\t%ld\t<%lu\t<%lu\n",
+                ucl_object_tostring (ucl_object_lookup (uobj, "name")),
+                field (uobj, "calls"),
+                field (uobj, "errors"),
+                percentile (uhist, 50),
+                percentile (uhist, 99));
+    }
+
+    printf ("\nFD\tPID\tUID\tCALLS\tIN\tOUT\tDEPTH\tMAX\tDROPPED\tLAG(ms)\n");
+    it = NULL;
+    while ((uobj = ucl_iterate_object (
+                ucl_object_lookup (ustats, "connections"), &it, true)))
+        printf ("%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+                field (uobj, "fd"),
+                field (uobj, "pid"),
+                field (uobj, "uid"),
+                field (uobj, "calls"),
+                field (uobj, "bytes-in"),
+                field (uobj, "bytes-out"),
+                field (uobj, "depth"),
+                field (uobj, "max-depth"),
+                field (uobj, "dropped"),
+                field (uobj, "lag-ms"));
+
+    ucl_object_unref (ustats);
+
+    return 0;
+}
+
 int main (int argc, char * argv[])
 {
-    if (s16db_hdl_new (&svcs.h))
+    int c;
+    bool show_stats = false;
+
+    while ((c = getopt (argc, argv, "S")) != -1)
+    {
+        switch (c)
+        {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-S]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!show_stats)
+    {
+        printf ("STATE\t\tSTIME\t\tPATH\n");
+        if (print_view ())
+            return 0;
+    }
+
+    if (s16db_hdl_new_with_projection (&svcs.h, S16DB_PROJ_STATE))
         perror ("Failed to connect to repository");
-    svcs.svcs = s16db_get_all_services (&svcs.h);
 
-    printf ("STATE\t\tSTIME\t\tPATH\n");
+    /* Repository statistics, rather than services. */
+    if (show_stats)
+        return print_stats ();
+    svcs.svcs = s16db_get_all_services (&svcs.h);
 
     list_foreach (svc, svcs.svcs, sit)
     {
-        print_svc (sit->val->state, sit->val->path);
+        print_path (sit->val->state, sit->val->path);
 
         list_foreach (inst, &sit->val->insts, iit)
         {
-            print_svc (iit->val->state, iit->val->path);
+            print_path (iit->val->state, iit->val->path);
         }
     }
 
@@ -26,12 +26,111 @@
 #include <assert.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <unistd.h>
 
 #include "S16/NVRPC.h"
+#include "dnv.h"
 
 #include "PBus/PBus.h"
 #include "PBus/PBus_Private.h"
 
+static void * connectionMsgSend (S16NVRPCCallContext * ctx,
+                                 const char * fromBusname,
+                                 const char * toBusname,
+                                 const char * objectPath, const char * selector,
+                                 nvlist_t * params)
+{
+    PBusConnection * conn = ctx->extra;
+    nvlist_t * result;
+
+    if (!conn->rootObject)
+    {
+        ctx->err.code = kS16NVRPCErrorNoSuchMethod;
+        ctx->err.message = "No objects are served on this connection";
+        return NULL;
+    }
+
+    /* The broker vouched for the peer's identity when it made the link. */
+    if (conn->peerBusName)
+        fromBusname = conn->peerBusName;
+
+    result = PBusDispatchCacheSend (conn->dispatchCache,
+                                    &ctx->err,
+                                    objectPath,
+                                    fromBusname,
+                                    selector,
+                                    params);
+
+    if (!result && !ctx->err.code)
+    {
+        ctx->err.code = kS16NVRPCErrorNoSuchMethod;
+        ctx->err.message = "No such object or selector";
+    }
+
+    return result;
+}
+
+static void * connectionReceiveNotification (S16NVRPCCallContext * ctx,
+                                             intptr_t subscriptionID,
+                                             const char * fromBusname,
+                                             const char * notificationName,
+                                             nvlist_t * params)
+{
+    PBusConnection * conn = ctx->extra;
+
+    if (conn->fnNotification)
+        conn->fnNotification (conn,
+                              subscriptionID,
+                              fromBusname,
+                              notificationName,
+                              params,
+                              conn->notificationUser);
+
+    return NULL;
+}
+
+static PBusConnection * ConnectionAddDirectLink (PBusConnection * connection,
+                                                 const char * peerBusName,
+                                                 int fd)
+{
+    PBusConnection * link = PBusConnectionNew (connection->rootObject);
+
+    PBusConnectionConnectDirect (link, fd);
+    link->parent = connection;
+    link->peerBusName = strdup (peerBusName);
+    PBusConnection_list_add (&connection->directLinks, link);
+
+    return link;
+}
+
+static void ConnectionDetachDirectLink (PBusConnection * link)
+{
+    if (link->parent)
+        PBusConnection_list_del (&link->parent->directLinks, link);
+    link->parent = NULL;
+}
+
+static void * connectionDirectConnection (S16NVRPCCallContext * ctx,
+                                          const char * fromBusname,
+                                          fdptr_t fd)
+{
+    PBusConnection *conn = ctx->extra, *link;
+    int linkFd = dup (fd); /* @fd is closed when we return. */
+
+    if (linkFd == -1)
+    {
+        S16Log (kS16LogError, "Failed to accept direct link: %m\n");
+        return NULL;
+    }
+
+    link = ConnectionAddDirectLink (conn, fromBusname, linkFd);
+
+    if (conn->fnDirectLink)
+        conn->fnDirectLink (conn, link, conn->directLinkUser);
+
+    return NULL;
+}
+
 /*
  * Creates a new PBusConnection with @rootObject as its root object. You may
  * specify NULL if you don't want to respond to anything.
@@ -44,10 +143,93 @@ PBusConnection * PBusConnectionNew (PBusObject * rootObject)
     conn->rpcServer = S16NVRPCServerNew (conn);
     conn->rootObject = rootObject;
     conn->brokerObject = NULL;
+    conn->dispatchCache = rootObject ? PBusDispatchCacheNew (rootObject) : NULL;
+    S16NVRPCAsyncContextInit (&conn->asyncContext);
+    conn->fnNotification = NULL;
+    conn->notificationUser = NULL;
+    conn->directLinks = PBusConnection_list_new ();
+    conn->fnDirectLink = NULL;
+    conn->directLinkUser = NULL;
+    conn->parent = NULL;
+    conn->peerBusName = NULL;
+
+    S16NVRPCServerRegisterMethod (conn->rpcServer,
+                                  &msgSendSig,
+                                  (S16NVRPCImplementationFn)connectionMsgSend);
+    S16NVRPCServerRegisterMethod (
+        conn->rpcServer,
+        &PBusReceiveNotificationSig,
+        (S16NVRPCImplementationFn)connectionReceiveNotification);
+    S16NVRPCServerRegisterMethod (
+        conn->rpcServer,
+        &PBusDirectConnectionSig,
+        (S16NVRPCImplementationFn)connectionDirectConnection);
 
     return conn;
 }
 
+void PBusConnectionDestroy (PBusConnection * connection)
+{
+    PBusConnection * link;
+
+    while ((link = PBusConnection_list_lpop (&connection->directLinks)))
+    {
+        link->parent = NULL;
+        PBusConnectionDestroy (link);
+    }
+
+    ConnectionDetachDirectLink (connection);
+    S16NVRPCAsyncContextFailAll (&connection->asyncContext,
+                                 kS16NVRPCErrorInternalError,
+                                 "Connection closed");
+
+    if (connection->fd != -1)
+        close (connection->fd);
+    if (connection->dispatchCache)
+        PBusDispatchCacheDestroy (connection->dispatchCache);
+    free (connection->brokerObject);
+    free (connection->peerBusName);
+    free (connection);
+}
+
+int PBusConnectionReceiveFromFileDescriptor (PBusConnection * connection)
+{
+    nvlist_t * message = nvlist_recv (connection->fd, 0);
+    nvlist_t * response;
+
+    if (!message)
+    {
+        S16NVRPCAsyncContextFailAll (&connection->asyncContext,
+                                     kS16NVRPCErrorInternalError,
+                                     "Connection lost");
+        /* A lost direct link is of no further use; further invocations of
+         * the peer go through the broker again. */
+        if (connection->parent)
+            PBusConnectionDestroy (connection);
+        return -1;
+    }
+
+    if (S16NVRPCMessageIsReply (message))
+    {
+        if (S16NVRPCAsyncContextProcessReply (&connection->asyncContext,
+                                              message))
+            S16Log (kS16LogWarn, "Discarding reply to unknown invocation\n");
+        return 0;
+    }
+
+    response = S16NVRPCServerHandleRequest (connection->rpcServer, message);
+    nvlist_destroy (message);
+
+    if (response)
+    {
+        if (nvlist_send (connection->fd, response) == -1)
+            S16Log (kS16LogError, "Failed to send reply: %m\n");
+        nvlist_destroy (response);
+    }
+
+    return 0;
+}
+
 bool PBusConnectionIsConnected (PBusConnection * connection)
 {
     return connection->fd != -1;
@@ -55,7 +237,7 @@ bool PBusConnectionIsConnected (PBusConnection * connection)
 
 bool PBusConnectionIsDirect (PBusConnection * connection)
 {
-    return PBusConnectionIsConnected (connection) && connection->brokerObject;
+    return PBusConnectionIsConnected (connection) && !connection->brokerObject;
 }
 
 int PBusConnectionConnectToSystemBroker (PBusConnection * connection)
@@ -80,23 +262,174 @@ int PBusConnectionConnectToSystemBroker (PBusConnection * connection)
     {
         connection->fd = fd;
         connection->brokerObject =
-            PBusDistantObjectNew (connection, "PBus-Broker", "");
+            PBusDistantObjectNew (connection, kPBusBrokerBusName, "");
         return fd;
     }
 }
 
-static S16NVRPCError * ConnectionSendMessageSynchronous (
-    PBusConnection * connection, void ** result, const char * toBusname,
-    const char * objectPath, const char * selector, nvlist_t * params)
+void PBusConnectionConnectDirect (PBusConnection * connection, int fd)
+{
+    S16CloseOnExec (fd);
+    connection->fd = fd;
+    connection->brokerObject = NULL;
+}
+
+/*
+ * Sends @invocation to the broker, waits for the reply, and returns the integer
+ * result, or -1 if the call failed. Destroys the invocation.
+ */
+static int ConnectionCallBrokerInt (PBusConnection * connection,
+                                    PBusInvocation * invocation)
+{
+    S16NVRPCError * err;
+    int r = -1;
+
+    if (!connection->brokerObject)
+        r = -1;
+    else if ((err = PBusInvocationSendTo (invocation,
+                                          connection->brokerObject)))
+        S16NVRPCErrorDestroy (err);
+    else if (invocation->result)
+        r = dnvlist_get_number (invocation->result, "result", -1);
+
+    PBusInvocationDestroy (invocation);
+    return r;
+}
+
+int PBusConnectionRegisterBusName (PBusConnection * connection,
+                                   const char * busName)
 {
-    return S16NVRPCClientCall (connection->fd,
-                               result,
-                               &msgSendSig,
-                               "",
-                               toBusname,
-                               objectPath,
-                               selector,
-                               params);
+    PBusInvocation * invocation =
+        PBusInvocationNewWithSignature (&PBusBrokerRegisterBusNameSig);
+
+    PBusInvocationSetArguments (invocation, busName);
+    return ConnectionCallBrokerInt (connection, invocation);
+}
+
+void PBusConnectionSetNotificationHandler (PBusConnection * connection,
+                                           PBusNotificationFun fn, void * user)
+{
+    connection->fnNotification = fn;
+    connection->notificationUser = user;
+}
+
+int PBusConnectionSubscribe (PBusConnection * connection,
+                             const char * busNamePattern,
+                             const char * notificationNamePattern)
+{
+    PBusInvocation * invocation =
+        PBusInvocationNewWithSignature (&PBusBrokerSubscribeToSig);
+
+    PBusInvocationSetArguments (
+        invocation, busNamePattern, notificationNamePattern);
+    return ConnectionCallBrokerInt (connection, invocation);
+}
+
+int PBusConnectionUnsubscribe (PBusConnection * connection, int subscriptionID)
+{
+    PBusInvocation * invocation =
+        PBusInvocationNewWithSignature (&PBusBrokerUnsubscribeSig);
+
+    PBusInvocationSetArguments (invocation, (intptr_t)subscriptionID);
+    return ConnectionCallBrokerInt (connection, invocation);
+}
+
+PBusConnection * PBusConnectionConnectToPeer (PBusConnection * connection,
+                                              const char * busName)
+{
+    PBusInvocation * invocation;
+    S16NVRPCError * err;
+    PBusConnection * link = NULL;
+
+    if (!connection->brokerObject)
+        return NULL;
+
+    invocation = PBusInvocationNewWithSignature (&PBusBrokerConnectDirectSig);
+    PBusInvocationSetArguments (invocation, busName);
+
+    if ((err = PBusInvocationSendTo (invocation, connection->brokerObject)))
+    {
+        S16Log (kS16LogWarn,
+                "Failed to link directly to %s: %s\n",
+                busName,
+                err->message);
+        S16NVRPCErrorDestroy (err);
+    }
+    else if (invocation->result &&
+             nvlist_exists_descriptor (invocation->result, "result"))
+        link = ConnectionAddDirectLink (
+            connection,
+            busName,
+            nvlist_take_descriptor (invocation->result, "result"));
+
+    PBusInvocationDestroy (invocation);
+    return link;
+}
+
+void PBusConnectionSetDirectLinkHandler (PBusConnection * connection,
+                                         PBusDirectLinkFun fn, void * user)
+{
+    connection->fnDirectLink = fn;
+    connection->directLinkUser = user;
+}
+
+static bool matchPeerBusName (PBusConnection * link, void * busName)
+{
+    return !strcmp (link->peerBusName, busName);
+}
+
+static void ConnectionPublishCompleted (PBusInvocation * invocation,
+                                        S16NVRPCError * err, void * user)
+{
+    if (err)
+        S16Log (kS16LogWarn, "Failed to publish: %s\n", err->message);
+
+    PBusInvocationDestroy (invocation);
+}
+
+int PBusConnectionPublish (PBusConnection * connection,
+                           const char * notificationName, nvlist_t * params)
+{
+    PBusInvocation * invocation;
+
+    if (!connection->brokerObject)
+        return -1;
+
+    invocation = PBusInvocationNewWithSignature (&PBusBrokerPublishSig);
+    PBusInvocationSetArguments (invocation, notificationName, params);
+
+    if (PBusInvocationSendAsync (invocation,
+                                 connection->brokerObject,
+                                 ConnectionPublishCompleted,
+                                 NULL))
+    {
+        PBusInvocationDestroy (invocation);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ConnectionAsyncReplyReceived (S16NVRPCError * err, void * result,
+                                          void * user)
+{
+    PBusInvocation * invocation = user;
+
+    invocation->isComplete = true;
+
+    if (err)
+    {
+        invocation->error = calloc (1, sizeof (*invocation->error));
+        invocation->error->code = err->code;
+        invocation->error->message = err->message ? strdup (err->message)
+                                                  : NULL;
+    }
+    else
+        invocation->result = result;
+
+    if (invocation->fnCompletion)
+        invocation->fnCompletion (
+            invocation, invocation->error, invocation->user);
 }
 
 PBusDistantObject * PBusConnectionGetBrokerObject (PBusConnection * connection)
@@ -123,13 +456,24 @@ PBusDistantObject * PBusDistantObjectNew (PBusConnection * conn,
 PBusInvocation *
 PBusInvocationNewWithSignature (S16NVRPCMessageSignature * signature)
 {
-    PBusInvocation * invoc = malloc (sizeof (*invoc));
+    PBusInvocation * invoc = calloc (1, sizeof (*invoc));
     invoc->arguments = NULL;
     invoc->wasSent = false;
     invoc->signature = signature;
     return invoc;
 }
 
+void PBusInvocationDestroy (PBusInvocation * invocation)
+{
+    if (invocation->arguments)
+        nvlist_destroy (invocation->arguments);
+    if (invocation->result)
+        nvlist_destroy (invocation->result);
+    if (invocation->error)
+        S16NVRPCErrorDestroy (invocation->error);
+    free (invocation);
+}
+
 void _PBusInvocationSetArgumentsInternal (size_t nParams,
                                           PBusInvocation * invocation, ...)
 {
@@ -154,11 +498,74 @@ void _PBusInvocationSetArgumentsInternal (size_t nParams,
 S16NVRPCError * PBusInvocationSendTo (PBusInvocation * invocation,
                                       PBusDistantObject * object)
 {
+    S16NVRPCError * err;
+
+    if (PBusInvocationSendAsync (invocation, object, NULL, NULL))
+    {
+        err = calloc (1, sizeof (*err));
+        err->code = kS16NVRPCErrorInternalError;
+        err->message = strdup ("Failed to send message");
+        return err;
+    }
+
+    err = PBusInvocationWait (invocation);
+    /* The caller takes ownership of the error. */
+    invocation->error = NULL;
+    return err;
+}
+
+int PBusInvocationSendAsync (PBusInvocation * invocation,
+                             PBusDistantObject * object,
+                             PBusCompletionFun fnCompletion, void * user)
+{
+    PBusConnection * conn = object->connection;
+    nvlist_t * arguments = invocation->arguments;
+    S16NVRPCAsyncCall * call;
+    PBusConnection_list_it link;
+
+    if (!LL_empty (&conn->directLinks) &&
+        (link = PBusConnection_list_find (
+             &conn->directLinks, matchPeerBusName, (void *)object->busName)))
+        conn = list_it_val (link);
+
     invocation->wasSent = true;
-    return ConnectionSendMessageSynchronous (object->connection,
-                                             &invocation->result,
-                                             object->busName,
-                                             object->objectPath,
-                                             invocation->signature->name,
-                                             invocation->arguments);
+    invocation->isComplete = false;
+    invocation->error = NULL;
+    invocation->result = NULL;
+    invocation->connection = conn;
+    invocation->fnCompletion = fnCompletion;
+    invocation->user = user;
+
+    if (!arguments)
+        arguments = nvlist_create (0);
+
+    call = S16NVRPCClientCallAsync (&conn->asyncContext,
+                                    conn->fd,
+                                    ConnectionAsyncReplyReceived,
+                                    invocation,
+                                    &msgSendSig,
+                                    "",
+                                    object->busName,
+                                    object->objectPath,
+                                    invocation->signature->name,
+                                    arguments);
+
+    if (arguments != invocation->arguments)
+        nvlist_destroy (arguments);
+
+    return call ? 0 : -1;
+}
+
+bool PBusInvocationIsComplete (PBusInvocation * invocation)
+{
+    return invocation->isComplete;
+}
+
+S16NVRPCError * PBusInvocationWait (PBusInvocation * invocation)
+{
+    while (!invocation->isComplete)
+        if (PBusConnectionReceiveFromFileDescriptor (invocation->connection))
+            break;
+
+    return invocation->error;
 }
\ No newline at end of file
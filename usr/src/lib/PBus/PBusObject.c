@@ -25,9 +25,45 @@
 
 /*Returns: struct { error: number, result: variable } SendResult; */
 
+#include "uthash.h"
+
 #include "PBus/PBus.h"
 #include "PBus/PBus_Private.h"
 
+/*
+ * The dispatch cache is a trie keyed on the components of an object path. Each
+ * node records the static PBusObject that the path so far resolves to, and the
+ * PBusMethods that have so far been looked up on it by selector.
+ */
+typedef struct PBusDispatchCacheMethod
+{
+    const char * selector; /* Owned by the method signature */
+    PBusMethod * method;
+    UT_hash_handle hh;
+} PBusDispatchCacheMethod;
+
+typedef struct PBusDispatchCacheNode
+{
+    char * component; /* NULL for the root node */
+    PBusObject * object;
+    struct PBusDispatchCacheNode * children;
+    PBusDispatchCacheMethod * methods;
+    UT_hash_handle hh;
+} PBusDispatchCacheNode;
+
+struct PBusDispatchCache
+{
+    PBusObject * root;
+    unsigned long generation;
+    PBusDispatchCacheNode * rootNode;
+};
+
+/*
+ * Incremented whenever a static object graph is altered. Caches built under an
+ * older generation are discarded on their next use.
+ */
+static unsigned long gPBusObjectGeneration = 1;
+
 typedef void * (*PB0ParamFun) (PBusObject *, PBusInvocationContext *);
 typedef void * (*PB1ParamFun) (PBusObject *, PBusInvocationContext *,
                                const void *);
@@ -50,6 +86,87 @@ S16NVRPCMessageSignature msgSendSig = {
              {.name = "params", .type = {.kind = S16R_KNVLIST}},
              {.name = NULL}}};
 
+S16NVRPCMessageSignature PBusBrokerSubscribeToSig = {
+    .name = "subscribeTo",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 2,
+    .args = {
+        {.name = "busNamePattern", .type = {.kind = S16R_KSTRING}},
+        {.name = "notificationNamePattern", .type = {.kind = S16R_KSTRING}},
+        {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusBrokerUnsubscribeSig = {
+    .name = "unsubscribe",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 1,
+    .args = {{.name = "subscriptionID", .type = {.kind = S16R_KINT}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusBrokerPublishSig = {
+    .name = "publish",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 2,
+    .args = {{.name = "notificationName", .type = {.kind = S16R_KSTRING}},
+             {.name = "params", .type = {.kind = S16R_KNVLIST}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusReceiveNotificationSig = {
+    .name = "receiveNotification",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 4,
+    .args = {{.name = "subscriptionID", .type = {.kind = S16R_KINT}},
+             {.name = "fromBusname", .type = {.kind = S16R_KSTRING}},
+             {.name = "notificationName", .type = {.kind = S16R_KSTRING}},
+             {.name = "params", .type = {.kind = S16R_KNVLIST}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusBrokerConnectDirectSig = {
+    .name = "connectDirect",
+    .raw = false,
+    .rtype = {.kind = S16R_KDESCRIPTOR},
+    .nargs = 1,
+    .args = {{.name = "busName", .type = {.kind = S16R_KSTRING}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusDirectConnectionSig = {
+    .name = "directConnection",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 2,
+    .args = {{.name = "fromBusname", .type = {.kind = S16R_KSTRING}},
+             {.name = "descriptor", .type = {.kind = S16R_KDESCRIPTOR}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusBrokerRegisterBusNameSig = {
+    .name = "registerBusName",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 1,
+    .args = {{.name = "busName", .type = {.kind = S16R_KSTRING}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusBrokerAttachMonitorSig = {
+    .name = "attachMonitor",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 2,
+    .args = {{.name = "busNamePattern", .type = {.kind = S16R_KSTRING}},
+             {.name = "selectorPattern", .type = {.kind = S16R_KSTRING}},
+             {.name = NULL}}};
+
+S16NVRPCMessageSignature PBusMonitorFramesSig = {
+    .name = "monitorFrames",
+    .raw = false,
+    .rtype = {.kind = S16R_KINT},
+    .nargs = 2,
+    .args = {{.name = "monitorID", .type = {.kind = S16R_KINT}},
+             {.name = "batch", .type = {.kind = S16R_KNVLIST}},
+             {.name = NULL}}};
+
 static bool matchObject (PBusObject * o, const char * n)
 {
     return !strcmp (o->name, n);
@@ -113,7 +230,19 @@ static nvlist_t * sendMessage (PBusObject * self, PBusInvocationContext * ctx,
     if (!meth->messageSignature->raw)
     {
         void * result = dispatchFun (self, ctx, meth, params);
-        serialise (response, "result", &result, &meth->messageSignature->rtype);
+        S16NVRPCType * rtype = &meth->messageSignature->rtype;
+
+        if (ctx->err->code)
+        {
+            nvlist_destroy (response);
+            return NULL;
+        }
+
+        /* A handler returning a descriptor gives it up. */
+        if (rtype->kind == S16R_KDESCRIPTOR)
+            nvlist_move_descriptor (response, "result", (fdptr_t)result);
+        else
+            serialise (response, "result", &result, rtype);
     }
 
     return response;
@@ -138,13 +267,8 @@ static nvlist_t * dispatchMessage (PBusObject * self, S16NVRPCError * err,
     {
         PBusMethod * meth;
         for (int i = 0; (meth = (*self->isA->methods)[i]); i++)
-        {
-            printf ("Candidate: %s. Tofind: %s\n",
-                    meth->messageSignature->name,
-                    selector);
             if (!strcmp (selector, meth->messageSignature->name))
                 return sendMessage (self, &ctx, meth, params);
-        }
 
         printf ("Failed to find handler for %s in object %s!\n",
                 selector,
@@ -218,13 +342,12 @@ nvlist_t * PBusFindReceiver_Root (PBusObject * self, S16NVRPCError * err,
                                   const char * selector, nvlist_t * params)
 {
     PBusPathElement_list_t pathEls = PBusPathElement_list_new ();
-    char *pathCopy = NULL, *pathToSplit = NULL, *seg;
+    char *pathToSplit = NULL, *seg;
     char * saveptr = NULL;
     nvlist_t * result;
 
     if (path)
     {
-        pathCopy = strdup (path);
         pathToSplit = strdup (path);
 
         seg = strtok_r (pathToSplit, "/", &saveptr);
@@ -252,10 +375,217 @@ nvlist_t * PBusFindReceiver_Root (PBusObject * self, S16NVRPCError * err,
 
     if (path)
     {
-        free (pathCopy);
         free (pathToSplit);
         PBusPathElement_list_destroy (&pathEls);
     }
 
     return result;
 }
+
+static PBusDispatchCacheNode * cacheNodeNew (PBusObject * object,
+                                             const char * component,
+                                             size_t len)
+{
+    PBusDispatchCacheNode * node = calloc (1, sizeof (*node));
+
+    node->object = object;
+    node->component = component ? strndup (component, len) : NULL;
+
+    return node;
+}
+
+static void cacheNodeDestroy (PBusDispatchCacheNode * node)
+{
+    PBusDispatchCacheNode *child, *tmpChild;
+    PBusDispatchCacheMethod *meth, *tmpMeth;
+
+    HASH_ITER (hh, node->children, child, tmpChild)
+    {
+        HASH_DEL (node->children, child);
+        cacheNodeDestroy (child);
+    }
+
+    HASH_ITER (hh, node->methods, meth, tmpMeth)
+    {
+        HASH_DEL (node->methods, meth);
+        free (meth);
+    }
+
+    free (node->component);
+    free (node);
+}
+
+static void cacheFlush (PBusDispatchCache * cache)
+{
+    if (cache->rootNode)
+        cacheNodeDestroy (cache->rootNode);
+    cache->rootNode = NULL;
+    cache->generation = gPBusObjectGeneration;
+}
+
+static PBusObject * findStaticSubObject (PBusObject * self, const char * name,
+                                         size_t len)
+{
+    LL_each (&self->subObjects, it)
+    {
+        PBusObject * sub = list_it_val (it);
+        if (sub->name && !strncmp (sub->name, name, len) && !sub->name[len])
+            return sub;
+    }
+    return NULL;
+}
+
+/*
+ * Walks the trie along @path, filling in missing nodes from the static object
+ * graph as it goes. Returns NULL if the path is not wholly static (i.e. some
+ * object along it resolves its subobjects programmatically) or if it does not
+ * resolve; the caller should then take the slow path.
+ */
+static PBusDispatchCacheNode * cacheLookupNode (PBusDispatchCache * cache,
+                                                const char * path)
+{
+    PBusDispatchCacheNode * node;
+    const char * seg = path;
+
+    if (!cache->rootNode)
+        cache->rootNode = cacheNodeNew (cache->root, NULL, 0);
+    node = cache->rootNode;
+
+    while (*seg)
+    {
+        PBusDispatchCacheNode * child;
+        size_t len;
+
+        if (*seg == '/')
+        {
+            seg++;
+            continue;
+        }
+
+        len = strcspn (seg, "/");
+        HASH_FIND (hh, node->children, seg, len, child);
+
+        if (!child)
+        {
+            PBusObject * sub;
+
+            if (node->object->isA->fnResolveSubObject ||
+                !(sub = findStaticSubObject (node->object, seg, len)))
+                return NULL;
+
+            child = cacheNodeNew (sub, seg, len);
+            HASH_ADD_KEYPTR (hh, node->children, child->component, len, child);
+        }
+
+        node = child;
+        seg += len;
+    }
+
+    return node;
+}
+
+static PBusMethod * cacheLookupMethod (PBusDispatchCacheNode * node,
+                                       const char * selector)
+{
+    PBusDispatchCacheMethod * entry;
+    PBusMethod * meth;
+
+    HASH_FIND_STR (node->methods, selector, entry);
+    if (entry)
+        return entry->method;
+
+    for (int i = 0; (meth = (*node->object->isA->methods)[i]); i++)
+        if (!strcmp (selector, meth->messageSignature->name))
+        {
+            entry = malloc (sizeof (*entry));
+            entry->selector = meth->messageSignature->name;
+            entry->method = meth;
+            HASH_ADD_KEYPTR (
+                hh, node->methods, entry->selector, strlen (selector), entry);
+            return meth;
+        }
+
+    return NULL;
+}
+
+PBusDispatchCache * PBusDispatchCacheNew (PBusObject * root)
+{
+    PBusDispatchCache * cache = malloc (sizeof (*cache));
+
+    cache->root = root;
+    cache->rootNode = NULL;
+    cache->generation = gPBusObjectGeneration;
+
+    return cache;
+}
+
+void PBusDispatchCacheDestroy (PBusDispatchCache * cache)
+{
+    cacheFlush (cache);
+    free (cache);
+}
+
+nvlist_t * PBusDispatchCacheSend (PBusDispatchCache * cache,
+                                  S16NVRPCError * err, const char * path,
+                                  const char * fromBusname,
+                                  const char * selector, nvlist_t * params)
+{
+    PBusDispatchCacheNode * node;
+    PBusMethod * meth;
+    PBusInvocationContext ctx;
+
+    if (!path)
+        return PBusFindReceiver_Root (
+            cache->root, err, path, fromBusname, selector, params);
+
+    if (cache->generation != gPBusObjectGeneration)
+        cacheFlush (cache);
+
+    if (!(node = cacheLookupNode (cache, path)) ||
+        node->object->isA->fnDispatchMessage ||
+        !(meth = cacheLookupMethod (node, selector)))
+        return PBusFindReceiver_Root (
+            cache->root, err, path, fromBusname, selector, params);
+
+    ctx.err = err;
+    ctx.fullSelfPath = path;
+    ctx.selfPath = node->component;
+    ctx.user = NULL;
+    ctx.selector = selector;
+    ctx.fromBusname = fromBusname;
+
+    return sendMessage (node->object, &ctx, meth, params);
+}
+
+PBusObject * PBusObjectNew (PBusClass * isa, char * name, void * data)
+{
+    PBusObject * obj = malloc (sizeof (*obj));
+
+    obj->isA = isa;
+    obj->name = name ? strdup (name) : NULL;
+    obj->data = data;
+    obj->subObjects = PBusObject_list_new ();
+
+    return obj;
+}
+
+void PBusObjectDestroy (PBusObject * obj)
+{
+    PBusObject_list_destroy (&obj->subObjects);
+    free (obj->name);
+    free (obj);
+    gPBusObjectGeneration++;
+}
+
+void PBusObjectDeepDestroy (PBusObject * obj)
+{
+    LL_each (&obj->subObjects, it)
+        PBusObjectDeepDestroy (list_it_val (it));
+    PBusObjectDestroy (obj);
+}
+
+void PBusObjectAddSubObject (PBusObject * obj, PBusObject * subObj)
+{
+    PBusObject_list_add (&obj->subObjects, subObj);
+    gPBusObjectGeneration++;
+}
@@ -43,8 +43,10 @@ extern "C"
     typedef struct PBusDistantObject PBusDistantObject;
     typedef struct PBusConnection PBusConnection;
     typedef struct PBusInvocation PBusInvocation;
+    typedef struct PBusDispatchCache PBusDispatchCache;
 
     S16ListType (PBusObject, PBusObject *);
+    S16ListType (PBusConnection, PBusConnection *);
     S16ListType (PBusPathElement, char *);
 
     typedef PBusObject * (*ResolveSubObjectFun) (
@@ -55,11 +57,36 @@ extern "C"
                                               PBusInvocationContext * ctx,
                                               nvlist_t * params);
 
+    /*
+     * Called when an asynchronously-sent invocation completes. @err is NULL if
+     * it succeeded, in which case the invocation's result field is set.
+     */
+    typedef void (*PBusCompletionFun) (PBusInvocation * invocation,
+                                       S16NVRPCError * err, void * user);
+
+    /*
+     * Called when a notification to which the connection is subscribed is
+     * received.
+     */
+    typedef void (*PBusNotificationFun) (PBusConnection * connection,
+                                         int subscriptionID,
+                                         const char * fromBusname,
+                                         const char * notificationName,
+                                         const nvlist_t * params, void * user);
+
+    /*
+     * Called when a direct link to a peer is established at the peer's
+     * request. The consumer should watch the link's file descriptor as it does
+     * that of the connection.
+     */
+    typedef void (*PBusDirectLinkFun) (PBusConnection * connection,
+                                       PBusConnection * link, void * user);
+
     /*
      * A P-Bus handler function. Its arguments have all been automatically
      * deserialised, and its return type will be automatically serialised. But
      * it is the responsibility of the handler to duplicate any resources it
-     * retains.
+     * retains. A descriptor returned is closed once it has been sent.
      */
     typedef void * (*PBusFun) (PBusObject * self, PBusInvocationContext * ctx,
                                ...);
@@ -119,6 +146,22 @@ extern "C"
                                              the Broker object. */
         S16NVRPCServer * rpcServer;
         PBusObject * rootObject;
+        PBusDispatchCache * dispatchCache; /* Resolves incoming messages. */
+        S16NVRPCAsyncContext asyncContext; /* Invocations awaiting reply. */
+        PBusNotificationFun fnNotification;
+        void * notificationUser;
+
+        /*
+         * Direct links to peers, arranged through the broker. Invocations of
+         * objects at a linked peer's bus name are sent over the link.
+         */
+        PBusConnection_list_t directLinks;
+        PBusDirectLinkFun fnDirectLink;
+        void * directLinkUser;
+
+        /* For a direct link, the connection it was arranged through. */
+        PBusConnection * parent;
+        char * peerBusName; /* For a direct link, the peer's bus name. */
     };
 
     /*
@@ -137,6 +180,12 @@ extern "C"
         nvlist_t * arguments;
         bool wasSent;
         void * result;
+
+        bool isComplete;             /* Reply received or call failed. */
+        S16NVRPCError * error;       /* Set if the call failed. */
+        PBusConnection * connection; /* Connection on which it was sent. */
+        PBusCompletionFun fnCompletion;
+        void * user;
     };
 
     /*
@@ -163,11 +212,84 @@ extern "C"
      */
     int PBusConnectionConnectToSystemBroker (PBusConnection * connection);
 
+    /*
+     * Connects a PBusConnection directly to a peer over @fd, an already
+     * connected stream socket. No broker is involved.
+     */
+    void PBusConnectionConnectDirect (PBusConnection * connection, int fd);
+
+    /*
+     * Destroys a PBusConnection, closing its file descriptor and any direct
+     * links it has.
+     */
+    void PBusConnectionDestroy (PBusConnection * connection);
+
+    /*
+     * Asks the broker for a direct link to the peer known by @busName. Once
+     * established, invocations of that peer's objects through @connection
+     * are sent over the link, bypassing the broker. The consumer should watch
+     * the link's file descriptor as it does that of the connection. Returns
+     * the link, or NULL if the broker refused or the call failed.
+     */
+    PBusConnection * PBusConnectionConnectToPeer (PBusConnection * connection,
+                                                  const char * busName);
+
+    /*
+     * Sets the function called when a peer establishes a direct link to this
+     * connection.
+     */
+    void PBusConnectionSetDirectLinkHandler (PBusConnection * connection,
+                                             PBusDirectLinkFun fn,
+                                             void * user);
+
+    /*
+     * Asks the broker to know this connection by @busName. Returns 0 if
+     * successful, -1 otherwise (e.g. if the name is taken.)
+     */
+    int PBusConnectionRegisterBusName (PBusConnection * connection,
+                                       const char * busName);
+
+    /*
+     * Sets the function called when a notification is received.
+     */
+    void PBusConnectionSetNotificationHandler (PBusConnection * connection,
+                                               PBusNotificationFun fn,
+                                               void * user);
+
+    /*
+     * Subscribes to notifications published by bus names matching the glob
+     * pattern @busNamePattern with names matching @notificationNamePattern.
+     * Returns the subscription ID, or -1 if it failed.
+     */
+    int PBusConnectionSubscribe (PBusConnection * connection,
+                                 const char * busNamePattern,
+                                 const char * notificationNamePattern);
+
+    /*
+     * Cancels a subscription. Returns 0 if successful, -1 otherwise.
+     */
+    int PBusConnectionUnsubscribe (PBusConnection * connection,
+                                   int subscriptionID);
+
+    /*
+     * Publishes a notification to all subscribers. This does not wait for the
+     * broker to acknowledge it. Returns 0 if it was sent, -1 otherwise.
+     */
+    int PBusConnectionPublish (PBusConnection * connection,
+                               const char * notificationName,
+                               nvlist_t * params);
+
     /*
      * Consumers should call when data is ready for reading from the file
-     * descriptor associated with this P-Bus connection.
+     * descriptor associated with this P-Bus connection. One message is read;
+     * it may be a request, which is served, or a reply, which completes the
+     * corresponding asynchronous invocation.
+     * Returns -1 if the connection was lost, in which case all invocations in
+     * flight are failed and, if the connection is a direct link, it is
+     * detached from the connection it was arranged through and destroyed
+     * (so it must not be used again); 0 otherwise.
      */
-    void PBusConnectionReceiveFromFileDescriptor (PBusConnection * server);
+    int PBusConnectionReceiveFromFileDescriptor (PBusConnection * server);
 
     /*
      * Returns the PBusDistantObject referring to the P-Bus Broker's services,
@@ -189,6 +311,12 @@ extern "C"
     PBusInvocation *
     PBusInvocationNewWithSignature (S16NVRPCMessageSignature * signature);
 
+    /*
+     * Destroys an invocation, along with its arguments, and any result or
+     * error.
+     */
+    void PBusInvocationDestroy (PBusInvocation * invocation);
+
     /*
      * Sets up the arguments of a PBusInvocation.
      * Argument 1 must be the invocation; the remainder are the
@@ -204,6 +332,28 @@ extern "C"
     S16NVRPCError * PBusInvocationSendTo (PBusInvocation * Invocation,
                                           PBusDistantObject * object);
 
+    /*
+     * Sends a message asynchronously. The reply is processed by
+     * PBusConnectionReceiveFromFileDescriptor, which then calls @fnCompletion
+     * (if not NULL) with @user. Any number of invocations may be in flight on
+     * a connection at once. Returns 0 if the message was sent, -1 otherwise.
+     */
+    int PBusInvocationSendAsync (PBusInvocation * invocation,
+                                 PBusDistantObject * object,
+                                 PBusCompletionFun fnCompletion, void * user);
+
+    /*
+     * Returns true if an invocation sent asynchronously has completed.
+     */
+    bool PBusInvocationIsComplete (PBusInvocation * invocation);
+
+    /*
+     * Waits for an invocation sent asynchronously to complete, serving
+     * requests and processing other replies arriving meanwhile. Returns NULL if
+     * it succeeded, otherwise returns an error description.
+     */
+    S16NVRPCError * PBusInvocationWait (PBusInvocation * invocation);
+
     /*
      * Creates a new PBusObject of class @isa, name @name, and with user
      * data
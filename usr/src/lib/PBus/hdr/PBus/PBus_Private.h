@@ -34,12 +34,33 @@ extern "C"
 #include "PBus/PBus.h"
 
 #define kPBusSocketPath "/var/run/PBus.sock"
+#define kPBusBrokerBusName "PBus-Broker"
+
+/* Error code for a request the broker refuses to carry out. */
+#define kPBusErrorNotPermitted -32000
 
     nvlist_t * PBusFindReceiver_Root (PBusObject * obj, S16NVRPCError * err,
                                       const char * path,
                                       const char * fromBusname,
                                       const char * selector, nvlist_t * params);
 
+    /*
+     * Creates a dispatch cache for messages sent to objects under @root. The
+     * cache remembers the object and method that each (path, selector) pair
+     * resolved to, so long as the path passes only through static subobjects.
+     * It is discarded automatically whenever a static object graph changes.
+     */
+    PBusDispatchCache * PBusDispatchCacheNew (PBusObject * root);
+    void PBusDispatchCacheDestroy (PBusDispatchCache * cache);
+
+    /*
+     * Like PBusFindReceiver_Root, but consults and fills in the cache first.
+     */
+    nvlist_t * PBusDispatchCacheSend (PBusDispatchCache * cache,
+                                      S16NVRPCError * err, const char * path,
+                                      const char * fromBusname,
+                                      const char * selector, nvlist_t * params);
+
     /*
      * NVList(SendResult) msgSend(fromBusname: String, objectPath: String,
      *                            selector: String, params: NVList)
@@ -52,6 +73,86 @@ extern "C"
      */
     extern S16NVRPCMessageSignature msgSendSig;
 
+    /*
+     * Methods of the broker object.
+     *
+     * Int subscribeTo(busNamePattern: String, notificationNamePattern: String)
+     * Subscribes to notifications published by bus names matching the first
+     * glob pattern, with names matching the second. Returns an ID by which
+     * this subscription rule will be known and can be deleted by, and which is
+     * attached to all receiveNotification messages.
+     *
+     * Int unsubscribe(subscriptionID: Int)
+     * Returns 0 if the subscription was deleted, -1 if there was none.
+     *
+     * Int publish(notificationName: String, params: NVList)
+     * Publishes a notification. Returns the number of subscriptions to which
+     * it was delivered.
+     *
+     * Descriptor connectDirect(busName: String)
+     * Creates a direct link to the client known by busName, if the caller is
+     * permitted one. One end of a socket pair is returned; the other is sent to
+     * the peer in a directConnection notification.
+     *
+     * Int registerBusName(busName: String)
+     * Returns 0 if this connection is henceforth known by busName, -1 if the
+     * name is already taken.
+     *
+     * Int attachMonitor(busNamePattern: String, selectorPattern: String)
+     * Begins delivery to the caller of monitorFrames notifications carrying
+     * the traffic through the broker in which either end has a bus name
+     * matching the first glob pattern and the selector matches the second.
+     * Returns the monitor ID. The monitor lasts until the caller disconnects.
+     */
+    extern S16NVRPCMessageSignature PBusBrokerSubscribeToSig;
+    extern S16NVRPCMessageSignature PBusBrokerUnsubscribeSig;
+    extern S16NVRPCMessageSignature PBusBrokerPublishSig;
+    extern S16NVRPCMessageSignature PBusBrokerConnectDirectSig;
+    extern S16NVRPCMessageSignature PBusBrokerRegisterBusNameSig;
+    extern S16NVRPCMessageSignature PBusBrokerAttachMonitorSig;
+
+    /*
+     * receiveNotification(subscriptionID: Int, fromBusname: String,
+     *                     notificationName: String, params: NVList)
+     * Sent by the broker, as a notification, to each matching subscriber.
+     */
+    extern S16NVRPCMessageSignature PBusReceiveNotificationSig;
+
+    /*
+     * directConnection(fromBusname: String, descriptor: Descriptor)
+     * Sent by the broker, as a notification, to the peer of a connectDirect
+     * call.
+     */
+    extern S16NVRPCMessageSignature PBusDirectConnectionSig;
+
+    /*
+     * monitorFrames(monitorID: Int, batch: NVList)
+     * Sent by the broker, as a notification, to each monitor after every pass
+     * of its event loop in which traffic passing the monitor's filters was
+     * captured. The batch holds "records", a binary of capture records in the
+     * format below (absent if there were none), and "dropped", the number of
+     * records lost to overflow of the broker's capture ring since the last
+     * batch.
+     */
+    extern S16NVRPCMessageSignature PBusMonitorFramesSig;
+
+/*
+ * The capture file format. A capture file begins with the eight bytes of
+ * kPBusCaptureMagic; a series of records follows. Each record is a
+ * PBusCaptureRecordHeader, in host byte order, then @length bytes of a packed
+ * nvlist: {fromBusname: String, toBusname: String, selector: String,
+ * message: NVList}. The message is absent if it carried descriptors.
+ */
+#define kPBusCaptureMagic "PBUSCAP1"
+#define kPBusCaptureMagicLen 8
+
+    typedef struct
+    {
+        uint64_t timestamp; /* Nanoseconds since the epoch */
+        uint32_t length;    /* Of the packed nvlist following */
+        uint32_t reserved;
+    } PBusCaptureRecordHeader;
+
     /*Returns: struct { error: number, result: variable } SendResult;
 
     To Bus: SendResult msgSend( endPoint: string, objectPath: list[string],
@@ -23,7 +23,10 @@
  * Use is subject to license terms.
  */
 
+#include <sys/socket.h>
+
 #include <atf-c.h>
+#include <unistd.h>
 
 #include "S16/NVRPC.h"
 
@@ -52,10 +55,27 @@ static void * testFun (PBusObject * self, PBusInvocationContext * ctx,
     return "Done!";
 }
 
+S16NVRPCMessageSignature echoSig = {
+    .name = "Echo",
+    .raw = false,
+    .rtype = {.kind = S16R_KSTRING},
+    .nargs = 1,
+    .args = {{.name = "str", .type = {.kind = S16R_KSTRING}}, {.name = NULL}}};
+
+static void * echoFun (PBusObject * self, PBusInvocationContext * ctx,
+                       const char * str)
+{
+    ATF_CHECK_STREQ ("b/c", ctx->fullSelfPath);
+    return strdup (str);
+}
+
 PBusMethod testMeth = {.fnImplementation = (PBusFun)testFun,
                        .messageSignature = &testMethSig};
 
-PBusMethod * testMethSigs[2] = {&testMeth, NULL};
+PBusMethod echoMeth = {.fnImplementation = (PBusFun)echoFun,
+                       .messageSignature = &echoSig};
+
+PBusMethod * testMethSigs[3] = {&testMeth, &echoMeth, NULL};
 
 PBusClass testCls = {.methods = &testMethSigs};
 
@@ -69,7 +89,7 @@ ATF_TC_BODY (send_message, tc)
     PBusObject *a, *b, *c;
     nvlist_t * params = nvlist_create (0);
     nvlist_t * res;
-    S16NVRPCError err;
+    S16NVRPCError err = {0};
 
     nvlist_add_string (params, "argA", "Hello");
     nvlist_add_string (params, "argB", "World");
@@ -101,8 +121,115 @@ ATF_TC_BODY (send_message, tc)
     destroyObj (c);
 }
 
+ATF_TC (cached_dispatch);
+ATF_TC_HEAD (cached_dispatch, tc)
+{
+    atf_tc_set_md_var (tc, "descr", "Test cached dispatch and invalidation.");
+}
+ATF_TC_BODY (cached_dispatch, tc)
+{
+    PBusObject *a, *b, *c;
+    PBusDispatchCache * cache;
+    nvlist_t * params = nvlist_create (0);
+    S16NVRPCError err = {0};
+
+    nvlist_add_string (params, "argA", "Hello");
+    nvlist_add_string (params, "argB", "World");
+
+    a = PBusObjectNew (&testCls, "a", NULL);
+    b = PBusObjectNew (&testCls, "b", NULL);
+    c = PBusObjectNew (&testCls, "c", NULL);
+    PBusObjectAddSubObject (a, b);
+
+    cache = PBusDispatchCacheNew (a);
+
+    /* Not yet present: must fail, and must not be remembered as failing. */
+    ATF_CHECK (!PBusDispatchCacheSend (
+        cache, &err, "b/c", "pbus:/system/testSvc", "TestMeth", params));
+
+    PBusObjectAddSubObject (b, c);
+
+    for (int i = 0; i < 2; i++)
+    {
+        nvlist_t * res = PBusDispatchCacheSend (
+            cache, &err, "b/c", "pbus:/system/testSvc", "TestMeth", params);
+        ATF_REQUIRE (res);
+        ATF_CHECK_STREQ ("Done!", nvlist_get_string (res, "result"));
+        nvlist_destroy (res);
+    }
+
+    PBusDispatchCacheDestroy (cache);
+    PBusObjectDeepDestroy (a);
+    nvlist_destroy (params);
+}
+
+static void echoCompleted (PBusInvocation * invocation, S16NVRPCError * err,
+                           void * user)
+{
+    int * nCompleted = user;
+
+    ATF_REQUIRE (!err);
+    ATF_CHECK_STREQ (*nCompleted ? "second" : "first",
+                     nvlist_get_string (invocation->result, "result"));
+    (*nCompleted)++;
+}
+
+ATF_TC (send_async);
+ATF_TC_HEAD (send_async, tc)
+{
+    atf_tc_set_md_var (tc, "descr", "Test concurrent asynchronous sends.");
+}
+ATF_TC_BODY (send_async, tc)
+{
+    PBusObject *a, *b, *c;
+    PBusConnection *server, *client;
+    PBusDistantObject * remote;
+    PBusInvocation *first, *second;
+    int sv[2], nCompleted = 0;
+
+    a = PBusObjectNew (&testCls, "a", NULL);
+    b = PBusObjectNew (&testCls, "b", NULL);
+    c = PBusObjectNew (&testCls, "c", NULL);
+    PBusObjectAddSubObject (a, b);
+    PBusObjectAddSubObject (b, c);
+
+    ATF_REQUIRE (!socketpair (AF_UNIX, SOCK_STREAM, 0, sv));
+    server = PBusConnectionNew (a);
+    client = PBusConnectionNew (NULL);
+    PBusConnectionConnectDirect (server, sv[0]);
+    PBusConnectionConnectDirect (client, sv[1]);
+    remote = PBusDistantObjectNew (client, "", "b/c");
+
+    first = PBusInvocationNewWithSignature (&echoSig);
+    PBusInvocationSetArguments (first, "first");
+    second = PBusInvocationNewWithSignature (&echoSig);
+    PBusInvocationSetArguments (second, "second");
+
+    ATF_REQUIRE (
+        !PBusInvocationSendAsync (first, remote, echoCompleted, &nCompleted));
+    ATF_REQUIRE (
+        !PBusInvocationSendAsync (second, remote, echoCompleted, &nCompleted));
+    ATF_CHECK (!PBusInvocationIsComplete (first));
+
+    /* Serve both requests before either reply is read. */
+    ATF_REQUIRE (!PBusConnectionReceiveFromFileDescriptor (server));
+    ATF_REQUIRE (!PBusConnectionReceiveFromFileDescriptor (server));
+
+    ATF_CHECK (!PBusInvocationWait (second));
+    ATF_CHECK (PBusInvocationIsComplete (first));
+    ATF_CHECK_EQ (2, nCompleted);
+
+    PBusInvocationDestroy (first);
+    PBusInvocationDestroy (second);
+    close (sv[0]);
+    close (sv[1]);
+    PBusObjectDeepDestroy (a);
+}
+
 ATF_TP_ADD_TCS (tp)
 {
     ATF_TP_ADD_TC (tp, send_message);
+    ATF_TP_ADD_TC (tp, cached_dispatch);
+    ATF_TP_ADD_TC (tp, send_async);
     return atf_no_error ();
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Note coalescing. A cascade often queues several notes about the same
+ * path in one go, some of which are made redundant by those following. Before
+ * a queue is drained, s16note_list_coalesce removes them, so that consumers
+ * act once on the outcome rather than on each step towards it.
+ *
+ * A note is only ever weighed against the last surviving note about the same
+ * path in the queue, and then only if both are of the same note_type; a note
+ * of another type about the path in between keeps both. The rules are:
+ *
+ *  - A note identical (in type and reason) to that last note is redundant,
+ *    and is elided. This applies to every note_type.
+ *  - N_ADMIN_REQ: an A_ENABLE or A_DISABLE supersedes an earlier A_ENABLE or
+ *    A_DISABLE; the administrator's last word wins.
+ *  - N_RESTARTER_REQ: an RR_ENABLE or RR_DISABLE supersedes an earlier
+ *    RR_ENABLE or RR_DISABLE. An RR_STOP supersedes an earlier RR_START, as
+ *    the instance was never to be started. The reverse is a restart, and both
+ *    are kept.
+ *  - N_STATE_CHANGE: only duplicates are elided. Every transition matters to
+ *    the graph: offline followed by online must still restart dependents.
+ *  - N_CONFIG: two CF_CHANGED notes are merged, the later taking the union
+ *    of their diffs. A CF_CHANGED after a CF_ADDED is elided, as consumers
+ *    take the new service or instance as they find it; one before a
+ *    CF_REMOVED is elided too. An addition and a removal are both kept.
+ *
+ * When a note supersedes another, the earlier is elided and the later kept
+ * where it is. Nothing is ever moved, so the relative order of notes about
+ * different paths is preserved.
+ */
+
+#include <stdlib.h>
+
+#include "S16/Repository_Private.h"
+#include "uthash.h"
+
+typedef struct last_note_s
+{
+    char * path;
+    s16note_list_it node;
+    UT_hash_handle hh;
+} last_note_t;
+
+typedef enum
+{
+    kKeepBoth,
+    kElideNewer,
+    kElideOlder,
+    /* Elide the older, after merging its diff into the newer's. */
+    kMerge,
+} coalesce_verdict_t;
+
+static bool is_pair (int a, int b, int x, int y)
+{
+    return (a == x || a == y) && (b == x || b == y);
+}
+
+static coalesce_verdict_t judge_config (const s16note_t * older,
+                                        const s16note_t * newer)
+{
+    if (older->type == CF_CHANGED && newer->type == CF_CHANGED)
+        return older->diff && newer->diff ? kMerge : kElideNewer;
+    else if (older->type == newer->type)
+        return kElideNewer;
+    else if (older->type == CF_ADDED && newer->type == CF_CHANGED)
+        return kElideNewer;
+    else if (older->type == CF_CHANGED && newer->type == CF_REMOVED)
+        return kElideOlder;
+
+    return kKeepBoth;
+}
+
+static coalesce_verdict_t judge (const s16note_t * older,
+                                 const s16note_t * newer)
+{
+    if (older->note_type != newer->note_type)
+        return kKeepBoth;
+
+    /* Their diffs differ, even where type and reason do not. */
+    if (newer->note_type == N_CONFIG)
+        return judge_config (older, newer);
+
+    if (older->type == newer->type && older->reason == newer->reason)
+        return kElideNewer;
+
+    switch (newer->note_type)
+    {
+    case N_ADMIN_REQ:
+        if (is_pair (older->type, newer->type, A_ENABLE, A_DISABLE))
+            return kElideOlder;
+        break;
+
+    case N_RESTARTER_REQ:
+        if (is_pair (older->type, newer->type, RR_ENABLE, RR_DISABLE))
+            return kElideOlder;
+        if (older->type == RR_START && newer->type == RR_STOP)
+            return kElideOlder;
+        break;
+
+    case N_STATE_CHANGE:
+        break;
+
+    case N_CONFIG:
+        break;
+    }
+
+    return kKeepBoth;
+}
+
+size_t s16note_list_coalesce (s16note_list_t * notes)
+{
+    last_note_t * lasts = NULL, * last, * tmp;
+    s16note_list_it it, prev, next;
+    size_t elided = 0;
+
+    /* Elided notes are destroyed at once, but their nodes are left with a
+     * NULL value and only unlinked afterwards, as the table refers to them. */
+    for (it = list_begin (notes); it != NULL; it = list_next (it))
+    {
+        char * path = S16PathToString (it->val->path);
+
+        HASH_FIND_STR (lasts, path, last);
+
+        if (!last)
+        {
+            last = malloc (sizeof (*last));
+            last->path = path;
+            last->node = it;
+            HASH_ADD_KEYPTR (hh, lasts, last->path, strlen (last->path), last);
+            continue;
+        }
+
+        free (path);
+
+        switch (judge (last->node->val, it->val))
+        {
+        case kElideNewer:
+            s16note_destroy (it->val);
+            it->val = NULL;
+            elided++;
+            continue;
+
+        case kMerge:
+            s16note_config_diff_merge (it->val->diff, last->node->val->diff);
+            /* fall through */
+        case kElideOlder:
+            s16note_destroy (last->node->val);
+            last->node->val = NULL;
+            elided++;
+            break;
+
+        case kKeepBoth:
+            break;
+        }
+
+        last->node = it;
+    }
+
+    HASH_ITER (hh, lasts, last, tmp)
+    {
+        HASH_DEL (lasts, last);
+        free (last->path);
+        free (last);
+    }
+
+    for (prev = NULL, it = list_begin (notes); it != NULL; it = next)
+    {
+        next = list_next (it);
+
+        if (it->val)
+        {
+            prev = it;
+            continue;
+        }
+
+        if (prev)
+            prev->Link = next;
+        else
+            notes->List = next;
+        s16mem_free (it);
+    }
+
+    return elided;
+}
@@ -133,33 +133,42 @@ void u_add_meths (ucl_object_t * obj, meth_list_t * meths)
         ucl_array_append (arr, s16db_meth_to_ucl (it->val));
 }
 
-ucl_object_t * s16db_inst_to_ucl (S16ServiceInstance * inst)
+ucl_object_t * s16db_inst_to_ucl_projected (S16ServiceInstance * inst,
+                                            int proj)
 {
     ucl_object_t * uinst = ucl_object_typed_new (UCL_OBJECT);
     char * path = S16PathToString (inst->path);
 
     ins_key (uinst, "path", path);
 
-    if (!prop_list_empty (&inst->props))
+    if ((proj & S16DB_PROJ_PROPS) && !prop_list_empty (&inst->props))
         u_add_props (uinst, &inst->props);
 
-    if (!meth_list_empty (&inst->meths))
+    if ((proj & S16DB_PROJ_METHODS) && !meth_list_empty (&inst->meths))
         u_add_meths (uinst, &inst->meths);
 
-    if (!depgroup_list_empty (&inst->depgroups))
+    if ((proj & S16DB_PROJ_DEPGROUPS) &&
+        !depgroup_list_empty (&inst->depgroups))
         u_add_depgroups (uinst, &inst->depgroups);
 
-    ucl_object_insert_key (
-        uinst, ucl_object_frombool (inst->enabled), "enabled", 0, 1);
-    ucl_object_insert_key (
-        uinst, ucl_object_fromint (inst->state), "state", 0, 1);
+    if (proj & S16DB_PROJ_ENABLED)
+        ucl_object_insert_key (
+            uinst, ucl_object_frombool (inst->enabled), "enabled", 0, 1);
+    if (proj & S16DB_PROJ_STATE)
+        ucl_object_insert_key (
+            uinst, ucl_object_fromint (inst->state), "state", 0, 1);
 
     free (path);
 
     return uinst;
 }
 
-ucl_object_t * s16db_S16Serviceo_ucl (S16Service * svc)
+ucl_object_t * s16db_inst_to_ucl (S16ServiceInstance * inst)
+{
+    return s16db_inst_to_ucl_projected (inst, S16DB_PROJ_ALL);
+}
+
+ucl_object_t * s16db_S16Serviceo_ucl_projected (S16Service * svc, int proj)
 {
     ucl_object_t * usvc = ucl_object_typed_new (UCL_OBJECT);
     char * path = S16PathToString (svc->path);
@@ -168,10 +177,10 @@ ucl_object_t * s16db_S16Serviceo_ucl (S16Service * svc)
     if (svc->def_inst)
         ins_key (usvc, "default-instance", svc->def_inst);
 
-    if (!prop_list_empty (&svc->props))
+    if ((proj & S16DB_PROJ_PROPS) && !prop_list_empty (&svc->props))
         u_add_props (usvc, &svc->props);
 
-    if (!meth_list_empty (&svc->meths))
+    if ((proj & S16DB_PROJ_METHODS) && !meth_list_empty (&svc->meths))
         u_add_meths (usvc, &svc->meths);
 
     if (!inst_list_empty (&svc->insts))
@@ -179,19 +188,50 @@ ucl_object_t * s16db_S16Serviceo_ucl (S16Service * svc)
         ucl_object_t * arr = ins_key_arr (usvc, "instances");
         for (inst_list_it it = inst_list_begin (&svc->insts); it != NULL;
              it = inst_list_it_next (it))
-            ucl_array_append (arr, s16db_inst_to_ucl (it->val));
+            ucl_array_append (arr,
+                              s16db_inst_to_ucl_projected (it->val, proj));
     }
-    if (!depgroup_list_empty (&svc->depgroups))
+    if ((proj & S16DB_PROJ_DEPGROUPS) && !depgroup_list_empty (&svc->depgroups))
         u_add_depgroups (usvc, &svc->depgroups);
 
-    ucl_object_insert_key (
-        usvc, ucl_object_fromint (svc->state), "state", 0, 1);
+    if (proj & S16DB_PROJ_STATE)
+        ucl_object_insert_key (
+            usvc, ucl_object_fromint (svc->state), "state", 0, 1);
 
     free (path);
 
     return usvc;
 }
 
+ucl_object_t * s16db_S16Serviceo_ucl (S16Service * svc)
+{
+    return s16db_S16Serviceo_ucl_projected (svc, S16DB_PROJ_ALL);
+}
+
+static void names_to_ucl (ucl_object_t * udiff, const char * key,
+                          const s16note_names_t * names)
+{
+    ucl_object_t * arr = ins_key_arr (udiff, key);
+
+    for (size_t i = 0; i < names->n; i++)
+        ucl_array_append (arr, ucl_object_fromstring (names->names[i]));
+}
+
+static ucl_object_t * diff_to_ucl (const s16note_config_diff_t * diff)
+{
+    ucl_object_t * udiff = ucl_object_typed_new (UCL_OBJECT);
+
+    names_to_ucl (udiff, "properties", &diff->props);
+    names_to_ucl (udiff, "methods", &diff->meths);
+    names_to_ucl (udiff, "dependencies", &diff->depgroups);
+    ucl_object_insert_key (
+        udiff, ucl_object_frombool (diff->enabled), "enabled", 0, 1);
+    ucl_object_insert_key (
+        udiff, ucl_object_frombool (diff->insts), "instances", 0, 1);
+
+    return udiff;
+}
+
 ucl_object_t * s16db_note_to_ucl (const s16note_t * note)
 {
     ucl_object_t * unote = ucl_object_typed_new (UCL_OBJECT);
@@ -204,12 +244,65 @@ ucl_object_t * s16db_note_to_ucl (const s16note_t * note)
     ins_key (unote, "path", path);
     ucl_object_insert_key (
         unote, ucl_object_fromint (note->reason), "reason", 0, 1);
+    if (note->diff)
+        ucl_object_insert_key (unote, diff_to_ucl (note->diff), "diff", 0, 1);
 
     free (path);
 
     return unote;
 }
 
+ucl_object_t * s16db_note_filter_to_ucl (const s16db_note_filter_t * filter)
+{
+    ucl_object_t * ufilter = ucl_object_typed_new (UCL_OBJECT);
+    ucl_object_t * uprefixes = ins_key_arr (ufilter, "prefixes");
+    ucl_object_t * uinsts = ins_key_arr (ufilter, "instances");
+
+    for (size_t i = 0; i < filter->nsvc_prefixes; i++)
+        ucl_array_append (uprefixes,
+                          ucl_object_fromstring (filter->svc_prefixes[i]));
+    for (size_t i = 0; i < filter->ninsts; i++)
+        ucl_array_append (uinsts, s16db_S16Patho_ucl (filter->insts[i]));
+    ucl_object_insert_key (
+        ufilter, ucl_object_fromint (filter->types), "types", 0, 1);
+
+    return ufilter;
+}
+
+ucl_object_t * s16db_query_to_ucl (const s16db_query_t * query)
+{
+    ucl_object_t * upred = ucl_object_typed_new (UCL_OBJECT);
+
+    if (query->has_state)
+        ucl_object_insert_key (
+            upred, ucl_object_fromint (query->state), "state", 0, 1);
+    if (query->has_enabled)
+        ucl_object_insert_key (
+            upred, ucl_object_frombool (query->enabled), "enabled", 0, 1);
+    if (query->prop_name)
+    {
+        ucl_object_t * uprop = ucl_object_typed_new (UCL_OBJECT);
+
+        ucl_object_insert_key (
+            uprop, ucl_object_fromstring (query->prop_name), "name", 0, 1);
+        if (query->prop_value)
+            ucl_object_insert_key (uprop,
+                                   ucl_object_fromstring (query->prop_value),
+                                   query->prop_prefix ? "prefix" : "equals",
+                                   0,
+                                   1);
+        ucl_object_insert_key (upred, uprop, "property", 0, 1);
+    }
+    if (query->depends_on)
+        ucl_object_insert_key (
+            upred, s16db_S16Patho_ucl (query->depends_on), "depends-on", 0, 1);
+    if (query->path_glob)
+        ucl_object_insert_key (
+            upred, ucl_object_fromstring (query->path_glob), "path", 0, 1);
+
+    return upred;
+}
+
 /******************************************************
  * Conversions from UCL to internal representation
  ******************************************************/
@@ -325,8 +418,8 @@ S16Property * s16db_ucl_to_prop (const ucl_object_t * obj)
     assert (ucl_object_type (val) == UCL_STRING);
 
     prop->type = kS16PropertyTypeString;
-    prop->name = strdup (ucl_object_tostring (name));
-    prop->value.s = strdup (ucl_object_tostring (val));
+    prop->name = s16str_intern (ucl_object_tostring (name));
+    prop->value.s = s16str_intern (ucl_object_tostring (val));
 
     return prop;
 
@@ -373,7 +466,7 @@ S16ServiceMethod * s16db_ucl_to_meth (const ucl_object_t * obj)
     assert (ucl_object_type (name) == UCL_STRING);
     assert (ucl_object_type (props) == UCL_ARRAY);
 
-    meth->name = strdup (ucl_object_tostring (name));
+    meth->name = s16str_intern (ucl_object_tostring (name));
     add_props (props, &meth->props);
 
     return meth;
@@ -544,15 +637,111 @@ svc_list_t s16db_ucl_to_svcs (const ucl_object_t * usvcs)
     return svcs;
 }
 
+int s16db_canonicalise_manifest (ucl_object_t * usvc)
+{
+    ucl_object_t * uname = ucl_object_pop_key (usvc, "name");
+    const ucl_object_t * uinsts = ucl_object_lookup (usvc, "instances");
+    const char * name = ucl_object_tostring (uname);
+
+    if (!name)
+    {
+        if (uname)
+            ucl_object_unref (uname);
+        return -1;
+    }
+
+    ucl_object_insert_key (usvc, uname, "path", 0, 1);
+
+    if (uinsts)
+    {
+        ucl_object_t * uinst;
+        ucl_object_iter_t it = NULL;
+
+        while ((uinst = (ucl_object_t *)ucl_object_iterate (uinsts, &it, true)))
+        {
+            ucl_object_t * uname = ucl_object_pop_key (uinst, "name");
+            char * path;
+
+            asprintf (&path, "%s:%s", name, ucl_object_tostring (uname));
+            ucl_object_insert_key (
+                uinst, ucl_object_fromstring (path), "path", 0, 1);
+
+            if (uname)
+                ucl_object_unref (uname);
+            free (path);
+        }
+    }
+
+    return 0;
+}
+
+S16Service * s16db_parse_manifest (const char * path, char ** err)
+{
+    struct ucl_parser * parser = ucl_parser_new (0);
+    ucl_object_t * usvc = NULL;
+    S16Service * svc = NULL;
+
+    *err = NULL;
+    ucl_parser_add_file (parser, path);
+
+    if (ucl_parser_get_error (parser))
+        asprintf (
+            err, "Manifest parser error: %s", ucl_parser_get_error (parser));
+    else if (!(usvc = ucl_parser_get_object (parser)) ||
+             ucl_object_type (usvc) != UCL_OBJECT ||
+             s16db_canonicalise_manifest (usvc))
+        *err = strdup ("Manifest names no service");
+    else if (!(svc = s16db_ucl_to_svc (usvc)))
+        *err = strdup ("Invalid service description");
+
+    if (usvc)
+        ucl_object_unref (usvc);
+    ucl_parser_free (parser);
+
+    return svc;
+}
+
+static void ucl_to_names (const ucl_object_t * udiff, const char * key,
+                          s16note_names_t * names)
+{
+    const ucl_object_t * arr = ucl_object_lookup (udiff, key);
+    const ucl_object_t * uname;
+    ucl_object_iter_t it = NULL;
+
+    if (!arr || ucl_object_type (arr) != UCL_ARRAY)
+        return;
+
+    while ((uname = ucl_iterate_object (arr, &it, true)))
+        if (ucl_object_type (uname) == UCL_STRING)
+            s16note_names_add (names, ucl_object_tostring (uname));
+}
+
+static s16note_config_diff_t * ucl_to_diff (const ucl_object_t * udiff)
+{
+    s16note_config_diff_t * diff = calloc (1, sizeof (*diff));
+    const ucl_object_t * uflag;
+
+    ucl_to_names (udiff, "properties", &diff->props);
+    ucl_to_names (udiff, "methods", &diff->meths);
+    ucl_to_names (udiff, "dependencies", &diff->depgroups);
+    if ((uflag = ucl_object_lookup (udiff, "enabled")))
+        diff->enabled = ucl_object_toboolean (uflag);
+    if ((uflag = ucl_object_lookup (udiff, "instances")))
+        diff->insts = ucl_object_toboolean (uflag);
+
+    return diff;
+}
+
 s16note_t * s16db_ucl_to_note (const ucl_object_t * unote)
 {
     s16note_t * note = malloc (sizeof (s16note_t));
-    const ucl_object_t *unote_type, *utype, *upath, *ureason;
+    const ucl_object_t *unote_type, *utype, *upath, *ureason, *udiff;
 
     unote_type = ucl_object_lookup (unote, "note-type");
     utype = ucl_object_lookup (unote, "type");
     upath = ucl_object_lookup (unote, "path");
     ureason = ucl_object_lookup (unote, "reason");
+    udiff = ucl_object_lookup (unote, "diff");
 
     assert (unote_type && ucl_object_type (unote_type) == UCL_INT);
     assert (utype && ucl_object_type (utype) == UCL_INT);
@@ -563,6 +752,9 @@ s16note_t * s16db_ucl_to_note (const ucl_object_t * unote)
     note->type = ucl_object_toint (utype);
     note->path = s16db_ucl_to_path (upath);
     note->reason = ucl_object_toint (ureason);
+    note->diff = udiff && ucl_object_type (udiff) == UCL_OBJECT
+                     ? ucl_to_diff (udiff)
+                     : NULL;
 
     return note;
 }
\ No newline at end of file
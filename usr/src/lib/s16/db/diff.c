@@ -0,0 +1,284 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Configuration diffs. When configd merges a new form of a service, it
+ * compares it with the old, and describes in an N_CONFIG note what changed:
+ * which properties, methods, and depgroups, and whether instances came, went,
+ * or were enabled or disabled. Consumers reconfigure just what is named, not
+ * the whole service.
+ *
+ * Properties are compared by type and value; methods by their properties;
+ * depgroups by type, restart-on condition, and paths, in order. Names are
+ * interned, so that sets of them are compared by pointer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "S16/Core.h"
+#include "S16/Repository_Private.h"
+
+static bool streq (const char * a, const char * b)
+{
+    if (a == b)
+        return true;
+    else if (!a || !b)
+        return false;
+    return !strcmp (a, b);
+}
+
+void s16note_names_add (s16note_names_t * names, const char * name)
+{
+    char * str = s16str_intern (name);
+
+    if (s16note_names_contain (names, str))
+    {
+        s16str_release (str);
+        return;
+    }
+
+    names->names =
+        realloc (names->names, (names->n + 1) * sizeof (*names->names));
+    names->names[names->n++] = str;
+}
+
+bool s16note_names_contain (const s16note_names_t * names, const char * name)
+{
+    for (size_t i = 0; i < names->n; i++)
+        if (streq (names->names[i], name))
+            return true;
+
+    return false;
+}
+
+static void names_destroy (s16note_names_t * names)
+{
+    for (size_t i = 0; i < names->n; i++)
+        s16str_release (names->names[i]);
+    free (names->names);
+}
+
+static bool prop_equal (const S16Property * a, const S16Property * b)
+{
+    if (a->type != b->type)
+        return false;
+    else if (a->type == kS16PropertyTypeString)
+        return streq (a->value.s, b->value.s);
+    return a->value.i == b->value.i;
+}
+
+static const S16Property * prop_find (const prop_list_t * props,
+                                      const char * name)
+{
+    list_foreach (prop, props, it)
+        if (streq (it->val->name, name))
+            return it->val;
+
+    return NULL;
+}
+
+/* Adds to @out the names of properties in only one of @old and @now, or
+ * differing between them. */
+static void diff_props (const prop_list_t * old, const prop_list_t * now,
+                        s16note_names_t * out)
+{
+    list_foreach (prop, now, it)
+    {
+        const S16Property * was = prop_find (old, it->val->name);
+
+        if (!was || !prop_equal (was, it->val))
+            s16note_names_add (out, it->val->name);
+    }
+
+    list_foreach (prop, old, it)
+        if (!prop_find (now, it->val->name))
+            s16note_names_add (out, it->val->name);
+}
+
+static bool props_equal (const prop_list_t * a, const prop_list_t * b)
+{
+    s16note_names_t names = {NULL, 0};
+    bool equal;
+
+    diff_props (a, b, &names);
+    equal = !names.n;
+    names_destroy (&names);
+
+    return equal;
+}
+
+static const S16ServiceMethod * meth_find (const meth_list_t * meths,
+                                           const char * name)
+{
+    list_foreach (meth, meths, it)
+        if (streq (it->val->name, name))
+            return it->val;
+
+    return NULL;
+}
+
+static void diff_meths (const meth_list_t * old, const meth_list_t * now,
+                        s16note_names_t * out)
+{
+    list_foreach (meth, now, it)
+    {
+        const S16ServiceMethod * was = meth_find (old, it->val->name);
+
+        if (!was || !props_equal (&was->props, &it->val->props))
+            s16note_names_add (out, it->val->name);
+    }
+
+    list_foreach (meth, old, it)
+        if (!meth_find (now, it->val->name))
+            s16note_names_add (out, it->val->name);
+}
+
+static const S16DependencyGroup * depgroup_find (const depgroup_list_t * dgs,
+                                                 const char * name)
+{
+    list_foreach (depgroup, dgs, it)
+        if (streq (it->val->name, name))
+            return it->val;
+
+    return NULL;
+}
+
+static bool depgroup_equal (const S16DependencyGroup * a,
+                            const S16DependencyGroup * b)
+{
+    path_list_it ia, ib;
+
+    if (a->type != b->type || a->restart_on != b->restart_on)
+        return false;
+
+    for (ia = list_begin (&a->paths), ib = list_begin (&b->paths);
+         ia && ib;
+         ia = list_next (ia), ib = list_next (ib))
+        if (!S16PathEqual (ia->val, ib->val))
+            return false;
+
+    return !ia && !ib;
+}
+
+static void diff_depgroups (const depgroup_list_t * old,
+                            const depgroup_list_t * now,
+                            s16note_names_t * out)
+{
+    list_foreach (depgroup, now, it)
+    {
+        const S16DependencyGroup * was = depgroup_find (old, it->val->name);
+
+        if (!was || !depgroup_equal (was, it->val))
+            s16note_names_add (out, it->val->name);
+    }
+
+    list_foreach (depgroup, old, it)
+        if (!depgroup_find (now, it->val->name))
+            s16note_names_add (out, it->val->name);
+}
+
+static bool diff_empty (const s16note_config_diff_t * diff)
+{
+    return !diff->props.n && !diff->meths.n && !diff->depgroups.n &&
+           !diff->enabled && !diff->insts;
+}
+
+/* Returns @diff, or NULL if it is empty. */
+static s16note_config_diff_t * nonempty (s16note_config_diff_t * diff)
+{
+    if (!diff_empty (diff))
+        return diff;
+
+    s16note_config_diff_destroy (diff);
+    return NULL;
+}
+
+static bool has_inst (const S16Service * svc, const S16ServiceInstance * inst)
+{
+    list_foreach (inst, &svc->insts, it)
+        if (streq (it->val->path->inst, inst->path->inst))
+            return true;
+
+    return false;
+}
+
+s16note_config_diff_t * s16note_diff_svc (const S16Service * old,
+                                          const S16Service * now)
+{
+    s16note_config_diff_t * diff = calloc (1, sizeof (*diff));
+
+    diff_props (&old->props, &now->props, &diff->props);
+    diff_meths (&old->meths, &now->meths, &diff->meths);
+    diff_depgroups (&old->depgroups, &now->depgroups, &diff->depgroups);
+
+    diff->insts = !streq (old->def_inst, now->def_inst);
+    list_foreach (inst, &now->insts, it)
+        diff->insts = diff->insts || !has_inst (old, it->val);
+    list_foreach (inst, &old->insts, it)
+        diff->insts = diff->insts || !has_inst (now, it->val);
+
+    return nonempty (diff);
+}
+
+s16note_config_diff_t * s16note_diff_inst (const S16ServiceInstance * old,
+                                           const S16ServiceInstance * now)
+{
+    s16note_config_diff_t * diff = calloc (1, sizeof (*diff));
+
+    diff_props (&old->props, &now->props, &diff->props);
+    diff_meths (&old->meths, &now->meths, &diff->meths);
+    diff_depgroups (&old->depgroups, &now->depgroups, &diff->depgroups);
+    diff->enabled = old->enabled != now->enabled;
+
+    return nonempty (diff);
+}
+
+static void names_merge (s16note_names_t * into, const s16note_names_t * from)
+{
+    for (size_t i = 0; i < from->n; i++)
+        s16note_names_add (into, from->names[i]);
+}
+
+void s16note_config_diff_merge (s16note_config_diff_t * into,
+                                const s16note_config_diff_t * from)
+{
+    names_merge (&into->props, &from->props);
+    names_merge (&into->meths, &from->meths);
+    names_merge (&into->depgroups, &from->depgroups);
+    into->enabled = into->enabled || from->enabled;
+    into->insts = into->insts || from->insts;
+}
+
+void s16note_config_diff_destroy (s16note_config_diff_t * diff)
+{
+    if (!diff)
+        return;
+
+    names_destroy (&diff->props);
+    names_destroy (&diff->meths);
+    names_destroy (&diff->depgroups);
+    free (diff);
+}
@@ -0,0 +1,763 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Repository images. An image is a snapshot of the repository's layers
+ * and its record of imported manifests, laid out so that it may be
+ * memory-mapped and read in place without any parsing. configd loads one at
+ * startup, and rewrites it whenever the repository has settled after changes.
+ *
+ * An image consists of a header followed by sections. Each section is an
+ * array of fixed-layout records, except the last, which is a table of
+ * NUL-terminated strings. Records refer to strings by their offset in the
+ * string table, and to their children by a range of indices into the
+ * children's section. All integers are in host byte order; an image is not
+ * meant to be moved between machines.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "S16/Repository_Private.h"
+#include "image.h"
+#include "uthash.h"
+
+uint64_t s16db_hash (const void * data, size_t len)
+{
+    const unsigned char * p = data;
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (len--)
+    {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+int s16db_manifest_sig (const char * path, s16db_manifest_sig_t * sig)
+{
+    int fd = open (path, O_RDONLY);
+    struct stat sb;
+    void * data;
+
+    if (fd == -1)
+        return -1;
+
+    if (fstat (fd, &sb) == -1)
+    {
+        close (fd);
+        return -1;
+    }
+
+    sig->path = strdup (path);
+    sig->size = sb.st_size;
+
+    if (sb.st_size == 0)
+        sig->hash = s16db_hash (NULL, 0);
+    else if ((data = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+             MAP_FAILED)
+    {
+        sig->hash = s16db_hash (data, sb.st_size);
+        munmap (data, sb.st_size);
+    }
+    else
+    {
+        free (sig->path);
+        close (fd);
+        return -1;
+    }
+
+    close (fd);
+    return 0;
+}
+
+/**********************************************************
+ * Writing
+ **********************************************************/
+
+typedef struct
+{
+    char * data;
+    size_t len, cap;
+} img_buf_t;
+
+typedef struct str_entry_s
+{
+    char * str;
+    uint32_t off;
+
+    UT_hash_handle hh;
+} str_entry_t;
+
+typedef struct
+{
+    img_buf_t sects[kSectMax];
+    str_entry_t * strs; /* Strings already in the table */
+} img_writer_t;
+
+/* Returns the number of records in a section. */
+static uint32_t w_count (img_writer_t * w, int sect, size_t size)
+{
+    return w->sects[sect].len / size;
+}
+
+/* Appends a record to a section, returning its index. */
+static uint32_t w_push (img_writer_t * w, int sect, const void * rec,
+                        size_t size)
+{
+    img_buf_t * buf = &w->sects[sect];
+
+    if (buf->len + size > buf->cap)
+    {
+        buf->cap = buf->cap ? buf->cap * 2 : 4096;
+        while (buf->len + size > buf->cap)
+            buf->cap *= 2;
+        buf->data = realloc (buf->data, buf->cap);
+    }
+
+    memcpy (buf->data + buf->len, rec, size);
+    buf->len += size;
+
+    return w_count (w, sect, size) - 1;
+}
+
+static uint32_t w_str (img_writer_t * w, const char * str)
+{
+    str_entry_t * entry;
+
+    if (!str)
+        return kNoString;
+
+    HASH_FIND_STR (w->strs, str, entry);
+
+    if (!entry)
+    {
+        entry = malloc (sizeof (*entry));
+        entry->str = strdup (str);
+        entry->off = w->sects[kSectStrings].len;
+        w_push (w, kSectStrings, str, strlen (str) + 1);
+        HASH_ADD_KEYPTR (hh, w->strs, entry->str, strlen (entry->str), entry);
+    }
+
+    return entry->off;
+}
+
+static uint32_t w_path (img_writer_t * w, const S16Path * path)
+{
+    char * spath = S16PathToString (path);
+    uint32_t off = w_str (w, spath);
+
+    free (spath);
+    return off;
+}
+
+static img_range_t w_props (img_writer_t * w, prop_list_t * props)
+{
+    img_range_t range = {.first = w_count (w, kSectProps, sizeof (img_prop_t)),
+                         .count = 0};
+
+    list_foreach (prop, props, it)
+    {
+        img_prop_t rec = {.name = w_str (w, it->val->name),
+                          .type = it->val->type};
+
+        if (it->val->type == kS16PropertyTypeString)
+            rec.value = w_str (w, it->val->value.s);
+        else
+            rec.value = it->val->value.i;
+
+        w_push (w, kSectProps, &rec, sizeof (rec));
+        range.count++;
+    }
+
+    return range;
+}
+
+static img_range_t w_meths (img_writer_t * w, meth_list_t * meths)
+{
+    img_range_t range = {.first = w_count (w, kSectMeths, sizeof (img_meth_t)),
+                         .count = 0};
+
+    list_foreach (meth, meths, it)
+    {
+        img_meth_t rec = {.name = w_str (w, it->val->name),
+                          .props = w_props (w, &it->val->props)};
+
+        w_push (w, kSectMeths, &rec, sizeof (rec));
+        range.count++;
+    }
+
+    return range;
+}
+
+static img_range_t w_depgroups (img_writer_t * w, depgroup_list_t * depgroups)
+{
+    img_range_t range = {
+        .first = w_count (w, kSectDepgroups, sizeof (img_depgroup_t)),
+        .count = 0};
+
+    list_foreach (depgroup, depgroups, it)
+    {
+        img_depgroup_t rec = {.name = w_str (w, it->val->name),
+                              .type = it->val->type,
+                              .restart_on = it->val->restart_on,
+                              .paths = {.first = w_count (w, kSectPaths,
+                                                          sizeof (uint32_t)),
+                                        .count = 0}};
+
+        list_foreach (path, &it->val->paths, pit)
+        {
+            uint32_t off = w_path (w, pit->val);
+
+            w_push (w, kSectPaths, &off, sizeof (off));
+            rec.paths.count++;
+        }
+
+        w_push (w, kSectDepgroups, &rec, sizeof (rec));
+        range.count++;
+    }
+
+    return range;
+}
+
+static img_range_t w_insts (img_writer_t * w, inst_list_t * insts)
+{
+    img_range_t range = {.first = w_count (w, kSectInsts, sizeof (img_inst_t)),
+                         .count = 0};
+
+    list_foreach (inst, insts, it)
+    {
+        img_inst_t rec = {.path = w_path (w, it->val->path),
+                          .enabled = it->val->enabled,
+                          .props = w_props (w, &it->val->props),
+                          .meths = w_meths (w, &it->val->meths),
+                          .depgroups = w_depgroups (w, &it->val->depgroups)};
+
+        w_push (w, kSectInsts, &rec, sizeof (rec));
+        range.count++;
+    }
+
+    return range;
+}
+
+static void w_svc (img_writer_t * w, s16db_layer_t layer, S16Service * svc)
+{
+    img_svc_t rec = {.layer = layer,
+                     .path = w_path (w, svc->path),
+                     .def_inst = w_str (w, svc->def_inst),
+                     .props = w_props (w, &svc->props),
+                     .meths = w_meths (w, &svc->meths),
+                     .insts = w_insts (w, &svc->insts),
+                     .depgroups = w_depgroups (w, &svc->depgroups)};
+
+    w_push (w, kSectSvcs, &rec, sizeof (rec));
+}
+
+static void w_svcs (img_writer_t * w, s16db_layer_t layer,
+                    const svc_list_t * svcs)
+{
+    list_foreach (svc, svcs, it)
+        w_svc (w, layer, it->val);
+}
+
+/* Fills in the header for the sections written, each to be 8-byte aligned.
+ * The checksum is computed as the concatenation of sections and padding would
+ * be. */
+static void w_layout (img_writer_t * w, img_header_t * hdr)
+{
+    uint64_t off = sizeof (*hdr), checksum = 14695981039346656037ULL;
+
+    memset (hdr, 0, sizeof (*hdr));
+    memcpy (hdr->magic, kImageMagic, sizeof (hdr->magic));
+    hdr->version = kImageVersion;
+
+    for (int i = 0; i < kSectMax; i++)
+    {
+        size_t padlen = (8 - w->sects[i].len % 8) % 8;
+        const unsigned char * p = (const unsigned char *)w->sects[i].data;
+
+        hdr->sections[i].off = off;
+        hdr->sections[i].len = w->sects[i].len;
+        off += w->sects[i].len + padlen;
+
+        for (size_t j = 0; j < w->sects[i].len; j++)
+            checksum = (checksum ^ p[j]) * 1099511628211ULL;
+        for (size_t j = 0; j < padlen; j++)
+            checksum = checksum * 1099511628211ULL;
+    }
+
+    hdr->size = off;
+    hdr->checksum = checksum;
+}
+
+static void w_free (img_writer_t * w)
+{
+    str_entry_t *entry, *tmp;
+
+    for (int i = 0; i < kSectMax; i++)
+        free (w->sects[i].data);
+    HASH_ITER (hh, w->strs, entry, tmp)
+    {
+        HASH_DEL (w->strs, entry);
+        free (entry->str);
+        free (entry);
+    }
+}
+
+void * img_build (s16db_layer_t layer, S16Service * const * svcs, size_t n,
+                  size_t * len)
+{
+    img_writer_t w;
+    img_header_t hdr;
+    char * buf;
+    size_t off = sizeof (hdr);
+
+    memset (&w, 0, sizeof (w));
+
+    for (size_t i = 0; i < n; i++)
+        w_svc (&w, layer, svcs[i]);
+
+    w_layout (&w, &hdr);
+    buf = calloc (1, hdr.size);
+    memcpy (buf, &hdr, sizeof (hdr));
+
+    for (int i = 0; i < kSectMax; i++)
+    {
+        if (w.sects[i].len)
+            memcpy (buf + off, w.sects[i].data, w.sects[i].len);
+        off += w.sects[i].len + (8 - w.sects[i].len % 8) % 8;
+    }
+
+    w_free (&w);
+    *len = hdr.size;
+
+    return buf;
+}
+
+void s16db_mkdir_parents (const char * path)
+{
+    char * dir = strdup (path);
+    char * slash = dir;
+
+    while ((slash = strchr (slash + 1, '/')))
+    {
+        *slash = '\0';
+        mkdir (dir, 0755);
+        *slash = '/';
+    }
+
+    free (dir);
+}
+
+static int write_all (int fd, const void * data, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write (fd, data, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1)
+            return -1;
+
+        data = (const char *)data + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int s16db_image_write (const char * path, const svc_list_t * manifest,
+                       const svc_list_t * admin,
+                       const s16db_manifest_sig_t * sigs, size_t nsigs)
+{
+    img_writer_t w;
+    img_header_t hdr;
+    char * tmppath;
+    char * dir;
+    int fd, r = -1;
+    static const char pad[8];
+
+    memset (&w, 0, sizeof (w));
+
+    w_svcs (&w, L_MANIFEST, manifest);
+    w_svcs (&w, L_ADMIN, admin);
+
+    for (size_t i = 0; i < nsigs; i++)
+    {
+        img_manifest_t rec = {.path = w_str (&w, sigs[i].path),
+                              .size = sigs[i].size,
+                              .hash = sigs[i].hash};
+
+        w_push (&w, kSectManifests, &rec, sizeof (rec));
+    }
+
+    w_layout (&w, &hdr);
+
+    /* Written aside and renamed into place, so that a crash never leaves a
+     * partial image. */
+    asprintf (&tmppath, "%s.new", path);
+    s16db_mkdir_parents (path);
+
+    if ((fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+    {
+        S16Log (kS16LogError, "Failed to create %s: %m\n", tmppath);
+        goto out;
+    }
+
+    if (write_all (fd, &hdr, sizeof (hdr)))
+        goto fail;
+
+    for (int i = 0; i < kSectMax; i++)
+        if (write_all (fd, w.sects[i].data, w.sects[i].len) ||
+            write_all (fd, pad, (8 - w.sects[i].len % 8) % 8))
+            goto fail;
+
+    if (fsync (fd) || close (fd))
+    {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+
+    if (rename (tmppath, path))
+        goto fail;
+
+    /* Make the rename itself durable. */
+    dir = strdup (path);
+    if ((fd = open (dirname (dir), O_RDONLY)) != -1)
+    {
+        fsync (fd);
+        close (fd);
+    }
+    free (dir);
+
+    r = 0;
+    goto out;
+
+fail:
+    S16Log (kS16LogError, "Failed to write repository image %s: %m\n", path);
+    if (fd != -1)
+        close (fd);
+    unlink (tmppath);
+
+out:
+    free (tmppath);
+    w_free (&w);
+
+    return r;
+}
+
+/**********************************************************
+ * Reading
+ **********************************************************/
+
+typedef struct
+{
+    const char * base;
+    const img_header_t * hdr;
+    bool ok; /* Cleared on finding any inconsistency */
+} img_reader_t;
+
+static char * r_str (img_reader_t * r, uint32_t off)
+{
+    const img_section_t * sect = &r->hdr->sections[kSectStrings];
+
+    if (off == kNoString)
+        return NULL;
+    else if (off >= sect->len)
+    {
+        r->ok = false;
+        return strdup ("");
+    }
+
+    return strdup (r->base + sect->off + off);
+}
+
+/* As r_str, but interned. */
+static char * r_istr (img_reader_t * r, uint32_t off)
+{
+    const img_section_t * sect = &r->hdr->sections[kSectStrings];
+
+    if (off == kNoString)
+        return NULL;
+    else if (off >= sect->len)
+    {
+        r->ok = false;
+        return s16str_intern ("");
+    }
+
+    return s16str_intern (r->base + sect->off + off);
+}
+
+static S16Path * r_path (img_reader_t * r, uint32_t off)
+{
+    char * spath = r_str (r, off);
+    S16Path * path = s16db_string_to_path (spath ? spath : "");
+
+    free (spath);
+    return path;
+}
+
+/* Returns the records of a range, or NULL if it is out of bounds. */
+static const void * r_range (img_reader_t * r, int sect, size_t size,
+                             img_range_t range)
+{
+    const img_section_t * s = &r->hdr->sections[sect];
+
+    if ((uint64_t)range.first + range.count > s->len / size)
+    {
+        r->ok = false;
+        return NULL;
+    }
+
+    return r->base + s->off + (size_t)range.first * size;
+}
+
+static prop_list_t r_props (img_reader_t * r, img_range_t range)
+{
+    prop_list_t props = prop_list_new ();
+    const img_prop_t * recs =
+        r_range (r, kSectProps, sizeof (img_prop_t), range);
+
+    for (uint32_t i = 0; recs && i < range.count; i++)
+    {
+        S16Property * prop = malloc (sizeof (*prop));
+
+        prop->name = r_istr (r, recs[i].name);
+        prop->type = recs[i].type;
+        if (prop->type == kS16PropertyTypeString)
+            prop->value.s = r_istr (r, recs[i].value);
+        else
+            prop->value.i = recs[i].value;
+
+        if (!prop->name || (prop->type == kS16PropertyTypeString &&
+                            !prop->value.s))
+            r->ok = false;
+
+        prop_list_add (&props, prop);
+    }
+
+    return props;
+}
+
+static meth_list_t r_meths (img_reader_t * r, img_range_t range)
+{
+    meth_list_t meths = meth_list_new ();
+    const img_meth_t * recs =
+        r_range (r, kSectMeths, sizeof (img_meth_t), range);
+
+    for (uint32_t i = 0; recs && i < range.count; i++)
+    {
+        S16ServiceMethod * meth = malloc (sizeof (*meth));
+
+        meth->name = r_istr (r, recs[i].name);
+        meth->props = r_props (r, recs[i].props);
+        if (!meth->name)
+            r->ok = false;
+
+        meth_list_add (&meths, meth);
+    }
+
+    return meths;
+}
+
+static depgroup_list_t r_depgroups (img_reader_t * r, img_range_t range)
+{
+    depgroup_list_t depgroups = depgroup_list_new ();
+    const img_depgroup_t * recs =
+        r_range (r, kSectDepgroups, sizeof (img_depgroup_t), range);
+
+    for (uint32_t i = 0; recs && i < range.count; i++)
+    {
+        S16DependencyGroup * depgroup = malloc (sizeof (*depgroup));
+        const uint32_t * paths =
+            r_range (r, kSectPaths, sizeof (uint32_t), recs[i].paths);
+
+        depgroup->name = r_str (r, recs[i].name);
+        depgroup->type = recs[i].type;
+        depgroup->restart_on = recs[i].restart_on;
+        depgroup->paths = path_list_new ();
+
+        for (uint32_t j = 0; paths && j < recs[i].paths.count; j++)
+            path_list_add (&depgroup->paths, r_path (r, paths[j]));
+
+        depgroup_list_add (&depgroups, depgroup);
+    }
+
+    return depgroups;
+}
+
+static inst_list_t r_insts (img_reader_t * r, img_range_t range)
+{
+    inst_list_t insts = inst_list_new ();
+    const img_inst_t * recs =
+        r_range (r, kSectInsts, sizeof (img_inst_t), range);
+
+    for (uint32_t i = 0; recs && i < range.count; i++)
+    {
+        S16ServiceInstance * inst = calloc (1, sizeof (*inst));
+
+        inst->path = r_path (r, recs[i].path);
+        inst->enabled = recs[i].enabled;
+        inst->props = r_props (r, recs[i].props);
+        inst->meths = r_meths (r, recs[i].meths);
+        inst->depgroups = r_depgroups (r, recs[i].depgroups);
+        inst->state = kS16StateNone;
+
+        inst_list_add (&insts, inst);
+    }
+
+    return insts;
+}
+
+static bool image_valid (const char * base, size_t size)
+{
+    const img_header_t * hdr = (const img_header_t *)base;
+    const img_section_t * strings;
+
+    if (size < sizeof (*hdr) || memcmp (hdr->magic, kImageMagic, 8) ||
+        hdr->version != kImageVersion || hdr->size != size)
+        return false;
+
+    for (int i = 0; i < kSectMax; i++)
+        if (hdr->sections[i].off < sizeof (*hdr) ||
+            hdr->sections[i].off % 8 ||
+            (uint64_t)hdr->sections[i].off + hdr->sections[i].len > size)
+            return false;
+
+    /* So that no string can run off the end. */
+    strings = &hdr->sections[kSectStrings];
+    if (strings->len && base[strings->off + strings->len - 1])
+        return false;
+
+    return s16db_hash (base + sizeof (*hdr), size - sizeof (*hdr)) ==
+           hdr->checksum;
+}
+
+int s16db_image_load (const char * path, s16db_image_svc_fun svc_fn,
+                      s16db_image_manifest_fun manifest_fn, void * user)
+{
+    int fd = open (path, O_RDONLY);
+    struct stat sb;
+    img_reader_t r;
+    const img_section_t * sect;
+    const img_svc_t * svcs;
+    const img_manifest_t * manifests;
+    S16Service ** decoded;
+    size_t nsvcs, nmanifests;
+    void * base;
+
+    if (fd == -1)
+        return -1;
+
+    if (fstat (fd, &sb) == -1 || sb.st_size == 0)
+    {
+        close (fd);
+        return -1;
+    }
+
+    base = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    if (!image_valid (base, sb.st_size))
+    {
+        S16Log (kS16LogWarn, "Repository image %s is invalid.\n", path);
+        munmap (base, sb.st_size);
+        return -1;
+    }
+
+    r.base = base;
+    r.hdr = base;
+    r.ok = true;
+
+    sect = &r.hdr->sections[kSectSvcs];
+    svcs = (const img_svc_t *)(r.base + sect->off);
+    nsvcs = sect->len / sizeof (img_svc_t);
+    decoded = calloc (nsvcs ? nsvcs : 1, sizeof (*decoded));
+
+    /* Every record is decoded and checked before anything is handed over. */
+    for (size_t i = 0; i < nsvcs; i++)
+    {
+        S16Service * svc = S16ServiceAlloc ();
+
+        svc->path = r_path (&r, svcs[i].path);
+        svc->def_inst = r_str (&r, svcs[i].def_inst);
+        svc->props = r_props (&r, svcs[i].props);
+        svc->meths = r_meths (&r, svcs[i].meths);
+        svc->insts = r_insts (&r, svcs[i].insts);
+        svc->depgroups = r_depgroups (&r, svcs[i].depgroups);
+        svc->state = kS16StateNone;
+
+        if (svcs[i].layer != L_MANIFEST && svcs[i].layer != L_ADMIN)
+            r.ok = false;
+
+        decoded[i] = svc;
+    }
+
+    sect = &r.hdr->sections[kSectManifests];
+    manifests = (const img_manifest_t *)(r.base + sect->off);
+    nmanifests = sect->len / sizeof (img_manifest_t);
+
+    for (size_t i = 0; i < nmanifests; i++)
+        if (manifests[i].path >= r.hdr->sections[kSectStrings].len)
+            r.ok = false;
+
+    for (size_t i = 0; i < nsvcs; i++)
+        if (r.ok)
+            svc_fn (svcs[i].layer, decoded[i], user);
+        else
+            S16ServiceDestroy (decoded[i]);
+    free (decoded);
+
+    for (size_t i = 0; r.ok && i < nmanifests; i++)
+    {
+        s16db_manifest_sig_t sig = {.path = r_str (&r, manifests[i].path),
+                                    .size = manifests[i].size,
+                                    .hash = manifests[i].hash};
+
+        manifest_fn (&sig, user);
+        free (sig.path);
+    }
+
+    munmap (base, sb.st_size);
+
+    if (!r.ok)
+        S16Log (kS16LogWarn, "Repository image %s is corrupt.\n", path);
+
+    return r.ok ? 0 : -1;
+}
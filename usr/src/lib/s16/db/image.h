@@ -0,0 +1,121 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: The layout of repository images, shared by the image file and by the
+ * shared-memory view of the merged repository.
+ */
+
+#ifndef S16_DB_IMAGE_H_
+#define S16_DB_IMAGE_H_
+
+#include <stdint.h>
+
+#include "S16/Repository.h"
+
+#define kImageMagic "S16REPO1"
+#define kImageVersion 1
+/* String offset denoting a NULL string. */
+#define kNoString UINT32_MAX
+
+enum
+{
+    kSectSvcs,
+    kSectInsts,
+    kSectDepgroups,
+    kSectPaths, /* uint32_t string offsets */
+    kSectProps,
+    kSectMeths,
+    kSectManifests,
+    kSectStrings,
+    kSectMax
+};
+
+typedef struct
+{
+    uint32_t first, count;
+} img_range_t;
+
+typedef struct
+{
+    uint32_t off, len; /* In bytes */
+} img_section_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;     /* Of the whole image */
+    uint64_t checksum; /* s16db_hash of everything after the header */
+    img_section_t sections[kSectMax];
+} img_header_t;
+
+typedef struct
+{
+    uint32_t layer;
+    uint32_t path, def_inst;
+    img_range_t props, meths, insts, depgroups;
+} img_svc_t;
+
+typedef struct
+{
+    uint32_t path;
+    uint32_t enabled;
+    img_range_t props, meths, depgroups;
+} img_inst_t;
+
+typedef struct
+{
+    uint32_t name, type, restart_on;
+    img_range_t paths;
+} img_depgroup_t;
+
+typedef struct
+{
+    uint32_t name, type;
+    int64_t value; /* For a string, its offset */
+} img_prop_t;
+
+typedef struct
+{
+    uint32_t name;
+    img_range_t props;
+} img_meth_t;
+
+typedef struct
+{
+    uint32_t path, reserved;
+    uint64_t size, hash;
+} img_manifest_t;
+
+/* Lays out in one buffer an image of the services @svcs, all recorded as of
+ * @layer, returning it and setting *@len to its length. The records of the
+ * services, and of their instances, are in the order of @svcs and of each
+ * one's instances. */
+void * img_build (s16db_layer_t layer, S16Service * const * svcs, size_t n,
+                  size_t * len);
+
+#endif
@@ -34,6 +34,11 @@
 #include "S16/Repository_Private.h"
 
 int s16db_hdl_new (s16db_hdl_t * hdl)
+{
+    return s16db_hdl_new_with_projection (hdl, S16DB_PROJ_ALL);
+}
+
+int s16db_hdl_new_with_projection (s16db_hdl_t * hdl, int projection)
 {
     struct sockaddr_un sun;
 
@@ -55,9 +60,13 @@ int s16db_hdl_new (s16db_hdl_t * hdl)
     hdl->clnt = s16rpc_clnt_new (hdl->fd);
     hdl->srv = NULL;
     hdl->notes = s16note_list_new ();
-    hdl->scope.svcs = s16db_repo_get_all_services_merged (hdl);
+    hdl->scope.svcs = svc_list_new ();
+    /* No such epoch exists, so the whole repository is fetched. */
+    hdl->epoch = 0;
+    hdl->generation = 0;
+    hdl->projection = projection;
 
-    return 0;
+    return s16db_refresh (hdl);
 }
 
 void s16db_investigate_kevent (s16db_hdl_t * hdl, struct kevent * ev)
@@ -71,6 +80,11 @@ s16note_t * s16db_get_note (s16db_hdl_t * hdl)
     return s16note_list_lpop (&hdl->notes);
 }
 
+size_t s16db_coalesce_notes (s16db_hdl_t * hdl)
+{
+    return s16note_list_coalesce (&hdl->notes);
+}
+
 const svc_list_t * s16db_get_all_services (s16db_hdl_t * hdl)
 {
     return &hdl->scope.svcs;
@@ -81,6 +95,24 @@ s16db_lookup_result_t s16db_lookup_path (s16db_hdl_t * hdl, S16Path * path)
     return s16db_lookup_path_in_scope (hdl->scope, path);
 }
 
+s16db_lookup_result_t s16db_lookup_path_details (s16db_hdl_t * hdl,
+                                                 S16Path * path)
+{
+    s16db_lookup_result_t res;
+
+    if (hdl->projection == S16DB_PROJ_ALL)
+        return s16db_lookup_path (hdl, path);
+
+    res = s16db_repo_get_path_merged (hdl, path);
+
+    if (res.type == SVC && res.s)
+        s16db_scope_put_svc (&hdl->scope, res.s);
+    else if (res.type == INSTANCE && res.i)
+        s16db_scope_put_inst (&hdl->scope, res.i);
+
+    return s16db_lookup_path (hdl, path);
+}
+
 s16db_lookup_result_t s16db_lookup_path_in_scope (s16db_scope_t scope,
                                                   S16Path * path)
 {
@@ -156,6 +188,85 @@ s16db_lookup_result_t s16db_lookup_path_in_scope (s16db_scope_t scope,
     return res;
 }
 
+static S16Service * scope_find_svc (s16db_scope_t * scope, const char * name)
+{
+    list_foreach (svc, &scope->svcs, it)
+    {
+        if (!strcmp (it->val->path->svc, name))
+            return it->val;
+    }
+    return NULL;
+}
+
+static S16ServiceInstance * svc_find_inst (S16Service * svc, const char * name)
+{
+    list_foreach (inst, &svc->insts, it)
+    {
+        if (!strcmp (it->val->path->inst, name))
+            return it->val;
+    }
+    return NULL;
+}
+
+void s16db_scope_put_svc (s16db_scope_t * scope, S16Service * svc)
+{
+    svc_list_it it =
+        svc_list_find_cmp (&scope->svcs, S16ServiceNamesEqual, svc);
+
+    if (it)
+    {
+        S16ServiceDestroy (it->val);
+        it->val = svc;
+    }
+    else
+        svc_list_add (&scope->svcs, svc);
+}
+
+void s16db_scope_put_inst (s16db_scope_t * scope, S16ServiceInstance * inst)
+{
+    S16Service * svc = scope_find_svc (scope, inst->path->svc);
+    inst_list_it it;
+
+    /* The instance's service must be on its way too. */
+    if (!svc)
+    {
+        S16InstanceDestroy (inst);
+        return;
+    }
+
+    if ((it = inst_list_find_cmp (&svc->insts, S16InstanceNamesEqual, inst)))
+    {
+        S16InstanceDestroy (it->val);
+        it->val = inst;
+    }
+    else
+        inst_list_add (&svc->insts, inst);
+}
+
+void s16db_scope_remove_path (s16db_scope_t * scope, S16Path * path)
+{
+    S16Service * svc = scope_find_svc (scope, path->svc);
+
+    if (!svc)
+        return;
+
+    if (path->inst)
+    {
+        S16ServiceInstance * inst = svc_find_inst (svc, path->inst);
+
+        if (inst)
+        {
+            inst_list_del (&svc->insts, inst);
+            S16InstanceDestroy (inst);
+        }
+    }
+    else
+    {
+        svc_list_del (&scope->svcs, svc);
+        S16ServiceDestroy (svc);
+    }
+}
+
 s16note_t * s16note_new (s16note_type_t note_type, int type,
                          const S16Path * path, int reason)
 {
@@ -164,11 +275,22 @@ s16note_t * s16note_new (s16note_type_t note_type, int type,
     note->type = type;
     note->path = S16PathCopy (path);
     note->reason = reason;
+    note->diff = NULL;
+    return note;
+}
+
+s16note_t * s16note_config_new (s16note_config_type_t type,
+                                const S16Path * path,
+                                s16note_config_diff_t * diff)
+{
+    s16note_t * note = s16note_new (N_CONFIG, type, path, 0);
+    note->diff = diff;
     return note;
 }
 
 void s16note_destroy (s16note_t * note)
 {
     S16PathDestroy (note->path);
+    s16note_config_diff_destroy (note->diff);
     free (note);
 }
\ No newline at end of file
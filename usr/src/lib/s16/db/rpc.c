@@ -60,20 +60,152 @@ ucl_object_t * handle_notify (s16rpc_data_t * dat, const ucl_object_t * unote)
     return ucl_object_fromint (0);
 }
 
-void s16db_subscribe (s16db_hdl_t * hdl, int kq, int /* s16note_type_t */ kinds)
+/* Fun: changes
+ * Desc: Applies changes to the repository to the local scope.
+ * Sig: int ({epoch, generation, full, services, instances, removed}) */
+ucl_object_t * handle_changes (s16rpc_data_t * dat,
+                               const ucl_object_t * uchanges)
+{
+    s16db_apply_changes ((s16db_hdl_t *)dat->extra, uchanges);
+    return ucl_object_fromint (0);
+}
+
+/* Sets up the server through which configd calls us back. */
+static void setup_srv (s16db_hdl_t * hdl, int kq)
+{
+    if (hdl->srv)
+        return;
+
+    hdl->srv = s16rpc_srv_new (kq, hdl->fd, (void *)hdl, 1);
+    /* Notifications may arrive while we await replies to our calls. */
+    hdl->clnt.srv = hdl->srv;
+    s16rpc_srv_register_method (
+        hdl->srv, "notify", 1, (s16rpc_fun_t)handle_notify);
+    s16rpc_srv_register_method (
+        hdl->srv, "changes", 1, (s16rpc_fun_t)handle_changes);
+}
+
+void s16db_apply_changes (s16db_hdl_t * hdl, const ucl_object_t * uchanges)
+{
+    const ucl_object_t * uobj;
+    ucl_object_iter_t it = NULL;
+
+    if (ucl_object_toboolean (ucl_object_lookup (uchanges, "full")))
+    {
+        svc_list_deepdestroy (&hdl->scope.svcs, S16ServiceDestroy);
+        hdl->scope.svcs = svc_list_new ();
+    }
+
+    while ((uobj = ucl_iterate_object (
+                ucl_object_lookup (uchanges, "services"), &it, true)))
+        s16db_scope_put_svc (&hdl->scope, s16db_ucl_to_svc (uobj));
+
+    it = NULL;
+    while ((uobj = ucl_iterate_object (
+                ucl_object_lookup (uchanges, "instances"), &it, true)))
+        s16db_scope_put_inst (&hdl->scope, s16db_ucl_to_inst (uobj));
+
+    it = NULL;
+    while ((uobj = ucl_iterate_object (
+                ucl_object_lookup (uchanges, "removed"), &it, true)))
+    {
+        S16Path * path = s16db_ucl_to_path (uobj);
+        s16db_scope_remove_path (&hdl->scope, path);
+        S16PathDestroy (path);
+    }
+
+    hdl->epoch = ucl_object_toint (ucl_object_lookup (uchanges, "epoch"));
+    hdl->generation =
+        ucl_object_toint (ucl_object_lookup (uchanges, "generation"));
+}
+
+int s16db_refresh (s16db_hdl_t * hdl)
 {
     s16rpc_error_t rerr;
-    ucl_object_t * ukinds = ucl_object_fromint (kinds);
+    ucl_object_t * uepoch = ucl_object_fromint (hdl->epoch);
+    ucl_object_t * ugen = ucl_object_fromint (hdl->generation);
+    ucl_object_t * uproj = ucl_object_fromint (hdl->projection);
+    ucl_object_t * reply;
+    int errc = 0;
+
+    reply = s16rpc_clnt_call (
+        &hdl->clnt, &rerr, "get-changes-since", uepoch, ugen, uproj);
+    ucl_object_unref (uepoch);
+    ucl_object_unref (ugen);
+    ucl_object_unref (uproj);
+
+    if (!reply)
+    {
+        S16Log (kS16LogError,
+                "Failed to send get-changes-since message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        errc = rerr.code;
+        s16rpc_error_destroy (&rerr);
+    }
+    else
+    {
+        s16db_apply_changes (hdl, reply);
+        ucl_object_unref (reply);
+    }
+
+    return errc;
+}
+
+void s16db_subscribe_changes (s16db_hdl_t * hdl, int kq)
+{
+    s16rpc_error_t rerr;
+    ucl_object_t * uepoch = ucl_object_fromint (hdl->epoch);
+    ucl_object_t * ugen = ucl_object_fromint (hdl->generation);
+    ucl_object_t * uproj = ucl_object_fromint (hdl->projection);
     ucl_object_t * reply;
 
-    if (!hdl->srv)
+    setup_srv (hdl, kq);
+
+    reply = s16rpc_clnt_call (
+        &hdl->clnt, &rerr, "subscribe-changes", uepoch, ugen, uproj);
+    ucl_object_unref (uepoch);
+    ucl_object_unref (ugen);
+    ucl_object_unref (uproj);
+
+    if (!reply)
+    {
+        S16Log (kS16LogError,
+                "Failed to send subscribe-changes message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        s16rpc_error_destroy (&rerr);
+    }
+    else
     {
-        hdl->srv = s16rpc_srv_new (kq, hdl->fd, (void *)hdl, 1);
-        s16rpc_srv_register_method (
-            hdl->srv, "notify", 1, (s16rpc_fun_t)handle_notify);
+        /* Whatever changed since we last refreshed. */
+        s16db_apply_changes (hdl, reply);
+        ucl_object_unref (reply);
     }
+}
+
+void s16db_subscribe (s16db_hdl_t * hdl, int kq, int /* s16note_type_t */ kinds)
+{
+    s16db_note_filter_t all = {0};
 
-    reply = s16rpc_clnt_call (&hdl->clnt, &rerr, "subscribe", ukinds);
+    s16db_subscribe_filtered (hdl, kq, kinds, &all);
+}
+
+void s16db_subscribe_filtered (s16db_hdl_t * hdl, int kq,
+                               int /* s16note_type_t */ kinds,
+                               const s16db_note_filter_t * filter)
+{
+    s16rpc_error_t rerr;
+    ucl_object_t * ukinds = ucl_object_fromint (kinds);
+    ucl_object_t * ufilter = s16db_note_filter_to_ucl (filter);
+    ucl_object_t * reply;
+
+    setup_srv (hdl, kq);
+
+    reply = s16rpc_clnt_call (
+        &hdl->clnt, &rerr, "subscribe-filtered", ukinds, ufilter);
+    ucl_object_unref (ukinds);
+    ucl_object_unref (ufilter);
 
     if (!reply)
     {
@@ -205,23 +337,33 @@ svc_list_t s16db_repo_get_all_services_merged (s16db_hdl_t * hdl)
 
 s16db_lookup_result_t s16db_repo_get_path_merged (s16db_hdl_t * hdl,
                                                   S16Path * path)
+{
+    return s16db_repo_get_path_projected (hdl, path, S16DB_PROJ_ALL);
+}
+
+s16db_lookup_result_t s16db_repo_get_path_projected (s16db_hdl_t * hdl,
+                                                     S16Path * path, int proj)
 {
     s16rpc_error_t rerr;
     s16db_lookup_result_t res;
     ucl_object_t * upath = s16db_S16Patho_ucl (path);
+    ucl_object_t * uproj = ucl_object_fromint (proj);
     /* reply */
     ucl_object_t * reply = NULL;
     /* reply elements */
     const ucl_object_t *type, *value;
 
-    reply = s16rpc_clnt_call (&hdl->clnt, &rerr, "get-path-merged", upath);
+    reply = s16rpc_clnt_call (
+        &hdl->clnt, &rerr, "get-path-projected", upath, uproj);
     ucl_object_unref (upath);
+    ucl_object_unref (uproj);
 
     if (!reply)
     {
-        res.type = rerr.code;
+        res.type = NOTFOUND;
+        res.s = NULL;
         S16Log (kS16LogError,
-                "Failed to send get-path-merged message: code %d: %s\n",
+                "Failed to send get-path-projected message: code %d: %s\n",
                 rerr.code,
                 rerr.message);
         s16rpc_error_destroy (&rerr);
@@ -282,4 +424,220 @@ int s16db_import_ucl_svc (s16db_hdl_t * hdl, ucl_object_t * usvc,
     }
 
     return e;
-}
\ No newline at end of file
+}
+void s16db_txn_begin (s16db_txn_t * txn)
+{
+    txn->ops = ucl_object_typed_new (UCL_ARRAY);
+}
+
+void s16db_txn_abort (s16db_txn_t * txn)
+{
+    if (txn->ops)
+        ucl_object_unref (txn->ops);
+    txn->ops = NULL;
+}
+
+size_t s16db_txn_size (const s16db_txn_t * txn)
+{
+    return txn->ops ? ucl_array_size (txn->ops) : 0;
+}
+
+static ucl_object_t * txn_op (s16db_txn_t * txn, const char * type,
+                              S16Path * path)
+{
+    ucl_object_t * uop = ucl_object_typed_new (UCL_OBJECT);
+
+    add_param (uop, "op", ucl_object_fromstring (type));
+    if (path)
+        add_param (uop, "path", s16db_S16Patho_ucl (path));
+    ucl_array_append (txn->ops, uop);
+
+    return uop;
+}
+
+void s16db_txn_enable (s16db_txn_t * txn, S16Path * path)
+{
+    txn_op (txn, "enable", path);
+}
+
+void s16db_txn_disable (s16db_txn_t * txn, S16Path * path)
+{
+    txn_op (txn, "disable", path);
+}
+
+void s16db_txn_set_state (s16db_txn_t * txn, S16Path * path,
+                          S16ServiceState state)
+{
+    add_param (
+        txn_op (txn, "set-state", path), "state", ucl_object_fromint (state));
+}
+
+void s16db_txn_import_ucl_svc (s16db_txn_t * txn, ucl_object_t * usvc,
+                               s16db_layer_t layer)
+{
+    ucl_object_t * uop = txn_op (txn, "import-service", NULL);
+
+    add_param (uop, "service", usvc);
+    add_param (uop, "layer", ucl_object_fromint (layer));
+}
+
+int s16db_txn_commit (s16db_hdl_t * hdl, s16db_txn_t * txn, size_t * failed)
+{
+    s16rpc_error_t rerr;
+    const ucl_object_t * ufailed;
+    ucl_object_t * reply;
+    int errc;
+
+    reply = s16rpc_clnt_call (&hdl->clnt, &rerr, "transaction", txn->ops);
+    s16db_txn_abort (txn);
+
+    if (!reply)
+    {
+        errc = rerr.code;
+        S16Log (kS16LogError,
+                "Failed to send transaction message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        s16rpc_error_destroy (&rerr);
+        return errc;
+    }
+
+    /* A malformed call is answered with a bare code. */
+    if (ucl_object_type (reply) != UCL_OBJECT)
+        errc = ucl_object_toint (reply);
+    else
+    {
+        errc = ucl_object_toint (ucl_object_lookup (reply, "error"));
+        if (failed && (ufailed = ucl_object_lookup (reply, "failed")))
+            *failed = ucl_object_toint (ufailed);
+    }
+
+    ucl_object_unref (reply);
+
+    return errc;
+}
+
+int s16db_import_manifests (s16db_hdl_t * hdl, const char * const * paths,
+                            size_t n, s16db_layer_t layer,
+                            s16db_import_report_t * report)
+{
+    s16rpc_error_t rerr;
+    ucl_object_t * upaths = ucl_object_typed_new (UCL_ARRAY);
+    ucl_object_t * ulayer = ucl_object_fromint (layer);
+    const ucl_object_t *ufailed, *ufail;
+    ucl_object_iter_t it = NULL;
+    ucl_object_t * reply;
+    size_t nfailed;
+
+    memset (report, 0, sizeof (*report));
+
+    for (size_t i = 0; i < n; i++)
+        ucl_array_append (upaths, ucl_object_fromstring (paths[i]));
+
+    reply = s16rpc_clnt_call (
+        &hdl->clnt, &rerr, "import-manifests", upaths, ulayer);
+    ucl_object_unref (upaths);
+    ucl_object_unref (ulayer);
+
+    if (!reply)
+    {
+        int e = rerr.code;
+
+        S16Log (kS16LogError,
+                "Failed to send import-manifests message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        s16rpc_error_destroy (&rerr);
+        return e;
+    }
+
+    report->imported = ucl_object_toint (ucl_object_lookup (reply, "imported"));
+    report->unchanged =
+        ucl_object_toint (ucl_object_lookup (reply, "unchanged"));
+    ufailed = ucl_object_lookup (reply, "failed");
+    nfailed = ucl_array_size (ufailed);
+    report->failed_paths = calloc (nfailed + 1, sizeof (char *));
+    report->failed_errors = calloc (nfailed + 1, sizeof (char *));
+
+    while ((ufail = ucl_iterate_object (ufailed, &it, true)))
+    {
+        const char * path =
+            ucl_object_tostring (ucl_object_lookup (ufail, "path"));
+        const char * error =
+            ucl_object_tostring (ucl_object_lookup (ufail, "error"));
+
+        report->failed_paths[report->nfailed] = strdup (path ? path : "");
+        report->failed_errors[report->nfailed] = strdup (error ? error : "");
+        report->nfailed++;
+    }
+
+    ucl_object_unref (reply);
+
+    return 0;
+}
+
+int s16db_query (s16db_hdl_t * hdl, const s16db_query_t * query, int proj,
+                 inst_list_t * out)
+{
+    s16rpc_error_t rerr;
+    ucl_object_t * upred = s16db_query_to_ucl (query);
+    ucl_object_t * uproj = ucl_object_fromint (proj);
+    const ucl_object_t * uinst;
+    ucl_object_iter_t it = NULL;
+    ucl_object_t * reply;
+    int errc = 0;
+
+    reply = s16rpc_clnt_call (&hdl->clnt, &rerr, "query", upred, uproj);
+    ucl_object_unref (upred);
+    ucl_object_unref (uproj);
+
+    if (!reply)
+    {
+        errc = rerr.code;
+        S16Log (kS16LogError,
+                "Failed to send query message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        s16rpc_error_destroy (&rerr);
+        return errc;
+    }
+
+    /* An error is returned as a code in place of the array. */
+    if (ucl_object_type (reply) != UCL_ARRAY)
+        errc = ucl_object_toint (reply);
+    else
+        while ((uinst = ucl_iterate_object (reply, &it, true)))
+            inst_list_add (out, s16db_ucl_to_inst (uinst));
+
+    ucl_object_unref (reply);
+
+    return errc;
+}
+
+ucl_object_t * s16db_get_stats (s16db_hdl_t * hdl)
+{
+    s16rpc_error_t rerr;
+    ucl_object_t * reply = s16rpc_clnt_call (&hdl->clnt, &rerr, "get-stats");
+
+    if (!reply)
+    {
+        S16Log (kS16LogError,
+                "Failed to send get-stats message: code %d: %s\n",
+                rerr.code,
+                rerr.message);
+        s16rpc_error_destroy (&rerr);
+    }
+
+    return reply;
+}
+
+void s16db_import_report_destroy (s16db_import_report_t * report)
+{
+    for (size_t i = 0; i < report->nfailed; i++)
+    {
+        free (report->failed_paths[i]);
+        free (report->failed_errors[i]);
+    }
+    free (report->failed_paths);
+    free (report->failed_errors);
+}
@@ -0,0 +1,651 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: The shared-memory view of the merged repository. configd publishes
+ * into a shared memory object an image (see image.h) of the merged repository
+ * after each batch of changes, and local clients read it in place, without
+ * copying it or asking configd for anything.
+ *
+ * The object begins with a control block, followed by two slots, each able to
+ * hold an image of up to the capacity recorded in the control block. An image
+ * in a slot is followed by the runtime state of each service record, then of
+ * each instance record, as a uint32_t each; the image format itself has no
+ * place for them. Each slot is followed by a NUL byte which is never written,
+ * so that no string read from a slot can run off its end.
+ *
+ * The publisher writes the slot not active, then makes it active. Readers are
+ * kept consistent by a sequence count, which the publisher makes odd for the
+ * duration of writing a slot. A reader which begins at count s may have chosen
+ * either slot active during a write begun at s; so what it reads is consistent
+ * only if, when it is done, no write has since begun into that slot, i.e. the
+ * count has not exceeded (s & ~1) + 2. Readers never write to the object.
+ *
+ * When an image outgrows the slots, the publisher creates a new object under
+ * the same name and marks the old one retired; readers notice this when next
+ * they begin a read, and reopen the view.
+ *
+ * The control block also records the pid of the publisher. A view left behind
+ * by a configd which has died no longer reflects the repository, so readers
+ * refuse to open it, and report inconsistent any read begun after its death.
+ *
+ * The object is named S16DB_VIEW_SHM_NAME, unless the environment variable
+ * S16DB_VIEW_SHM_ENV names another.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "S16/Repository_Private.h"
+#include "image.h"
+
+#define kViewMagic "S16VIEW1"
+#define kViewVersion 2
+/* The smallest capacity a view is made with. */
+#define kViewMinCap (64 * 1024)
+
+typedef struct
+{
+    uint64_t len;    /* Of the image and states, in bytes */
+    uint64_t states; /* Offset of the states */
+    uint64_t generation;
+} view_slot_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    atomic_uint retired;
+    atomic_uint active;
+    atomic_int pid; /* Of the publisher */
+    atomic_ulong seq;
+    uint64_t cap; /* Of each slot; fixed for the life of the object */
+    view_slot_t slots[2];
+} view_ctl_t;
+
+struct s16db_view_pub_s
+{
+    int fd;
+    char * base;
+    size_t size;
+    view_ctl_t * ctl;
+};
+
+struct s16db_view_s
+{
+    int fd;
+    const char * base;
+    size_t size;
+    const view_ctl_t * ctl;
+
+    /* Of the read underway: */
+    unsigned long seq;
+    const char * slot;
+    size_t len, states;
+    bool torn; /* Set on finding anything out of bounds */
+};
+
+/* Offset of a slot within a view of slot capacity @cap. */
+static size_t slot_off (uint64_t cap, unsigned i)
+{
+    return sizeof (view_ctl_t) + i * ((cap + 1 + 7) & ~(uint64_t)7);
+}
+
+static size_t view_size (uint64_t cap) { return slot_off (cap, 2); }
+
+static const char * view_name ()
+{
+    const char * name = getenv (S16DB_VIEW_SHM_ENV);
+
+    return name && *name ? name : S16DB_VIEW_SHM_NAME;
+}
+
+/* Whether the publisher recorded in @ctl still lives. */
+static bool publisher_alive (const view_ctl_t * ctl)
+{
+    pid_t pid = atomic_load_explicit (&ctl->pid, memory_order_acquire);
+
+    return pid > 0 && (!kill (pid, 0) || errno == EPERM);
+}
+
+/**********************************************************
+ * Publishing
+ **********************************************************/
+
+/* Creates a new view object with slots of capacity @cap, replacing that of
+ * the same name, if any. Readers which open it before anything is published
+ * to it ignore it. Returns 0 if successful. */
+static int pub_create (s16db_view_pub_t * pub, uint64_t cap)
+{
+    size_t size = view_size (cap);
+    int fd;
+    char * base;
+
+    shm_unlink (view_name ());
+    if ((fd = shm_open (view_name (), O_RDWR | O_CREAT | O_EXCL, 0644)) == -1)
+        return -1;
+
+    if (ftruncate (fd, size) == -1 ||
+        (base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                      0)) == MAP_FAILED)
+    {
+        close (fd);
+        shm_unlink (view_name ());
+        return -1;
+    }
+
+    pub->fd = fd;
+    pub->base = base;
+    pub->size = size;
+    pub->ctl = (view_ctl_t *)base;
+
+    memcpy (pub->ctl->magic, kViewMagic, sizeof (pub->ctl->magic));
+    pub->ctl->version = kViewVersion;
+    pub->ctl->cap = cap;
+    atomic_store_explicit (&pub->ctl->pid, getpid (), memory_order_release);
+
+    return 0;
+}
+
+s16db_view_pub_t * s16db_view_pub_new ()
+{
+    s16db_view_pub_t * pub = calloc (1, sizeof (*pub));
+
+    if (pub_create (pub, kViewMinCap))
+    {
+        S16Log (kS16LogError, "Failed to create repository view: %m\n");
+        free (pub);
+        return NULL;
+    }
+
+    return pub;
+}
+
+s16db_view_pub_t * s16db_view_pub_adopt (int fd)
+{
+    s16db_view_pub_t * pub = calloc (1, sizeof (*pub));
+    struct stat sb;
+
+    if (fstat (fd, &sb) == -1 || (size_t)sb.st_size < sizeof (view_ctl_t) ||
+        (pub->base = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        S16Log (kS16LogError, "Failed to adopt repository view: %m\n");
+        free (pub);
+        return NULL;
+    }
+
+    pub->fd = fd;
+    pub->size = sb.st_size;
+    pub->ctl = (view_ctl_t *)pub->base;
+
+    if (memcmp (pub->ctl->magic, kViewMagic, sizeof (pub->ctl->magic)) ||
+        pub->ctl->version != kViewVersion ||
+        view_size (pub->ctl->cap) > pub->size)
+    {
+        S16Log (kS16LogError, "Repository view handed over is invalid.\n");
+        munmap (pub->base, pub->size);
+        free (pub);
+        return NULL;
+    }
+
+    atomic_store_explicit (&pub->ctl->pid, getpid (), memory_order_release);
+
+    return pub;
+}
+
+int s16db_view_pub_fd (s16db_view_pub_t * pub) { return pub->fd; }
+
+int s16db_view_pub_put (s16db_view_pub_t * pub, S16Service * const * svcs,
+                        size_t n, unsigned long gen)
+{
+    size_t len, nstates = n, total;
+    char * image = img_build (L_MANIFEST, svcs, n, &len);
+    uint32_t * states;
+    view_ctl_t * ctl;
+    unsigned next;
+    unsigned long seq;
+    char * slot;
+    s16db_view_pub_t old = {.ctl = NULL};
+
+    for (size_t i = 0; i < n; i++)
+        nstates += inst_list_size (&svcs[i]->insts);
+    total = len + nstates * sizeof (uint32_t);
+
+    if (total > pub->ctl->cap)
+    {
+        uint64_t cap = pub->ctl->cap;
+
+        while (cap < total)
+            cap *= 2;
+
+        old = *pub;
+        if (pub_create (pub, cap))
+        {
+            S16Log (kS16LogError, "Failed to grow repository view: %m\n");
+            free (image);
+            return -1;
+        }
+    }
+
+    ctl = pub->ctl;
+    next = !atomic_load_explicit (&ctl->active, memory_order_relaxed);
+    slot = pub->base + slot_off (ctl->cap, next);
+
+    seq = atomic_load_explicit (&ctl->seq, memory_order_relaxed);
+    atomic_store_explicit (&ctl->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+
+    memcpy (slot, image, len);
+    states = (uint32_t *)(slot + len);
+    for (size_t i = 0; i < n; i++)
+        *states++ = svcs[i]->state;
+    for (size_t i = 0; i < n; i++)
+        list_foreach (inst, &svcs[i]->insts, it)
+            *states++ = it->val->state;
+
+    ctl->slots[next].len = total;
+    ctl->slots[next].states = len;
+    ctl->slots[next].generation = gen;
+
+    atomic_store_explicit (&ctl->active, next, memory_order_release);
+    atomic_store_explicit (&ctl->seq, seq + 2, memory_order_release);
+
+    /* Outgrown, the old object remains, retired, for the readers which still
+     * map it. */
+    if (old.ctl)
+    {
+        atomic_store_explicit (&old.ctl->retired, 1, memory_order_release);
+        munmap (old.base, old.size);
+        close (old.fd);
+    }
+
+    free (image);
+    return 0;
+}
+
+void s16db_view_pub_destroy (s16db_view_pub_t * pub)
+{
+    atomic_store_explicit (&pub->ctl->retired, 1, memory_order_release);
+    munmap (pub->base, pub->size);
+    close (pub->fd);
+    shm_unlink (view_name ());
+    free (pub);
+}
+
+/**********************************************************
+ * Reading
+ **********************************************************/
+
+static int view_map (s16db_view_t * view)
+{
+    struct stat sb;
+    const view_ctl_t * ctl;
+    int fd = shm_open (view_name (), O_RDONLY, 0);
+    void * base;
+
+    if (fd == -1)
+        return -1;
+
+    if (fstat (fd, &sb) == -1 || (size_t)sb.st_size < sizeof (view_ctl_t) ||
+        (base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+            MAP_FAILED)
+    {
+        close (fd);
+        return -1;
+    }
+
+    /* One to which nothing has yet been published, or whose publisher has
+     * gone, is as good as none. */
+    ctl = base;
+    if (memcmp (ctl->magic, kViewMagic, sizeof (ctl->magic)) ||
+        ctl->version != kViewVersion ||
+        view_size (ctl->cap) > (size_t)sb.st_size ||
+        !atomic_load_explicit (&ctl->seq, memory_order_acquire) ||
+        !publisher_alive (ctl))
+    {
+        munmap (base, sb.st_size);
+        close (fd);
+        return -1;
+    }
+
+    view->fd = fd;
+    view->base = base;
+    view->size = sb.st_size;
+    view->ctl = ctl;
+
+    return 0;
+}
+
+static void view_unmap (s16db_view_t * view)
+{
+    munmap ((void *)view->base, view->size);
+    close (view->fd);
+}
+
+s16db_view_t * s16db_view_open ()
+{
+    s16db_view_t * view = calloc (1, sizeof (*view));
+
+    if (view_map (view))
+    {
+        free (view);
+        return NULL;
+    }
+
+    return view;
+}
+
+void s16db_view_close (s16db_view_t * view)
+{
+    view_unmap (view);
+    free (view);
+}
+
+unsigned long s16db_view_begin (s16db_view_t * view)
+{
+    const view_ctl_t * ctl;
+    unsigned active;
+
+    /* Should reopening fail, the retired view is still readable, if stale. */
+    if (atomic_load_explicit (&view->ctl->retired, memory_order_acquire))
+    {
+        s16db_view_t fresh;
+
+        if (!view_map (&fresh))
+        {
+            view_unmap (view);
+            view->fd = fresh.fd;
+            view->base = fresh.base;
+            view->size = fresh.size;
+            view->ctl = fresh.ctl;
+        }
+    }
+
+    ctl = view->ctl;
+    view->seq = atomic_load_explicit (&ctl->seq, memory_order_acquire);
+    active = atomic_load_explicit (&ctl->active, memory_order_acquire) & 1;
+
+    view->slot = view->base + slot_off (ctl->cap, active);
+    view->len = ctl->slots[active].len;
+    view->states = ctl->slots[active].states;
+    view->torn = false;
+
+    if (view->len > ctl->cap || view->states > view->len ||
+        (view->len && view->len < sizeof (img_header_t)) ||
+        !publisher_alive (ctl))
+    {
+        view->len = 0;
+        view->torn = true;
+    }
+
+    return ctl->slots[active].generation;
+}
+
+bool s16db_view_end (s16db_view_t * view)
+{
+    unsigned long seq;
+
+    atomic_thread_fence (memory_order_acquire);
+    seq = atomic_load_explicit (&view->ctl->seq, memory_order_relaxed);
+
+    return !view->torn && seq - (view->seq & ~1ul) <= 2;
+}
+
+/* Returns @count records of size @size at index @first of section @sect, or
+ * NULL (marking the read torn) if they are out of bounds. */
+static const void * v_recs (s16db_view_t * view, int sect, size_t size,
+                            uint64_t first, uint64_t count)
+{
+    const img_header_t * hdr = (const img_header_t *)view->slot;
+    img_section_t s;
+
+    if (!view->len)
+        return NULL;
+
+    s = hdr->sections[sect];
+    if ((uint64_t)s.off + s.len > view->states ||
+        first + count > s.len / size)
+    {
+        view->torn = true;
+        return NULL;
+    }
+
+    return view->slot + s.off + first * size;
+}
+
+static const char * v_str (s16db_view_t * view, uint32_t off)
+{
+    const img_header_t * hdr = (const img_header_t *)view->slot;
+    const char * strs = v_recs (view, kSectStrings, 1, 0, 0);
+
+    if (off == kNoString)
+        return NULL;
+    else if (!strs || off >= hdr->sections[kSectStrings].len)
+    {
+        view->torn = true;
+        return "";
+    }
+
+    return strs + off;
+}
+
+static const img_svc_t * v_svc (s16db_view_t * view, uint32_t i)
+{
+    return v_recs (view, kSectSvcs, sizeof (img_svc_t), i, 1);
+}
+
+static const img_inst_t * v_inst (s16db_view_t * view, uint32_t i)
+{
+    return v_recs (view, kSectInsts, sizeof (img_inst_t), i, 1);
+}
+
+static size_t v_count (s16db_view_t * view, int sect, size_t size)
+{
+    const img_header_t * hdr = (const img_header_t *)view->slot;
+
+    return view->len ? hdr->sections[sect].len / size : 0;
+}
+
+size_t s16db_view_nsvcs (s16db_view_t * view)
+{
+    return v_count (view, kSectSvcs, sizeof (img_svc_t));
+}
+
+s16db_view_ent_t s16db_view_svc (s16db_view_t * view, size_t i)
+{
+    (void)view;
+    return (s16db_view_ent_t){.inst = false, .idx = i};
+}
+
+size_t s16db_view_ninsts (s16db_view_t * view, s16db_view_ent_t svc)
+{
+    const img_svc_t * rec = svc.inst ? NULL : v_svc (view, svc.idx);
+
+    return rec ? rec->insts.count : 0;
+}
+
+s16db_view_ent_t s16db_view_inst (s16db_view_t * view, s16db_view_ent_t svc,
+                                  size_t i)
+{
+    const img_svc_t * rec = svc.inst ? NULL : v_svc (view, svc.idx);
+
+    return (s16db_view_ent_t){.inst = true,
+                              .idx = rec ? rec->insts.first + i : UINT32_MAX};
+}
+
+/* The name of a service within a path string. */
+static const char * svc_name (const char * spath)
+{
+    return strncmp (spath, "svc:/", 5) ? spath : spath + 5;
+}
+
+bool s16db_view_find (s16db_view_t * view, const S16Path * path,
+                      s16db_view_ent_t * ent)
+{
+    size_t lo = 0, hi = s16db_view_nsvcs (view);
+    const img_svc_t * svc = NULL;
+    const img_inst_t * insts;
+
+    /* Services are sorted by name. */
+    while (lo < hi && !svc)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const img_svc_t * rec = v_svc (view, mid);
+        int cmp;
+
+        if (!rec)
+            return false;
+
+        cmp = strcmp (path->svc, svc_name (v_str (view, rec->path)));
+        if (cmp < 0)
+            hi = mid;
+        else if (cmp > 0)
+            lo = mid + 1;
+        else
+        {
+            svc = rec;
+            *ent = s16db_view_svc (view, mid);
+        }
+    }
+
+    if (!svc)
+        return false;
+    else if (!path->inst)
+        return true;
+
+    insts = v_recs (view, kSectInsts, sizeof (img_inst_t), svc->insts.first,
+                    svc->insts.count);
+    for (uint32_t i = 0; insts && i < svc->insts.count; i++)
+    {
+        const char * spath = v_str (view, insts[i].path);
+        const char * colon = spath ? strrchr (spath, ':') : NULL;
+
+        if (colon && !strcmp (colon + 1, path->inst))
+        {
+            *ent = (s16db_view_ent_t){.inst = true,
+                                      .idx = svc->insts.first + i};
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char * s16db_view_path (s16db_view_t * view, s16db_view_ent_t ent)
+{
+    const char * spath = NULL;
+
+    if (!ent.inst && v_svc (view, ent.idx))
+        spath = v_str (view, v_svc (view, ent.idx)->path);
+    else if (ent.inst && v_inst (view, ent.idx))
+        spath = v_str (view, v_inst (view, ent.idx)->path);
+
+    return spath ? spath : "";
+}
+
+S16ServiceState s16db_view_state (s16db_view_t * view, s16db_view_ent_t ent)
+{
+    uint64_t i = ent.inst ? s16db_view_nsvcs (view) + (uint64_t)ent.idx
+                          : ent.idx;
+    uint32_t state;
+
+    if (!view->len ||
+        view->states + (i + 1) * sizeof (uint32_t) > view->len)
+    {
+        view->torn = true;
+        return kS16StateNone;
+    }
+
+    memcpy (&state, view->slot + view->states + i * sizeof (uint32_t),
+            sizeof (state));
+
+    return state < kS16StateEnumMaximum ? state : kS16StateNone;
+}
+
+bool s16db_view_enabled (s16db_view_t * view, s16db_view_ent_t ent)
+{
+    const img_inst_t * rec = ent.inst ? v_inst (view, ent.idx) : NULL;
+
+    return rec && rec->enabled;
+}
+
+static const img_prop_t * v_prop (s16db_view_t * view, s16db_view_ent_t ent,
+                                  const char * name)
+{
+    const img_prop_t * props;
+    img_range_t range;
+
+    if (!ent.inst && v_svc (view, ent.idx))
+        range = v_svc (view, ent.idx)->props;
+    else if (ent.inst && v_inst (view, ent.idx))
+        range = v_inst (view, ent.idx)->props;
+    else
+        return NULL;
+
+    props = v_recs (view, kSectProps, sizeof (img_prop_t), range.first,
+                    range.count);
+    for (uint32_t i = 0; props && i < range.count; i++)
+    {
+        const char * pname = v_str (view, props[i].name);
+
+        if (pname && !strcmp (pname, name))
+            return &props[i];
+    }
+
+    return NULL;
+}
+
+const char * s16db_view_prop_string (s16db_view_t * view,
+                                     s16db_view_ent_t ent, const char * name)
+{
+    const img_prop_t * prop = v_prop (view, ent, name);
+
+    if (!prop || prop->type != kS16PropertyTypeString ||
+        prop->value < 0 || prop->value > UINT32_MAX)
+        return NULL;
+
+    return v_str (view, prop->value);
+}
+
+bool s16db_view_prop_number (s16db_view_t * view, s16db_view_ent_t ent,
+                             const char * name, long * value)
+{
+    const img_prop_t * prop = v_prop (view, ent, name);
+
+    if (!prop || prop->type == kS16PropertyTypeString)
+        return false;
+
+    *value = prop->value;
+    return true;
+}
@@ -45,6 +45,37 @@ extern "C"
     void s16mem_free (void * ap);
 #endif
 
+    typedef struct s16mem_stats_s
+    {
+        /* Blocks allocated and freed, by any means. */
+        unsigned long allocs, frees;
+        /* Blocks allocated from the emergency pool, malloc() having failed;
+         * and how much of the pool has ever been carved up. */
+        unsigned long pool_allocs;
+        unsigned long pool_used, pool_size;
+    } s16mem_stats_t;
+
+    void s16mem_stats (s16mem_stats_t * stats);
+
+    /* Interned strings, shared between all who intern the same string. An
+     * interned string must not be modified, and must be given up with
+     * s16str_release(), never free(). NULL is passed through. */
+    char * s16str_intern (const char * str);
+    /* Takes another reference to an interned string. */
+    char * s16str_ref (char * str);
+    void s16str_release (char * str);
+
+    typedef struct s16str_stats_s
+    {
+        /* Distinct strings held, and references to them. */
+        size_t strings, refs;
+        /* Bytes the strings occupy, and those which copies for each
+         * reference would have occupied besides. */
+        size_t bytes, bytes_saved;
+    } s16str_stats_t;
+
+    void s16str_stats (s16str_stats_t * stats);
+
 #define GET_ARG_COUNT(...)                                                     \
     INTERNAL_GET_ARG_COUNT_PRIVATE (                                           \
         0, ##__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
@@ -89,6 +120,17 @@ extern "C"
      */
     void S16HandleSignalWithKQueue (int kq, int sig);
 
+/* The first descriptor passed by the LISTEN_FDS protocol. */
+#define S16_LISTEN_FDS_START 3
+    /* Returns how many descriptors were passed to this process by the
+     * LISTEN_FDS protocol, numbered from S16_LISTEN_FDS_START; they are set
+     * close-on-exec, and the environment variables of the protocol unset. */
+    int S16ListenFds ();
+    /* To be called in a child about to exec: moves the @n descriptors @fds to
+     * S16_LISTEN_FDS_START onwards, and sets the environment variables of the
+     * LISTEN_FDS protocol to pass them. Returns 0 if successful. */
+    int S16PassListenFds (const int * fds, int n);
+
 #ifdef __cplusplus
 }
 #endif
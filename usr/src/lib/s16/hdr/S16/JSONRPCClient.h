@@ -33,9 +33,16 @@ extern "C"
 {
 #endif
 
+    struct s16rpc_srv_s;
+
     typedef struct
     {
         int fd;
+        /* Id for the next call; replies are matched to calls by id. */
+        int64_t next_id;
+        /* If set, notifications which arrive on fd while a reply is awaited
+         * are handed to this server. */
+        struct s16rpc_srv_s * srv;
     } s16rpc_clnt_t;
 
     s16rpc_clnt_t s16rpc_clnt_new (int sock);
@@ -34,6 +34,7 @@ extern "C"
 #endif
 
     struct kevent;
+    struct nvlist;
     typedef struct s16rpc_srv_s s16rpc_srv_t;
 
     typedef struct s16rpc_data_s
@@ -42,10 +43,69 @@ extern "C"
         const char * method;
         s16rpc_error_t err;
         void * extra;
+        /* Private to the server. */
+        struct s16rpc_call_s * call;
     } s16rpc_data_t;
 
     typedef ucl_object_t * (*s16rpc_fun_t) (s16rpc_data_t *);
 
+    /* A call whose reply is sent later, rather than on return from its
+     * method. */
+    typedef struct s16rpc_deferred_s s16rpc_deferred_t;
+
+    /* A message ready for sending, which may be shared between several
+     * connections' output queues. */
+    typedef struct s16rpc_frame_s s16rpc_frame_t;
+
+    /* What happens when a frame is sent to a connection which already has
+     * its limit of droppable frames queued. */
+    typedef enum
+    {
+        /* Drop a queued frame with the same key as the new one, which
+         * supersedes it; if there is none, drop the oldest. */
+        S16RPC_OVERFLOW_COALESCE,
+        /* Drop the oldest queued frame. */
+        S16RPC_OVERFLOW_DROP_OLDEST,
+        /* Close the connection. */
+        S16RPC_OVERFLOW_DISCONNECT,
+    } s16rpc_overflow_policy_t;
+
+    typedef struct s16rpc_queue_stats_s
+    {
+        /* Droppable frames queued now, and at most. */
+        size_t depth, max_depth;
+        unsigned long sent, dropped, coalesced;
+        /* How long the oldest queued frame has waited. */
+        unsigned long lag_ms;
+        /* Traffic over the connection's life. */
+        unsigned long calls, bytes_in, bytes_out;
+        /* The peer's credentials; pid is -1 where unavailable. */
+        long pid, uid;
+    } s16rpc_queue_stats_t;
+
+/* Latencies are counted in buckets of powers of two: bucket 0 counts calls
+ * taking under 1us, bucket i those taking [2^(i-1), 2^i)us, and the last any
+ * longer. */
+#define S16RPC_LATENCY_BUCKETS 24
+
+    typedef struct s16rpc_method_stats_s
+    {
+        const char * name;
+        unsigned long calls, errors;
+        /* From receipt of the call until its reply, deferred or not, is
+         * ready to send. */
+        unsigned long latency[S16RPC_LATENCY_BUCKETS];
+    } s16rpc_method_stats_t;
+
+    typedef void (*s16rpc_conn_walk_fun) (int fd,
+                                          const s16rpc_queue_stats_t * stats,
+                                          void * user);
+    typedef void (*s16rpc_method_walk_fun) (
+        const s16rpc_method_stats_t * stats, void * user);
+    /* Called with each connection adopted from another server, and the
+     * descriptor it had there. */
+    typedef void (*s16rpc_conn_adopt_fun) (int old_fd, int fd, void * user);
+
     /* Creates a new server on the given KQueue and socket. If is_client is
      * true, this server will only listen for messages on the given sock, and
      * not try to accept(). */
@@ -54,6 +114,72 @@ extern "C"
     /* Registers a method with the server. */
     void s16rpc_srv_register_method (s16rpc_srv_t * srv, const char * name,
                                      size_t nparams, s16rpc_fun_t fun);
+    /* Holds back replies to calls, rather than sending them as each call
+     * completes, until s16rpc_srv_release_replies() is called. This lets a
+     * server make the effects of a batch of calls durable before any of
+     * them is acknowledged. */
+    void s16rpc_srv_hold_replies (s16rpc_srv_t * srv);
+    /* Sends all held replies and stops holding them. */
+    void s16rpc_srv_release_replies (s16rpc_srv_t * srv);
+    /* Replaces every reply now held with an error with @code and
+     * @message, for when the effects of the batch could not be made
+     * durable. They are still held until s16rpc_srv_release_replies(). */
+    void s16rpc_srv_fail_replies (s16rpc_srv_t * srv, int code,
+                                  const char * message);
+    /* Called by a method to defer its reply; the method's return value is
+     * then ignored, and the reply sent by s16rpc_srv_complete(). This lets
+     * the work of a call be done on another thread. */
+    s16rpc_deferred_t * s16rpc_defer (s16rpc_data_t * dat);
+    /* Sends @result, which is consumed, as the reply to a deferred call. If
+     * the caller has since gone, it is discarded. Like all else here, this
+     * must be called on the thread running the server. */
+    void s16rpc_srv_complete (s16rpc_srv_t * srv, s16rpc_deferred_t * call,
+                              ucl_object_t * result);
+    /* Limits the droppable frames queued for any one connection to @limit
+     * (0 for no limit), applying @policy when it is reached. */
+    void s16rpc_srv_set_queue_limit (s16rpc_srv_t * srv, size_t limit,
+                                     s16rpc_overflow_policy_t policy);
+
+    /* Creates a frame holding a notification: a call to which no reply is
+     * sent. @params is not consumed. Frames with the same @key, if given,
+     * supersede one another; a @droppable frame may be dropped or coalesced
+     * when a queue overflows. */
+    s16rpc_frame_t * s16rpc_frame_new_notification (const char * method,
+                                                    ucl_object_t * params,
+                                                    const char * key,
+                                                    bool droppable);
+    s16rpc_frame_t * s16rpc_frame_ref (s16rpc_frame_t * frame);
+    void s16rpc_frame_release (s16rpc_frame_t * frame);
+    /* Queues a frame for sending on the connection @fd. It is sent as soon
+     * as the peer will take it, without ever blocking. Returns 0 if
+     * successful, or -1 if there is no such connection, or it was closed
+     * by the overflow policy. */
+    int s16rpc_srv_send (s16rpc_srv_t * srv, int fd, s16rpc_frame_t * frame);
+    /* Whether a frame with @key is queued for the connection @fd. */
+    bool s16rpc_srv_is_queued (s16rpc_srv_t * srv, int fd, const char * key);
+    /* Retrieves statistics of connection @fd and its output queue. Returns
+     * 0 if successful. */
+    int s16rpc_srv_queue_stats (s16rpc_srv_t * srv, int fd,
+                                s16rpc_queue_stats_t * stats);
+    /* Calls @fn with the statistics of each connection. */
+    void s16rpc_srv_walk_conns (s16rpc_srv_t * srv, s16rpc_conn_walk_fun fn,
+                                void * user);
+    /* Calls @fn with the statistics of each method. */
+    void s16rpc_srv_walk_methods (s16rpc_srv_t * srv,
+                                  s16rpc_method_walk_fun fn, void * user);
+    /* The bucket of a latency histogram which counts @us microseconds. */
+    unsigned s16rpc_latency_bucket (unsigned long us);
+
+    /* Describes the connections of @srv, for another server (generally in
+     * another process) to adopt: their descriptors, any message partly
+     * received, and the output not yet sent. @srv is left as it was. */
+    struct nvlist * s16rpc_srv_export (s16rpc_srv_t * srv);
+    /* Adopts the connections described by s16rpc_srv_export(), calling @fn
+     * (if given) with each. Output handed over is queued like a reply: if
+     * replies are being held, it is not sent until they are released. */
+    void s16rpc_srv_import (s16rpc_srv_t * srv, const struct nvlist * nvl,
+                            s16rpc_conn_adopt_fun fn, void * user);
+
     /* Must be called when your KEvent event-loop receives an event. */
     void s16rpc_investigate_kevent (s16rpc_srv_t * srv, struct kevent * ev);
 
@@ -163,7 +163,8 @@ extern "C"
     S16NVRPCServer * S16NVRPCServerNew (void * extra);
 
     /*
-     * Registers a method with the server.
+     * Registers a method with the server. If the method's return type is an
+     * NVList, the server takes ownership of the NVList returned.
      */
     void S16NVRPCServerRegisterMethod (S16NVRPCServer * srv,
                                        S16NVRPCMessageSignature * sig,
@@ -177,6 +178,33 @@ extern "C"
     void S16NVRPCServerReceiveFromFileDescriptor (S16NVRPCServer * server,
                                                   int fd);
 
+    /*
+     * Handles a request which has already been received. Returns the response
+     * to be sent, or NULL if the request was a notification.
+     */
+    nvlist_t * S16NVRPCServerHandleRequest (S16NVRPCServer * server,
+                                            nvlist_t * request);
+
+    /*
+     * Creates an error reply to the request with ID @id; for use by those who
+     * route requests rather than serving them.
+     */
+    nvlist_t * S16NVRPCErrorReplyNew (int id, S16NVRPCErrorCode code,
+                                      const char * message);
+
+    /*
+     * Creates a notification (a request to which no reply is sent) of method
+     * @methodName. Takes ownership of @params.
+     */
+    nvlist_t * S16NVRPCNotificationNew (const char * methodName,
+                                        nvlist_t * params);
+
+    /*
+     * Returns true if @message is a reply rather than a request or
+     * notification.
+     */
+    bool S16NVRPCMessageIsReply (const nvlist_t * message);
+
     /*
      * Synchronous API
      */
@@ -208,39 +236,74 @@ extern "C"
      * Asynchronous API
      */
 
+    /*
+     * Called when the reply to an asynchronous call is received, or when the
+     * call fails. Exactly one of @err and @result is meaningful; @err, if set,
+     * is destroyed after the callback returns.
+     */
+    typedef void (*S16NVRPCReplyCallback) (S16NVRPCError * err, void * result,
+                                           void * user);
+
     typedef struct S16NVRPCAsynchronousCall
     {
         int id;
-        nvlist_t * result;
+        S16NVRPCMessageSignature * signature;
+        S16NVRPCReplyCallback callback;
+        void * user;
     } S16NVRPCAsyncCall;
 
     S16ListType (S16NVRPCAsyncCall, S16NVRPCAsyncCall *);
 
     /*
-     * This must be kept in order to do asynchronous calls.
+     * This must be kept in order to do asynchronous calls. It tracks the calls
+     * in flight on one descriptor.
      */
     typedef struct S16NVRPCAsyncContext
     {
         S16List (S16NVRPCAsyncCall) calls;
+        int nextID;
     } S16NVRPCAsyncContext;
 
-    typedef void * (*S16NVRPCReplyReceivedCallback) (S16NVRPCCallContext *,
-                                                     ...);
+    void S16NVRPCAsyncContextInit (S16NVRPCAsyncContext * asyncContext);
+
+    /*
+     * Feeds a reply (c.f. S16NVRPCMessageIsReply) to the asynchronous context,
+     * calling the callback of the matching call. Takes ownership of @reply.
+     * Returns 0 if a matching call was found, -1 otherwise.
+     */
+    int S16NVRPCAsyncContextProcessReply (S16NVRPCAsyncContext * asyncContext,
+                                          nvlist_t * reply);
+
+    /*
+     * Fails every call in flight with error @code and message @message; for
+     * use when the descriptor is lost.
+     */
+    void S16NVRPCAsyncContextFailAll (S16NVRPCAsyncContext * asyncContext,
+                                      S16NVRPCErrorCode code,
+                                      const char * message);
 
     S16NVRPCAsyncCall *
     S16NVRPCClientCallAsyncInternal (S16NVRPCAsyncContext * asyncContext,
-                                     int fd, size_t nparams,
+                                     int fd, S16NVRPCReplyCallback callback,
+                                     void * user, size_t nparams,
                                      S16NVRPCMessageSignature * signature, ...);
 
-/* Makes an asynchronous call to  the given method on the client reached on the
- * On receiving reply, callback is called.
+/* Makes an asynchronous call to the given method on the peer reached on the
+ * given descriptor. On receiving the reply, the callback is called.
  * @param Asynchronous context.
  * @param Descriptor on which to send.
+ * @param Callback to invoke with the result.
+ * @param User data passed to the callback.
  * @param Message signature.
+ * Returns the call, or NULL if it could not be sent.
  * */
-#define S16NVRPCClientCallAsync(asyncContext, fd, ...)                         \
-    S16NVRPCClientCallAsyncInternal (                                          \
-        asyncContext, fd, GET_ARG_COUNT (__VA_ARGS__), ##__VA_ARGS__)
+#define S16NVRPCClientCallAsync(asyncContext, fd, callback, user, ...)         \
+    S16NVRPCClientCallAsyncInternal (asyncContext,                             \
+                                     fd,                                       \
+                                     callback,                                 \
+                                     user,                                     \
+                                     GET_ARG_COUNT (__VA_ARGS__),              \
+                                     ##__VA_ARGS__)
 
     void testIt ();
 
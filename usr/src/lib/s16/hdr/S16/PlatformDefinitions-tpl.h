@@ -33,6 +33,7 @@ extern "C"
 
 #define S16_PREFIX "@CMAKE_INSTALL_PREFIX@"
 #define S16_LIBEXECDIR S16_PREFIX "/@CMAKE_INSTALL_LIBEXECDIR@"
+#define S16_LOCALSTATEDIR S16_PREFIX "/@CMAKE_INSTALL_LOCALSTATEDIR@"
 
 #cmakedefine S16_PLAT_BSD
 #cmakedefine S16_ENABLE_SD_NOTIFY
@@ -45,6 +45,10 @@ extern "C"
 #endif
 
 #define S16DB_CONFIGD_SOCKET_PATH "/var/tmp/configd"
+/* Name of the shared memory object holding the view of the repository; and
+ * the environment variable which, if set, names another in its place. */
+#define S16DB_VIEW_SHM_NAME "/s16.repository-view"
+#define S16DB_VIEW_SHM_ENV "S16_VIEW_SHM_NAME"
 
     typedef struct s16note_sub_s s16note_sub_t;
 
@@ -54,6 +58,12 @@ extern "C"
         S16EBADPATH = 6000,
         S16ENOSUCHSVC = 6001,
         S16ENOSUCHINST = 6002,
+        /* Query predicate is malformed */
+        S16EBADQUERY = 6003,
+        /* Transaction operation is malformed */
+        S16EBADTXN = 6004,
+        /* Changes could not be made durable */
+        S16ENOTDURABLE = 6005,
     } s16db_errcode_t;
 
     typedef enum s16db_layer_e
@@ -62,6 +72,19 @@ extern "C"
         L_ADMIN,
     } s16db_layer_t;
 
+    /* Fields of services and instances which may be requested of the
+     * repository. Paths, default instances and the instances of a service
+     * are always sent; of the rest, only those in the projection are. */
+    typedef enum s16db_projection_e
+    {
+        S16DB_PROJ_STATE = 1 << 0,
+        S16DB_PROJ_ENABLED = 1 << 1,
+        S16DB_PROJ_DEPGROUPS = 1 << 2,
+        S16DB_PROJ_METHODS = 1 << 3,
+        S16DB_PROJ_PROPS = 1 << 4,
+        S16DB_PROJ_ALL = (1 << 5) - 1,
+    } s16db_projection_t;
+
     typedef struct s16db_scope_s
     {
         svc_list_t svcs;
@@ -80,8 +103,88 @@ extern "C"
         /* A local set of all services (merged) is kept as it's sufficient for
          * most purposes. */
         s16db_scope_t scope;
+        /* The epoch and generation of the repository which the scope
+         * reflects. */
+        unsigned long epoch, generation;
+        /* The fields fetched into the scope. */
+        int /* s16db_projection_t */ projection;
     } s16db_hdl_t;
 
+    /* Identifies the content of a manifest file, so that unchanged
+     * manifests need not be imported again. */
+    typedef struct s16db_manifest_sig_s
+    {
+        char * path;
+        uint64_t size;
+        uint64_t hash;
+    } s16db_manifest_sig_t;
+
+    /* The outcome of importing a set of manifests. */
+    typedef struct s16db_import_report_s
+    {
+        size_t imported, unchanged;
+        /* The manifests which failed to import, and why. */
+        size_t nfailed;
+        char ** failed_paths;
+        char ** failed_errors;
+    } s16db_import_report_t;
+
+    /* Restricts the notes delivered to a subscriber. If any service prefixes
+     * or instances are given, a note is delivered only if its path matches
+     * one of them; if types is nonzero, only if its sub-type is among them. */
+    typedef struct s16db_note_filter_s
+    {
+        /* Service names, matched as prefixes; e.g. "network/". */
+        const char ** svc_prefixes;
+        size_t nsvc_prefixes;
+        /* Instances. Notes about their services as a whole also match. */
+        S16Path ** insts;
+        size_t ninsts;
+        /* Set of sub-types, each as (1 << type). */
+        unsigned types;
+    } s16db_note_filter_t;
+
+    /* A predicate over instances for s16db_query. Each term given must hold;
+     * those left zeroed are unconstrained. */
+    typedef struct s16db_query_s
+    {
+        bool has_state;
+        S16ServiceState state;
+        bool has_enabled;
+        bool enabled;
+        /* The property @prop_name, set on the instance or else its service,
+         * whose value, as a string, equals @prop_value; or, if @prop_prefix,
+         * begins with it. With no @prop_value, the property need only be
+         * set. */
+        const char * prop_name;
+        const char * prop_value;
+        bool prop_prefix;
+        /* A service or instance named in a dependency group of the instance
+         * or its service. */
+        S16Path * depends_on;
+        /* An fnmatch(3) pattern for the instance's full path, e.g.
+         * "svc:/network/\*:default". */
+        const char * path_glob;
+    } s16db_query_t;
+
+    /* Operations gathered to be applied to the repository together. */
+    typedef struct s16db_txn_s
+    {
+        struct ucl_object_s * ops;
+    } s16db_txn_t;
+
+    /* A read-only view of the merged repository, which configd publishes in
+     * shared memory, and which is read in place. */
+    typedef struct s16db_view_s s16db_view_t;
+
+    /* A service or instance within a view. It identifies the same one only
+     * within the read in which it was got. */
+    typedef struct s16db_view_ent_s
+    {
+        bool inst;
+        uint32_t idx;
+    } s16db_view_ent_t;
+
     typedef struct s16db_lookup_result_s
     {
         enum
@@ -102,6 +205,10 @@ extern "C"
     /* Creates a new handle, connecting it to the repository.
      * Returns 0 if successful. */
     int s16db_hdl_new (s16db_hdl_t * hdl);
+    /* Creates a new handle whose local scope holds only the fields in
+     * @projection. Returns 0 if successful. */
+    int s16db_hdl_new_with_projection (s16db_hdl_t * hdl,
+                                       int /* s16db_projection_t */ projection);
 
     /**********************************************************
      * Events related
@@ -113,15 +220,27 @@ extern "C"
     /* If subscribed to receive notes, calling this will take from the note
      * queue the last note received. */
     s16note_t * s16db_get_note (s16db_hdl_t * hdl);
+    /* Coalesces the notes received but not yet taken, as described for
+     * s16note_list_coalesce. Returns the number elided. */
+    size_t s16db_coalesce_notes (s16db_hdl_t * hdl);
 
     /* Messages to the repository: */
     /* Subscribe to receive notifications of the given kinds. */
     void s16db_subscribe (s16db_hdl_t * hdl, int kq,
                           int /* s16note_type_t */ kinds);
 
+    /* As s16db_subscribe, but receiving only notes which pass @filter. */
+    void s16db_subscribe_filtered (s16db_hdl_t * hdl, int kq,
+                                   int /* s16note_type_t */ kinds,
+                                   const s16db_note_filter_t * filter);
+
     /* Publish an event. */
     void s16db_publish (s16db_hdl_t * hdl, s16note_t * note);
 
+    /* Subscribe to have changes to the repository applied to the local
+     * cached scope as they happen. */
+    void s16db_subscribe_changes (s16db_hdl_t * hdl, int kq);
+
     /**********************************************************
      * Immediate functions
      * These directly interface with the repository.
@@ -129,6 +248,23 @@ extern "C"
     /* Imports a UCL-form service into the given layer. */
     int s16db_import_ucl_svc (s16db_hdl_t * hdl, struct ucl_object_s * usvc,
                               s16db_layer_t layer);
+    /* Has the repository import the manifest files at @paths, which must be
+     * absolute, into the given layer. Those unchanged since last imported
+     * are skipped. The manifests are parsed in parallel, and all applied
+     * together. Fills in @report, which must be destroyed with
+     * s16db_import_report_destroy(). Returns: 0 if successful. */
+    int s16db_import_manifests (s16db_hdl_t * hdl, const char * const * paths,
+                                size_t n, s16db_layer_t layer,
+                                s16db_import_report_t * report);
+    void s16db_import_report_destroy (s16db_import_report_t * report);
+    /* Asks the repository for the instances satisfying @query, with only
+     * the fields in @proj, appending them to @out. Returns: 0 if
+     * successful. */
+    int s16db_query (s16db_hdl_t * hdl, const s16db_query_t * query,
+                     int /* s16db_projection_t */ proj, inst_list_t * out);
+    /* Retrieves configd's statistics, as described for its get-stats
+     * method; or NULL on failure. */
+    struct ucl_object_s * s16db_get_stats (s16db_hdl_t * hdl);
     /* Gets the state for the given instance path. */
     S16ServiceState s16db_get_state (s16db_hdl_t * hdl, S16Path * path);
     /* Sets the state for the given instance path.
@@ -144,6 +280,35 @@ extern "C"
      * instance; if path is a service, enables all its instances. Otherwise
      * does nothing. Returns: 0 if successful. */
     int s16db_enable (s16db_hdl_t * hdl, S16Path * path);
+    /* Applies the operations of @txn to the repository atomically: all of
+     * them, or, if any fails, none. Subscribers are notified of them
+     * together. If an operation fails, and @failed is given, its index is
+     * stored there. The transaction is ended either way.
+     * Returns: 0 if successful. */
+    int s16db_txn_commit (s16db_hdl_t * hdl, s16db_txn_t * txn,
+                          size_t * failed);
+
+    /* Brings the local cached scope up to date with the repository. Only
+     * the services and instances changed since it was last brought up to
+     * date are fetched. Returns: 0 if successful. */
+    int s16db_refresh (s16db_hdl_t * hdl);
+
+    /**********************************************************
+     * Transactions
+     * These gather operations locally, for s16db_txn_commit.
+     **********************************************************/
+    void s16db_txn_begin (s16db_txn_t * txn);
+    /* Ends a transaction, discarding the operations gathered. */
+    void s16db_txn_abort (s16db_txn_t * txn);
+    size_t s16db_txn_size (const s16db_txn_t * txn);
+    void s16db_txn_enable (s16db_txn_t * txn, S16Path * path);
+    void s16db_txn_disable (s16db_txn_t * txn, S16Path * path);
+    void s16db_txn_set_state (s16db_txn_t * txn, S16Path * path,
+                              S16ServiceState state);
+    /* Takes @usvc. */
+    void s16db_txn_import_ucl_svc (s16db_txn_t * txn,
+                                   struct ucl_object_s * usvc,
+                                   s16db_layer_t layer);
 
     /**********************************************************
      * Permanent state
@@ -161,11 +326,56 @@ extern "C"
     /* Retrieves the merged service or instance specified by the path.
      * r.type is ENOTFOUND if not found. */
     s16db_lookup_result_t s16db_lookup_path (s16db_hdl_t * hdl, S16Path * path);
+    /* As s16db_lookup_path, but if the handle's scope is projected, first
+     * fetches all fields of the service or instance into the scope. They
+     * remain until the next change to it replaces it with the projection. */
+    s16db_lookup_result_t s16db_lookup_path_details (s16db_hdl_t * hdl,
+                                                     S16Path * path);
+
+    /**********************************************************
+     * Shared view
+     **********************************************************/
+    /* Opens the view of the repository. Returns NULL if configd publishes
+     * none, or the configd which published it has died; in which case the
+     * repository must be read with a handle. */
+    s16db_view_t * s16db_view_open ();
+    void s16db_view_close (s16db_view_t * view);
+    /* Begins a read of the view, returning the generation of the repository
+     * it shows. Strings got during the read point into the view. */
+    unsigned long s16db_view_begin (s16db_view_t * view);
+    /* Ends a read. Returns true if everything read during it was consistent;
+     * if not, it must all be discarded and the read retried. A view whose
+     * publisher has died is never consistent, so a reader should give up
+     * after a few retries and read the repository with a handle instead. */
+    bool s16db_view_end (s16db_view_t * view);
+    /* Services are numbered in order of name. */
+    size_t s16db_view_nsvcs (s16db_view_t * view);
+    s16db_view_ent_t s16db_view_svc (s16db_view_t * view, size_t i);
+    size_t s16db_view_ninsts (s16db_view_t * view, s16db_view_ent_t svc);
+    s16db_view_ent_t s16db_view_inst (s16db_view_t * view,
+                                      s16db_view_ent_t svc, size_t i);
+    /* Finds the service or instance at @path. Returns true if found. */
+    bool s16db_view_find (s16db_view_t * view, const S16Path * path,
+                          s16db_view_ent_t * ent);
+    const char * s16db_view_path (s16db_view_t * view, s16db_view_ent_t ent);
+    S16ServiceState s16db_view_state (s16db_view_t * view,
+                                      s16db_view_ent_t ent);
+    bool s16db_view_enabled (s16db_view_t * view, s16db_view_ent_t ent);
+    /* Looks up a property of a service or instance. Returns NULL, or false,
+     * if it has none of that name and type. */
+    const char * s16db_view_prop_string (s16db_view_t * view,
+                                         s16db_view_ent_t ent,
+                                         const char * name);
+    bool s16db_view_prop_number (s16db_view_t * view, s16db_view_ent_t ent,
+                                 const char * name, long * value);
 
     /**********************************************************
      * Conversions
      **********************************************************/
     /* UCL to internal: */
+    /* Computes the signature of the manifest file at @path.
+     * Returns 0 if successful. */
+    int s16db_manifest_sig (const char * path, s16db_manifest_sig_t * sig);
     /* Converts a string path to a path. */
     S16Path * s16db_string_to_path (const char * txt);
     S16Path * s16db_ucl_to_path (const struct ucl_object_s * upath);
@@ -173,6 +383,13 @@ extern "C"
     S16ServiceInstance * s16db_ucl_to_inst (const struct ucl_object_s * obj);
     /* Converts a UCL manifest to a service. */
     S16Service * s16db_ucl_to_svc (const struct ucl_object_s * obj);
+    /* Converts a manifest as written, with a name, and instances named
+     * within it, to the form of a service, with paths. Returns 0 if
+     * successful. */
+    int s16db_canonicalise_manifest (struct ucl_object_s * usvc);
+    /* Reads the manifest at @path into a service. On failure, NULL is
+     * returned and *@err set to a description, which the caller frees. */
+    S16Service * s16db_parse_manifest (const char * path, char ** err);
     /* Converts a UCL service array to a service list. */
     svc_list_t s16db_ucl_to_svcs (const struct ucl_object_s * usvcs);
     /* Converts a UCL notification to an S16 notification. */
@@ -182,7 +399,17 @@ extern "C"
     struct ucl_object_s * s16db_S16Patho_ucl (S16Path * path);
     struct ucl_object_s * s16db_inst_to_ucl (S16ServiceInstance * path);
     struct ucl_object_s * s16db_S16Serviceo_ucl (S16Service * svc);
+    /* As above, sending only the fields in @proj. */
+    struct ucl_object_s *
+    s16db_inst_to_ucl_projected (S16ServiceInstance * inst,
+                                 int /* s16db_projection_t */ proj);
+    struct ucl_object_s *
+    s16db_S16Serviceo_ucl_projected (S16Service * svc,
+                                     int /* s16db_projection_t */ proj);
     struct ucl_object_s * s16db_note_to_ucl (const s16note_t * note);
+    struct ucl_object_s *
+    s16db_note_filter_to_ucl (const s16db_note_filter_t * filter);
+    struct ucl_object_s * s16db_query_to_ucl (const s16db_query_t * query);
 
 #ifdef __cplusplus
 }
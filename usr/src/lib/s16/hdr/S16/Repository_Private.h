@@ -31,8 +31,14 @@
 #ifndef S16_DB_PRIV_H_
 #define S16_DB_PRIV_H_
 
+#include "S16/PlatformDefinitions.h"
 #include "S16/Repository.h"
 
+#define S16DB_CONFIGD_IMAGE_PATH S16_LOCALSTATEDIR "/db/s16/repository.img"
+#define S16DB_CONFIGD_LOG_PATH S16_LOCALSTATEDIR "/db/s16/repository.log"
+/* Where a running configd awaits a successor to hand over to. */
+#define S16DB_CONFIGD_HANDOFF_PATH "/var/tmp/configd-handoff"
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -48,8 +54,12 @@ extern "C"
     svc_list_t s16db_repo_get_all_services_merged (s16db_hdl_t * hdl);
     /* Retrieves from the repository the merged service or instance
      * specified by the path. r.type is ENOTFOUND if not found. */
-    s16db_lookup_result_t s16db_repo_lookup_path_merged (s16db_hdl_t * hdl,
-                                                         S16Path * path);
+    s16db_lookup_result_t s16db_repo_get_path_merged (s16db_hdl_t * hdl,
+                                                      S16Path * path);
+    /* As above, fetching only the fields in @proj. */
+    s16db_lookup_result_t s16db_repo_get_path_projected (s16db_hdl_t * hdl,
+                                                         S16Path * path,
+                                                         int proj);
 
     /**********************************************************
      * Scope lookup
@@ -57,6 +67,66 @@ extern "C"
     s16db_lookup_result_t s16db_lookup_path_in_scope (s16db_scope_t scope,
                                                       S16Path * path);
 
+    /**********************************************************
+     * Scope alteration
+     **********************************************************/
+    /* Applies to the scope a description of changes of the form returned by
+     * configd's get-changes-since, updating the epoch and generation. */
+    void s16db_apply_changes (s16db_hdl_t * hdl, const ucl_object_t * uchanges);
+    /* Replaces the same-named service or instance in the scope, or adds it.
+     * The scope takes ownership. */
+    void s16db_scope_put_svc (s16db_scope_t * scope, S16Service * svc);
+    void s16db_scope_put_inst (s16db_scope_t * scope,
+                               S16ServiceInstance * inst);
+    /* Removes and destroys the service or instance at the path, if any. */
+    void s16db_scope_remove_path (s16db_scope_t * scope, S16Path * path);
+
+    /**********************************************************
+     * Repository images
+     **********************************************************/
+    typedef void (*s16db_image_svc_fun) (s16db_layer_t layer, S16Service * svc,
+                                         void * user);
+    typedef void (*s16db_image_manifest_fun) (const s16db_manifest_sig_t * sig,
+                                              void * user);
+
+    /* Creates the directories leading to @path. */
+    void s16db_mkdir_parents (const char * path);
+    /* 64-bit FNV-1a hash of the data. */
+    uint64_t s16db_hash (const void * data, size_t len);
+    /* Atomically replaces the image at @path with one holding the manifest
+     * and admin layers and the manifest signatures. Returns 0 if
+     * successful. */
+    int s16db_image_write (const char * path, const svc_list_t * manifest,
+                           const svc_list_t * admin,
+                           const s16db_manifest_sig_t * sigs, size_t nsigs);
+    /* Loads the image at @path, handing each service to @svc_fn (which takes
+     * ownership) and each signature to @manifest_fn. Nothing is handed over
+     * from an image which fails validation. Returns 0 if successful. */
+    int s16db_image_load (const char * path, s16db_image_svc_fun svc_fn,
+                          s16db_image_manifest_fun manifest_fn, void * user);
+
+    /**********************************************************
+     * Shared view
+     **********************************************************/
+    typedef struct s16db_view_pub_s s16db_view_pub_t;
+
+    /* Creates the view, replacing any left behind. Returns NULL if it
+     * can't be created. */
+    s16db_view_pub_t * s16db_view_pub_new ();
+    /* Takes over publishing to the view whose shared memory object is open
+     * as @fd, which it takes ownership of. Readers carry on undisturbed.
+     * Returns NULL if @fd is not such an object. */
+    s16db_view_pub_t * s16db_view_pub_adopt (int fd);
+    /* The descriptor of the view's shared memory object, which may be handed
+     * to a successor to adopt. */
+    int s16db_view_pub_fd (s16db_view_pub_t * pub);
+    /* Publishes to the view the merged services @svcs, sorted by name, as of
+     * generation @gen. Returns 0 if successful. */
+    int s16db_view_pub_put (s16db_view_pub_t * pub, S16Service * const * svcs,
+                            size_t n, unsigned long gen);
+    /* Retires the view and removes it. */
+    void s16db_view_pub_destroy (s16db_view_pub_t * pub);
+
 #ifdef __cplusplus
 }
 #endif
@@ -209,6 +209,23 @@ extern "C"
     bool S16MethodNamesEqual (const S16ServiceMethod * a,
                               const S16ServiceMethod * b);
 
+    /* Template functions */
+    /* A string which may refer to properties as ${name}; see template.c. */
+    typedef struct S16Template_s S16Template;
+    /* Compiles a template. */
+    S16Template * S16TemplateCompile (const char * text);
+    void S16TemplateDestroy (S16Template * tpl);
+    /* Returns @tpl if it was compiled from @text, or else destroys it and
+     * returns @text compiled (or NULL, if @text is NULL). */
+    S16Template * S16TemplateUpdate (S16Template * tpl, const char * text);
+    /* Expands a template for an instance of a service (@svc may be NULL).
+     * The expansion belongs to the template, and is returned again, without
+     * further work, until a property it depends on changes. */
+    const char * S16TemplateExpand (S16Template * tpl, const S16Service * svc,
+                                    const S16ServiceInstance * inst);
+    /* Tests whether a template refers to nothing. */
+    bool S16TemplateIsLiteral (const S16Template * tpl);
+
     /* Instance functions */
     /* Destroys an instance. */
     void S16InstanceDestroy (S16ServiceInstance * inst);
@@ -96,6 +96,42 @@ extern "C"
         SC_DISABLED,
     } s16note_sc_type_t;
 
+    /* Configuration change type */
+    typedef enum s16note_config_type_e
+    {
+        /* The service or instance is new. */
+        CF_ADDED,
+        /* Its configuration changed; the note's diff says how. */
+        CF_CHANGED,
+        /* It is gone. */
+        CF_REMOVED,
+    } s16note_config_type_t;
+
+    /* A set of names of properties, methods, or depgroups. The names are
+     * interned (see s16str_intern). */
+    typedef struct s16note_names_s
+    {
+        char ** names;
+        size_t n;
+    } s16note_names_t;
+
+    /* What changed in the configuration of a service or instance. Only what
+     * is configured on it directly is described; as an instance inherits
+     * from its service, a change to a service may concern its instances. */
+    typedef struct s16note_config_diff_s
+    {
+        /* The properties, methods, and depgroups added, removed, or altered,
+         * by name. */
+        s16note_names_t props;
+        s16note_names_t meths;
+        s16note_names_t depgroups;
+        /* Whether an instance was enabled or disabled. */
+        bool enabled;
+        /* Whether a service gained or lost instances, or its default
+         * instance changed. */
+        bool insts;
+    } s16note_config_diff_t;
+
     typedef struct s16note_s
     {
         /* The type of the note. */
@@ -106,6 +142,9 @@ extern "C"
         S16Path * path;
         /* The relevant reason for this note_type. */
         int reason;
+        /* For an N_CONFIG note of type CF_CHANGED, what changed; otherwise
+         * NULL. */
+        s16note_config_diff_t * diff;
     } s16note_t;
 
     S16ListType (s16note, s16note_t *);
@@ -114,6 +153,31 @@ extern "C"
                              const S16Path * path, int reason);
     void s16note_destroy (s16note_t * note);
 
+    /* Creates an N_CONFIG note of @type about @path, taking @diff. */
+    s16note_t * s16note_config_new (s16note_config_type_t type,
+                                    const S16Path * path,
+                                    s16note_config_diff_t * diff);
+    /* Compares the configuration of two forms of a service, or of an
+     * instance, returning what changed, or NULL if nothing did. */
+    s16note_config_diff_t * s16note_diff_svc (const S16Service * old,
+                                              const S16Service * now);
+    s16note_config_diff_t * s16note_diff_inst (const S16ServiceInstance * old,
+                                               const S16ServiceInstance * now);
+    /* Adds to @into everything changed in @from. */
+    void s16note_config_diff_merge (s16note_config_diff_t * into,
+                                    const s16note_config_diff_t * from);
+    void s16note_config_diff_destroy (s16note_config_diff_t * diff);
+    /* Adds @name to @names, if not already there. */
+    void s16note_names_add (s16note_names_t * names, const char * name);
+    /* Tests whether @name is in @names. */
+    bool s16note_names_contain (const s16note_names_t * names,
+                                const char * name);
+
+    /* Elides from a queue of notes those made redundant by later notes about
+     * the same path, preserving the order of the rest. Returns the number of
+     * notes elided. The rules are described in db/coalesce.c. */
+    size_t s16note_list_coalesce (s16note_list_t * notes);
+
 #ifdef __cplusplus
 }
 #endif
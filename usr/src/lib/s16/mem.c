@@ -34,6 +34,7 @@
  * it into the public domain */
 
 #include "S16/Service.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,6 +68,11 @@ static mem_header_t * freep = 0;
 static unsigned char pool[POOL_SIZE] = {0};
 static unsigned long pool_free_pos = 0;
 
+/* Counters, kept atomically as any thread may allocate. */
+static atomic_ulong nallocs, nfrees, npool_allocs;
+
+static void release (void * ap);
+
 void s16mem_init ()
 {
     base.s.next = 0;
@@ -90,7 +96,7 @@ static mem_header_t * get_mem_from_pool (unsigned long nquantas)
     {
         h = (mem_header_t *)(pool + pool_free_pos);
         h->s.size = nquantas;
-        s16mem_free ((void *)(h + 1));
+        release ((void *)(h + 1));
         pool_free_pos += total_req_size;
     }
     else
@@ -115,10 +121,14 @@ void * s16mem_alloc (unsigned long nbytes)
     mem_header_t * p;
     mem_header_t * prevp;
 
+    atomic_fetch_add_explicit (&nallocs, 1, memory_order_relaxed);
+
     /* We first try to use the system malloc. */
     if ((m = malloc (nbytes)))
         return m;
 
+    atomic_fetch_add_explicit (&npool_allocs, 1, memory_order_relaxed);
+
     // Calculate how many quantas are required: we need enough to house all
     // the requested bytes, plus the header. The -1 and +1 are there to make
     // sure
@@ -193,7 +203,7 @@ char * s16mem_strdup (const char * str)
 // free block. This is either between two existing blocks or at the end of the
 // list. In any case, if the block being freed is adjacent to either neighbor,
 // the adjacent blocks are combined.
-void s16mem_free (void * ap)
+static void release (void * ap)
 {
     mem_header_t * block;
     mem_header_t * p;
@@ -245,3 +255,19 @@ void s16mem_free (void * ap)
 
     freep = p;
 }
+
+void s16mem_free (void * ap)
+{
+    atomic_fetch_add_explicit (&nfrees, 1, memory_order_relaxed);
+    release (ap);
+}
+
+void s16mem_stats (s16mem_stats_t * stats)
+{
+    stats->allocs = atomic_load_explicit (&nallocs, memory_order_relaxed);
+    stats->frees = atomic_load_explicit (&nfrees, memory_order_relaxed);
+    stats->pool_allocs =
+        atomic_load_explicit (&npool_allocs, memory_order_relaxed);
+    stats->pool_used = pool_free_pos;
+    stats->pool_size = POOL_SIZE;
+}
@@ -161,7 +161,11 @@ static nvlist_t * CreateNVResponse (S16NVRPCType * rtype, void * result,
     assert (!nvlist_error (response));
     if (result)
     {
-        serialise (response, "result", &result, rtype);
+        /* NVList results are handed over to the response. */
+        if (rtype->kind == S16R_KNVLIST)
+            nvlist_move_nvlist (response, "result", result);
+        else
+            serialise (response, "result", &result, rtype);
         assert (!nvlist_error (response));
     }
     else
@@ -282,22 +286,58 @@ void S16NVRPCServerRegisterMethod (S16NVRPCServer * srv,
     s16r_method_list_add (&srv->meths, meth);
 }
 
+nvlist_t * S16NVRPCServerHandleRequest (S16NVRPCServer * server,
+                                        nvlist_t * request)
+{
+    return s16r_handle_request (server, request);
+}
+
+nvlist_t * S16NVRPCErrorReplyNew (int id, S16NVRPCErrorCode code,
+                                  const char * message)
+{
+    return CreateNVResponse (
+        NULL, NULL, CreateNVError (code, message, 0, NULL), id);
+}
+
+nvlist_t * S16NVRPCNotificationNew (const char * methodName, nvlist_t * params)
+{
+    nvlist_t * note = nvlist_create (0);
+
+    nvlist_add_string (note, "nvrpc", "0.9");
+    nvlist_add_string (note, "method", methodName);
+    nvlist_move_nvlist (note, "params", params);
+    assert (!nvlist_error (note));
+
+    return note;
+}
+
+bool S16NVRPCMessageIsReply (const nvlist_t * message)
+{
+    return !nvlist_exists (message, "method") &&
+           nvlist_exists_number (message, "id");
+}
+
 void S16NVRPCServerReceiveFromFileDescriptor (S16NVRPCServer * server, int fd)
 {
     nvlist_t * request = nvlist_recv (fd, 0);
     nvlist_t * response;
 
+    if (!request)
+        return;
+
     response = s16r_handle_request (server, request);
     nvlist_destroy (request);
-    assert (nvlist_send (fd, response) != -1);
-    nvlist_destroy (response);
+    if (response)
+    {
+        assert (nvlist_send (fd, response) != -1);
+        nvlist_destroy (response);
+    }
 }
 
-/* Returns ID. */
-static int clientCallInternal (int fd, const char * methodName,
-                               nvlist_t * params)
+static int clientSendInternal (int fd, const char * methodName,
+                               nvlist_t * params, int id)
 {
-    int id = rand ();
+    int r;
     nvlist_t * message = nvlist_create (0);
 
     nvlist_add_string (message, "nvrpc", "0.9");
@@ -309,9 +349,20 @@ static int clientCallInternal (int fd, const char * methodName,
     nvlist_add_number (message, "id", id);
     assert (!nvlist_error (message));
 
-    assert (!nvlist_send (fd, message));
+    r = nvlist_send (fd, message);
     nvlist_destroy (message);
 
+    return r;
+}
+
+/* Returns ID. */
+static int clientCallInternal (int fd, const char * methodName,
+                               nvlist_t * params)
+{
+    int id = rand ();
+
+    assert (!clientSendInternal (fd, methodName, params, id));
+
     return id;
 }
 
@@ -354,6 +405,21 @@ static S16NVRPCError * ProcessReply (nvlist_t * reply)
     return NULL;
 }
 
+/*
+ * NVLists are normally deserialised by reference into the message; but a result
+ * must outlive the reply that carried it, so it is taken instead.
+ */
+static void deserialiseResult (nvlist_t * reply, S16NVRPCType * rtype,
+                               void ** result)
+{
+    if (rtype->kind == S16R_KNVLIST)
+        *result = nvlist_exists_nvlist (reply, "result")
+                      ? nvlist_take_nvlist (reply, "result")
+                      : NULL;
+    else
+        S16NVRPCMemberDeserialise (reply, "result", rtype, result);
+}
+
 S16NVRPCError * S16NVRPCClientCallInternal (int fd, void ** result,
                                             size_t nparams,
                                             S16NVRPCMessageSignature * sig, ...)
@@ -382,21 +448,81 @@ S16NVRPCError * S16NVRPCClientCallInternal (int fd, void ** result,
     err = ProcessReply (reply);
 
     if (!err)
-        S16NVRPCMemberDeserialise (reply, "result", &sig->rtype, result);
+        deserialiseResult (reply, &sig->rtype, result);
 
     nvlist_destroy (reply);
 
     return err;
 }
 
+static bool matchCallID (S16NVRPCAsyncCall * call, int id)
+{
+    return call->id == id;
+}
+
+void S16NVRPCAsyncContextInit (S16NVRPCAsyncContext * asyncContext)
+{
+    asyncContext->calls = S16NVRPCAsyncCall_list_new ();
+    asyncContext->nextID = 1;
+}
+
+int S16NVRPCAsyncContextProcessReply (S16NVRPCAsyncContext * asyncContext,
+                                      nvlist_t * reply)
+{
+    S16NVRPCAsyncCall_list_it it;
+    S16NVRPCAsyncCall * call;
+    S16NVRPCError * err;
+    void * result = NULL;
+
+    it = S16NVRPCAsyncCall_list_find_int (
+        &asyncContext->calls, matchCallID, nvlist_get_number (reply, "id"));
+    if (!it)
+    {
+        nvlist_destroy (reply);
+        return -1;
+    }
+
+    call = list_it_val (it);
+    S16NVRPCAsyncCall_list_del (&asyncContext->calls, call);
+
+    if (!(err = ProcessReply (reply)))
+        deserialiseResult (reply, &call->signature->rtype, &result);
+    nvlist_destroy (reply);
+
+    call->callback (err, result, call->user);
+
+    if (err)
+        S16NVRPCErrorDestroy (err);
+    free (call);
+
+    return 0;
+}
+
+void S16NVRPCAsyncContextFailAll (S16NVRPCAsyncContext * asyncContext,
+                                  S16NVRPCErrorCode code, const char * message)
+{
+    S16NVRPCAsyncCall * call;
+
+    while ((call = S16NVRPCAsyncCall_list_lpop (&asyncContext->calls)))
+    {
+        S16NVRPCError err = {.code = code,
+                             .message = (char *)message,
+                             .data_len = 0,
+                             .data = NULL};
+        call->callback (&err, NULL, call->user);
+        free (call);
+    }
+}
+
 S16NVRPCAsyncCall *
 S16NVRPCClientCallAsyncInternal (S16NVRPCAsyncContext * asyncContext, int fd,
+                                 S16NVRPCReplyCallback callback, void * user,
                                  size_t nparams, S16NVRPCMessageSignature * sig,
                                  ...)
 {
     va_list args;
     nvlist_t * params = nvlist_create (0);
-    S16NVRPCAsyncCall * asyncCall = calloc (1, sizeof (&asyncCall));
+    S16NVRPCAsyncCall * asyncCall = calloc (1, sizeof (*asyncCall));
 
     nparams--;
 
@@ -409,10 +535,22 @@ S16NVRPCClientCallAsyncInternal (S16NVRPCAsyncContext * asyncContext, int fd,
     }
     va_end (args);
 
-    printf (">%s<\n",
-            ucl_object_emit (S16NVRPCNVListToUCL (params), UCL_EMIT_YAML));
+    /* IDs are never 0, which would mark the call as a notification. */
+    if (asyncContext->nextID <= 0)
+        asyncContext->nextID = 1;
+
+    asyncCall->id = asyncContext->nextID++;
+    asyncCall->signature = sig;
+    asyncCall->callback = callback;
+    asyncCall->user = user;
+
+    if (clientSendInternal (fd, sig->name, params, asyncCall->id))
+    {
+        free (asyncCall);
+        return NULL;
+    }
 
-    asyncCall->id = clientCallInternal (fd, sig->name, params);
+    S16NVRPCAsyncCall_list_add (&asyncContext->calls, asyncCall);
 
     return asyncCall;
 }
@@ -25,19 +25,26 @@
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <sys/event.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "S16/JSONRPCClient.h"
 #include "S16/JSONRPCServer.h"
+#include "nv.h"
 
 #define S16_JSONRPC_VERSION "2.0"
 
 #define MAX_LEN_MSG 16384
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 typedef ucl_object_t * (*s16rpc_fun0_t) (s16rpc_data_t *);
 typedef ucl_object_t * (*s16rpc_fun1_t) (s16rpc_data_t *, const ucl_object_t *);
 typedef ucl_object_t * (*s16rpc_fun2_t) (s16rpc_data_t *, const ucl_object_t *,
@@ -56,13 +63,41 @@ typedef struct
     /* Parameter count */
     size_t nparams;
     void * fun;
+    /* stats.name is the name above. */
+    s16rpc_method_stats_t stats;
 } s16rpc_S16ServiceMethod;
 
 S16ListType (s16rpc_method, s16rpc_S16ServiceMethod *);
 
+/* A message, serialised once and shared by every queue it is sent on. */
+struct s16rpc_frame_s
+{
+    int refs;
+    /* Notifications may be dropped or coalesced when a queue overflows;
+     * replies never are. */
+    bool droppable;
+    /* Frames with the same key supersede one another. */
+    char * key;
+    /* The length prefix, then the text */
+    size_t len;
+    char * data;
+    /* For a reply being held back, the ID of the call it answers. */
+    ucl_object_t * held_id;
+};
+
+typedef struct
+{
+    s16rpc_frame_t * frame;
+    struct timespec queued;
+} s16rpc_out_t;
+
+S16ListType (s16rpc_out, s16rpc_out_t *);
+
 typedef struct
 {
     int fd;
+    /* Distinguishes this connection from others which had the same fd. */
+    unsigned long serial;
     /* Every message from a client begins with 4 bytes representing the
      * length of the message. When we receive those 4 bytes, we allocate a
      * buffer to hold the rest of the message. */
@@ -71,6 +106,14 @@ typedef struct
     int cur_msg_off;
     /* Message buffer. */
     char * cur_msg_buf;
+    /* Frames waiting to be sent, and how much of the first has been. Output
+     * is never allowed to block; what the peer can't take yet waits here. */
+    s16rpc_out_list_t out;
+    size_t out_off;
+    /* Whether we are waiting for the peer's socket to be writable */
+    bool want_write;
+    /* stats.depth counts the droppable frames waiting. */
+    s16rpc_queue_stats_t stats;
 } s16rpc_conn_t;
 
 S16ListType (s16rpc_conn, s16rpc_conn_t *);
@@ -86,21 +129,131 @@ struct s16rpc_srv_s
     void * extra;
     s16rpc_method_list_t meths;
     s16rpc_conn_list_t conns;
+    /* Whether replies are being held back */
+    bool hold;
+    /* Droppable frames which may wait on a connection (0 for no limit), and
+     * what happens when there are more. */
+    size_t queue_limit;
+    s16rpc_overflow_policy_t overflow;
+    unsigned long next_serial;
 };
 
+/* The call being handled. */
+struct s16rpc_call_s
+{
+    s16rpc_conn_t * conn;
+    const ucl_object_t * id;
+    s16rpc_deferred_t * deferred;
+    s16rpc_S16ServiceMethod * meth;
+    struct timespec received;
+};
+
+struct s16rpc_deferred_s
+{
+    int fd;
+    unsigned long serial;
+    /* NULL if the call was a notification. */
+    ucl_object_t * id;
+    /* For the method's statistics. */
+    s16rpc_S16ServiceMethod * meth;
+    struct timespec received;
+};
+
+unsigned s16rpc_latency_bucket (unsigned long us)
+{
+    unsigned bucket = 0;
+
+    while (us && bucket < S16RPC_LATENCY_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/* Counts a call to @meth, received at @received, as now complete. */
+static void count_call (s16rpc_S16ServiceMethod * meth,
+                        const struct timespec * received, bool error)
+{
+    struct timespec now;
+    unsigned long us;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - received->tv_sec) * 1000000 +
+         (now.tv_nsec - received->tv_nsec) / 1000;
+
+    meth->stats.calls++;
+    if (error)
+        meth->stats.errors++;
+    meth->stats.latency[s16rpc_latency_bucket (us)]++;
+}
+
+/* Fills in what credentials of the peer on @fd can be had. */
+static void peer_creds (int fd, s16rpc_queue_stats_t * stats)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+
+    stats->pid = stats->uid = -1;
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return;
+    stats->pid = cred.pid;
+    stats->uid = cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+
+    stats->pid = stats->uid = -1;
+    if (getpeereid (fd, &uid, &gid) == -1)
+        return;
+    stats->uid = uid;
+#endif
+}
+
 static s16rpc_conn_t * conn_new (s16rpc_srv_t * srv, int fd)
 {
     s16rpc_conn_t * res = calloc (1, sizeof (s16rpc_conn_t));
     res->fd = fd;
+    res->serial = ++srv->next_serial;
+    res->out = s16rpc_out_list_new ();
+    peer_creds (fd, &res->stats);
     s16rpc_conn_list_add (&srv->conns, res);
     return res;
 }
 
+static void out_remove (s16rpc_conn_t * conn, s16rpc_out_t * out)
+{
+    s16rpc_out_list_del (&conn->out, out);
+    if (out->frame->droppable)
+        conn->stats.depth--;
+    s16rpc_frame_release (out->frame);
+    free (out);
+}
+
 static int conn_close (s16rpc_srv_t * srv, s16rpc_conn_t * con)
 {
-    int clos = close (con->fd);
+    struct kevent ev;
+    s16rpc_out_t * out;
+    int clos;
+
+    /* The filters go first, lest they outlive the descriptor and fire for
+     * another given the same number. */
+    EV_SET (&ev, con->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent (srv->kq, &ev, 1, NULL, 0, NULL);
+    if (con->want_write)
+    {
+        EV_SET (&ev, con->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent (srv->kq, &ev, 1, NULL, 0, NULL);
+    }
+    clos = close (con->fd);
+
     if (con->cur_msg_buf)
         free (con->cur_msg_buf);
+    /* Output waiting for a closed connection is simply dropped. */
+    while ((out = list_it_val (list_begin (&con->out))))
+        out_remove (con, out);
     s16rpc_conn_list_del (&srv->conns, con);
     free (con);
     return clos;
@@ -129,6 +282,204 @@ int write_object (int fd, const ucl_object_t * obj)
     return 1;
 }
 
+/******************************************************************************
+ * OUTPUT QUEUES
+ ******************************************************************************/
+
+static s16rpc_frame_t * frame_new (const ucl_object_t * msg, const char * key,
+                                   bool droppable)
+{
+    s16rpc_frame_t * frame = malloc (sizeof (*frame));
+    char * text = (char *)ucl_object_emit (msg, UCL_EMIT_JSON_COMPACT);
+    int32_t len = strlen (text) + 1;
+
+    frame->refs = 1;
+    frame->droppable = droppable;
+    frame->key = key ? strdup (key) : NULL;
+    frame->held_id = NULL;
+    frame->len = sizeof (len) + len;
+    frame->data = malloc (frame->len);
+    memcpy (frame->data, &len, sizeof (len));
+    memcpy (frame->data + sizeof (len), text, len);
+    free (text);
+
+    return frame;
+}
+
+s16rpc_frame_t * s16rpc_frame_new_notification (const char * method,
+                                                ucl_object_t * params,
+                                                const char * key,
+                                                bool droppable)
+{
+    ucl_object_t * msg = ucl_object_typed_new (UCL_OBJECT);
+    s16rpc_frame_t * frame;
+
+    ucl_object_insert_key (
+        msg, ucl_object_fromstring (S16_JSONRPC_VERSION), "jsonrpc", 0, 1);
+    ucl_object_insert_key (msg, ucl_object_fromstring (method), "method", 0, 1);
+    ucl_object_insert_key (msg, ucl_object_ref (params), "params", 0, 1);
+
+    frame = frame_new (msg, key, droppable);
+    ucl_object_unref (msg);
+
+    return frame;
+}
+
+s16rpc_frame_t * s16rpc_frame_ref (s16rpc_frame_t * frame)
+{
+    frame->refs++;
+    return frame;
+}
+
+void s16rpc_frame_release (s16rpc_frame_t * frame)
+{
+    if (--frame->refs)
+        return;
+
+    free (frame->key);
+    free (frame->data);
+    if (frame->held_id)
+        ucl_object_unref (frame->held_id);
+    free (frame);
+}
+
+static void watch_write (s16rpc_srv_t * srv, s16rpc_conn_t * conn, bool want)
+{
+    struct kevent ev;
+
+    if (conn->want_write == want)
+        return;
+
+    EV_SET (&ev, conn->fd, EVFILT_WRITE, want ? EV_ADD : EV_DELETE, 0, 0, 0);
+    if (kevent (srv->kq, &ev, 1, NULL, 0, NULL) == -1)
+        err (1, "kevent");
+    conn->want_write = want;
+}
+
+/* Sends as much of the queue as the peer will take without blocking. */
+static void conn_flush (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
+{
+    s16rpc_out_t * out;
+
+    while ((out = list_it_val (list_begin (&conn->out))))
+    {
+        ssize_t n = send (conn->fd,
+                          out->frame->data + conn->out_off,
+                          out->frame->len - conn->out_off,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            /* Resumed once the peer has read some. */
+            watch_write (srv, conn, true);
+            return;
+        }
+        else if (n == -1)
+            /* The peer is gone; its EOF will close the connection. */
+            break;
+
+        conn->out_off += n;
+        conn->stats.bytes_out += n;
+        if (conn->out_off == out->frame->len)
+        {
+            conn->out_off = 0;
+            conn->stats.sent++;
+            out_remove (conn, out);
+        }
+    }
+
+    watch_write (srv, conn, false);
+}
+
+/* Finds the oldest droppable frame not already being sent; if @key is given,
+ * with that key. */
+static s16rpc_out_t * find_droppable (s16rpc_conn_t * conn, const char * key)
+{
+    list_foreach (s16rpc_out, &conn->out, it)
+    {
+        s16rpc_frame_t * frame = it->val->frame;
+
+        if (it == list_begin (&conn->out) && conn->out_off)
+            continue;
+        else if (frame->droppable &&
+                 (!key || (frame->key && !strcmp (frame->key, key))))
+            return it->val;
+    }
+
+    return NULL;
+}
+
+/* Queues a frame on a connection. Returns -1 if, rather than queueing it, the
+ * connection was closed. */
+static int conn_send (s16rpc_srv_t * srv, s16rpc_conn_t * conn,
+                      s16rpc_frame_t * frame)
+{
+    s16rpc_out_t * out;
+
+    if (frame->droppable && srv->queue_limit &&
+        conn->stats.depth >= srv->queue_limit)
+    {
+        s16rpc_out_t * victim = NULL;
+
+        switch (srv->overflow)
+        {
+        case S16RPC_OVERFLOW_COALESCE:
+            if (frame->key && (victim = find_droppable (conn, frame->key)))
+            {
+                conn->stats.coalesced++;
+                break;
+            }
+            /* Nothing superseded; make room by dropping the oldest. */
+        case S16RPC_OVERFLOW_DROP_OLDEST:
+            if ((victim = find_droppable (conn, NULL)))
+                conn->stats.dropped++;
+            break;
+        case S16RPC_OVERFLOW_DISCONNECT:
+            S16Log (kS16LogWarn,
+                    "Disconnecting peer on fd %d: output queue full\n",
+                    conn->fd);
+            conn_close (srv, conn);
+            return -1;
+        }
+
+        if (!victim)
+        {
+            /* Only a frame in flight is queued; the new one goes instead. */
+            conn->stats.dropped++;
+            return 0;
+        }
+
+        out_remove (conn, victim);
+    }
+
+    out = malloc (sizeof (*out));
+    out->frame = s16rpc_frame_ref (frame);
+    clock_gettime (CLOCK_MONOTONIC, &out->queued);
+    s16rpc_out_list_add (&conn->out, out);
+
+    if (frame->droppable && ++conn->stats.depth > conn->stats.max_depth)
+        conn->stats.max_depth = conn->stats.depth;
+
+    if (!srv->hold)
+        conn_flush (srv, conn);
+
+    return 0;
+}
+
+/* Sends a reply now, or holds it back if replies are being held. */
+static void write_reply (s16rpc_srv_t * srv, s16rpc_conn_t * conn,
+                         const ucl_object_t * msg)
+{
+    s16rpc_frame_t * frame = frame_new (msg, NULL, false);
+
+    if (srv->hold)
+        frame->held_id = ucl_object_copy (ucl_object_lookup (msg, "id"));
+    conn_send (srv, conn, frame);
+    s16rpc_frame_release (frame);
+}
+
 void add_obj_el (ucl_object_t * msg, const char * name, ucl_object_t * value)
 {
     ucl_object_insert_key (msg, value, name, 0, 0);
@@ -145,10 +496,11 @@ ucl_object_t * make_error (int code, const char * message, ucl_object_t * data)
     return uerr;
 }
 
-void reply_error (s16rpc_conn_t * conn, const ucl_object_t * id, int code,
-                  const char * message, ucl_object_t * data)
+static ucl_object_t * error_msg (const ucl_object_t * id, int code,
+                                 const char * message, ucl_object_t * data)
 {
     ucl_object_t * msg = ucl_object_typed_new (UCL_OBJECT);
+
     ucl_object_insert_key (
         msg, ucl_object_fromstring (S16_JSONRPC_VERSION), "jsonrpc", 0, 0);
     ucl_object_insert_key (
@@ -160,14 +512,49 @@ void reply_error (s16rpc_conn_t * conn, const ucl_object_t * id, int code,
                            "id",
                            0,
                            0);
-    write_object (conn->fd, msg);
+    return msg;
+}
+
+void reply_error (s16rpc_srv_t * srv, s16rpc_conn_t * conn,
+                  const ucl_object_t * id, int code, const char * message,
+                  ucl_object_t * data)
+{
+    ucl_object_t * msg = error_msg (id, code, message, data);
+
+    write_reply (srv, conn, msg);
     ucl_object_unref (msg);
 }
 
-void reply_result (s16rpc_conn_t * conn, const ucl_object_t * id,
-                   ucl_object_t * result)
+/* As reply_error(), but for a well-formed call: a notification wants no
+ * reply, even an error. A message which could not be parsed, or is not a
+ * call, is still answered, with a null id. */
+static void reply_call_error (s16rpc_srv_t * srv, s16rpc_conn_t * conn,
+                              const ucl_object_t * id, int code,
+                              const char * message, ucl_object_t * data)
 {
-    ucl_object_t * msg = ucl_object_typed_new (UCL_OBJECT);
+    if (!id)
+    {
+        if (data)
+            ucl_object_unref (data);
+        return;
+    }
+
+    reply_error (srv, conn, id, code, message, data);
+}
+
+void reply_result (s16rpc_srv_t * srv, s16rpc_conn_t * conn,
+                   const ucl_object_t * id, ucl_object_t * result)
+{
+    ucl_object_t * msg;
+
+    if (!id)
+    {
+        if (result)
+            ucl_object_unref (result);
+        return;
+    }
+
+    msg = ucl_object_typed_new (UCL_OBJECT);
     ucl_object_insert_key (
         msg, ucl_object_fromstring (S16_JSONRPC_VERSION), "jsonrpc", 0, 0);
     ucl_object_insert_key (msg, result, "result", 0, 0);
@@ -178,7 +565,7 @@ void reply_result (s16rpc_conn_t * conn, const ucl_object_t * id,
                            "id",
                            0,
                            0);
-    write_object (conn->fd, msg);
+    write_reply (srv, conn, msg);
     ucl_object_unref (msg);
 }
 
@@ -205,18 +592,18 @@ ucl_object_t * dispatch_method (s16rpc_data_t * dat, void * fun, size_t nparams,
     return NULL;
 }
 
-void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
+void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn, const char * text)
 {
     struct ucl_parser * parser = ucl_parser_new (0);
     ucl_object_t * obj = NULL;
 
-    ucl_parser_add_string (parser, conn->cur_msg_buf, conn->cur_msg_len);
+    ucl_parser_add_string (parser, text, strlen (text));
 
     if (ucl_parser_get_error (parser))
     {
         printf ("RPC error: Malformed message: %s\n",
                 ucl_parser_get_error (parser));
-        reply_error (conn, NULL, 1, "Error parsing JSON", NULL);
+        reply_error (srv, conn, NULL, 1, "Error parsing JSON", NULL);
         goto cleanup;
     }
 
@@ -231,6 +618,9 @@ void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
         const char * txt = method ? ucl_object_tostring (method) : NULL;
         size_t nparams = params ? ucl_array_size (params) : 0;
         s16rpc_data_t dat;
+        struct s16rpc_call_s call = {.conn = conn, .id = id};
+
+        clock_gettime (CLOCK_MONOTONIC, &call.received);
 
         s16rpc_S16ServiceMethod * cand;
 
@@ -238,7 +628,8 @@ void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
         {
             printf (
                 "RPC error: Malformed message: Mising or malformed method\n");
-            reply_error (conn, id, 1, "Missing or malformed method", NULL);
+            reply_error (
+                srv, conn, id, 1, "Missing or malformed method", NULL);
             goto cleanup;
         }
 
@@ -250,8 +641,12 @@ void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
         if (!cand)
         {
             printf ("RPC error: Server cannot handle method %s\n", txt);
-            reply_error (
-                conn, id, S16ENOSUCHMETH, "Server cannot handle method", NULL);
+            reply_call_error (srv,
+                              conn,
+                              id,
+                              S16ENOSUCHMETH,
+                              "Server cannot handle method",
+                              NULL);
             goto cleanup;
         }
 
@@ -262,7 +657,8 @@ void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
                     txt,
                     cand->nparams,
                     nparams);
-            reply_error (conn, id, 1, "Incorrect parameter count", NULL);
+            reply_call_error (
+                srv, conn, id, 1, "Incorrect parameter count", NULL);
             goto cleanup;
         }
 
@@ -272,22 +668,39 @@ void handle_msg (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
         dat.err.data = 0;
         dat.err.message = NULL;
         dat.extra = srv->extra;
+        dat.call = &call;
+        call.meth = cand;
+        conn->stats.calls++;
 
         result = dispatch_method (&dat, cand->fun, nparams, params);
 
-        if (dat.err.code)
+        /* The method will reply by s16rpc_srv_complete() instead. */
+        if (call.deferred)
+        {
+            assert (!dat.err.code);
+            if (result)
+                ucl_object_unref (result);
+        }
+        else if (dat.err.code)
         {
             assert (!result);
-            reply_error (conn, id, dat.err.code, dat.err.message, dat.err.data);
+            reply_call_error (srv,
+                              conn,
+                              id,
+                              dat.err.code,
+                              dat.err.message,
+                              dat.err.data);
             /* err.data is auto-freed by unref in reply_error; no need to do
              * away with it. */
             if (dat.err.message)
                 free (dat.err.message);
+            count_call (cand, &call.received, true);
         }
         else
         {
             assert (!dat.err.code && !dat.err.message && !dat.err.data);
-            reply_result (conn, id, result);
+            reply_result (srv, conn, id, result);
+            count_call (cand, &call.received, false);
         }
     }
 
@@ -300,24 +713,31 @@ cleanup:
 static void handle_recv (s16rpc_srv_t * srv, s16rpc_conn_t * conn)
 {
     int len_to_recv;
+    ssize_t received;
 
     if (!conn->cur_msg_len)
     {
         size_t len =
             recv (conn->fd, (char *)&conn->cur_msg_len, sizeof (int32_t), 0);
         assert (len == 4);
+        conn->stats.bytes_in += len;
         conn->cur_msg_buf = malloc (conn->cur_msg_len);
         conn->cur_msg_off = 0;
     }
 
     len_to_recv = conn->cur_msg_len - conn->cur_msg_off;
-    conn->cur_msg_off += recv (conn->fd, conn->cur_msg_buf, len_to_recv, 0);
+    received =
+        recv (conn->fd, conn->cur_msg_buf + conn->cur_msg_off, len_to_recv, 0);
+    conn->cur_msg_off += received;
+    if (received > 0)
+        conn->stats.bytes_in += received;
 
     if (conn->cur_msg_len && (conn->cur_msg_off == conn->cur_msg_len))
     {
         /* message fully received */
+        conn->cur_msg_buf[conn->cur_msg_len - 1] = '\0';
         conn->cur_msg_len = 0;
-        handle_msg (srv, conn);
+        handle_msg (srv, conn, conn->cur_msg_buf);
         free (conn->cur_msg_buf);
         conn->cur_msg_buf = NULL;
     }
@@ -341,12 +761,7 @@ void s16rpc_investigate_kevent (s16rpc_srv_t * srv, struct kevent * ev)
             list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
 
         if (cand)
-        {
-            EV_SET (&nev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-            if (kevent (srv->kq, &nev, 1, NULL, 0, NULL) == -1)
-                err (1, "kevent");
             conn_close (srv, cand);
-        }
     }
     else if (!srv->is_client && ev->ident == srv->fd)
     {
@@ -358,6 +773,16 @@ void s16rpc_investigate_kevent (s16rpc_srv_t * srv, struct kevent * ev)
         if (kevent (srv->kq, &nev, 1, NULL, 0, NULL) == -1)
             err (1, "kevent");
     }
+    else if (ev->filter == EVFILT_WRITE)
+    {
+        int fd = ev->ident;
+        s16rpc_conn_t * cand =
+            list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
+
+        /* Held replies wait for s16rpc_srv_release_replies(). */
+        if (cand && !srv->hold)
+            conn_flush (srv, cand);
+    }
     else if (ev->filter == EVFILT_READ)
     {
         int fd = ev->ident;
@@ -369,11 +794,168 @@ void s16rpc_investigate_kevent (s16rpc_srv_t * srv, struct kevent * ev)
     }
 }
 
+s16rpc_deferred_t * s16rpc_defer (s16rpc_data_t * dat)
+{
+    s16rpc_deferred_t * call = malloc (sizeof (*call));
+
+    call->fd = dat->call->conn->fd;
+    call->serial = dat->call->conn->serial;
+    call->id = dat->call->id ? ucl_object_copy (dat->call->id) : NULL;
+    call->meth = dat->call->meth;
+    call->received = dat->call->received;
+    dat->call->deferred = call;
+
+    return call;
+}
+
+void s16rpc_srv_complete (s16rpc_srv_t * srv, s16rpc_deferred_t * call,
+                          ucl_object_t * result)
+{
+    s16rpc_conn_t * conn = list_it_val (
+        s16rpc_conn_list_find_int (&srv->conns, match_fd, call->fd));
+
+    if (conn && conn->serial == call->serial)
+        reply_result (srv, conn, call->id, result);
+    else if (result)
+        ucl_object_unref (result);
+    count_call (call->meth, &call->received, false);
+
+    if (call->id)
+        ucl_object_unref (call->id);
+    free (call);
+}
+
+void s16rpc_srv_hold_replies (s16rpc_srv_t * srv) { srv->hold = true; }
+
+void s16rpc_srv_release_replies (s16rpc_srv_t * srv)
+{
+    srv->hold = false;
+
+    list_foreach (s16rpc_conn, &srv->conns, it)
+    {
+        list_foreach (s16rpc_out, &it->val->out, oit)
+        {
+            s16rpc_frame_t * frame = oit->val->frame;
+
+            if (frame->held_id)
+            {
+                ucl_object_unref (frame->held_id);
+                frame->held_id = NULL;
+            }
+        }
+        conn_flush (srv, it->val);
+    }
+}
+
+void s16rpc_srv_fail_replies (s16rpc_srv_t * srv, int code,
+                              const char * message)
+{
+    list_foreach (s16rpc_conn, &srv->conns, it)
+    {
+        list_foreach (s16rpc_out, &it->val->out, oit)
+        {
+            s16rpc_frame_t * frame = oit->val->frame;
+            ucl_object_t * msg;
+
+            if (!frame->held_id)
+                continue;
+
+            msg = error_msg (frame->held_id, code, message, NULL);
+            oit->val->frame = frame_new (msg, NULL, false);
+            ucl_object_unref (msg);
+            s16rpc_frame_release (frame);
+        }
+    }
+}
+
+void s16rpc_srv_set_queue_limit (s16rpc_srv_t * srv, size_t limit,
+                                 s16rpc_overflow_policy_t policy)
+{
+    srv->queue_limit = limit;
+    srv->overflow = policy;
+}
+
+int s16rpc_srv_send (s16rpc_srv_t * srv, int fd, s16rpc_frame_t * frame)
+{
+    s16rpc_conn_t * conn =
+        list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
+
+    return conn ? conn_send (srv, conn, frame) : -1;
+}
+
+bool s16rpc_srv_is_queued (s16rpc_srv_t * srv, int fd, const char * key)
+{
+    s16rpc_conn_t * conn =
+        list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
+
+    if (!conn)
+        return false;
+
+    list_foreach (s16rpc_out, &conn->out, it)
+    {
+        if (it->val->frame->key && !strcmp (it->val->frame->key, key))
+            return true;
+    }
+
+    return false;
+}
+
+static void conn_stats (s16rpc_conn_t * conn, s16rpc_queue_stats_t * stats)
+{
+    s16rpc_out_t * oldest;
+
+    *stats = conn->stats;
+    stats->lag_ms = 0;
+
+    if ((oldest = list_it_val (list_begin (&conn->out))))
+    {
+        struct timespec now;
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        stats->lag_ms = (now.tv_sec - oldest->queued.tv_sec) * 1000 +
+                        (now.tv_nsec - oldest->queued.tv_nsec) / 1000000;
+    }
+}
+
+int s16rpc_srv_queue_stats (s16rpc_srv_t * srv, int fd,
+                            s16rpc_queue_stats_t * stats)
+{
+    s16rpc_conn_t * conn =
+        list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
+
+    if (!conn)
+        return -1;
+
+    conn_stats (conn, stats);
+
+    return 0;
+}
+
+void s16rpc_srv_walk_conns (s16rpc_srv_t * srv, s16rpc_conn_walk_fun fn,
+                            void * user)
+{
+    list_foreach (s16rpc_conn, &srv->conns, it)
+    {
+        s16rpc_queue_stats_t stats;
+
+        conn_stats (it->val, &stats);
+        fn (it->val->fd, &stats, user);
+    }
+}
+
+void s16rpc_srv_walk_methods (s16rpc_srv_t * srv, s16rpc_method_walk_fun fn,
+                              void * user)
+{
+    list_foreach (s16rpc_method, &srv->meths, it)
+        fn (&it->val->stats, user);
+}
+
 void s16rpc_srv_register_method (s16rpc_srv_t * srv, const char * name,
                                  size_t nparams, s16rpc_fun_t fun)
 {
-    s16rpc_S16ServiceMethod * meth = malloc (sizeof (s16rpc_S16ServiceMethod));
+    s16rpc_S16ServiceMethod * meth = calloc (1, sizeof (*meth));
     meth->name = name;
+    meth->stats.name = name;
     meth->nparams = nparams;
     meth->fun = fun;
     s16rpc_method_list_add (&srv->meths, meth);
@@ -388,6 +970,10 @@ s16rpc_srv_t * s16rpc_srv_new (int kq, int sock, void * extra, bool is_client)
     srv->kq = kq;
     srv->fd = sock;
     srv->extra = extra;
+    srv->hold = false;
+    srv->queue_limit = 0;
+    srv->overflow = S16RPC_OVERFLOW_COALESCE;
+    srv->next_serial = 0;
     srv->conns = s16rpc_conn_list_new ();
     srv->meths = s16rpc_method_list_new ();
 
@@ -403,41 +989,196 @@ s16rpc_srv_t * s16rpc_srv_new (int kq, int sock, void * extra, bool is_client)
     return srv;
 }
 
+/******************************************************************************
+ * HANDOVER
+ ******************************************************************************/
+
+nvlist_t * s16rpc_srv_export (s16rpc_srv_t * srv)
+{
+    nvlist_t * nvl = nvlist_create (0);
+
+    list_foreach (s16rpc_conn, &srv->conns, it)
+    {
+        s16rpc_conn_t * conn = it->val;
+        nvlist_t * nvconn = nvlist_create (0);
+        size_t len = 0, off = conn->out_off;
+        char * out, name[16];
+
+        nvlist_add_descriptor (nvconn, "fd", conn->fd);
+
+        /* The length of a message partly received is already consumed. */
+        if (conn->cur_msg_len)
+        {
+            nvlist_add_number (nvconn, "in-len", conn->cur_msg_len);
+            if (conn->cur_msg_off)
+                nvlist_add_binary (
+                    nvconn, "in", conn->cur_msg_buf, conn->cur_msg_off);
+        }
+
+        /* Queued output goes as one frame, which may no longer be dropped. */
+        LL_each (&conn->out, oit)
+            len += oit->val->frame->len;
+        if (len - off)
+        {
+            out = malloc (len - off);
+            len = 0;
+            LL_each (&conn->out, oit)
+            {
+                s16rpc_frame_t * frame = oit->val->frame;
+
+                memcpy (out + len, frame->data + off, frame->len - off);
+                len += frame->len - off;
+                off = 0;
+            }
+            nvlist_add_binary (nvconn, "out", out, len);
+            free (out);
+        }
+
+        snprintf (name, sizeof (name), "%d", conn->fd);
+        nvlist_move_nvlist (nvl, name, nvconn);
+    }
+
+    return nvl;
+}
+
+void s16rpc_srv_import (s16rpc_srv_t * srv, const nvlist_t * nvl,
+                        s16rpc_conn_adopt_fun fn, void * user)
+{
+    const char * name;
+    void * cookie = NULL;
+    int type;
+
+    while ((name = nvlist_next (nvl, &type, &cookie)))
+    {
+        const nvlist_t * nvconn;
+        s16rpc_conn_t * conn;
+        struct kevent ev;
+        int fd;
+
+        if (type != NV_TYPE_NVLIST)
+            continue;
+
+        nvconn = nvlist_get_nvlist (nvl, name);
+        /* The descriptor belongs to the nvlist; ours is a duplicate. */
+        if ((fd = dup (nvlist_get_descriptor (nvconn, "fd"))) == -1)
+            continue;
+        S16CloseOnExec (fd);
+        conn = conn_new (srv, fd);
+
+        if (nvlist_exists_number (nvconn, "in-len"))
+        {
+            conn->cur_msg_len = nvlist_get_number (nvconn, "in-len");
+            conn->cur_msg_buf = malloc (conn->cur_msg_len);
+            if (nvlist_exists_binary (nvconn, "in"))
+            {
+                size_t len;
+                const void * in = nvlist_get_binary (nvconn, "in", &len);
+
+                memcpy (conn->cur_msg_buf, in, len);
+                conn->cur_msg_off = len;
+            }
+        }
+
+        EV_SET (&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent (srv->kq, &ev, 1, NULL, 0, NULL) == -1)
+            err (1, "kevent");
+
+        if (nvlist_exists_binary (nvconn, "out"))
+        {
+            s16rpc_frame_t * frame = calloc (1, sizeof (*frame));
+            const void * out = nvlist_get_binary (nvconn, "out", &frame->len);
+
+            frame->refs = 1;
+            frame->data = malloc (frame->len);
+            memcpy (frame->data, out, frame->len);
+            conn_send (srv, conn, frame);
+            s16rpc_frame_release (frame);
+        }
+
+        if (fn)
+            fn (strtol (name, NULL, 10), fd, user);
+    }
+}
+
 /******************************************************************************
  * CLIENT SIDE
  ******************************************************************************/
 
+/* Receives exactly @len bytes, or returns -1. */
+static int recv_all (int fd, char * buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = recv (fd, buf, len, 0);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
 char * recv_text (int fd)
 {
-    size_t len_read;
     int32_t len;
     char * buf;
 
-    len_read = recv (fd, (char *)&len, sizeof (int32_t), 0);
-    assert (len_read == sizeof (int32_t));
+    if (recv_all (fd, (char *)&len, sizeof (int32_t)) || len <= 0)
+        return NULL;
+
+    buf = malloc (len);
 
-    if (len > MAX_LEN_MSG)
+    if (recv_all (fd, buf, len))
     {
-        S16Log (kS16LogError, "ignoring message of excessive length\n");
-        buf = strdup ("INVALID-MESSAGE");
+        free (buf);
+        return NULL;
     }
-    else
+    else if (len > MAX_LEN_MSG)
     {
-        buf = malloc (len);
-        recv (fd, buf, len, 0);
+        S16Log (kS16LogError, "ignoring message of excessive length\n");
+        free (buf);
+        return strdup ("INVALID-MESSAGE");
     }
 
+    buf[len - 1] = '\0';
     return buf;
 }
 
-ucl_object_t * recv_reply (int fd, s16rpc_error_t * rerror)
+/* Completes receipt of any message which the client's server has begun to
+ * receive, so that the next message read is whole. */
+static void finish_partial (s16rpc_srv_t * srv, int fd)
 {
-    char * reply = recv_text (fd);
-    struct ucl_parser * parser = ucl_parser_new (0);
+    s16rpc_conn_t * conn =
+        list_it_val (s16rpc_conn_list_find_int (&srv->conns, match_fd, fd));
+
+    while (conn && conn->cur_msg_len)
+        handle_recv (srv, conn);
+}
+
+ucl_object_t * recv_reply (s16rpc_clnt_t * clnt, int64_t id,
+                           s16rpc_error_t * rerror)
+{
+    char * reply;
+    struct ucl_parser * parser;
     ucl_object_t * obj = NULL;
-    const ucl_object_t *error, *result;
+    const ucl_object_t *error, *result, *uid;
     ucl_object_t * ret = NULL;
 
+next:
+    if (!(reply = recv_text (clnt->fd)))
+    {
+        rerror->code = 1;
+        rerror->message = strdup ("Connection lost");
+        rerror->data = NULL;
+        return NULL;
+    }
+
+    parser = ucl_parser_new (0);
     ucl_parser_add_string (parser, reply, strlen (reply));
 
     if (ucl_parser_get_error (parser))
@@ -448,6 +1189,34 @@ ucl_object_t * recv_reply (int fd, s16rpc_error_t * rerror)
 
     obj = ucl_parser_get_object (parser);
 
+    /* The peer may send us notifications while we await the reply; they
+     * are handed to our server, or discarded if we have none. */
+    if (obj && ucl_object_lookup (obj, "method"))
+    {
+        s16rpc_conn_t * conn =
+            clnt->srv ? list_it_val (s16rpc_conn_list_find_int (
+                            &clnt->srv->conns, match_fd, clnt->fd))
+                      : NULL;
+
+        if (conn)
+            handle_msg (clnt->srv, conn, reply);
+
+        free (reply);
+        ucl_object_unref (obj);
+        ucl_parser_free (parser);
+        goto next;
+    }
+
+    /* A stale reply, to a call whose reply was never collected. */
+    if (obj && (uid = ucl_object_lookup (obj, "id")) &&
+        ucl_object_type (uid) == UCL_INT && ucl_object_toint (uid) != id)
+    {
+        free (reply);
+        ucl_object_unref (obj);
+        ucl_parser_free (parser);
+        goto next;
+    }
+
     result = ucl_object_lookup (obj, "result");
     error = ucl_object_lookup (obj, "error");
 
@@ -471,6 +1240,9 @@ ucl_object_t * recv_reply (int fd, s16rpc_error_t * rerror)
     else
     {
         printf ("RPC Error: Malformed reply\n");
+        rerror->code = 1;
+        rerror->message = strdup ("Malformed reply");
+        rerror->data = NULL;
     }
 
     free (reply);
@@ -486,6 +1258,8 @@ s16rpc_clnt_t s16rpc_clnt_new (int sock)
 {
     s16rpc_clnt_t clnt;
     clnt.fd = sock;
+    clnt.next_id = 1;
+    clnt.srv = NULL;
     return clnt;
 }
 
@@ -495,17 +1269,22 @@ ucl_object_t * s16rpc_i_clnt_call_arr (s16rpc_clnt_t * clnt,
                                        ucl_object_t * params)
 {
     ucl_object_t * msg = ucl_object_typed_new (UCL_OBJECT);
+    int64_t id = clnt->next_id++;
 
     ucl_object_insert_key (
         msg, ucl_object_fromstring (S16_JSONRPC_VERSION), "jsonrpc", 0, 1);
     ucl_object_insert_key (
         msg, ucl_object_fromstring (meth_name), "method", 0, 1);
     ucl_object_insert_key (msg, params, "params", 0, 1);
+    ucl_object_insert_key (msg, ucl_object_fromint (id), "id", 0, 1);
+
+    if (clnt->srv)
+        finish_partial (clnt->srv, clnt->fd);
 
     write_object (clnt->fd, msg);
     ucl_object_unref (msg);
 
-    return recv_reply (clnt->fd, rerror);
+    return recv_reply (clnt, id, rerror);
 }
 
 ucl_object_t * s16rpc_i_clnt_call (s16rpc_clnt_t * clnt,
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "S16/Service.h"
 
@@ -170,21 +171,23 @@ bool S16DependencyGroupNamesEqual (const S16DependencyGroup * a,
 }
 
 /* Property functions */
+/* The names and string values of properties, and the names of methods, are
+ * interned; copies share them. */
 void S16PropertyDestroy (S16Property * prop)
 {
-    free (prop->name);
+    s16str_release (prop->name);
     if (prop->type == kS16PropertyTypeString)
-        free (prop->value.s);
+        s16str_release (prop->value.s);
     free (prop);
 }
 
 S16Property * S16PropertyCopy (const S16Property * prop)
 {
     S16Property * r = malloc (sizeof (S16Property));
-    r->name = strdup (prop->name);
+    r->name = s16str_ref (prop->name);
     r->type = prop->type;
     if (prop->type == kS16PropertyTypeString)
-        r->value.s = strdup (prop->value.s);
+        r->value.s = s16str_ref (prop->value.s);
     else
         r->value.i = prop->value.i;
     return r;
@@ -199,7 +202,7 @@ bool S16PropertyNamesEqual (const S16Property * a, const S16Property * b)
 S16ServiceMethod * S16MethodCopy (const S16ServiceMethod * meth)
 {
     S16ServiceMethod * r = malloc (sizeof (S16ServiceMethod));
-    r->name = strdup (meth->name);
+    r->name = s16str_ref (meth->name);
     r->props = prop_list_map (&meth->props, S16PropertyCopy);
     return r;
 }
@@ -212,7 +215,7 @@ bool S16MethodNamesEqual (const S16ServiceMethod * a,
 
 void S16MethodDestroy (S16ServiceMethod * meth)
 {
-    free (meth->name);
+    s16str_release (meth->name);
     prop_list_deepdestroy (&meth->props, S16PropertyDestroy);
     free (meth);
 }
@@ -235,6 +238,7 @@ S16ServiceInstance * S16InstanceCopy (const S16ServiceInstance * inst)
     r->props = prop_list_map (&inst->props, S16PropertyCopy);
     r->meths = meth_list_map (&inst->meths, S16MethodCopy);
     r->depgroups = depgroup_list_map (&inst->depgroups, S16DependencyGroupCopy);
+    r->enabled = inst->enabled;
     r->state = inst->state;
     return r;
 }
@@ -406,4 +410,55 @@ void S16HandleSignalWithKQueue (int kq, int sig)
         perror ("KQueue: Failed to set signal event\n");
         exit (EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
+
+int S16ListenFds ()
+{
+    const char * spid = getenv ("LISTEN_PID");
+    const char * sfds = getenv ("LISTEN_FDS");
+    int n = 0;
+
+    /* They may have been inherited from a process they were meant for. */
+    if (spid && sfds && strtol (spid, NULL, 10) == getpid ())
+        n = strtol (sfds, NULL, 10);
+
+    for (int i = 0; i < n; i++)
+        S16CloseOnExec (S16_LISTEN_FDS_START + i);
+
+    unsetenv ("LISTEN_PID");
+    unsetenv ("LISTEN_FDS");
+
+    return n > 0 ? n : 0;
+}
+
+int S16PassListenFds (const int * fds, int n)
+{
+    int * dups = malloc ((n ? n : 1) * sizeof (int));
+    char buf[32];
+    int r = 0;
+
+    /* Each is first moved clear of the range, so none is overwritten before
+     * it has been moved. The duplicates are without FD_CLOEXEC. */
+    for (int i = 0; i < n; i++)
+        if ((dups[i] = fcntl (fds[i], F_DUPFD, S16_LISTEN_FDS_START + n)) ==
+            -1)
+            r = -1;
+
+    for (int i = 0; !r && i < n; i++)
+    {
+        if (dup2 (dups[i], S16_LISTEN_FDS_START + i) == -1)
+            r = -1;
+        close (dups[i]);
+    }
+    free (dups);
+
+    if (r)
+        return r;
+
+    snprintf (buf, sizeof (buf), "%d", n);
+    setenv ("LISTEN_FDS", buf, 1);
+    snprintf (buf, sizeof (buf), "%ld", (long)getpid ());
+    setenv ("LISTEN_PID", buf, 1);
+
+    return 0;
+}
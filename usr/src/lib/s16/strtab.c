@@ -0,0 +1,154 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: The string table. Strings which recur across many services and
+ * instances, such as property names and values, and method names, are held
+ * once here and shared, with a count of references. Interning a string which
+ * is already held takes a reference to it rather than copying it; the last
+ * release frees it.
+ *
+ * Interned strings are told apart by address alone: each is the tail of its
+ * table entry. So a string that was not interned must never be released
+ * here, nor an interned one freed with free().
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "S16/Core.h"
+#include "uthash.h"
+
+typedef struct s16str_entry_s
+{
+    size_t refs;
+    size_t len;
+
+    UT_hash_handle hh;
+    char str[];
+} s16str_entry_t;
+
+static s16str_entry_t * table = NULL;
+/* Any thread may convert or copy services, so the table is locked. */
+static mtx_t lock;
+static once_flag lock_once = ONCE_FLAG_INIT;
+/* References taken in all, beyond the first to each string. */
+static size_t nshared = 0;
+
+static void lock_init () { mtx_init (&lock, mtx_plain); }
+
+static s16str_entry_t * entry_of (const char * str)
+{
+    return (s16str_entry_t *)(str - offsetof (s16str_entry_t, str));
+}
+
+char * s16str_intern (const char * str)
+{
+    s16str_entry_t * entry;
+    size_t len;
+
+    if (!str)
+        return NULL;
+
+    len = strlen (str);
+    call_once (&lock_once, lock_init);
+    mtx_lock (&lock);
+
+    HASH_FIND (hh, table, str, len, entry);
+
+    if (entry)
+    {
+        entry->refs++;
+        nshared++;
+    }
+    else
+    {
+        entry = malloc (sizeof (*entry) + len + 1);
+        entry->refs = 1;
+        entry->len = len;
+        memcpy (entry->str, str, len + 1);
+        HASH_ADD_KEYPTR (hh, table, entry->str, len, entry);
+    }
+
+    mtx_unlock (&lock);
+
+    return entry->str;
+}
+
+char * s16str_ref (char * str)
+{
+    if (!str)
+        return NULL;
+
+    mtx_lock (&lock);
+    entry_of (str)->refs++;
+    nshared++;
+    mtx_unlock (&lock);
+
+    return str;
+}
+
+void s16str_release (char * str)
+{
+    s16str_entry_t * entry;
+
+    if (!str)
+        return;
+
+    entry = entry_of (str);
+    mtx_lock (&lock);
+
+    if (--entry->refs)
+        nshared--;
+    else
+    {
+        HASH_DEL (table, entry);
+        free (entry);
+    }
+
+    mtx_unlock (&lock);
+}
+
+void s16str_stats (s16str_stats_t * stats)
+{
+    s16str_entry_t *entry, *tmp;
+
+    memset (stats, 0, sizeof (*stats));
+    call_once (&lock_once, lock_init);
+    mtx_lock (&lock);
+
+    HASH_ITER (hh, table, entry, tmp)
+    {
+        stats->strings++;
+        stats->bytes += entry->len + 1;
+        /* Each reference beyond the first would otherwise be a copy. */
+        stats->bytes_saved += (entry->refs - 1) * (entry->len + 1);
+    }
+    stats->refs = stats->strings + nshared;
+
+    mtx_unlock (&lock);
+}
@@ -0,0 +1,324 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Desc: Property templates. A string such as a method's exec property may
+ * refer to properties by name, as in "getty ${device}", and to the instance's
+ * name, as "${instance-name}". "$$" stands for a literal "$".
+ *
+ * A template is compiled once into a sequence of segments, each either
+ * literal text or a reference. It is expanded for an instance by resolving
+ * each reference against the instance's properties, then its service's; a
+ * property's value may itself refer to others. The expansion is kept, along
+ * with the value each name resolved to, and returned again until one of those
+ * values changes. As property values are interned, that is usually a pointer
+ * comparison.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "S16/Service.h"
+
+/* How deeply properties may refer to one another; deeper references, as
+ * circular ones become, expand to nothing. */
+#define kMaxDepth 8
+/* The name which refers to the instance's own name. */
+#define kInstanceName "instance-name"
+
+typedef struct
+{
+    bool ref;
+    /* The literal text, or the name referred to; interned. */
+    char * text;
+} tpl_seg_t;
+
+typedef struct
+{
+    char * name;
+    /* The value it resolved to, before expansion; or NULL if unset. */
+    char * value;
+} tpl_dep_t;
+
+struct S16Template_s
+{
+    char * src;
+    size_t nsegs;
+    tpl_seg_t * segs;
+
+    /* The last expansion, and everything it depended on. */
+    char * expansion;
+    size_t ndeps, deps_cap;
+    tpl_dep_t * deps;
+};
+
+typedef struct
+{
+    char * s;
+    size_t len, cap;
+} buf_t;
+
+typedef void (*scan_fun) (bool ref, const char * text, size_t len,
+                          void * user);
+
+static void buf_add (buf_t * buf, const char * text, size_t len)
+{
+    if (buf->len + len + 1 > buf->cap)
+    {
+        buf->cap = (buf->len + len + 1) * 2;
+        buf->s = realloc (buf->s, buf->cap);
+    }
+    memcpy (buf->s + buf->len, text, len);
+    buf->len += len;
+    buf->s[buf->len] = '\0';
+}
+
+/* Calls @fn with each literal and reference segment of @text in turn. An
+ * unterminated reference is taken literally. */
+static void scan (const char * text, scan_fun fn, void * user)
+{
+    const char * lit = text;
+    const char * p = text;
+
+    while ((p = strchr (p, '$')))
+    {
+        const char * end;
+
+        if (p[1] == '$')
+        {
+            fn (false, lit, p - lit + 1, user);
+            lit = p += 2;
+        }
+        else if (p[1] == '{' && (end = strchr (p + 2, '}')))
+        {
+            if (p > lit)
+                fn (false, lit, p - lit, user);
+            fn (true, p + 2, end - p - 2, user);
+            lit = p = end + 1;
+        }
+        else
+            p++;
+    }
+
+    if (*lit)
+        fn (false, lit, strlen (lit), user);
+}
+
+static void add_seg (bool ref, const char * text, size_t len, void * user)
+{
+    S16Template * tpl = user;
+    char * copy = strndup (text, len);
+
+    tpl->segs = realloc (tpl->segs, (tpl->nsegs + 1) * sizeof (*tpl->segs));
+    tpl->segs[tpl->nsegs].ref = ref;
+    tpl->segs[tpl->nsegs].text = s16str_intern (copy);
+    tpl->nsegs++;
+    free (copy);
+}
+
+S16Template * S16TemplateCompile (const char * text)
+{
+    S16Template * tpl = calloc (1, sizeof (*tpl));
+
+    tpl->src = s16str_intern (text);
+    scan (text, add_seg, tpl);
+
+    return tpl;
+}
+
+static void forget (S16Template * tpl)
+{
+    for (size_t i = 0; i < tpl->ndeps; i++)
+    {
+        s16str_release (tpl->deps[i].name);
+        s16str_release (tpl->deps[i].value);
+    }
+    tpl->ndeps = 0;
+    free (tpl->expansion);
+    tpl->expansion = NULL;
+}
+
+void S16TemplateDestroy (S16Template * tpl)
+{
+    if (!tpl)
+        return;
+
+    forget (tpl);
+    for (size_t i = 0; i < tpl->nsegs; i++)
+        s16str_release (tpl->segs[i].text);
+    free (tpl->segs);
+    free (tpl->deps);
+    s16str_release (tpl->src);
+    free (tpl);
+}
+
+S16Template * S16TemplateUpdate (S16Template * tpl, const char * text)
+{
+    if (tpl && text && !strcmp (tpl->src, text))
+        return tpl;
+
+    S16TemplateDestroy (tpl);
+    return text ? S16TemplateCompile (text) : NULL;
+}
+
+/* The value of a property in a list, or NULL. */
+static const char * prop_value (prop_list_t * props, const char * name)
+{
+    list_foreach (prop, props, it)
+    {
+        if (it->val->type == kS16PropertyTypeString &&
+            !strcmp (it->val->name, name))
+            return it->val->value.s;
+    }
+
+    return NULL;
+}
+
+/* The unexpanded value a name resolves to. */
+static const char * resolve (const char * name, const S16Service * svc,
+                             const S16ServiceInstance * inst)
+{
+    const char * value;
+
+    if (!strcmp (name, kInstanceName))
+        return inst->path->inst;
+    else if ((value = prop_value ((prop_list_t *)&inst->props, name)))
+        return value;
+    else if (svc)
+        return prop_value ((prop_list_t *)&svc->props, name);
+
+    return NULL;
+}
+
+typedef struct
+{
+    S16Template * tpl;
+    const S16Service * svc;
+    const S16ServiceInstance * inst;
+    buf_t buf;
+    int depth;
+} expand_ctx_t;
+
+static void expand_seg (bool ref, const char * text, size_t len, void * user);
+
+static void expand_ref (expand_ctx_t * ctx, const char * name)
+{
+    S16Template * tpl = ctx->tpl;
+    const char * value = resolve (name, ctx->svc, ctx->inst);
+
+    if (tpl->ndeps == tpl->deps_cap)
+    {
+        tpl->deps_cap = tpl->deps_cap ? tpl->deps_cap * 2 : 4;
+        tpl->deps = realloc (tpl->deps, tpl->deps_cap * sizeof (*tpl->deps));
+    }
+    tpl->deps[tpl->ndeps].name = s16str_intern (name);
+    tpl->deps[tpl->ndeps].value = s16str_intern (value);
+    tpl->ndeps++;
+
+    if (!value)
+        return;
+    else if (ctx->depth == kMaxDepth)
+    {
+        S16LogPath (kS16LogWarn,
+                    ctx->inst->path,
+                    "Property references nested too deeply at %s\n",
+                    name);
+        return;
+    }
+
+    ctx->depth++;
+    scan (value, expand_seg, ctx);
+    ctx->depth--;
+}
+
+static void expand_seg (bool ref, const char * text, size_t len, void * user)
+{
+    expand_ctx_t * ctx = user;
+    char * name;
+
+    if (!ref)
+    {
+        buf_add (&ctx->buf, text, len);
+        return;
+    }
+
+    name = strndup (text, len);
+    expand_ref (ctx, name);
+    free (name);
+}
+
+/* Whether every name last expanded still resolves to the same value. */
+static bool still_valid (S16Template * tpl, const S16Service * svc,
+                         const S16ServiceInstance * inst)
+{
+    if (!tpl->expansion)
+        return false;
+
+    for (size_t i = 0; i < tpl->ndeps; i++)
+    {
+        const char * now = resolve (tpl->deps[i].name, svc, inst);
+        const char * then = tpl->deps[i].value;
+
+        if (now != then && (!now || !then || strcmp (now, then)))
+            return false;
+    }
+
+    return true;
+}
+
+const char * S16TemplateExpand (S16Template * tpl, const S16Service * svc,
+                                const S16ServiceInstance * inst)
+{
+    expand_ctx_t ctx = {.tpl = tpl, .svc = svc, .inst = inst};
+
+    if (still_valid (tpl, svc, inst))
+        return tpl->expansion;
+
+    forget (tpl);
+    buf_add (&ctx.buf, "", 0);
+
+    for (size_t i = 0; i < tpl->nsegs; i++)
+    {
+        if (tpl->segs[i].ref)
+            expand_ref (&ctx, tpl->segs[i].text);
+        else
+            buf_add (&ctx.buf,
+                     tpl->segs[i].text,
+                     strlen (tpl->segs[i].text));
+    }
+
+    tpl->expansion = ctx.buf.s;
+
+    return tpl->expansion;
+}
+
+bool S16TemplateIsLiteral (const S16Template * tpl)
+{
+    for (size_t i = 0; i < tpl->nsegs; i++)
+        if (tpl->segs[i].ref)
+            return false;
+
+    return true;
+}
@@ -23,9 +23,17 @@
  * Use is subject to license terms.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <atf-c.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
 
-#include "S16/Repository.h"
+#include "S16/Repository_Private.h"
 
 S16Service make_svc () {}
 
@@ -91,8 +99,496 @@ ATF_TC_BODY (convert_svc, tc)
     ATF_CHECK_STREQ (converted, correct);
 }
 
+ATF_TC (coalesce_notes);
+ATF_TC_HEAD (coalesce_notes, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Test elision of superseded and duplicate notes.");
+}
+ATF_TC_BODY (coalesce_notes, tc)
+{
+    s16note_list_t notes = s16note_list_new ();
+    S16Path * a = S16PathNew ("a", "i");
+    S16Path * b = S16PathNew ("b", "i");
+    s16note_t * note;
+
+#define Add(nt, t, at)                                                         \
+    s16note_list_add (&notes, s16note_new (nt, t, at, 0))
+    Add (N_ADMIN_REQ, A_ENABLE, a);
+    Add (N_STATE_CHANGE, SC_OFFLINE, b);
+    Add (N_ADMIN_REQ, A_DISABLE, a);
+    Add (N_STATE_CHANGE, SC_OFFLINE, b);
+    Add (N_STATE_CHANGE, SC_ONLINE, b);
+    Add (N_RESTARTER_REQ, RR_STOP, a);
+    Add (N_RESTARTER_REQ, RR_START, a);
+#undef Add
+
+    ATF_CHECK_EQ (s16note_list_coalesce (&notes), 2);
+
+#define Expect(nt, t, want)                                                    \
+    note = s16note_list_lpop (&notes);                                         \
+    ATF_REQUIRE (note != NULL);                                                \
+    ATF_CHECK_EQ (note->note_type, nt);                                        \
+    ATF_CHECK_EQ (note->type, t);                                              \
+    ATF_CHECK (S16PathEqual (note->path, want));                               \
+    s16note_destroy (note)
+    Expect (N_STATE_CHANGE, SC_OFFLINE, b);
+    Expect (N_ADMIN_REQ, A_DISABLE, a);
+    Expect (N_STATE_CHANGE, SC_ONLINE, b);
+    Expect (N_RESTARTER_REQ, RR_STOP, a);
+    Expect (N_RESTARTER_REQ, RR_START, a);
+#undef Expect
+
+    ATF_CHECK (list_begin (&notes) == NULL);
+
+    S16PathDestroy (a);
+    S16PathDestroy (b);
+}
+
+ATF_TC (diff_config);
+ATF_TC_HEAD (diff_config, tc)
+{
+    atf_tc_set_md_var (
+        tc,
+        "descr",
+        "Test diffing of instances, and merging of N_CONFIG notes' diffs.");
+}
+ATF_TC_BODY (diff_config, tc)
+{
+    prop_list_t old_props = prop_list_new (), new_props = prop_list_new ();
+    S16Property same = {
+        .name = "same", .type = kS16PropertyTypeString, .value.s = "v"};
+    S16Property was = {
+        .name = "changed", .type = kS16PropertyTypeNumber, .value.i = 1};
+    S16Property now = {
+        .name = "changed", .type = kS16PropertyTypeNumber, .value.i = 2};
+    S16Property gone = {
+        .name = "gone", .type = kS16PropertyTypeBoolean, .value.i = 1};
+    S16ServiceInstance old_inst = {.path = S16PathNew ("a", "i"),
+                                   .meths = meth_list_new (),
+                                   .depgroups = depgroup_list_new (),
+                                   .enabled = true};
+    S16ServiceInstance new_inst = old_inst;
+    s16note_list_t notes = s16note_list_new ();
+    s16note_config_diff_t * diff;
+    s16note_t * note;
+
+    prop_list_add (&old_props, &same);
+    prop_list_add (&old_props, &was);
+    prop_list_add (&old_props, &gone);
+    prop_list_add (&new_props, &same);
+    prop_list_add (&new_props, &now);
+    old_inst.props = old_props;
+    new_inst.props = new_props;
+
+    ATF_CHECK (s16note_diff_inst (&old_inst, &old_inst) == NULL);
+
+    diff = s16note_diff_inst (&old_inst, &new_inst);
+    ATF_REQUIRE (diff != NULL);
+    ATF_CHECK_EQ (diff->props.n, 2);
+    ATF_CHECK (s16note_names_contain (&diff->props, "changed"));
+    ATF_CHECK (s16note_names_contain (&diff->props, "gone"));
+    ATF_CHECK (!s16note_names_contain (&diff->props, "same"));
+    ATF_CHECK (!diff->enabled && !diff->meths.n && !diff->depgroups.n);
+    s16note_list_add (&notes,
+                      s16note_config_new (CF_CHANGED, old_inst.path, diff));
+
+    new_inst.props = old_props;
+    new_inst.enabled = false;
+    diff = s16note_diff_inst (&old_inst, &new_inst);
+    ATF_REQUIRE (diff != NULL);
+    ATF_CHECK (diff->enabled && !diff->props.n);
+    s16note_list_add (&notes,
+                      s16note_config_new (CF_CHANGED, old_inst.path, diff));
+
+    ATF_CHECK_EQ (s16note_list_coalesce (&notes), 1);
+    note = s16note_list_lpop (&notes);
+    ATF_REQUIRE (note != NULL && note->diff != NULL);
+    ATF_CHECK_EQ (note->type, CF_CHANGED);
+    ATF_CHECK (note->diff->enabled);
+    ATF_CHECK (s16note_names_contain (&note->diff->props, "gone"));
+    ATF_CHECK (list_begin (&notes) == NULL);
+    s16note_destroy (note);
+
+    /* A change to something just added is news to no one. */
+    s16note_list_add (&notes,
+                      s16note_config_new (CF_ADDED, old_inst.path, NULL));
+    diff = s16note_diff_inst (&old_inst, &new_inst);
+    s16note_list_add (&notes,
+                      s16note_config_new (CF_CHANGED, old_inst.path, diff));
+    ATF_CHECK_EQ (s16note_list_coalesce (&notes), 1);
+    note = s16note_list_lpop (&notes);
+    ATF_CHECK_EQ (note->type, CF_ADDED);
+    s16note_destroy (note);
+
+    prop_list_destroy (&old_props);
+    prop_list_destroy (&new_props);
+    S16PathDestroy (old_inst.path);
+}
+
+ATF_TC (intern_strings);
+ATF_TC_HEAD (intern_strings, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that converted and copied properties share "
+                       "interned strings");
+}
+ATF_TC_BODY (intern_strings, tc)
+{
+    struct ucl_parser * parser = ucl_parser_new (0);
+    ucl_object_t * uinsts;
+    svc_list_t svcs;
+    S16Service * svc;
+    S16ServiceInstance *a, *b;
+    S16Property *pa, *pb, *copy;
+    s16str_stats_t before, after;
+
+    s16str_stats (&before);
+
+    ucl_parser_add_string (
+        parser,
+        "[{ path = \"svc:/s\"; instances = ["
+        "  { path = \"svc:/s:a\"; properties = [{ name = \"device\";"
+        "      value = \"${instance-name}\"; }]; },"
+        "  { path = \"svc:/s:b\"; properties = [{ name = \"device\";"
+        "      value = \"${instance-name}\"; }]; }]; }]",
+        0);
+    uinsts = ucl_parser_get_object (parser);
+    svcs = s16db_ucl_to_svcs (uinsts);
+    ucl_object_unref (uinsts);
+    ucl_parser_free (parser);
+
+    svc = list_it_val (list_begin (&svcs));
+    ATF_REQUIRE (svc != NULL);
+    a = list_it_val (list_begin (&svc->insts));
+    b = list_it_val (list_next (list_begin (&svc->insts)));
+    ATF_REQUIRE (a != NULL && b != NULL);
+    pa = list_it_val (list_begin (&a->props));
+    pb = list_it_val (list_begin (&b->props));
+    ATF_REQUIRE (pa != NULL && pb != NULL);
+
+    /* Equal strings are one string. */
+    ATF_CHECK (pa->name == pb->name);
+    ATF_CHECK (pa->value.s == pb->value.s);
+    copy = S16PropertyCopy (pa);
+    ATF_CHECK (copy->name == pa->name);
+    ATF_CHECK_STREQ (copy->value.s, "${instance-name}");
+
+    s16str_stats (&after);
+    ATF_CHECK_EQ (after.strings - before.strings, 2);
+    ATF_CHECK_EQ (after.refs - before.refs, 6);
+    ATF_CHECK_EQ (after.bytes_saved - before.bytes_saved,
+                  2 * sizeof ("device") + 2 * sizeof ("${instance-name}"));
+
+    /* And go with the last reference. */
+    S16PropertyDestroy (copy);
+    svc_list_deepdestroy (&svcs, S16ServiceDestroy);
+    s16str_stats (&after);
+    ATF_CHECK_EQ (after.strings, before.strings);
+    ATF_CHECK_EQ (after.refs, before.refs);
+}
+
+ATF_TC (expand_template);
+ATF_TC_HEAD (expand_template, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests expansion of property templates, and that "
+                       "expansions are kept until a property changes");
+}
+ATF_TC_BODY (expand_template, tc)
+{
+    prop_list_t sprops = prop_list_new (), iprops = prop_list_new ();
+    S16Property device = {.name = "device",
+                          .type = kS16PropertyTypeString,
+                          .value.s = s16str_intern ("${instance-name}")};
+    S16Property speed = {.name = "speed",
+                         .type = kS16PropertyTypeString,
+                         .value.s = s16str_intern ("9600")};
+    S16Service svc = {.path = S16PathNew ("getty", NULL),
+                      .props = *prop_list_add (&sprops, &device)};
+    S16ServiceInstance inst = {.path = S16PathNew ("getty", "console"),
+                               .props = *prop_list_add (&iprops, &speed)};
+    S16Template * tpl =
+        S16TemplateCompile ("getty ${device} ${speed} $$TERM${unset}.");
+    const char * first;
+
+    ATF_CHECK (!S16TemplateIsLiteral (tpl));
+    first = S16TemplateExpand (tpl, &svc, &inst);
+    ATF_CHECK_STREQ (first, "getty console 9600 $TERM.");
+    /* Nothing changed, so nothing is redone. */
+    ATF_CHECK (S16TemplateExpand (tpl, &svc, &inst) == first);
+
+    speed.value.s = s16str_intern ("115200");
+    ATF_CHECK_STREQ (S16TemplateExpand (tpl, &svc, &inst),
+                     "getty console 115200 $TERM.");
+
+    ATF_CHECK (S16TemplateUpdate (tpl, "getty ${device} ${speed} "
+                                       "$$TERM${unset}.") == tpl);
+    tpl = S16TemplateUpdate (tpl, "plain");
+    ATF_CHECK (S16TemplateIsLiteral (tpl));
+    ATF_CHECK_STREQ (S16TemplateExpand (tpl, &svc, &inst), "plain");
+    S16TemplateDestroy (tpl);
+}
+
+ATF_TC (shared_view);
+ATF_TC_HEAD (shared_view, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests publishing and reading in place the shared view "
+                       "of the repository, and that a read overtaken by "
+                       "publishing, or of a view whose publisher has died, is "
+                       "reported inconsistent");
+}
+ATF_TC_BODY (shared_view, tc)
+{
+    prop_list_t props = prop_list_new ();
+    inst_list_t insts = inst_list_new ();
+    S16Property port = {
+        .name = "port", .type = kS16PropertyTypeNumber, .value.i = 22};
+    S16ServiceInstance inst = {.path = S16PathNew ("ssh", "default"),
+                               .props = *prop_list_add (&props, &port),
+                               .enabled = true,
+                               .state = kS16StateOnline};
+    S16Service ftp = {.path = S16PathNew ("ftp", NULL),
+                      .state = kS16StateDisabled};
+    S16Service ssh = {.path = S16PathNew ("ssh", NULL),
+                      .insts = *inst_list_add (&insts, &inst)};
+    S16Service * svcs[] = {&ftp, &ssh};
+    s16db_view_pub_t * pub;
+    s16db_view_t * view;
+    s16db_view_ent_t ent;
+    long value;
+    char name[64], c;
+    int ready[2];
+    pid_t pid;
+
+    /* Not to disturb the view of any configd running. */
+    snprintf (name, sizeof (name), "/s16.test-view.%d", getpid ());
+    setenv (S16DB_VIEW_SHM_ENV, name, 1);
+
+    ATF_REQUIRE ((pub = s16db_view_pub_new ()) != NULL);
+    /* Nothing is yet published. */
+    ATF_CHECK (s16db_view_open () == NULL);
+    ATF_REQUIRE (!s16db_view_pub_put (pub, svcs, 2, 7));
+    ATF_REQUIRE ((view = s16db_view_open ()) != NULL);
+
+    ATF_CHECK_EQ (s16db_view_begin (view), 7);
+    ATF_CHECK_EQ (s16db_view_nsvcs (view), 2);
+    ent = s16db_view_svc (view, 0);
+    ATF_CHECK_STREQ (s16db_view_path (view, ent), "svc:/ftp");
+    ATF_CHECK_EQ (s16db_view_state (view, ent), kS16StateDisabled);
+    ATF_CHECK_EQ (s16db_view_ninsts (view, ent), 0);
+    ATF_REQUIRE (s16db_view_find (view, inst.path, &ent));
+    ATF_CHECK_STREQ (s16db_view_path (view, ent), "svc:/ssh:default");
+    ATF_CHECK_EQ (s16db_view_state (view, ent), kS16StateOnline);
+    ATF_CHECK (s16db_view_enabled (view, ent));
+    ATF_CHECK (s16db_view_prop_number (view, ent, "port", &value));
+    ATF_CHECK_EQ (value, 22);
+    ATF_CHECK (s16db_view_prop_string (view, ent, "port") == NULL);
+    ATF_CHECK (!s16db_view_find (view, S16PathNew ("ssh", "other"), &ent));
+    ATF_CHECK (s16db_view_end (view));
+
+    /* A read survives one publication, which goes to the other slot, but
+     * not two. */
+    inst.state = kS16StateMaintenance;
+    s16db_view_begin (view);
+    s16db_view_pub_put (pub, svcs, 2, 8);
+    ATF_CHECK (s16db_view_end (view));
+    s16db_view_begin (view);
+    s16db_view_pub_put (pub, svcs, 2, 9);
+    s16db_view_pub_put (pub, svcs, 2, 10);
+    ATF_CHECK (!s16db_view_end (view));
+
+    ATF_CHECK_EQ (s16db_view_begin (view), 10);
+    ATF_REQUIRE (s16db_view_find (view, inst.path, &ent));
+    ATF_CHECK_EQ (s16db_view_state (view, ent), kS16StateMaintenance);
+    ATF_CHECK (s16db_view_end (view));
+
+    s16db_view_close (view);
+    s16db_view_pub_destroy (pub);
+
+    /* A view left by a publisher which has died is not to be believed. */
+    ATF_REQUIRE (!pipe (ready));
+    if (!(pid = fork ()))
+    {
+        pub = s16db_view_pub_new ();
+        s16db_view_pub_put (pub, svcs, 2, 11);
+        write (ready[1], "", 1);
+        pause ();
+        _exit (0);
+    }
+    ATF_REQUIRE (pid != -1);
+    close (ready[1]);
+    ATF_REQUIRE_EQ (read (ready[0], &c, 1), 1);
+
+    view = s16db_view_open ();
+    ATF_CHECK (view != NULL);
+    if (view)
+    {
+        ATF_CHECK_EQ (s16db_view_begin (view), 11);
+        ATF_CHECK (s16db_view_end (view));
+    }
+
+    kill (pid, SIGKILL);
+    waitpid (pid, NULL, 0);
+
+    if (view)
+    {
+        s16db_view_begin (view);
+        ATF_CHECK (!s16db_view_end (view));
+        s16db_view_close (view);
+    }
+    ATF_CHECK (s16db_view_open () == NULL);
+
+    shm_unlink (name);
+    close (ready[0]);
+}
+
+typedef struct
+{
+    int nsvcs, nsigs;
+    s16db_layer_t layers[4];
+    S16Service * svcs[4];
+    s16db_manifest_sig_t sig;
+} loaded_image_t;
+
+static void load_svc (s16db_layer_t layer, S16Service * svc, void * user)
+{
+    loaded_image_t * img = user;
+
+    if (img->nsvcs < 4)
+    {
+        img->layers[img->nsvcs] = layer;
+        img->svcs[img->nsvcs++] = svc;
+    }
+    else
+        S16ServiceDestroy (svc);
+}
+
+static void load_manifest (const s16db_manifest_sig_t * sig, void * user)
+{
+    loaded_image_t * img = user;
+
+    img->sig = *sig;
+    img->sig.path = strdup (sig->path);
+    img->nsigs++;
+}
+
+/* Rewrites the byte at @off of the file at @path. */
+static void poke (const char * path, off_t off, char c)
+{
+    int fd = open (path, O_WRONLY);
+
+    ATF_REQUIRE (fd != -1);
+    ATF_REQUIRE (pwrite (fd, &c, 1, off) == 1);
+    close (fd);
+}
+
+ATF_TC (image_round_trip);
+ATF_TC_HEAD (image_round_trip, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests writing and loading a repository image, and that "
+                       "nothing is loaded from one corrupt or truncated");
+}
+ATF_TC_BODY (image_round_trip, tc)
+{
+    prop_list_t props = prop_list_new ();
+    inst_list_t insts = inst_list_new ();
+    svc_list_t manifest = svc_list_new (), admin = svc_list_new ();
+    S16Property port = {
+        .name = "port", .type = kS16PropertyTypeNumber, .value.i = 22};
+    S16ServiceInstance inst = {.path = S16PathNew ("ssh", "default"),
+                               .props = *prop_list_add (&props, &port),
+                               .meths = meth_list_new (),
+                               .depgroups = depgroup_list_new (),
+                               .enabled = true};
+    S16Service ssh = {.path = S16PathNew ("ssh", NULL),
+                      .def_inst = "default",
+                      .props = prop_list_new (),
+                      .meths = meth_list_new (),
+                      .insts = *inst_list_add (&insts, &inst),
+                      .depgroups = depgroup_list_new ()};
+    S16Service ftp = {.path = S16PathNew ("ftp", NULL),
+                      .props = prop_list_new (),
+                      .meths = meth_list_new (),
+                      .insts = inst_list_new (),
+                      .depgroups = depgroup_list_new ()};
+    s16db_manifest_sig_t sig = {
+        .path = "/manifests/ssh.ucl", .size = 120, .hash = 0xfeedface};
+    loaded_image_t img = {0};
+    S16ServiceInstance * linst;
+    S16Property * lprop;
+    struct stat sb;
+
+    svc_list_add (&manifest, &ssh);
+    svc_list_add (&admin, &ftp);
+    ATF_REQUIRE_EQ (0, s16db_image_write ("img", &manifest, &admin, &sig, 1));
+
+    ATF_REQUIRE_EQ (0, s16db_image_load ("img", load_svc, load_manifest, &img));
+    ATF_REQUIRE_EQ (2, img.nsvcs);
+    ATF_CHECK_EQ (L_MANIFEST, img.layers[0]);
+    ATF_CHECK_STREQ ("svc:/ssh", S16PathToString (img.svcs[0]->path));
+    ATF_CHECK_STREQ ("default", img.svcs[0]->def_inst);
+    ATF_REQUIRE ((linst = list_it_val (list_begin (&img.svcs[0]->insts))));
+    ATF_CHECK_STREQ ("svc:/ssh:default", S16PathToString (linst->path));
+    ATF_CHECK (linst->enabled);
+    ATF_REQUIRE ((lprop = list_it_val (list_begin (&linst->props))));
+    ATF_CHECK_STREQ ("port", lprop->name);
+    ATF_CHECK_EQ (22, lprop->value.i);
+    ATF_CHECK_EQ (L_ADMIN, img.layers[1]);
+    ATF_CHECK_STREQ ("svc:/ftp", S16PathToString (img.svcs[1]->path));
+    ATF_REQUIRE_EQ (1, img.nsigs);
+    ATF_CHECK_STREQ (sig.path, img.sig.path);
+    ATF_CHECK_EQ (sig.size, img.sig.size);
+    ATF_CHECK_EQ (sig.hash, img.sig.hash);
+
+    ATF_REQUIRE (stat ("img", &sb) == 0);
+    ATF_REQUIRE (link ("img", "img.good") == 0);
+
+    /* A flipped byte anywhere fails the checksum. */
+    ATF_REQUIRE_EQ (0, s16db_image_write ("img", &manifest, &admin, &sig, 1));
+    poke ("img", sb.st_size / 2, 0x5a);
+    memset (&img, 0, sizeof (img));
+    ATF_CHECK_EQ (-1, s16db_image_load ("img", load_svc, load_manifest, &img));
+    ATF_CHECK_EQ (0, img.nsvcs);
+    ATF_CHECK_EQ (0, img.nsigs);
+
+    /* As does a torn header. */
+    ATF_REQUIRE_EQ (0, s16db_image_write ("img", &manifest, &admin, &sig, 1));
+    poke ("img", 0, 'X');
+    ATF_CHECK_EQ (-1, s16db_image_load ("img", load_svc, load_manifest, &img));
+    ATF_CHECK_EQ (0, img.nsvcs);
+
+    /* And truncation, whether to within the header or past it. */
+    ATF_REQUIRE (truncate ("img.good", sb.st_size - 8) == 0);
+    ATF_CHECK_EQ (
+        -1, s16db_image_load ("img.good", load_svc, load_manifest, &img));
+    ATF_REQUIRE (truncate ("img.good", 16) == 0);
+    ATF_CHECK_EQ (
+        -1, s16db_image_load ("img.good", load_svc, load_manifest, &img));
+    ATF_REQUIRE (truncate ("img.good", 0) == 0);
+    ATF_CHECK_EQ (
+        -1, s16db_image_load ("img.good", load_svc, load_manifest, &img));
+    ATF_CHECK_EQ (0, img.nsvcs);
+    ATF_CHECK_EQ (0, img.nsigs);
+
+    ATF_CHECK_EQ (-1, s16db_image_load ("none", load_svc, load_manifest, &img));
+}
+
 ATF_TP_ADD_TCS (tp)
 {
     ATF_TP_ADD_TC (tp, convert_svc);
+    ATF_TP_ADD_TC (tp, coalesce_notes);
+    ATF_TP_ADD_TC (tp, diff_config);
+    ATF_TP_ADD_TC (tp, intern_strings);
+    ATF_TP_ADD_TC (tp, expand_template);
+    ATF_TP_ADD_TC (tp, shared_view);
+    ATF_TP_ADD_TC (tp, image_round_trip);
     return atf_no_error ();
 }
\ No newline at end of file
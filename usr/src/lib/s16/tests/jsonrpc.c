@@ -0,0 +1,374 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/SYSTEMXVI.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2020 David MacKay.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atf-c.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "S16/JSONRPCServer.h"
+
+/* A server with one connection, the far end of which is peer. */
+typedef struct
+{
+    int kq;
+    int fd, peer;
+    s16rpc_srv_t * srv;
+} test_srv_t;
+
+static void test_srv_new (test_srv_t * t)
+{
+    int sv[2];
+
+    ATF_REQUIRE (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    ATF_REQUIRE ((t->kq = kqueue ()) != -1);
+    t->fd = sv[0];
+    t->peer = sv[1];
+    t->srv = s16rpc_srv_new (t->kq, t->fd, NULL, true);
+}
+
+/* Sends a notification named @method, with @key. */
+static int notify (test_srv_t * t, const char * method, const char * key,
+                   bool droppable)
+{
+    ucl_object_t * params = ucl_object_typed_new (UCL_ARRAY);
+    s16rpc_frame_t * frame =
+        s16rpc_frame_new_notification (method, params, key, droppable);
+    int r = s16rpc_srv_send (t->srv, t->fd, frame);
+
+    s16rpc_frame_release (frame);
+    ucl_object_unref (params);
+    return r;
+}
+
+/* Reads what has been sent to the peer, and checks that it is notifications
+ * of exactly the given methods, in order. */
+static void expect_methods (test_srv_t * t, const char * const * methods)
+{
+    char buf[4096];
+    ssize_t len = recv (t->peer, buf, sizeof (buf), MSG_DONTWAIT);
+    size_t off = 0;
+
+    if (len == -1)
+        len = 0;
+
+    for (; *methods; methods++)
+    {
+        int32_t flen;
+        struct ucl_parser * parser = ucl_parser_new (0);
+        ucl_object_t * msg;
+
+        ATF_REQUIRE (off + sizeof (flen) <= (size_t)len);
+        memcpy (&flen, buf + off, sizeof (flen));
+        off += sizeof (flen);
+        ATF_REQUIRE (off + flen <= (size_t)len);
+
+        ucl_parser_add_string (parser, buf + off, flen - 1);
+        ATF_REQUIRE ((msg = ucl_parser_get_object (parser)));
+        ATF_CHECK_STREQ (
+            *methods, ucl_object_tostring (ucl_object_lookup (msg, "method")));
+        ucl_object_unref (msg);
+        ucl_parser_free (parser);
+        off += flen;
+    }
+
+    ATF_CHECK_EQ (off, (size_t)len);
+}
+
+ATF_TC (overflow_coalesce);
+ATF_TC_HEAD (overflow_coalesce, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that a full queue drops a frame superseded by a "
+                       "new one with its key, else the oldest");
+}
+ATF_TC_BODY (overflow_coalesce, tc)
+{
+    test_srv_t t;
+    s16rpc_queue_stats_t stats;
+    const char * expected[] = {"x2", "z", NULL};
+
+    test_srv_new (&t);
+    s16rpc_srv_set_queue_limit (t.srv, 2, S16RPC_OVERFLOW_COALESCE);
+    /* Holding replies keeps everything queued. */
+    s16rpc_srv_hold_replies (t.srv);
+
+    ATF_CHECK_EQ (0, notify (&t, "x1", "x", true));
+    ATF_CHECK_EQ (0, notify (&t, "y", "y", true));
+    ATF_CHECK_EQ (0, notify (&t, "x2", "x", true));
+    ATF_REQUIRE_EQ (0, s16rpc_srv_queue_stats (t.srv, t.fd, &stats));
+    ATF_CHECK_EQ (2, stats.depth);
+    ATF_CHECK_EQ (1, stats.coalesced);
+    ATF_CHECK_EQ (0, stats.dropped);
+    ATF_CHECK (s16rpc_srv_is_queued (t.srv, t.fd, "x"));
+
+    /* Nothing queued has key z, so the oldest, y, goes. */
+    ATF_CHECK_EQ (0, notify (&t, "z", "z", true));
+    ATF_REQUIRE_EQ (0, s16rpc_srv_queue_stats (t.srv, t.fd, &stats));
+    ATF_CHECK_EQ (2, stats.depth);
+    ATF_CHECK_EQ (1, stats.dropped);
+    ATF_CHECK (!s16rpc_srv_is_queued (t.srv, t.fd, "y"));
+
+    s16rpc_srv_release_replies (t.srv);
+    expect_methods (&t, expected);
+}
+
+ATF_TC (overflow_drop_oldest);
+ATF_TC_HEAD (overflow_drop_oldest, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that a full queue drops the oldest droppable "
+                       "frame, and never one that isn't droppable");
+}
+ATF_TC_BODY (overflow_drop_oldest, tc)
+{
+    test_srv_t t;
+    s16rpc_queue_stats_t stats;
+    const char * expected[] = {"b", "keep", "c", NULL};
+
+    test_srv_new (&t);
+    s16rpc_srv_set_queue_limit (t.srv, 2, S16RPC_OVERFLOW_DROP_OLDEST);
+    s16rpc_srv_hold_replies (t.srv);
+
+    ATF_CHECK_EQ (0, notify (&t, "a", "k", true));
+    ATF_CHECK_EQ (0, notify (&t, "b", "k", true));
+    /* Not counted against the limit. */
+    ATF_CHECK_EQ (0, notify (&t, "keep", NULL, false));
+    ATF_CHECK_EQ (0, notify (&t, "c", "k", true));
+
+    ATF_REQUIRE_EQ (0, s16rpc_srv_queue_stats (t.srv, t.fd, &stats));
+    ATF_CHECK_EQ (2, stats.depth);
+    ATF_CHECK_EQ (2, stats.max_depth);
+    ATF_CHECK_EQ (1, stats.dropped);
+    ATF_CHECK_EQ (0, stats.coalesced);
+
+    s16rpc_srv_release_replies (t.srv);
+    expect_methods (&t, expected);
+    ATF_REQUIRE_EQ (0, s16rpc_srv_queue_stats (t.srv, t.fd, &stats));
+    ATF_CHECK_EQ (0, stats.depth);
+    ATF_CHECK_EQ (3, stats.sent);
+}
+
+ATF_TC (overflow_disconnect);
+ATF_TC_HEAD (overflow_disconnect, tc)
+{
+    atf_tc_set_md_var (
+        tc, "descr", "Tests that a full queue can close the connection");
+}
+ATF_TC_BODY (overflow_disconnect, tc)
+{
+    test_srv_t t;
+    s16rpc_queue_stats_t stats;
+    char c;
+
+    test_srv_new (&t);
+    s16rpc_srv_set_queue_limit (t.srv, 1, S16RPC_OVERFLOW_DISCONNECT);
+    s16rpc_srv_hold_replies (t.srv);
+
+    ATF_CHECK_EQ (0, notify (&t, "a", NULL, true));
+    ATF_CHECK_EQ (-1, notify (&t, "b", NULL, true));
+    ATF_CHECK_EQ (-1, s16rpc_srv_queue_stats (t.srv, t.fd, &stats));
+    ATF_CHECK_EQ (-1, notify (&t, "c", NULL, true));
+
+    /* What was queued went with the connection. */
+    ATF_CHECK_EQ (0, recv (t.peer, &c, 1, MSG_DONTWAIT));
+}
+
+/* Handles whatever events are pending on the server. */
+static void pump (int kq, s16rpc_srv_t * srv)
+{
+    struct timespec zero = {0, 0};
+    struct kevent ev;
+
+    for (int i = 0; i < 64 && kevent (kq, NULL, 0, &ev, 1, &zero) == 1; i++)
+        s16rpc_investigate_kevent (srv, &ev);
+}
+
+static void dial (int s)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX, .sun_path = "sock"};
+
+    ATF_REQUIRE (connect (s, (struct sockaddr *)&sun, SUN_LEN (&sun)) == 0);
+}
+
+/* Sends @text as one message. */
+static void send_text (int s, const char * text)
+{
+    int32_t len = strlen (text) + 1;
+
+    ATF_REQUIRE (write (s, &len, sizeof (len)) == sizeof (len));
+    ATF_REQUIRE (write (s, text, len) == len);
+}
+
+static void call (int s, const char * method, int id)
+{
+    char text[128];
+
+    snprintf (text,
+              sizeof (text),
+              "{\"jsonrpc\":\"2.0\",\"method\":\"%s\","
+              "\"params\":[],\"id\":%d}",
+              method,
+              id);
+    send_text (s, text);
+}
+
+/* Receives one message into @buf, of size @size. */
+static void recv_msg (int s, char * buf, size_t size)
+{
+    int32_t len;
+
+    ATF_REQUIRE (recv (s, &len, sizeof (len), 0) == sizeof (len));
+    ATF_REQUIRE (len > 0 && (size_t)len <= size);
+    ATF_REQUIRE (recv (s, buf, len, 0) == len);
+}
+
+static s16rpc_deferred_t * deferred;
+
+static ucl_object_t * defer_call (s16rpc_data_t * dat)
+{
+    deferred = s16rpc_defer (dat);
+    return NULL;
+}
+
+static void note_fd (int fd, const s16rpc_queue_stats_t * stats, void * user)
+{
+    *(int *)user = fd;
+}
+
+ATF_TC (defer_stale);
+ATF_TC_HEAD (defer_stale, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that the reply to a deferred call goes to its "
+                       "caller, and not to a later connection given the "
+                       "caller's descriptor");
+}
+ATF_TC_BODY (defer_stale, tc)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX, .sun_path = "sock"};
+    int kq, lfd, a, b, afd = -1, bfd = -1;
+    s16rpc_deferred_t * stale;
+    s16rpc_srv_t * srv;
+    char buf[128];
+    int32_t len;
+
+    ATF_REQUIRE ((kq = kqueue ()) != -1);
+    ATF_REQUIRE ((lfd = socket (AF_UNIX, SOCK_STREAM, 0)) != -1);
+    ATF_REQUIRE (bind (lfd, (struct sockaddr *)&sun, SUN_LEN (&sun)) == 0);
+    ATF_REQUIRE (listen (lfd, 5) == 0);
+    srv = s16rpc_srv_new (kq, lfd, NULL, false);
+    s16rpc_srv_register_method (srv, "defer", 0, defer_call);
+
+    ATF_REQUIRE ((a = socket (AF_UNIX, SOCK_STREAM, 0)) != -1);
+    dial (a);
+    pump (kq, srv);
+    s16rpc_srv_walk_conns (srv, note_fd, &afd);
+
+    call (a, "defer", 1);
+    pump (kq, srv);
+    ATF_REQUIRE (deferred != NULL);
+    s16rpc_srv_complete (srv, deferred, ucl_object_fromint (42));
+
+    ATF_REQUIRE (recv (a, &len, sizeof (len), 0) == sizeof (len));
+    ATF_REQUIRE (len < (int32_t)sizeof (buf));
+    ATF_REQUIRE (recv (a, buf, len, 0) == len);
+    ATF_CHECK (strstr (buf, "\"result\":42"));
+    ATF_CHECK (strstr (buf, "\"id\":1"));
+
+    deferred = NULL;
+    call (a, "defer", 2);
+    pump (kq, srv);
+    ATF_REQUIRE ((stale = deferred) != NULL);
+
+    /* Made before the caller goes, so that the server's next connection
+     * gets the caller's descriptor. */
+    ATF_REQUIRE ((b = socket (AF_UNIX, SOCK_STREAM, 0)) != -1);
+    close (a);
+    pump (kq, srv);
+    dial (b);
+    pump (kq, srv);
+    s16rpc_srv_walk_conns (srv, note_fd, &bfd);
+    ATF_REQUIRE_EQ (afd, bfd);
+
+    s16rpc_srv_complete (srv, stale, ucl_object_fromint (43));
+    ATF_CHECK_EQ (-1, recv (b, buf, sizeof (buf), MSG_DONTWAIT));
+    ATF_CHECK_EQ (EAGAIN, errno);
+}
+
+ATF_TC (error_replies);
+ATF_TC_HEAD (error_replies, tc)
+{
+    atf_tc_set_md_var (tc,
+                       "descr",
+                       "Tests that a malformed message is answered with an "
+                       "error with a null id, and a failed notification is "
+                       "not answered");
+}
+ATF_TC_BODY (error_replies, tc)
+{
+    test_srv_t t;
+    char buf[256];
+
+    test_srv_new (&t);
+
+    send_text (t.peer, "{\"jsonrpc\": ");
+    pump (t.kq, t.srv);
+    recv_msg (t.peer, buf, sizeof (buf));
+    ATF_CHECK (strstr (buf, "\"error\""));
+    ATF_CHECK (strstr (buf, "\"id\":null"));
+
+    send_text (t.peer, "{\"jsonrpc\":\"2.0\",\"params\":[]}");
+    pump (t.kq, t.srv);
+    recv_msg (t.peer, buf, sizeof (buf));
+    ATF_CHECK (strstr (buf, "\"id\":null"));
+
+    send_text (t.peer,
+               "{\"jsonrpc\":\"2.0\",\"method\":\"none\",\"params\":[]}");
+    call (t.peer, "none", 3);
+    pump (t.kq, t.srv);
+    /* Only the call is answered. */
+    recv_msg (t.peer, buf, sizeof (buf));
+    ATF_CHECK (strstr (buf, "\"id\":3"));
+    ATF_CHECK_EQ (-1, recv (t.peer, buf, sizeof (buf), MSG_DONTWAIT));
+}
+
+ATF_TP_ADD_TCS (tp)
+{
+    ATF_TP_ADD_TC (tp, overflow_coalesce);
+    ATF_TP_ADD_TC (tp, overflow_drop_oldest);
+    ATF_TP_ADD_TC (tp, overflow_disconnect);
+    ATF_TP_ADD_TC (tp, defer_stale);
+    ATF_TP_ADD_TC (tp, error_replies);
+    return atf_no_error ();
+}
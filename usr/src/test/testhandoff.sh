@@ -0,0 +1,34 @@
+# Hands a running configd over to a successor, and checks that the successor
+# serves the same repository over the same socket. Run from the build
+# directory.
+killall s16.configd || true
+agent/configd/s16.configd &
+old=$!
+sleep 1
+cmd/svccfg/svccfg import ../../test/a.ucl
+cmd/svccfg/svccfg import ../../test/b.ucl
+cmd/svcs/svcs > /tmp/svcs.before
+
+# SIGUSR2 starts a successor, which takes over and then becomes the only one.
+kill -USR2 $old
+sleep 2
+if kill -0 $old 2>/dev/null
+then
+    echo "Predecessor did not exit"
+    exit 1
+fi
+
+new=$(pgrep -x s16.configd)
+if [ -z "$new" ] || [ "$new" = "$old" ]
+then
+    echo "No successor running"
+    exit 1
+fi
+
+# Served over RPC through the inherited socket, then through the view.
+cmd/svcs/svcs -S > /dev/null || exit 1
+cmd/svcs/svcs > /tmp/svcs.after
+cmp /tmp/svcs.before /tmp/svcs.after || exit 1
+
+killall s16.configd || true
+echo "Handover succeeded"